@@ -0,0 +1,57 @@
+#!/usr/bin/env node
+
+var logger = require('../lib/logger');
+var BlockImporter = require('../lib/blockimporter').BlockImporter;
+var createNode = require('./init').createNode;
+
+var node = createNode();
+var cfg = node.cfg;
+
+if (!cfg.loadBlocks || !cfg.loadBlocks.length) {
+  logger.error('No block files given, use --loadblock=<file or directory>');
+  process.exit(1);
+}
+
+var files;
+try {
+  files = BlockImporter.listFiles(cfg.loadBlocks);
+} catch (err) {
+  logger.error(err.stack ? err.stack : err.toString());
+  process.exit(1);
+}
+
+var blockChain = node.getBlockChain();
+var importer = new BlockImporter(blockChain, cfg.network.magicBytes);
+
+var start = new Date().getTime();
+importer.on('fileDone', function (e) {
+  var seconds = (new Date().getTime() - start) / 1000;
+  logger.info('Imported '+e.file+' ('+e.stats.blocks+' blocks, '+
+              Math.round(e.stats.bytes / 1024 / 1024)+'MB in '+
+              Math.round(seconds)+'s, height '+
+              blockChain.getTopBlock().height+')');
+});
+
+blockChain.on('initComplete', function () {
+  importer.importFiles(files, function (err, stats) {
+    if (err) {
+      logger.error(err.stack ? err.stack : err.toString());
+      process.exit(1);
+    }
+
+    logger.info('Import finished: '+stats.blocks+' blocks, '+
+                stats.known+' known, '+stats.invalid+' invalid, '+
+                stats.failed+' rejected, '+
+                'top block at height '+blockChain.getTopBlock().height);
+
+    // The last blocks may still be being written or held back in a batch
+    blockChain.close(function (err) {
+      if (err) {
+        logger.error(err.stack ? err.stack : err.toString());
+        process.exit(1);
+      }
+      process.exit(0);
+    });
+  });
+});
+blockChain.init();
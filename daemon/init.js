@@ -94,6 +94,10 @@ var getConfig = exports.getConfig = function getConfig(initConfig) {
     noverify: {
       type: yanop.flag,
       description: 'Disable all tx/block verification'
+    },
+    loadblock: {
+      type: yanop.list,
+      description: 'Import blocks from a blk*.dat file or directory'
     }
   });
 
@@ -233,6 +237,9 @@ var getConfig = exports.getConfig = function getConfig(initConfig) {
   if (opts.noverify) {
     cfg.verify = false;
   }
+  if (opts.loadblock.length) {
+    cfg.loadBlocks = opts.loadblock;
+  }
 
   return cfg;
 };
@@ -72,6 +72,36 @@ cfg.network.connect = "auto";
 // inbound Bitcoin connections.
 cfg.network.noListen = false;
 
+// Inventory filters
+//
+// BitcoinJS remembers the last invFilterSize items announced to it and
+// ignores further announcements of them. For each peer it remembers the last
+// peerInvFilterSize items the peer has announced or was sent, so they aren't
+// announced to it again. A false positive means an item is skipped, so keep
+// the rate low; the size of each filter is capped at invFilterMaxBytes.
+//cfg.network.invFilterSize = 50000;
+//cfg.network.peerInvFilterSize = 5000;
+//cfg.network.invFilterFpRate = 0.000001;
+//cfg.network.invFilterMaxBytes = 1024 * 1024;
+
+// Block download
+//
+// Blocks are requested from all peers at once, at most downloadPerPeer from
+// each and downloadWindow in total. A request that isn't answered within
+// downloadStallTimeout milliseconds moves to another peer; after
+// downloadMaxAttempts peers the block is skipped.
+//cfg.network.downloadWindow = 512;
+//cfg.network.downloadPerPeer = 32;
+//cfg.network.downloadStallTimeout = 15000;
+//cfg.network.downloadMaxAttempts = 5;
+//cfg.network.downloadLowWater = 128;
+
+// Orphan transactions
+//
+// Transactions spending outputs we don't know yet are kept until those show
+// up, at most this many of them.
+//cfg.network.maxOrphanTxs = 10000;
+
 // DATABASE SECTION
 // -----------------------------------------------------------------------------
 // URI
@@ -102,6 +132,30 @@ cfg.network.noListen = false;
 //cfg.storage.uri = 'mongodb://localhost/bitcoin';
 //cfg.storage.uri = null;
 
+// Unspent output cache
+//
+// BitcoinJS keeps recently created and used transaction outputs in memory so
+// verifying inputs doesn't have to load whole transactions from the database.
+// This is the cache's memory budget in bytes.
+//cfg.storage.utxoCacheSize = 64 * 1024 * 1024;
+
+// Block write batching
+//
+// With LevelDB every block is written in one atomic batch. While downloading
+// the chain up to the last checkpoint, several blocks can share a batch to
+// save disk syncs. If the process crashes, up to this many blocks have to be
+// downloaded again, even ones that were already reported as saved. The
+// unspent outputs they change are written in the same batch.
+//cfg.storage.blockBatchSize = 16;
+
+// Block write pipeline
+//
+// The next blocks are verified while earlier ones are still being written,
+// up to writeQueueLimit writes at a time. The inputs of the next
+// prefetchDepth queued blocks are looked up ahead of time.
+//cfg.storage.writeQueueLimit = 4;
+//cfg.storage.prefetchDepth = 8;
+
 // OTHER SETTINGS
 // -----------------------------------------------------------------------------
 // For other (undocumented) settings, please see the lib/settings.js file in the
@@ -1,6 +1,23 @@
 #!/usr/bin/env node
 
+var logger = require('../lib/logger');
 var createNode = require('./init').createNode;
 
 var node = createNode({ welcome: true });
 node.start();
+
+// Write out the blocks and unspent outputs the storage is holding back
+// before exiting
+['SIGINT', 'SIGTERM'].forEach(function (signal) {
+  process.on(signal, function () {
+    logger.info('Shutting down');
+    node.getBlockChain().close(function (err) {
+      if (err) {
+        logger.error('Error while closing the block chain: ' +
+                     (err.stack ? err.stack : err.toString()));
+        process.exit(1);
+      }
+      process.exit(0);
+    });
+  });
+});
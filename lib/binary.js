@@ -10,17 +10,18 @@ exports.put.prototype.varint = function (i) {
   if (i < 0xFD) {
     // unsigned char
     this.word8(i);
-  } else if (i <= 1<<16) {
+  } else if (i <= 0xFFFF) {
     this.word8(0xFD);
     // unsigned short (LE)
     this.word16le(i);
-  } else if (i <= 1<<32) {
+  } else if (i <= 0xFFFFFFFF) {
     this.word8(0xFE);
     // unsigned int (LE)
     this.word32le(i);
-    } else {
+  } else {
     this.word8(0xFF);
     // unsigned long long (LE)
     this.word64le(i);
-    }
+  }
+  return this;
 };
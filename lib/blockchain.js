@@ -16,6 +16,10 @@ var LRU = require("lru-cache");
 
 var Block = require('./schema/block').Block;
 var Transaction = require('./schema/transaction').Transaction;
+var TransactionOut = require('./schema/transaction').TransactionOut;
+
+// Block tree status flag for blocks that failed to connect
+var BLOCK_FAILED = 0x80;
 
 var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
   events.EventEmitter.call(this);
@@ -42,13 +46,37 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
   var recentBlockIndex = new RecentBlockIndex(recentBlockIndexLimit);
   var recentTxIndex = new RecentTxIndex(2000);
 
+  // Headers of all stored blocks, see loadBlockTree(). Until it has been
+  // loaded, lookups that need older blocks go to the database.
+  var blockTree = this.blockTree = new Util.BlockTree();
+  var blockTreeComplete = false;
+
+  // Unspent outputs, so input lookups don't have to load whole transactions
+  var utxoSet = this.utxoSet = new Util.UtxoSet(settings.storage.utxoCacheSize);
+  var utxoFlushCount = 0;
+
   // Only process one block at a time
   var isProcessing = false;
   var incomingBlockQueue = [];
 
+  // Block writes still running while later blocks are being verified, see
+  // storeBlock(). A failed write stops the chain from advancing.
+  var writesInFlight = 0;
+  var writeWaiters = [];
+  var drainWaiters = [];
+  var writeError = null;
+
+  // Time spent in each stage of block processing
+  var stageStats = {};
+
   var checkpoints = settings.network.checkpoints || [];
 
   this.init = function init() {
+    // Unspent outputs go out with every write of the blocks that changed them
+    if ("function" === typeof storage.setUnspentOutputSource) {
+      storage.setUnspentOutputSource(takeUnspentOutputChanges);
+    }
+
     Step(
       function connectDatabaseStep() {
         storage.connect(this);
@@ -63,6 +91,11 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
 
         loadTopBlock(this);
       },
+      function loadBlockTreeStep(err) {
+        if (err) throw err;
+
+        loadBlockTree(this);
+      },
       function emitCompleteStep(err) {
         if (err) {
           logger.error("Error while initializing block chain: " +
@@ -94,6 +127,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
       genesisBlock.active = true;
       genesisBlock.setChainWork(genesisBlock.getWork());
       genesisBlock.txs = [genesisTransaction.getHash()];
+      indexBlock(genesisBlock);
 
       self.emit('blockAdd', {block: genesisBlock, txs: [genesisTransaction]});
     } catch (e) {
@@ -132,6 +166,55 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     });
   }
 
+  /**
+   * Index the headers of all stored blocks in the block tree.
+   */
+  function loadBlockTree(callback) {
+    if ("function" !== typeof storage.forEachBlockRecord) {
+      // Only the top block and its successors get indexed
+      indexBlock(currentTopBlock);
+      setTreeTip(currentTopBlock);
+      callback();
+      return;
+    }
+
+    var start = new Date().getTime();
+    storage.forEachBlockRecord(function (hash, record) {
+      blockTree.addRecord(record);
+    }, function (err) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      var unlinked = blockTree.link();
+      if (unlinked) {
+        logger.warn(unlinked+" stored blocks don't connect to the block tree");
+      }
+      setTreeTip(currentTopBlock);
+      blockTreeComplete = true;
+
+      var stats = blockTree.stats();
+      logger.info('Indexed '+stats.entries+' block headers in '+
+                  (new Date().getTime() - start)+'ms');
+      callback();
+    });
+  }
+
+  var indexBlock = function indexBlock(block) {
+    var hash = block.getHash();
+    if (!blockTree.add(hash, block.prev_hash, block.height, block.chainWork)) {
+      // Known block that is being connected again
+      blockTree.setStatus(hash, 0);
+    }
+  };
+
+  var setTreeTip = function setTreeTip(block) {
+    if (blockTree.has(block.getHash())) {
+      blockTree.setTip(block.getHash());
+    }
+  };
+
   var getGenesisBlock = this.getGenesisBlock =
   function getGenesisBlock() {
     return genesisBlock;
@@ -144,9 +227,58 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
 
   var getBlockLocator = this.getBlockLocator =
   function getBlockLocator(callback) {
+    if (blockTreeComplete) {
+      var locator = blockTree.locator();
+      process.nextTick(function () {
+        callback(null, locator);
+      });
+      return;
+    }
+
     BlockLocator.createFromBlockChain(this, callback);
   };
 
+  /**
+   * Get the hashes of the main chain blocks following a locator.
+   *
+   * This is the reply to a getblocks message: up to `limit` hashes, starting
+   * after the latest locator entry on the main chain and ending early at
+   * `stopHash`.
+   */
+  var getBlockHashesAfter = this.getBlockHashesAfter =
+  function getBlockHashesAfter(locator, stopHash, limit, callback) {
+    if (blockTreeComplete) {
+      var hashes = blockTree.getBlocks(locator, stopHash, limit);
+      process.nextTick(function () {
+        callback(null, hashes);
+      });
+      return;
+    }
+
+    Step(
+      function findStartStep() {
+        storage.getBlockByLocator(locator, this);
+      },
+      function getSliceStep(err, block) {
+        if (err) throw err;
+
+        storage.getBlockSlice(block ? block.height + 1 : 1, limit, this);
+      },
+      function truncateStep(err, hashes) {
+        if (err) throw err;
+
+        for (var i = 0; i < hashes.length; i++) {
+          if (hashes[i].compare(stopHash) == 0) {
+            hashes = hashes.slice(0, i + 1);
+            break;
+          }
+        }
+        this(null, hashes);
+      },
+      callback
+    );
+  };
+
   var isTestnet = this.isTestnet =
   function isTestnet() {
     return self.cfg.network.type == 'testnet';
@@ -227,8 +359,14 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
 
       var hash64 = hash.toString('base64');
 
+      var entry;
       if (connectingBlockIndex.getByHash(hash64)) {
         callback(null, true);
+      } else if ((entry = blockTree.get(hash)) &&
+                 !(entry.status & BLOCK_FAILED)) {
+        callback(null, true);
+      } else if (blockTreeComplete) {
+        callback(null, false);
       } else {
         storage.knowsBlock(hash, callback);
       }
@@ -311,7 +449,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     // Get from cache the transactions that aren't saved to database yet
     hashes = hashes.filter(function (hash) {
       var tx;
-      if ((tx = recentTxIndex.get(hash.toString('base64')))) {
+      if ((tx = recentTxIndex.get(hash))) {
         txs.push(tx);
         return false;
       } else {
@@ -343,7 +481,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     // Get from cache the transactions that aren't saved to database yet
     hashes = hashes.filter(function (hash) {
       var tx;
-      if ((tx = recentTxIndex.get(hash.toString('base64')))) {
+      if ((tx = recentTxIndex.get(hash))) {
         txs.push(tx);
         return false;
       } else {
@@ -362,6 +500,278 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     });
   };
 
+  /**
+   * Fetch unspent outputs by outpoint.
+   *
+   * Answers from the UTXO cache where possible and asks the storage backend
+   * for the rest, if it keeps unspent outputs. Calls back with an array that
+   * has a TransactionOut for each outpoint found and null otherwise, in which
+   * case the caller has to fall back to getOutputsByHashes.
+   */
+  var getUnspentOutputs = this.getUnspentOutputs =
+  function getUnspentOutputs(outpoints, callback) {
+    var outs = [];
+    var missing = [];
+    var missingIndex = [];
+
+    outpoints.forEach(function (outpoint, i) {
+      var data = utxoSet.get(outpoint);
+      if (data) {
+        outs[i] = new TransactionOut({v: data.slice(0, 8), s: data.slice(8)});
+      } else {
+        outs[i] = null;
+
+        // null means spent, only unknown outputs are worth a database lookup
+        if ("undefined" === typeof data) {
+          missing.push(outpoint);
+          missingIndex.push(i);
+        }
+      }
+    });
+
+    if (!missing.length || "function" !== typeof storage.getUnspentOutputs) {
+      callback(null, outs);
+      return;
+    }
+
+    // Outputs may have been spent and flushed while we were reading, only
+    // cache results from before the next flush.
+    var flushCount = utxoFlushCount;
+    storage.getUnspentOutputs(missing, function (err, results) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      results.forEach(function (data, j) {
+        if (data) {
+          if (flushCount === utxoFlushCount) {
+            utxoSet.load(missing[j], data);
+          }
+          outs[missingIndex[j]] = new TransactionOut({
+            v: data.slice(0, 8),
+            s: data.slice(8)
+          });
+        }
+      });
+
+      callback(null, outs);
+    });
+  };
+
+  /**
+   * Fetch the outputs spent by the inputs of a block's transactions.
+   *
+   * Calls back with an array per transaction that has a TransactionOut per
+   * input, or null for coinbase inputs and outputs that can't be found.
+   * Outputs created within `txs` are taken from there, the rest from the
+   * UTXO cache and storage. Outputs that are already spent are read from the
+   * transactions that created them.
+   */
+  var getSpentOutputs = this.getSpentOutputs =
+  function getSpentOutputs(txs, callback) {
+    var localTxs = {};
+    txs.forEach(function (tx) {
+      localTxs[tx.getHash().toString('base64')] = tx;
+    });
+
+    var spent = [];
+    var outpoints = [];
+    var positions = [];
+    txs.forEach(function (tx, i) {
+      spent[i] = tx.ins.map(function (txin, j) {
+        if (txin.isCoinBase()) {
+          return null;
+        }
+
+        var localTx = localTxs[txin.getOutpointHash().toString('base64')];
+        if (localTx) {
+          return localTx.outs[txin.getOutpointIndex()] || null;
+        }
+
+        outpoints.push(txin.o);
+        positions.push([i, j]);
+        return null;
+      });
+    });
+
+    if (!outpoints.length) {
+      callback(null, spent);
+      return;
+    }
+
+    var missing = [];
+    Step(
+      function getUnspentStep() {
+        getUnspentOutputs(outpoints, this);
+      },
+      function getSourceTxsStep(err, outs) {
+        if (err) throw err;
+
+        var hashes = [];
+        outs.forEach(function (out, k) {
+          var pos = positions[k];
+          if (out) {
+            spent[pos[0]][pos[1]] = out;
+          } else {
+            missing.push(k);
+            hashes.push(outpoints[k].slice(0, 32));
+          }
+        });
+
+        if (!hashes.length) {
+          this(null, []);
+          return;
+        }
+
+        getOutputsByHashes(hashes, this);
+      },
+      function (err, sourceTxs) {
+        if (err) throw err;
+
+        var sources = {};
+        sourceTxs.forEach(function (tx) {
+          sources[tx.getHash().toString('base64')] = tx;
+        });
+
+        missing.forEach(function (k) {
+          var pos = positions[k];
+          var txin = txs[pos[0]].ins[pos[1]];
+          var source = sources[txin.getOutpointHash().toString('base64')];
+          if (source) {
+            spent[pos[0]][pos[1]] =
+              source.outs[txin.getOutpointIndex()] || null;
+          }
+        });
+
+        this(null, spent);
+      },
+      callback
+    );
+  };
+
+  /**
+   * Load a block's transactions in block order, together with the outputs
+   * they spent.
+   */
+  var getBlockTransactions = function getBlockTransactions(block, callback) {
+    var txs;
+    Step(
+      function getTxsStep() {
+        getTransactionsByHashes(block.txs, this);
+      },
+      function getSpentOutputsStep(err, result) {
+        if (err) throw err;
+
+        var byHash = {};
+        result.forEach(function (tx) {
+          byHash[tx.getHash().toString('base64')] = tx;
+        });
+        txs = [];
+        block.txs.forEach(function (hash) {
+          var tx = byHash[hash.toString('base64')];
+          if (tx) {
+            txs.push(tx);
+          }
+        });
+
+        getSpentOutputs(txs, this);
+      },
+      function (err, spent) {
+        if (err) throw err;
+
+        this(null, txs, spent);
+      },
+      callback
+    );
+  };
+
+  var connectUnspentOutputs = function connectUnspentOutputs(txs) {
+    txs.forEach(function (tx) {
+      utxoSet.connect(tx.getHash(), tx.getBuffer());
+    });
+  };
+
+  /**
+   * Take a block's transactions out of the UTXO cache, newest first, and
+   * put back the outputs they spent as returned by getSpentOutputs().
+   */
+  var disconnectUnspentOutputs =
+  function disconnectUnspentOutputs(txs, spent) {
+    for (var i = txs.length - 1; i >= 0; i--) {
+      utxoSet.disconnect(txs[i].getHash(), txs[i].getBuffer(),
+                         spent[i].map(function (out) {
+                           return out ? out.v.concat(out.s) : null;
+                         }));
+    }
+  };
+
+  /**
+   * Hand the UTXO cache's changes to the storage.
+   *
+   * Storage engines that keep unspent outputs call this for every write, so
+   * the outputs on disk always belong to the same blocks as the rest of the
+   * database.
+   */
+  var takeUnspentOutputChanges = function takeUnspentOutputChanges() {
+    utxoFlushCount++;
+    return utxoSet.flush();
+  };
+
+  /**
+   * Write the UTXO cache's changes to the database, together with any
+   * blocks the storage is still holding back.
+   *
+   * Storage engines that don't keep unspent outputs just have the changes
+   * dropped, so the cache can evict the entries again. This happens after
+   * every connected block.
+   */
+  var flushUnspentOutputs = this.flushUnspentOutputs =
+  function flushUnspentOutputs(callback) {
+    if ("function" === typeof storage.setUnspentOutputSource) {
+      storage.commit(callback);
+      return;
+    }
+
+    takeUnspentOutputChanges();
+    callback(null);
+  };
+
+  /**
+   * Wait for running block writes, write out everything that is still held
+   * back and close the storage.
+   */
+  var close = this.close = function close(callback) {
+    Step(
+      function waitForWritesStep() {
+        if (writesInFlight) {
+          drainWaiters.push(this);
+        } else {
+          this(null);
+        }
+      },
+      function disconnectStep(err) {
+        if (err) throw err;
+
+        if (writeError) {
+          throw writeError;
+        }
+
+        flushUnspentOutputs(this);
+      },
+      function (err) {
+        if (err) throw err;
+
+        if ("function" === typeof storage.disconnect) {
+          storage.disconnect(this);
+        } else {
+          this(null);
+        }
+      },
+      callback
+    );
+  };
+
   var getQueueCount = this.getQueueCount = function getQueueCount() {
     return incomingBlockQueue.length;
   };
@@ -384,7 +794,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     }
 
     // Check if the block was recently added
-    if (recentBlockIndex.get(hash64)) {
+    if (recentBlockIndex.get(block.getHash())) {
       if (callback) {
         callback(null);
       }
@@ -413,6 +823,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     // Process blocks one at a time
     if (isProcessing) {
       incomingBlockQueue.push(bw);
+      prefetchQueue();
     } else {
       processBlock(bw);
     }
@@ -428,10 +839,14 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     // Shorthand
     var block = bw.block;
 
+    var endStage = startStage('connect');
+
     Step(
       function prepare() {
         isProcessing = true;
 
+        prefetchQueue();
+
         // Index block while it is being connected
         connectingBlockIndex.add(bw);
 
@@ -498,12 +913,19 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
       function verifyBlockStep(err) {
         if (err) throw err;
 
+        endStage();
+
         if (!self.cfg.verify) {
           this();
           return;
         }
 
-        verifyBlock(bw, this);
+        var callback = this;
+        endStage = startStage('verify');
+        verifyBlock(bw, function (err) {
+          endStage();
+          callback(err);
+        });
       },
       function reorganize(err) {
         if (err) throw err;
@@ -514,24 +936,15 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
           this(null);
         }
       },
-      function saveTransactions(err) {
-        if (err) throw err;
-
-        self.saveTransactions(bw.block, bw.txs, this);
-      },
-      function saveBlock(err) {
-        if (err) throw err;
-
-        self.saveBlock(bw, this);
-      },
-      function connectTransactions(err) {
+      function storeBlock(err) {
         if (err) throw err;
 
-        if (bw.mode == "main") {
-          self.connectTransactions(bw.block, bw.txs, this);
-        } else {
-          this();
-        }
+        var callback = this;
+        endStage = startStage('store');
+        self.storeBlock(bw, function (err) {
+          endStage();
+          callback(err);
+        });
       },
       function queueDependents(err) {
         if (err) throw err;
@@ -567,9 +980,13 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
           // the updating of currentTopBlock
           if (bw.mode == "main") {
             currentTopBlock = bw.parent;
+            setTreeTip(bw.parent);
+          }
+          if (bw.mode == "main" || bw.mode == "side") {
+            blockTree.setStatus(bw.block.getHash(), BLOCK_FAILED);
           }
           connectingBlockIndex.remove(bw);
-          recentBlockIndex.remove(bw.hash64);
+          recentBlockIndex.remove(bw.block.getHash());
         }
 
         bw.callback(err);
@@ -581,12 +998,96 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
           //self.processBlock(next);
         } else {
           isProcessing = false;
+          commitStorage();
           self.emit('queueDone', {chain: self});
         }
       }
     );
   };
 
+  /**
+   * Start timing a stage of block processing, returns the function that
+   * stops the clock.
+   */
+  var startStage = function startStage(name) {
+    var start = new Date().getTime();
+    return function endStage() {
+      var stats = stageStats[name];
+      if (!stats) {
+        stats = stageStats[name] = {count: 0, time: 0, max: 0};
+      }
+      var time = new Date().getTime() - start;
+      stats.count++;
+      stats.time += time;
+      if (time > stats.max) {
+        stats.max = time;
+      }
+    };
+  };
+
+  /**
+   * Counters for each stage of block processing (milliseconds) plus the
+   * current queue lengths.
+   */
+  var getPipelineStats = this.getPipelineStats =
+  function getPipelineStats() {
+    var stages = {};
+    for (var name in stageStats) {
+      var stats = stageStats[name];
+      stages[name] = {
+        count: stats.count,
+        time: stats.time,
+        avg: stats.count ? Math.round(stats.time / stats.count) : 0,
+        max: stats.max
+      };
+    }
+    return {
+      stages: stages,
+      queued: incomingBlockQueue.length,
+      writing: writesInFlight
+    };
+  };
+
+  /**
+   * Look up the inputs of the next few queued blocks, so their outputs are
+   * in the UTXO cache by the time the blocks are verified.
+   */
+  var prefetchQueue = function prefetchQueue() {
+    var l = Math.min(self.cfg.storage.prefetchDepth,
+                     incomingBlockQueue.length);
+    for (var i = 0; i < l; i++) {
+      var bw = incomingBlockQueue[i];
+      if (bw.prefetched) {
+        continue;
+      }
+      bw.prefetched = true;
+
+      var outpoints = [];
+      bw.txs = bw.txs.map(function (tx, j) {
+        if (!(tx instanceof Transaction)) {
+          tx = new Transaction(tx);
+        }
+        if (j > 0) {
+          tx.ins.forEach(function (txin) {
+            outpoints.push(txin.o);
+          });
+        }
+        return tx;
+      });
+
+      // Outputs of blocks still ahead of this one aren't stored yet, those
+      // are simply not found here.
+      var endStage = startStage('prefetch');
+      getUnspentOutputs(outpoints, function (err) {
+        endStage();
+        if (err) {
+          logger.warn("Error while prefetching outputs: " +
+                      (err.stack ? err.stack : err.toString()));
+        }
+      });
+    }
+  };
+
   var connectBlock = this.connectBlock =
   function connectBlock(bw, callback) {
     // Shorthand
@@ -624,7 +1125,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
       callback("orphan");
 
     // Maybe this block connects to a recently added block?
-    } else if ((parent = recentBlockIndex.get(bw.parent64))) {
+    } else if ((parent = recentBlockIndex.get(block.prev_hash))) {
       block.attachTo(parent);
 
       // Block connects to a side chain
@@ -685,12 +1186,15 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
   {
     // This block is no longer being connected
     connectingBlockIndex.remove(bw);
-    recentBlockIndex.set(bw.hash64, bw.block);
+    recentBlockIndex.set(bw.block.getHash(), bw.block);
 
     logger.bchdbg('Adding block '+Util.formatHashAlt(bw.block.hash));
     currentTopBlock = bw.block;
     bw.block.active = true;
 
+    indexBlock(bw.block);
+    blockTree.setTip(bw.block.getHash());
+
     callback(null);
   };
 
@@ -699,7 +1203,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
   {
     // This block is no longer being connected
     connectingBlockIndex.remove(bw);
-    recentBlockIndex.set(bw.hash64, bw.block);
+    recentBlockIndex.set(bw.block.getHash(), bw.block);
 
     logger.info('Adding block '+Util.formatHashAlt(bw.block.hash)+
                 ' on side chain');
@@ -707,6 +1211,8 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     // Switch chains if side chain has more work.
     bw.block.active = false;
 
+    indexBlock(bw.block);
+
     callback(null);
   };
 
@@ -719,6 +1225,11 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     bw.txs.forEach(function (tx) {
       localTx.add(tx);
     });
+
+    // The outputs each transaction spends, kept for the address index, see
+    // storeBlock()
+    var spent = [];
+
     // Connect transactions
     Step(
       function cacheTxInputs() {
@@ -736,6 +1247,15 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
 
             tx.getAffectedKeys(txCache);
 
+            spent[i] = tx.ins.map(function (txin) {
+              if (txin.isCoinBase()) {
+                return null;
+              }
+              var outs = txCache.txIndex[
+                txin.getOutpointHash().toString('base64')];
+              return outs && outs[txin.getOutpointIndex()] || null;
+            });
+
             // TODO: Are we doing static tx checks yet? The stuff from
             //       Transaction::CheckTransaction().
 
@@ -757,6 +1277,12 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
           });
         });
       },
+      function (err) {
+        if (err) throw err;
+
+        bw.spent = spent;
+        this(null);
+      },
       callback
     );
   };
@@ -790,6 +1316,145 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     });
   };
 
+  /**
+   * Saves a processed block along with its transactions and, for main
+   * chain blocks, connects the transactions.
+   *
+   * Storage engines that provide storeBlock() get all of it as one atomic
+   * write; during the initial download several blocks may share a write.
+   */
+  var storeBlock = this.storeBlock = function storeBlock(bw, callback)
+  {
+    var connect = bw.mode == "main";
+
+    if ("function" !== typeof storage.storeBlock) {
+      Step(
+        function saveTransactionsStep() {
+          saveTransactions(bw.block, bw.txs, this);
+        },
+        function saveBlockStep(err) {
+          if (err) throw err;
+
+          saveBlock(bw, this);
+        },
+        function connectTransactionsStep(err) {
+          if (err) throw err;
+
+          if (connect) {
+            connectTransactions(bw.block, bw.txs, this);
+          } else {
+            this(null);
+          }
+        },
+        callback
+      );
+      return;
+    }
+
+    // The address index needs the outputs this block spends. Verification
+    // has found them already, unless it is turned off.
+    loadAddressDeltas(connect ? bw.txs : [], bw.spent, function (err) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      if (writeError) {
+        callback(writeError);
+        return;
+      }
+
+      if ("function" === typeof storage.setBlockBatchSize) {
+        // Shrinking the batch writes out the blocks it holds
+        writesInFlight++;
+        storage.setBlockBatchSize(self.isPastCheckpoints() ?
+                                  1 : self.cfg.storage.blockBatchSize,
+                                  function (err) {
+                                    finishWrite(err, "blocks");
+                                  });
+      }
+
+      self.emit('blockAdd', {block: bw.block, txs: bw.txs, chain: self});
+      if (connect) {
+        emitTxAdd(bw.block, bw.txs);
+      }
+
+      // The storage serves the block's records from memory until they are
+      // written, so the next block can be verified right away. Only the UTXO
+      // cache has to be up to date first, and before the block is queued, so
+      // its changes go into the same write.
+      if (connect) {
+        connectUnspentOutputs(bw.txs);
+      }
+
+      var endStage = startStage('write');
+      writesInFlight++;
+      storage.storeBlock(bw.block, bw.txs, connect, function (err) {
+        endStage();
+
+        if (!err) {
+          // With cfg.storage.blockBatchSize above one the block may not be
+          // on disk yet, see storage.storeBlock()
+          self.emit('blockSave', {block: bw.block, txs: bw.txs, chain: self});
+
+          logger.bchdbg('Block added successfully ' + bw.block);
+
+          if (connect) {
+            emitTxSave(bw.block, bw.txs);
+          }
+        }
+
+        finishWrite(err, "block "+bw.block);
+      });
+
+      if (writeError) {
+        callback(writeError);
+      } else if (writesInFlight < self.cfg.storage.writeQueueLimit) {
+        callback(null);
+      } else {
+        writeWaiters.push(callback);
+      }
+    });
+  };
+
+  /**
+   * Count a finished block write and wake up whoever waits for it.
+   */
+  var finishWrite = function finishWrite(err, what) {
+    writesInFlight--;
+
+    if (err && !writeError) {
+      // Later blocks may already have been verified against the ones
+      // written, so there is no safe way to continue.
+      writeError = err;
+      logger.error("Error while writing "+what+": " +
+                   (err.stack ? err.stack : err.toString()));
+    }
+
+    while (writeWaiters.length &&
+           (writeError ||
+            writesInFlight < self.cfg.storage.writeQueueLimit)) {
+      writeWaiters.shift()(writeError);
+    }
+    while (!writesInFlight && drainWaiters.length) {
+      drainWaiters.shift()(null);
+    }
+  };
+
+  /**
+   * Writes out blocks the storage is still holding back.
+   */
+  var commitStorage = function commitStorage() {
+    if ("function" !== typeof storage.commit) {
+      return;
+    }
+
+    writesInFlight++;
+    storage.commit(function (err) {
+      finishWrite(err, "blocks");
+    });
+  };
+
   var saveTransactions = this.saveTransactions =
   function saveTransactions(block, txs, callback) {
     storage.saveTransactions(txs, function (err) {
@@ -802,15 +1467,106 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     });
   };
 
+  /**
+   * Mark a block's transactions as connected in storage. Storage engines
+   * with an address index get the block too, so they can index it.
+   */
+  var storageConnect = function storageConnect(block, txs, callback) {
+    if ("function" === typeof storage.connectBlock) {
+      storage.connectBlock(block, txs, callback);
+    } else {
+      storage.connectTransactions(txs, callback);
+    }
+  };
+
+  var storageDisconnect = function storageDisconnect(block, txs, callback) {
+    if ("function" === typeof storage.disconnectBlock) {
+      storage.disconnectBlock(block, txs, callback);
+    } else {
+      storage.disconnectTransactions(txs, callback);
+    }
+  };
+
+  /**
+   * Fill in each transaction's `addressDeltas`, what it does to the balance
+   * and unspent outputs of the pubkey hashes it pays or spends from, for
+   * storage engines with an address index.
+   */
+  var applyAddressDeltas = function applyAddressDeltas(txs, spent) {
+    if ("function" !== typeof storage.getAddressIndex) {
+      return;
+    }
+
+    txs.forEach(function (tx, i) {
+      tx.addressDeltas = tx.getAddressDeltas(spent[i]);
+    });
+  };
+
+  /**
+   * Like applyAddressDeltas(), but loads the spent outputs first unless
+   * they are given. Has to be called before the transactions are connected
+   * to the UTXO cache.
+   */
+  var loadAddressDeltas = function loadAddressDeltas(txs, spent, callback) {
+    if (!txs.length || "function" !== typeof storage.getAddressIndex) {
+      callback(null);
+      return;
+    }
+
+    if (spent) {
+      applyAddressDeltas(txs, spent);
+      callback(null);
+      return;
+    }
+
+    getSpentOutputs(txs, function (err, spent) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      applyAddressDeltas(txs, spent);
+      callback(null);
+    });
+  };
+
   var connectTransactions = this.connectTransactions =
   function connectTransactions(block, txs, callback)
   {
+    emitTxAdd(block, txs);
+
+    Step(
+      function loadAddressDeltasStep() {
+        loadAddressDeltas(txs, null, this);
+      },
+      function connectStep(err) {
+        if (err) throw err;
+
+        // Update the UTXO cache first, so its changes go out with the block
+        connectUnspentOutputs(txs);
+        storageConnect(block, txs, this);
+      },
+      function (err) {
+        if (err) throw err;
+
+        emitTxSave(block, txs);
+        if ("function" !== typeof storage.setUnspentOutputSource) {
+          flushUnspentOutputs(this);
+        } else {
+          this(null);
+        }
+      },
+      callback
+    );
+  };
+
+  var emitTxAdd = function emitTxAdd(block, txs) {
     txs.forEach(function (tx, i) {
       var e = {block: block, index: i, tx: tx, chain: self};
       self.emit('txAdd', e);
       self.emit('txAdd:'+tx.hash.toString('base64'), e);
 
-      recentTxIndex.set(tx.hash.toString('base64'), tx);
+      recentTxIndex.set(tx.hash, tx);
 
       // Create separate events for each address affected by this tx
       if (self.cfg.feature.liveAccounting && tx.affects) {
@@ -820,36 +1576,40 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
         });
       }
     });
+  };
 
-
-    storage.connectTransactions(txs, function (err) {
-      if (err) {
-        callback(err);
-        return;
-      }
-
-      txs.forEach(function (tx, i) {
-        var e = {block: block, index: i, tx: tx, chain: self};
-        self.emit('txSave', e);
-        self.emit('txSave:'+tx.hash.toString('base64'), e);
-      });
-
-      callback(null);
+  var emitTxSave = function emitTxSave(block, txs) {
+    txs.forEach(function (tx, i) {
+      var e = {block: block, index: i, tx: tx, chain: self};
+      self.emit('txSave', e);
+      self.emit('txSave:'+tx.hash.toString('base64'), e);
     });
   };
 
+  /**
+   * Find the blocks to disconnect (newest first) and to connect (oldest
+   * first) to switch the main chain from bOld to bNew.
+   */
   this.findFork = function findFork(bOld, bNew, toDisconnect, toConnect, callback) {
     try {
       if ("function" == typeof toDisconnect) {
         callback = toDisconnect;
         toDisconnect = null;
+
+        var fork;
+        if (blockTreeComplete &&
+            (fork = blockTree.findFork(bOld.getHash(), bNew.getHash()))) {
+          getForkBlocks(fork, bOld, bNew, callback);
+          return;
+        }
       }
 
       toDisconnect = toDisconnect || [];
       toConnect = toConnect || [];
 
       if (bOld.getHash().compare(bNew.getHash()) === 0) {
-        callback(null, toDisconnect, toConnect, bOld);
+        // Blocks to connect were collected walking backwards
+        callback(null, toDisconnect, toConnect.reverse(), bOld);
         return;
       }
 
@@ -872,6 +1632,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
       } else {
         if (bNew.height <= 0) {
           callback(new Error("No common root found"));
+          return;
         }
         toConnect.push(bNew);
 
@@ -894,6 +1655,42 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
     }
   };
 
+  /**
+   * Load the blocks of a fork found in the block tree.
+   *
+   * The branch heads are passed in, since the new one may not be stored yet.
+   */
+  var getForkBlocks = function getForkBlocks(fork, bOld, bNew, callback) {
+    var blocks = {};
+    blocks[bOld.getHash().toString('base64')] = bOld;
+    blocks[bNew.getHash().toString('base64')] = bNew;
+
+    var hashes = fork.disconnect.concat(fork.connect);
+    var missing = hashes.filter(function (hash) {
+      return !blocks[hash.toString('base64')];
+    });
+    storage.getBlocksByHashes(missing, function (err, result) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      result.forEach(function (block) {
+        blocks[block.getHash().toString('base64')] = block;
+      });
+
+      var lookup = function (hash) {
+        return blocks[hash.toString('base64')];
+      };
+      if (!hashes.every(lookup)) {
+        callback(new Error("Fork blocks missing from storage"));
+        return;
+      }
+
+      callback(null, fork.disconnect.map(lookup), fork.connect.map(lookup));
+    });
+  };
+
   this.reorganize = function reorganize(oldTopBlock, newTopBlock, callback) {
     logger.info('Reorganize (old head: '+Util.formatHashAlt(oldTopBlock.hash)+
                 ', new head: '+Util.formatHashAlt(newTopBlock.hash)+')');
@@ -922,7 +1719,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
 
           block.active = false;
 
-          self.getTransactionsByHashes(block.txs, function (err, txs) {
+          getBlockTransactions(block, function (err, txs, spent) {
             if (err) {
               logger.error('Error during reorg (while getting'+
                            'txs to disconnect): ' +
@@ -931,13 +1728,14 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
               return;
             }
 
-            // First revoke the transactions
-            var revokeSteps = txs.map(function (tx, i) {
-              return function (err) {
-                if (err) throw err;
+            disconnectUnspentOutputs(txs, spent);
 
-                var callback = this;
+            var revokeSteps = [];
 
+            // First revoke the transactions, in reverse order
+            revokeSteps.push(function revokeTxsStep() {
+              for (var i = txs.length - 1; i >= 0; i--) {
+                var tx = txs[i];
                 var e = {
                   block: block,
                   index: i,
@@ -954,15 +1752,12 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
                     self.emit('txRevoke:'+hash64, e);
                   });
                 }
+              }
 
-                // Disconnect the inputs for these transactions
-                storage.disconnectTransactions(txs, callback);
-              };
+              // Disconnect the inputs for these transactions
+              storageDisconnect(block, txs, this);
             });
 
-            // Revoke txs in reverse order
-            revokeSteps.reverse();
-
             // Once done, save the block and go to the next
             // reorg step.
             revokeSteps.push(function (err) {
@@ -998,7 +1793,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
 
           block.active = true;
 
-          getTransactionsByHashes(block.txs, function (err, txs) {
+          getBlockTransactions(block, function (err, txs, spent) {
             if (err) {
               logger.error('Error during reorg (while getting '+
                            'txs to connect): ' +
@@ -1007,12 +1802,13 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
               return;
             }
 
-            var addSteps = txs.map(function (tx, i) {
-              return function (err) {
-                if (err) throw err;
+            applyAddressDeltas(txs, spent);
+            connectUnspentOutputs(txs);
 
-                var callback = this;
+            var addSteps = [];
 
+            addSteps.push(function addTxsStep() {
+              txs.forEach(function (tx, i) {
                 var e = {
                   block: block,
                   index: i,
@@ -1030,10 +1826,10 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
                     self.emit('txAdd:'+hash64, e);
                   });
                 }
+              });
 
-                // Connect the inputs for these transactions
-                storage.connectTransactions(txs, callback);
-              };
+              // Connect the inputs for these transactions
+              storageConnect(block, txs, this);
             });
 
             addSteps.push(function (err) {
@@ -1087,6 +1883,7 @@ var BlockChain = exports.BlockChain = function BlockChain(storage, settings) {
       reorgSteps.push(function (err) {
         // Set new top block
         currentTopBlock = newTopBlock;
+        setTreeTip(newTopBlock);
 
         // Run callback
         if ("function" == typeof callback) {
@@ -1220,58 +2017,38 @@ ConnectingBlockIndex.prototype.removeHeads = function removeHeads(bws) {
   }.bind(this));
 };
 
+/**
+ * Recently added blocks by hash, the oldest are dropped first.
+ */
 var RecentBlockIndex = exports.RecentBlockIndex =
 function RecentBlockIndex(maxEntries) {
-  this.maxEntries = maxEntries;
-
-  this.list = [];
-  this.index = {};
+  this.index = new Util.HashTable(maxEntries);
 };
 
-RecentBlockIndex.prototype.set = function set(key, value) {
-  this.list.push(key);
-  this.index[key] = value;
-
-  this.clean();
-};
-
-RecentBlockIndex.prototype.get = function get(hash64) {
-  return this.index[hash64];
+RecentBlockIndex.prototype.set = function set(hash, value) {
+  this.index.set(hash, value);
 };
 
-RecentBlockIndex.prototype.remove = function remove(hash64) {
-  delete this.index[hash64];
+RecentBlockIndex.prototype.get = function get(hash) {
+  return this.index.get(hash);
 };
 
-RecentBlockIndex.prototype.clean = function clean() {
-  while (this.list.length > this.maxEntries) {
-    var dropped = this.list.shift();
-    delete this.index[dropped];
-  }
+RecentBlockIndex.prototype.remove = function remove(hash) {
+  this.index.remove(hash);
 };
 
+/**
+ * Recently added transactions by hash, the oldest are dropped first.
+ */
 var RecentTxIndex = exports.RecentTxIndex =
 function RecentTxIndex(maxEntries) {
-  this.maxEntries = maxEntries;
-
-  this.list = [];
-  this.index = {};
-};
-
-RecentTxIndex.prototype.set = function set(key, value) {
-  this.list.push(key);
-  this.index[key] = value;
-
-  this.clean();
+  this.index = new Util.HashTable(maxEntries);
 };
 
-RecentTxIndex.prototype.get = function get(key) {
-  return this.index[key];
+RecentTxIndex.prototype.set = function set(hash, value) {
+  this.index.set(hash, value);
 };
 
-RecentTxIndex.prototype.clean = function clean() {
-  while (this.list.length > this.maxEntries) {
-    var dropped = this.list.shift();
-    delete this.index[dropped];
-  }
+RecentTxIndex.prototype.get = function get(hash) {
+  return this.index.get(hash);
 };
@@ -1,6 +1,8 @@
 var util = require('util');
+var events = require('events');
 var logger = require('./logger');
 var Util = require('./util');
+var BlockScheduler = require('./blockscheduler').BlockScheduler;
 
 /**
  * This class manages the block chain and block chain downloads.
@@ -19,6 +21,13 @@ var BlockChainManager = exports.BlockChainManager = function (blockChain, peerMa
   // there are more blocks to be downloaded.
   this.tickle = null;
 
+  // Fetches the blocks announced to us from all peers at once
+  this.scheduler = new BlockScheduler(blockChain, peerManager);
+
+  // Last hash of a full getblocks reply, the next getblocks starts there
+  // as soon as the scheduler runs low on hashes.
+  this.nextBatchHash = null;
+
   // Move these to the Node's settings object
   this.checkInterval = 5000;
   this.downloadTimeout = 25000;
@@ -26,6 +35,7 @@ var BlockChainManager = exports.BlockChainManager = function (blockChain, peerMa
   this.peerManager.on('connect', this.handleConnect.bind(this));
   this.blockChain.on('blockSave', this.handleBlockSave.bind(this));
   this.blockChain.on('queueDone', this.handleQueueDone.bind(this));
+  this.scheduler.on('needMore', this.handleNeedMore.bind(this));
 };
 
 util.inherits(BlockChainManager, events.EventEmitter);
@@ -56,11 +66,15 @@ BlockChainManager.prototype.pingStatus = function ()
     this.currentDownload.handleTimeout();
   }
 
+  this.scheduler.checkStalled();
+
   this.timer = setTimeout(this.pingStatus.bind(this), this.checkInterval);
 };
 
-BlockChainManager.prototype.handleConnect = function ()
+BlockChainManager.prototype.handleConnect = function (e)
 {
+  this.scheduler.addConnection(e.conn);
+
   if (this.enabled &&
       this.currentDownload == null) {
      this.startDownload();
@@ -76,6 +90,9 @@ BlockChainManager.prototype.handleBlockSave = function handleBlockSave(e)
     }
     this.lastSeenTop = curTop;
   }
+
+  // The block chain has room for more blocks
+  this.scheduler.schedule();
 };
 
 BlockChainManager.prototype.handleQueueDone = function handleQueueDone(e)
@@ -88,6 +105,18 @@ BlockChainManager.prototype.handleQueueDone = function handleQueueDone(e)
   }
 };
 
+BlockChainManager.prototype.handleNeedMore = function handleNeedMore(e)
+{
+  if (!this.enabled || this.currentDownload || !this.nextBatchHash) {
+    return;
+  }
+
+  // Ask for the next batch while the scheduler is still busy with this one
+  var fromHash = this.nextBatchHash;
+  this.nextBatchHash = null;
+  this.createDownload(Util.NULL_HASH, fromHash);
+};
+
 BlockChainManager.prototype.startDownload = function (toHash, fromHash, conn)
 {
   var self = this;
@@ -117,6 +146,11 @@ BlockChainManager.prototype.startDownload = function (toHash, fromHash, conn)
     }
   }
 
+  this.createDownload(toHash, fromHash, conn);
+};
+
+BlockChainManager.prototype.createDownload = function (toHash, fromHash, conn)
+{
   try {
     // Don't start a new download while one is still going
     if (this.currentDownload) {
@@ -133,6 +167,13 @@ BlockChainManager.prototype.startDownload = function (toHash, fromHash, conn)
       this.startDownload(e.invs[0].hash, null, e.conn);
     }.bind(this));
 
+    // The reply to our getblocks, the scheduler downloads the blocks. A full
+    // reply means there are more, which we ask for once the scheduler needs
+    // them.
+    this.currentDownload.on('batch', function handleDownloadBatch(e) {
+      this.nextBatchHash = e.full ? e.invs[e.invs.length - 1].hash : null;
+    }.bind(this));
+
     // Handle block chain download timeout
     this.currentDownload.on('timeout', function handleTimeout(e) {
       // We need to nextTick this, because there will be a "close" event
@@ -210,7 +251,8 @@ BlockChainDownload.prototype.start = function start()
     }
 
     this.locator = locator;
-    // TODO: Figure out a way to spread load across peers
+    // Only the hashes come from this peer, the scheduler spreads the
+    // actual block downloads across all of them.
     if (!this.conn) {
       this.conn = this.bcm.getConnection();
     }
@@ -259,6 +301,9 @@ BlockChainDownload.prototype.start = function start()
   }).bind(this));
 };
 
+// Number of hashes in a getblocks reply if the peer has more to offer
+BlockChainDownload.MAX_BLOCKS_INV = 500;
+
 BlockChainDownload.prototype.handleInv = function handleInv(e) {
   var invs = e.message.invs;
 
@@ -270,6 +315,21 @@ BlockChainDownload.prototype.handleInv = function handleInv(e) {
       conn: e.conn
     });
     this.close();
+    return;
+  }
+
+  // Anything longer is the reply to our getblocks. The node queues the new
+  // blocks with the scheduler, so this download is done.
+  invs = invs.filter(function (inv) {
+    return inv.type == 2;
+  });
+  if (invs.length) {
+    this.emit('batch', {
+      invs: invs,
+      full: invs.length >= BlockChainDownload.MAX_BLOCKS_INV,
+      conn: e.conn
+    });
+    this.close();
   }
 };
 
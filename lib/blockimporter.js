@@ -0,0 +1,255 @@
+var fs = require('fs');
+var path = require('path');
+var util = require('util');
+var events = require('events');
+var logger = require('./logger');
+var Util = require('./util');
+var Transaction = require('./schema/transaction').Transaction;
+
+/**
+ * Imports blocks from bitcoind's blk*.dat files.
+ *
+ * Files are read in large chunks which are parsed natively, with the proof
+ * of work and merkle root of every block checked on the thread pool. The
+ * blocks then go through BlockChain.add() like blocks from the network, so
+ * below the last checkpoint signatures are skipped as usual.
+ *
+ * At most queueSize blocks wait in the block chain's queue at any time;
+ * reading pauses until it drains.
+ */
+var BlockImporter = exports.BlockImporter = function (blockChain, magic) {
+  events.EventEmitter.call(this);
+
+  this.blockChain = blockChain;
+  this.magic = magic;
+
+  this.chunkSize = 16 * 1024 * 1024;
+  this.queueSize = 256;
+  this.pollInterval = 20;
+
+  // Blocks handed to the block chain that haven't called back yet
+  this.outstanding = 0;
+  this.drainCallback = null;
+
+  this.stats = {
+    files: 0,
+    bytes: 0,
+    blocks: 0,
+    known: 0,
+    invalid: 0,
+    failed: 0
+  };
+};
+
+util.inherits(BlockImporter, events.EventEmitter);
+
+/**
+ * Expand directories to the blk*.dat files they contain, in file order.
+ */
+BlockImporter.listFiles = function (paths) {
+  var files = [];
+  paths.forEach(function (p) {
+    p = path.resolve(p);
+    if (!fs.statSync(p).isDirectory()) {
+      files.push(p);
+      return;
+    }
+
+    fs.readdirSync(p).filter(function (name) {
+      return /^blk\d+\.dat$/.test(name);
+    }).sort(function (a, b) {
+      return parseInt(a.slice(3), 10) - parseInt(b.slice(3), 10);
+    }).forEach(function (name) {
+      files.push(path.join(p, name));
+    });
+  });
+  return files;
+};
+
+BlockImporter.prototype.importFiles = function (files, callback)
+{
+  var self = this;
+  var i = 0;
+
+  (function next(err) {
+    if (err) {
+      callback(err, self.stats);
+      return;
+    }
+    if (i >= files.length) {
+      self.drain(function () {
+        callback(null, self.stats);
+      });
+      return;
+    }
+    self.importFile(files[i++], next);
+  })();
+};
+
+/**
+ * Call back once the block chain has processed every imported block.
+ */
+BlockImporter.prototype.drain = function (callback)
+{
+  if (this.outstanding) {
+    this.drainCallback = callback;
+  } else {
+    callback();
+  }
+};
+
+BlockImporter.prototype.importFile = function (file, callback)
+{
+  var self = this;
+
+  logger.info('Importing blocks from '+file);
+
+  fs.open(file, 'r', function (err, fd) {
+    if (err) {
+      callback(err);
+      return;
+    }
+
+    var position = 0;
+    var leftover = null;
+    var chunkSize = self.chunkSize;
+
+    function finish(err) {
+      fs.close(fd, function () {
+        if (!err) {
+          self.stats.files++;
+          self.emit('fileDone', {file: file, stats: self.stats});
+        }
+        callback(err || null);
+      });
+    }
+
+    function readChunk() {
+      var keep = leftover ? leftover.length : 0;
+      var chunk = new Buffer(Math.max(chunkSize, keep * 2));
+      if (keep) {
+        leftover.copy(chunk, 0);
+      }
+
+      fs.read(fd, chunk, keep, chunk.length - keep, position,
+              function (err, bytesRead) {
+        if (err) {
+          finish(err);
+          return;
+        }
+        if (!bytesRead) {
+          // Whatever is left over is padding or a truncated block
+          finish(null);
+          return;
+        }
+
+        position += bytesRead;
+        self.stats.bytes += bytesRead;
+        chunk = chunk.slice(0, keep + bytesRead);
+
+        Util.parseBlockFile(chunk, self.magic, function (err, result) {
+          if (err) {
+            finish(err);
+            return;
+          }
+
+          leftover = chunk.slice(result.end);
+          self.addBlocks(chunk, result.blocks, readChunk);
+        });
+      });
+    }
+
+    readChunk();
+  });
+};
+
+/**
+ * Hand parsed blocks to the block chain, waiting whenever its queue is
+ * full. Blocks the block chain already knows are skipped.
+ */
+BlockImporter.prototype.addBlocks = function (chunk, blocks, callback)
+{
+  var self = this;
+  var blockChain = this.blockChain;
+  var i = 0;
+
+  function addCallback(err) {
+    if (err) {
+      self.stats.failed++;
+      logger.warn('Import: '+(err.stack ? err.stack : err.toString()));
+    }
+
+    if (!--self.outstanding && self.drainCallback) {
+      var drainCallback = self.drainCallback;
+      self.drainCallback = null;
+      drainCallback();
+    }
+  }
+
+  function addEntry(entry) {
+    var data = chunk.slice(entry.offset, entry.offset + entry.length);
+    var block = blockChain.makeBlockObject({
+      version: Util.readUInt32LE(data, 0),
+      prev_hash: data.slice(4, 36),
+      merkle_root: data.slice(36, 68),
+      timestamp: Util.readUInt32LE(data, 68),
+      bits: Util.readUInt32LE(data, 72),
+      nonce: Util.readUInt32LE(data, 76)
+    });
+    block.hash = entry.hash;
+    block.size = entry.length;
+
+    // Table offsets are relative to the block
+    entry.buffer = data;
+    var txs = [];
+    for (var j = 0, l = entry.hashes.length / 32; j < l; j++) {
+      txs.push(Transaction.dataFromTable(entry, j));
+    }
+
+    self.stats.blocks++;
+    self.outstanding++;
+    blockChain.add(block, txs, addCallback);
+  }
+
+  function next() {
+    while (i < blocks.length) {
+      if (blockChain.getQueueCount() >= self.queueSize) {
+        setTimeout(next, self.pollInterval);
+        return;
+      }
+
+      var entry = blocks[i++];
+      if (entry.error) {
+        self.stats.invalid++;
+        logger.warn('Import: Skipping block '+Util.formatHashAlt(entry.hash)+
+                    ': '+entry.error);
+        continue;
+      }
+
+      // knowsBlock() usually answers synchronously from the block tree, we
+      // only leave the loop when it doesn't.
+      var sync = true, answered = false;
+      blockChain.knowsBlock(entry.hash, function (entry, err, known) {
+        answered = true;
+        if (known && !err) {
+          self.stats.known++;
+        } else {
+          addEntry(entry);
+        }
+        if (!sync) {
+          next();
+        }
+      }.bind(null, entry));
+      sync = false;
+
+      if (!answered) {
+        return;
+      }
+    }
+
+    self.emit('progress', {stats: self.stats});
+    callback();
+  }
+
+  next();
+};
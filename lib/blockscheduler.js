@@ -0,0 +1,335 @@
+var util = require('util');
+var events = require('events');
+var logger = require('./logger');
+var Util = require('./util');
+
+/**
+ * Spreads block downloads across all active connections.
+ *
+ * Block hashes are queued in the order they were announced and requested
+ * from whichever peers have the fewest requests outstanding. Blocks are
+ * handed to BlockChain.add() in that same order, no matter which peer
+ * delivers first. Requests a peer doesn't answer in time are moved to
+ * another peer.
+ */
+var BlockScheduler = exports.BlockScheduler = function (blockChain, peerManager) {
+  events.EventEmitter.call(this);
+
+  this.blockChain = blockChain;
+  this.peerManager = peerManager;
+
+  // Hashes (base64) in the order the blocks go to the block chain
+  this.sequence = [];
+
+  // Hashes that still have to be requested, oldest first
+  this.pending = [];
+
+  // State of every block in the sequence, indexed by hash
+  this.entries = {};
+
+  // Per-peer request state and throughput, indexed by peer address
+  this.peers = {};
+
+  var cfg = blockChain.cfg.network;
+  this.windowSize = cfg.downloadWindow;
+  this.maxPerPeer = cfg.downloadPerPeer;
+  this.stallTimeout = cfg.downloadStallTimeout;
+  this.maxAttempts = cfg.downloadMaxAttempts;
+  this.lowWater = cfg.downloadLowWater;
+};
+
+util.inherits(BlockScheduler, events.EventEmitter);
+
+BlockScheduler.prototype.addConnection = function (conn)
+{
+  var key = ""+conn.peer;
+  if (this.peers[key] && this.peers[key].conn === conn) {
+    return;
+  }
+
+  this.peers[key] = {
+    conn: conn,
+    inFlight: 0,
+    requested: 0,
+    received: 0,
+    bytes: 0,
+    stalls: 0,
+    rate: 0,
+    lastReceive: 0
+  };
+
+  conn.on('disconnect', this.removeConnection.bind(this, conn));
+};
+
+BlockScheduler.prototype.removeConnection = function (conn)
+{
+  var key = ""+conn.peer;
+  if (!this.peers[key] || this.peers[key].conn !== conn) {
+    return;
+  }
+  delete this.peers[key];
+
+  // Hand this peer's requests to someone else
+  var requeue = [];
+  for (var i = 0; i < this.sequence.length; i++) {
+    var entry = this.entries[this.sequence[i]];
+    if (entry.conn === conn && !entry.block) {
+      entry.conn = null;
+      requeue.push(this.sequence[i]);
+    }
+  }
+  this.pending = requeue.concat(this.pending);
+
+  this.schedule();
+};
+
+/**
+ * Whether a block is already queued, requested or waiting to be added.
+ */
+BlockScheduler.prototype.isKnown = function (hash)
+{
+  return this.entries.hasOwnProperty(hash.toString('base64'));
+};
+
+/**
+ * Queue block hashes for download.
+ *
+ * Hashes must be given in chain order, so their blocks can be added to the
+ * block chain without becoming orphans.
+ */
+BlockScheduler.prototype.enqueue = function (hashes)
+{
+  for (var i = 0; i < hashes.length; i++) {
+    var hash64 = hashes[i].toString('base64');
+    if (this.entries.hasOwnProperty(hash64)) {
+      continue;
+    }
+
+    this.entries[hash64] = {
+      hash: hashes[i],
+      conn: null,
+      requested: 0,
+      attempts: 0,
+      excluded: null,
+      block: null,
+      txs: null,
+      callback: null
+    };
+    this.sequence.push(hash64);
+    this.pending.push(hash64);
+  }
+
+  this.schedule();
+};
+
+/**
+ * Choose the peer for the next request.
+ *
+ * The least busy peer relative to its allowance wins, ties go to the
+ * faster one. Peers that let requests stall get a smaller allowance.
+ */
+BlockScheduler.prototype.pickPeer = function (peers, excluded)
+{
+  var best = null, bestLoad = Infinity;
+  for (var i = 0; i < peers.length; i++) {
+    var peer = peers[i];
+    var allowance = Math.max(2, this.maxPerPeer >> Math.min(peer.stalls, 4));
+    if (peer.inFlight >= allowance ||
+        (peer.conn === excluded && peers.length > 1)) {
+      continue;
+    }
+
+    var load = peer.inFlight / allowance;
+    if (load < bestLoad || (load == bestLoad && peer.rate > best.rate)) {
+      best = peer;
+      bestLoad = load;
+    }
+  }
+  return best;
+};
+
+/**
+ * Send out as many requests as the window allows.
+ */
+BlockScheduler.prototype.schedule = function ()
+{
+  var peers = [];
+  for (var key in this.peers) {
+    var peer = this.peers[key];
+    if (peer.conn.active && peer.conn.socket.writable) {
+      peers.push(peer);
+    }
+  }
+
+  var requests = [];
+  var now = new Date().getTime();
+  var busy = this.sequence.length - this.pending.length +
+    this.blockChain.getQueueCount();
+  while (this.pending.length && busy < this.windowSize) {
+    var entry = this.entries[this.pending[0]];
+    var peer = this.pickPeer(peers, entry.excluded);
+    if (!peer) {
+      break;
+    }
+    this.pending.shift();
+
+    entry.conn = peer.conn;
+    entry.requested = now;
+    peer.inFlight++;
+    peer.requested++;
+    busy++;
+
+    if (!peer.invs) {
+      peer.invs = [];
+      requests.push(peer);
+    }
+    peer.invs.push({type: 2, hash: entry.hash});
+  }
+
+  requests.forEach(function (peer) {
+    peer.conn.sendGetData(peer.invs);
+    peer.invs = null;
+  });
+
+  if (this.pending.length < this.lowWater) {
+    this.emit('needMore', {scheduler: this});
+  }
+};
+
+/**
+ * Accept a downloaded block.
+ *
+ * Returns false if the block wasn't requested through the scheduler, in
+ * that case the caller should add it to the block chain itself.
+ */
+BlockScheduler.prototype.receive = function (block, txs, conn, callback)
+{
+  var hash64 = block.getHash().toString('base64');
+  var entry = this.entries[hash64];
+  if (!entry || entry.block) {
+    return false;
+  }
+
+  var now = new Date().getTime();
+  var peer = this.peers[""+conn.peer];
+  if (peer && peer.conn === conn) {
+    // Throughput is measured from the later of the request and the previous
+    // block, since requests to a peer are answered one after another.
+    var start = Math.max(entry.requested, peer.lastReceive);
+    var sample = (block.size || 0) * 1000 / Math.max(now - start, 1);
+    peer.rate = peer.rate ? 0.8 * peer.rate + 0.2 * sample : sample;
+    peer.received++;
+    peer.bytes += block.size || 0;
+    peer.lastReceive = now;
+    if (peer.stalls) {
+      peer.stalls--;
+    }
+  }
+
+  // The block may have been reassigned or delivered by someone else
+  if (entry.conn) {
+    var assigned = this.peers[""+entry.conn.peer];
+    if (assigned && assigned.conn === entry.conn) {
+      assigned.inFlight--;
+    }
+  } else {
+    var i = this.pending.indexOf(hash64);
+    if (i != -1) {
+      this.pending.splice(i, 1);
+    }
+  }
+
+  entry.conn = null;
+  entry.block = block;
+  entry.txs = txs;
+  entry.callback = callback;
+
+  this.flush();
+  this.schedule();
+  return true;
+};
+
+/**
+ * Pass blocks to the block chain up to the first one still missing.
+ */
+BlockScheduler.prototype.flush = function ()
+{
+  while (this.sequence.length) {
+    var hash64 = this.sequence[0];
+    var entry = this.entries[hash64];
+    if (entry && !entry.block) {
+      break;
+    }
+
+    this.sequence.shift();
+    if (entry) {
+      delete this.entries[hash64];
+      this.blockChain.add(entry.block, entry.txs, entry.callback);
+    }
+  }
+};
+
+/**
+ * Move requests that have been outstanding for too long to other peers.
+ */
+BlockScheduler.prototype.checkStalled = function ()
+{
+  var now = new Date().getTime();
+  var requeue = [];
+  var givenUp = {};
+  for (var i = 0; i < this.sequence.length; i++) {
+    var hash64 = this.sequence[i];
+    var entry = this.entries[hash64];
+    if (!entry || !entry.conn || entry.block ||
+        entry.requested > now - this.stallTimeout) {
+      continue;
+    }
+
+    var peer = this.peers[""+entry.conn.peer];
+    if (peer && peer.conn === entry.conn) {
+      peer.inFlight--;
+      peer.stalls++;
+    }
+    logger.bchdbg('Block '+Util.formatHashAlt(entry.hash)+
+                  ' stalled at '+entry.conn.peer);
+
+    entry.excluded = entry.conn;
+    entry.conn = null;
+    if (++entry.attempts >= this.maxAttempts) {
+      // Skip it, the block chain will treat its successors as orphans
+      logger.warn('Giving up on block '+Util.formatHashAlt(entry.hash));
+      delete this.entries[hash64];
+      givenUp[hash64] = true;
+    } else {
+      requeue.push(hash64);
+    }
+  }
+  this.pending = requeue.concat(this.pending);
+  this.sequence = this.sequence.filter(function (hash64) {
+    return !givenUp[hash64];
+  });
+
+  this.flush();
+  this.schedule();
+};
+
+/**
+ * Download statistics for every connected peer.
+ */
+BlockScheduler.prototype.getPeerStats = function ()
+{
+  var stats = [];
+  for (var key in this.peers) {
+    var peer = this.peers[key];
+    stats.push({
+      peer: key,
+      inFlight: peer.inFlight,
+      requested: peer.requested,
+      received: peer.received,
+      bytes: peer.bytes,
+      stalls: peer.stalls,
+      rate: Math.round(peer.rate)
+    });
+  }
+  return stats;
+};
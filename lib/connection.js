@@ -1,29 +1,14 @@
 var util = require('util');
 var events = require('events');
-var Buffers = require('buffers');
 var logger = require('./logger');
 var Binary = require('./binary');
 var Parser = require('./parser').Parser;
 var Util = require('./util');
 var Block = require('./schema/block').Block;
+var Transaction = require('./schema/transaction').Transaction;
 
 var bitcoin = require('./bitcoin');
 
-Buffers.prototype.skip = function (i) {
-  if (i == 0) {
-    return;
-  } else if (i == this.length) {
-    this.buffers = [];
-    this.length = 0;
-    return;
-  }
-  var pos = this.pos(i);
-  this.buffers = this.buffers.slice(pos.buf);
-  this.buffers[0].length -= pos.offset;
-  this.buffers[0].offset += pos.offset;
-  this.length -= i;
-};
-
 var Connection = exports.Connection = function Connection(node, socket, peer) {
   events.EventEmitter.call(this);
 
@@ -44,8 +29,8 @@ var Connection = exports.Connection = function Connection(node, socket, peer) {
   // Have we sent a getaddr on this connection?
   this.getaddr = false;
 
-  // Receive buffer
-  this.buffers = new Buffers();
+  // Receive buffer, splits the incoming stream into messages
+  this.framer = new Util.MessageFramer(node.cfg.network.magicBytes);
 
   // Starting 20 Feb 2012, Version 0.2 is obsolete
   // This is the same behavior as the official client
@@ -220,78 +205,99 @@ Connection.prototype.sendGetAddr = function (invs) {
   this.sendMessage('getaddr', put.buffer());
 };
 
-Connection.prototype.sendInv = function (data) {
+/**
+ * Convert Blocks, Transactions and {type, hash} objects to inventory
+ * vectors.
+ */
+Connection.toInvs = function (data) {
   if (!Array.isArray(data)) {
     data = [data];
   }
 
-  var put = Binary.put();
-
-  put.varint(data.length);
-  data.forEach(function (value) {
-    if (value instanceof Block) {
-      // Block
-      put.word32le(2); // MSG_BLOCK
-    } else {
-      // Transaction
-      put.word32le(1); // MSG_TX
+  return data.map(function (value) {
+    if ("number" === typeof value.type && Buffer.isBuffer(value.hash)) {
+      // Inventory vector
+      return value;
     }
-    put.put(value.getHash());
+
+    return {
+      type: (value instanceof Block) ? 2 : 1, // MSG_BLOCK : MSG_TX
+      hash: value.getHash()
+    };
   });
+};
+
+Connection.prototype.sendInv = function (data) {
+  var invs = Connection.toInvs(data);
 
-  this.sendMessage('inv', put.buffer());
+  this.writeMessage('inv', this.assemble(function (magic, checksum) {
+    return Util.buildInvMessage(magic, invs, checksum);
+  }));
 };
 
 Connection.prototype.sendTx = function (tx) {
   this.sendMessage('tx', tx.serialize());
 };
 
+/**
+ * Send a block.
+ *
+ * Transactions may be given as Transaction objects or as the serialized
+ * Buffers from storage, which are sent as they are.
+ */
 Connection.prototype.sendBlock = function (block, txs) {
-  var put = Binary.put();
-
-  // Block header
-  put.put(block.getHeader());
-
-  // List of transactions
-  put.varint(txs.length);
-  txs.forEach(function (tx) {
-    put.put(tx.serialize());
+  txs = txs.map(function (tx) {
+    return Buffer.isBuffer(tx) ? tx : tx.serialize();
   });
 
-  this.sendMessage('block', put.buffer());
+  this.writeMessage('block', this.assemble(function (magic, checksum) {
+    return Util.buildBlockMessage(magic, block.getHeader(), txs, checksum);
+  }));
 };
 
 Connection.prototype.sendMessage = function (command, payload) {
-  try {
-    var magic = this.node.cfg.network.magicBytes;
-
-    var commandBuf = new Buffer(command, 'ascii');
-    if (commandBuf.length > 12) {
-      throw 'Command name too long';
-    }
+  this.writeMessage(command, this.assemble(function (magic, checksum) {
+    return Util.buildMessage(magic, command, payload, checksum);
+  }));
+};
 
-    var checksum;
-    if (this.sendVer >= 209) {
-      checksum = Util.twoSha256(payload).slice(0, 4);
-    } else {
-      checksum = new Buffer([]);
-    }
+/**
+ * Assemble a message with this connection's network magic and checksum
+ * setting. Returns null if the builder throws.
+ */
+Connection.prototype.assemble = function (builder) {
+  try {
+    return builder(this.node.cfg.network.magicBytes, this.usesChecksum());
+  } catch (err) {
+    logger.error("Error while building message for peer "+this.peer+": "+
+                 (err.stack ? err.stack : err.toString()));
+    return null;
+  }
+};
 
-    var message = Binary.put();           // -- HEADER --
-    message.put(magic);                   // magic bytes
-    message.put(commandBuf);              // command name
-    message.pad(12 - commandBuf.length);  // zero-padded
-    message.word32le(payload.length);     // payload length
-    message.put(checksum);                // checksum
-    // -- BODY --
-    message.put(payload);                 // payload data
+/**
+ * Whether messages to this peer carry a checksum.
+ */
+Connection.prototype.usesChecksum = function () {
+  return this.sendVer >= 209;
+};
 
-    var buffer = message.buffer();
+/**
+ * Send an assembled message.
+ *
+ * The same Buffer can be written to several connections, as long as they
+ * agree on usesChecksum().
+ */
+Connection.prototype.writeMessage = function (command, message) {
+  if (!message) {
+    return;
+  }
 
+  try {
     logger.netdbg('['+this.peer+'] '+
-                  "Sending message "+command+" ("+payload.length+" bytes)");
+                  "Sending message "+command+" ("+message.length+" bytes)");
 
-    this.socket.write(buffer);
+    this.socket.write(message);
   } catch (err) {
     // TODO: We should catch this error one level higher in order to better
     //       determine how to react to it. For now though, ignoring it will do.
@@ -301,11 +307,10 @@ Connection.prototype.sendMessage = function (command, payload) {
 };
 
 Connection.prototype.handleData = function (data) {
-  this.buffers.push(data);
+  this.framer.push(data);
 
-  if (this.buffers.length > (this.node.cfg.maxReceiveBuffer * 1000)) {
-    logger.error("Peer "+this.peer+" exceeded maxreceivebuffer, disconnecting."+
-                 (err.stack ? err.stack : err.toString()));
+  if (this.framer.length > (this.node.cfg.network.maxReceiveBuffer * 1000)) {
+    logger.error("Peer "+this.peer+" exceeded maxreceivebuffer, disconnecting.");
     this.socket.destroy();
     return;
   }
@@ -314,79 +319,46 @@ Connection.prototype.handleData = function (data) {
 };
 
 Connection.prototype.processData = function () {
-  // If there are less than 20 bytes there can't be a message yet.
-  if (this.buffers.length < 20) return;
-
-  var magic = this.node.cfg.network.magicBytes;
-  var i = 0;
-  for (;;) {
-    if (this.buffers.get(i  ) === magic[0] &&
-        this.buffers.get(i+1) === magic[1] &&
-        this.buffers.get(i+2) === magic[2] &&
-        this.buffers.get(i+3) === magic[3]) {
-      if (i !== 0) {
-        logger.netdbg('['+this.peer+'] '+
-                      'Received '+i+
-                      ' bytes of inter-message garbage: ');
-        logger.netdbg('... '+this.buffers.slice(0,i));
-
-        this.buffers.skip(i);
-      }
-      break;
-    }
-
-    if (i > (this.buffers.length - 4)) {
-      this.buffers.skip(i);
-      return;
+  var frame;
+
+  // Note that the checksum flag has to be checked for every message, since
+  // receiving "verack" switches it on.
+  while ((frame = this.framer.next(this.recvVer >= 209))) {
+    if (frame.skipped) {
+      logger.netdbg('['+this.peer+'] '+
+                    'Received '+frame.skipped+
+                    ' bytes of inter-message garbage');
     }
-    i++;
-  }
-
-  var payloadLen = (this.buffers.get(16)      ) +
-                   (this.buffers.get(17) <<  8) +
-                   (this.buffers.get(18) << 16) +
-                   (this.buffers.get(19) << 24);
-
-  var startPos = (this.recvVer >= 209) ? 24 : 20;
-  var endPos = startPos + payloadLen;
 
-  if (this.buffers.length < endPos) return;
+    var command = frame.command;
+    var payloadLen = frame.end - frame.start;
 
-  var command = this.buffers.slice(4, 16).toString('ascii').replace(/\0+$/,"");
-  var payload = this.buffers.slice(startPos, endPos);
-  var checksum = (this.recvVer >= 209) ? this.buffers.slice(20, 24) : null;
+    logger.netdbg('['+this.peer+'] ' +
+                  "Received message " + command +
+                  " (" + payloadLen + " bytes)");
 
-  logger.netdbg('['+this.peer+'] ' +
-                "Received message " + command +
-                " (" + payloadLen + " bytes)");
-
-  if (checksum !== null) {
-    var checksumConfirm = Util.twoSha256(payload).slice(0, 4);
-    if (checksumConfirm.compare(checksum) !== 0) {
+    if (!frame.checksumOk) {
       logger.error('['+this.peer+'] '+
                    'Checksum failed',
-                   { cmd: command,
-                     expected: Util.encodeHex(checksumConfirm),
-                     actual: Util.encodeHex(checksum) });
-      return;
+                   { cmd: command });
+      continue;
     }
-  }
 
-  var message;
-  try {
-    message = Connection.parseMessage(command, payload);
-  } catch (e) {
-    logger.error('Error while parsing message '+command+' from ' +
-                 this.peer + ':\n' +
-                 (e.stack ? e.stack : e.toString()));
-  }
+    var payload = frame.buffer.slice(frame.start, frame.end);
 
-  if (message) {
-    this.handleMessage(message);
-  }
+    var message;
+    try {
+      message = Connection.parseMessage(command, payload);
+    } catch (e) {
+      logger.error('Error while parsing message '+command+' from ' +
+                   this.peer + ':\n' +
+                   (e.stack ? e.stack : e.toString()));
+    }
 
-  this.buffers.skip(endPos);
-  this.processData();
+    if (message) {
+      this.handleMessage(message);
+    }
+  }
 };
 
 Connection.parseMessage = function (command, payload) {
@@ -431,11 +403,13 @@ Connection.parseMessage = function (command, payload) {
     data.bits = parser.word32le();
     data.nonce = parser.word32le();
 
-    var txCount = Connection.parseVarInt(parser);
+    // Transactions are parsed natively into one set of offset tables
+    var table = Util.parseBlock(payload);
+    var txCount = table.hashes.length / 32;
 
     data.txs = [];
     for (i = 0; i < txCount; i++) {
-      data.txs.push(Connection.parseTx(parser));
+      data.txs.push(Transaction.dataFromTable(table, i));
     }
 
     data.size = payload.length;
@@ -443,13 +417,8 @@ Connection.parseMessage = function (command, payload) {
 
   case 'tx':
     var txData = Connection.parseTx(parser);
-    return {
-      command: command,
-      version: txData.version,
-      lock_time: txData.lock_time,
-      ins: txData.ins,
-      outs: txData.outs
-    };
+    txData.command = command;
+    return txData;
 
   case 'getblocks':
     // TODO: Limit block locator size?
@@ -528,43 +497,19 @@ Connection.parseVarStr = function (parser) {
   return parser.buffer(len);
 };
 
+/**
+ * Parse a transaction at the parser's current position.
+ *
+ * Returns data for the Transaction constructor. Inputs and outputs are left
+ * in the parsed table and only decoded when the Transaction accesses them.
+ */
 Connection.parseTx = function (parser) {
   if (Buffer.isBuffer(parser)) {
     parser = new Parser(parser);
   }
 
-  var data = {}, i, sLen, startPos = parser.pos;
-
-  data.version = parser.word32le();
-  
-  var txinCount = Connection.parseVarInt(parser, 'tx_in_count');
-
-  data.ins = [];
-  for (j = 0; j < txinCount; j++) {
-    var txin = {};
-    txin.o = parser.buffer(36);               // outpoint
-    sLen = Connection.parseVarInt(parser);    // script_len
-    txin.s = parser.buffer(sLen);             // script
-    txin.q = parser.word32le();               // sequence
-    data.ins.push(txin);
-  }
-
-  var txoutCount = Connection.parseVarInt(parser);
-
-  data.outs = [];
-  for (j = 0; j < txoutCount; j++) {
-    var txout = {};
-    txout.v = parser.buffer(8);               // value
-    sLen = Connection.parseVarInt(parser);    // script_len
-    txout.s = parser.buffer(sLen);            // script
-    data.outs.push(txout);
-  }
-
-  data.lock_time = parser.word32le();
-
-  var endPos = parser.pos;
+  var table = Util.parseTx(parser.subject, parser.pos);
+  parser.pos = table.end;
 
-  data.buffer = parser.subject.slice(startPos, endPos);
-
-  return data;
+  return Transaction.dataFromTable(table, 0);
 };
@@ -0,0 +1,275 @@
+var fs = require('fs');
+var path = require('path');
+var mkdirp = require('mkdirp');
+var logger = require('../logger');
+var Util = require('../util');
+
+/**
+ * Append-only flat files holding raw blocks.
+ *
+ * Blocks are stored back to back like in bitcoind's blk*.dat files: the
+ * network magic, the block size and the serialized block. A block is
+ * addressed by file number, offset and length, and so is every transaction
+ * inside it. Files are grown in steps of chunkSize and a new file is
+ * started once one reaches maxFileSize.
+ *
+ * append() returns the position right away and writes in the background.
+ * flush() waits for those writes and syncs the files, after which index
+ * entries pointing at them can be committed. Data that is still being
+ * written is served from memory.
+ */
+var BlockFiles = exports.BlockFiles = function (dir, magic) {
+  this.dir = dir;
+  this.magic = magic;
+
+  this.maxFileSize = 128 * 1024 * 1024;
+  this.chunkSize = 16 * 1024 * 1024;
+
+  // File being appended to, write position and size on disk
+  this.file = 0;
+  this.end = 0;
+  this.allocated = 0;
+
+  // Open file descriptors, indexed by file number
+  this.fds = {};
+
+  // Files with completed writes that haven't been synced
+  this.dirty = {};
+
+  // Writes that haven't completed, oldest first
+  this.writes = [];
+  this.issued = 0;
+  this.error = null;
+
+  this.flushQueue = [];
+  this.flushing = false;
+};
+
+BlockFiles.FRAME_HEADER = 8;
+
+BlockFiles.prototype.getPath = function (file)
+{
+  var name = "" + file;
+  while (name.length < 5) {
+    name = "0" + name;
+  }
+  return path.join(this.dir, 'blk' + name + '.dat');
+};
+
+/**
+ * Resume appending to `file` at `end`, the position recorded with the last
+ * committed index entries. Anything written after it is overwritten.
+ */
+BlockFiles.prototype.open = function (file, end)
+{
+  if (!path.existsSync(this.dir)) {
+    mkdirp.sync(this.dir, 0755);
+  }
+
+  this.file = file || 0;
+  this.end = end || 0;
+  this.allocated = fs.fstatSync(this.getFd(this.file)).size;
+};
+
+BlockFiles.prototype.getFd = function (file)
+{
+  if (!this.fds.hasOwnProperty(file)) {
+    var filePath = this.getPath(file);
+    this.fds[file] = fs.openSync(filePath,
+                                 path.existsSync(filePath) ? 'r+' : 'w+');
+  }
+  return this.fds[file];
+};
+
+/**
+ * Append a block given as a list of Buffers (header, transaction count and
+ * transactions), which are copied straight into the frame.
+ *
+ * Returns {file, offset, length} of the block data.
+ */
+BlockFiles.prototype.append = function (parts)
+{
+  var self = this;
+
+  var length = 0;
+  parts.forEach(function (part) {
+    length += part.length;
+  });
+  var frameLength = BlockFiles.FRAME_HEADER + length;
+
+  if (this.end && this.end + frameLength > this.maxFileSize) {
+    this.file++;
+    this.end = 0;
+    this.allocated = 0;
+  }
+  var fd = this.getFd(this.file);
+
+  // Grow the file ahead of the writes, so appends don't have to extend it
+  // every time.
+  if (this.end + frameLength > this.allocated) {
+    this.allocated = Math.ceil((this.end + frameLength) / this.chunkSize) *
+      this.chunkSize;
+    fs.truncateSync(fd, this.allocated);
+  }
+
+  var frame = new Buffer(frameLength);
+  this.magic.copy(frame, 0);
+  Util.writeUInt32LE(frame, length, 4);
+  var pos = BlockFiles.FRAME_HEADER;
+  parts.forEach(function (part) {
+    part.copy(frame, pos);
+    pos += part.length;
+  });
+
+  var write = {
+    seq: this.issued++,
+    file: this.file,
+    start: this.end + BlockFiles.FRAME_HEADER,
+    data: frame.slice(BlockFiles.FRAME_HEADER)
+  };
+  this.writes.push(write);
+
+  fs.write(fd, frame, 0, frameLength, this.end, function (err) {
+    if (err && !self.error) {
+      logger.error('BlockFiles: Write failed: ' +
+                   (err.stack ? err.stack : err.toString()));
+      self.error = err;
+    }
+    // Marked only now, so a flush that started while this write was still
+    // running syncs the file again once it is done.
+    self.dirty[write.file] = fd;
+    self.writes.splice(self.writes.indexOf(write), 1);
+    self.processFlush();
+  });
+
+  var result = {file: this.file, offset: write.start, length: length};
+  this.end += frameLength;
+  return result;
+};
+
+/**
+ * Read `length` bytes at `offset` of `file`, a whole block or a single
+ * transaction inside one.
+ */
+BlockFiles.prototype.read = function (file, offset, length, callback)
+{
+  for (var i = 0; i < this.writes.length; i++) {
+    var write = this.writes[i];
+    if (write.file == file && offset >= write.start &&
+        offset + length <= write.start + write.data.length) {
+      var data = write.data.slice(offset - write.start,
+                                  offset - write.start + length);
+      process.nextTick(function () {
+        callback(null, data);
+      });
+      return;
+    }
+  }
+
+  var fd;
+  try {
+    fd = this.getFd(file);
+  } catch (err) {
+    callback(err);
+    return;
+  }
+
+  var buffer = new Buffer(length);
+  fs.read(fd, buffer, 0, length, offset, function (err, bytesRead) {
+    if (err) {
+      callback(err);
+    } else if (bytesRead != length) {
+      callback(new Error('Block file '+file+' truncated at '+offset));
+    } else {
+      callback(null, buffer);
+    }
+  });
+};
+
+/**
+ * Call back once everything appended so far is on disk.
+ *
+ * Callbacks run in the order flush() was called.
+ */
+BlockFiles.prototype.flush = function (callback)
+{
+  this.flushQueue.push({seq: this.issued, callback: callback});
+  this.processFlush();
+};
+
+BlockFiles.prototype.processFlush = function ()
+{
+  var self = this;
+
+  if (this.flushing || !this.flushQueue.length) {
+    return;
+  }
+  var head = this.flushQueue[0];
+  if (this.writes.length && this.writes[0].seq < head.seq) {
+    return;
+  }
+
+  var fds = [];
+  for (var file in this.dirty) {
+    fds.push(this.dirty[file]);
+  }
+  this.dirty = {};
+
+  this.flushing = true;
+  var remaining = fds.length + 1;
+  var syncErr = null;
+  function done(err) {
+    if (err && !syncErr) {
+      syncErr = err;
+    }
+    if (--remaining) {
+      return;
+    }
+
+    self.flushing = false;
+    self.flushQueue.shift();
+    head.callback(self.error || syncErr || null);
+    self.processFlush();
+  }
+  fds.forEach(function (fd) {
+    fs.fsync(fd, done);
+  });
+  done(null);
+};
+
+BlockFiles.prototype.close = function (callback)
+{
+  var self = this;
+
+  this.flush(function (err) {
+    for (var file in self.fds) {
+      fs.closeSync(self.fds[file]);
+    }
+    self.fds = {};
+    callback(err);
+  });
+};
+
+/**
+ * Delete all block files.
+ */
+BlockFiles.prototype.destroy = function ()
+{
+  for (var file in this.fds) {
+    fs.closeSync(this.fds[file]);
+  }
+  this.fds = {};
+
+  if (!path.existsSync(this.dir)) {
+    return;
+  }
+  fs.readdirSync(this.dir).forEach(function (name) {
+    if (/^blk\d+\.dat$/.test(name)) {
+      fs.unlinkSync(path.join(this.dir, name));
+    }
+  }, this);
+
+  this.file = 0;
+  this.end = 0;
+  this.allocated = 0;
+};
@@ -2,6 +2,7 @@ var logger = require('../../logger');
 var Step = require('step');
 var Storage = require('../../storage').Storage;
 var Connection = require('../../connection').Connection;
+var Binary = require('../../binary');
 var util = require('util');
 var fs = require('fs');
 var path = require('path');
@@ -9,33 +10,37 @@ var url = require('url');
 var mkdirp = require('mkdirp');
 
 var leveldb = require('leveldb'); // database
+var DB = leveldb.DB;
+
+var Util = require('../../util');
+var BlockFiles = require('../blockfiles').BlockFiles;
 
 var Block = require('../../schema/block').Block;
 var Transaction = require('../../schema/transaction').Transaction;
 
 function serializeBlock(block)
 {
-  var data = {
-    prev_hash: block.prev_hash.toString('binary'),
-    merkle_root: block.merkle_root.toString('binary'),
-    timestamp: block.timestamp,
-    bits: block.bits,
-    nonce: block.nonce,
-    version: block.version,
-    height: block.height,
-    size: block.size,
-    active: block.active,
-    chainWork: block.chainWork.toString('binary'),
-    txs: block.txs.map(function (hash) {
-      return hash.toString('binary');
-    })
-  };
-
-  return JSON.stringify(data);
+  return Util.encodeBlockRecord(block);
 }
 
 function deserializeBlock(data) {
-  data = JSON.parse(data);
+  return new Block(Util.decodeBlockRecord(data));
+}
+
+/**
+ * Decode a block stored as JSON by database revisions before 1.1.
+ *
+ * Returns null if the data is not such a record.
+ */
+function deserializeLegacyBlock(data) {
+  try {
+    data = JSON.parse(data.toString('utf8'));
+  } catch (e) {
+    return null;
+  }
+  if ("object" !== typeof data || !data || !data.merkle_root) {
+    return null;
+  }
   data.prev_hash = new Buffer(data.prev_hash, 'binary');
   data.merkle_root = new Buffer(data.merkle_root, 'binary');
   data.chainWork = new Buffer(data.chainWork, 'binary');
@@ -45,6 +50,18 @@ function deserializeBlock(data) {
   return new Block(data);
 }
 
+/**
+ * Whether a value stored under a hash in a rev. 1.x main database is a
+ * block record (as opposed to a transaction).
+ */
+function isBlockRecord(hash, data) {
+  try {
+    return Util.decodeBlockRecord(data).hash.compare(hash) == 0;
+  } catch (e) {
+    return false;
+  }
+}
+
 function serializeTransaction(tx) {
   return tx.getBuffer();
 }
@@ -53,6 +70,28 @@ function deserializeTransaction(data) {
   return new Transaction(Connection.parseTx(data));
 }
 
+// Everything lives in a single keyspace, the first byte of a key says what
+// kind of record it is.
+var BLOCK_PREFIX = new Buffer('b');     // block hash -> block record
+var TX_PREFIX = new Buffer('t');        // tx hash -> transaction
+var SPENT_PREFIX = new Buffer('s');     // outpoint -> spending tx hash
+var UTXO_PREFIX = new Buffer('u');      // outpoint -> value + script
+var PREV_PREFIX = new Buffer('p');      // prev block hash -> block hash
+var BLOCKTX_PREFIX = new Buffer('x');   // tx hash -> block hash
+var AFFECTS_PREFIX = new Buffer('a');   // pubkey hash + tx hash -> ''
+var BLOCKPOS_PREFIX = new Buffer('f');  // block hash -> block file position
+var TXPOS_PREFIX = new Buffer('o');     // tx hash -> position + block hash
+var META_PREFIX = new Buffer('m');      // name -> value
+var ADDRESS_PREFIX = new Buffer('h');   // pubkey hash + height -> postings
+var ADDRBLOCK_PREFIX = new Buffer('k'); // block hash -> indexed pubkey hashes
+
+// File number and write position of the block files
+var BLOCKFILES_KEY = META_PREFIX.concat(new Buffer('blockfiles'));
+
+// Heights use the prefix that sorts last, so the top block is always the
+// last key of the database.
+var HEIGHT_PREFIX = new Buffer('z');    // height -> block hash
+
 function formatHeightKey(height) {
   var tempHeightBuffer = new Buffer(4);
   height = Math.floor(+height);
@@ -70,23 +109,112 @@ function parseHeightKey(height) {
          (height[3]      );
 }
 
+/**
+ * A block file position is the file number, offset and length as little
+ * endian uint32s. Transaction positions are followed by the block hash.
+ */
+function encodePosition(pos, blockHash) {
+  var data = new Buffer(blockHash ? 44 : 12);
+  Util.writeUInt32LE(data, pos.file, 0);
+  Util.writeUInt32LE(data, pos.offset, 4);
+  Util.writeUInt32LE(data, pos.length, 8);
+  if (blockHash) {
+    blockHash.copy(data, 12);
+  }
+  return data;
+}
+
+function decodePosition(data) {
+  return {
+    file: Util.readUInt32LE(data, 0),
+    offset: Util.readUInt32LE(data, 4),
+    length: Util.readUInt32LE(data, 8),
+    blockHash: data.length >= 44 ? data.slice(12, 44) : null
+  };
+}
+
+/**
+ * Address index rows hold what a block did to one pubkey hash: the change
+ * in balance (int64 LE) and in unspent outputs (int32 LE), then a varint
+ * count and the positions of the affected transactions in the block,
+ * each as a varint delta from the one before.
+ */
+function encodeAddressRow(entry) {
+  var put = Binary.put();
+  var high = Math.floor(entry.value / 4294967296);
+  put.word32le(entry.value - high * 4294967296);
+  put.word32le(high >>> 0);
+  put.word32le(entry.unspent >>> 0);
+  put.varint(entry.positions.length);
+  entry.positions.forEach(function (pos, i) {
+    put.varint(i ? pos - entry.positions[i - 1] : pos);
+  });
+  return put.buffer();
+}
+
+function readVarInt(data, offset) {
+  var first = data[offset];
+  if (first < 0xfd) {
+    return {value: first, size: 1};
+  } else if (first == 0xfd) {
+    return {value: data[offset + 1] | data[offset + 2] << 8, size: 3};
+  } else {
+    return {value: Util.readUInt32LE(data, offset + 1), size: 5};
+  }
+}
+
+function decodeAddressRow(data) {
+  var count = readVarInt(data, 12);
+  var offset = 12 + count.size;
+  var positions = [];
+  for (var i = 0, pos = 0; i < count.value; i++) {
+    var delta = readVarInt(data, offset);
+    pos = i ? pos + delta.value : delta.value;
+    positions.push(pos);
+    offset += delta.size;
+  }
+
+  return {
+    value: Util.readUInt32LE(data, 0) +
+      (Util.readUInt32LE(data, 4) | 0) * 4294967296,
+    unspent: Util.readUInt32LE(data, 8) | 0,
+    positions: positions
+  };
+}
+
+function hasPrefix(key, prefix) {
+  return Buffer.isBuffer(key) && key.length > prefix.length &&
+    key.slice(0, prefix.length).compare(prefix) == 0;
+}
+
 var LeveldbStorage = exports.LeveldbStorage = exports.Storage =
 function LeveldbStorage(uri) {
   var self = this;
 
   var hMain;
-  var hBlockPrevIndex;
-  var bBlockHeightIndex;
-  var bBlockTxsIndex;
-  var bTxAffectsIndex;
 
   // Database version
-  var MAJOR_VERSION = 1;
+  //
+  // 1.1 - Binary block records instead of JSON
+  // 2.0 - All indexes merged into main.db under key prefixes
+  var MAJOR_VERSION = 2;
   var MINOR_VERSION = 0;
 
+  // Separate index databases used by rev. 1.x
+  var LEGACY_INDEXES = [
+    ['blockprev.db', PREV_PREFIX],
+    ['blockheight.db', HEIGHT_PREFIX],
+    ['blocktx.db', BLOCKTX_PREFIX],
+    ['affects.db', AFFECTS_PREFIX]
+  ];
+
   var connInfo = url.parse(uri);
   var prefix = connInfo.path.trim();
 
+  // Raw blocks live in flat files next to the database, the database only
+  // indexes them. The node sets magicBytes to its network's.
+  var blockFiles = null;
+
   var defaultCreateOpts = {
     create_if_missing: true,
     max_open_files: 50,
@@ -97,6 +225,11 @@ function LeveldbStorage(uri) {
     as_buffer: true
   };
 
+  // Block batches are synced to disk, each one holds whole blocks
+  var syncWriteOpts = {
+    sync: true
+  };
+
   var connected = false;
   var metadata;
   var connect = this.connect = function connect(callback) {
@@ -156,70 +289,214 @@ function LeveldbStorage(uri) {
           callback();
         });
       },
-      function createBlockPrevIndexDb(err) {
+      function openBlockFiles(err) {
+        if (err) throw err;
+
         var callback = this;
-        leveldb.open(prefix+'blockprev.db', defaultCreateOpts, function (err, db) {
-          if (err) throw err;
+        hMain.get(BLOCKFILES_KEY, defaultGetOpts, function (err, data) {
+          if (err) {
+            callback(err);
+            return;
+          }
 
-          self.hBlockPrevIndex = hBlockPrevIndex = db;
-          callback();
+          try {
+            var magic = self.magicBytes || new Buffer('f9beb4d9', 'hex');
+            blockFiles = new BlockFiles(prefix+'blocks', magic);
+            if (data) {
+              blockFiles.open(Util.readUInt32LE(data, 0),
+                              Util.readUInt32LE(data, 4));
+            } else {
+              blockFiles.open(0, 0);
+            }
+          } catch (e) {
+            callback(e);
+            return;
+          }
+          callback(null);
         });
       },
-      function createBlockHeightIndexDb(err) {
-        var callback = this;
-        leveldb.open(prefix+'blockheight.db', defaultCreateOpts, function (err, db) {
-          if (err) throw err;
+      function upgradeBlockRecords(err) {
+        if (err) throw err;
 
-          self.bBlockHeightIndex = bBlockHeightIndex = db;
-          callback();
-        });
+        if (metadata.majorVersion == 1 && metadata.minorVersion < 1) {
+          migrateBlockRecords(this);
+        } else {
+          this(null);
+        }
       },
-      function createBlockTxsIndexDb(err) {
-        var callback = this;
-        leveldb.open(prefix+'blocktx.db', defaultCreateOpts, function (err, db) {
-          if (err) throw err;
+      function upgradeKeyspace(err) {
+        if (err) throw err;
 
-          self.bBlockTxsIndex = bBlockTxsIndex = db;
-          callback();
-        });
+        if (metadata.majorVersion == 1) {
+          migrateKeyspace(this);
+        } else {
+          this(null);
+        }
       },
-      function createTxAffectsIndexDb(err) {
-        var callback = this;
-        leveldb.open(prefix+'affects.db', defaultCreateOpts, function (err, db) {
-          if (err) throw err;
+      callback
+    );
+  };
 
-          self.bTxAffectsIndex = bTxAffectsIndex = db;
-          callback();
-        });
+  // Number of database entries looked at per migration batch
+  var MIGRATE_CHUNK = 1000;
+
+  /**
+   * Walk all entries of `db`, letting `fn(key, value, wb)` queue changes to
+   * the main database in batches of MIGRATE_CHUNK entries.
+   */
+  var migrateEntries = function migrateEntries(db, fn, callback) {
+    var iterator;
+    Step(
+      function () {
+        db.iterator({}, this);
+      },
+      function (err, iter) {
+        if (err) throw err;
+
+        iterator = iter;
+        iterator.first(this);
+      },
+      function (err) {
+        if (err) throw err;
+
+        var stepCallback = this;
+        (function migrateChunk() {
+          var wb = hMain.batch();
+          var key;
+          for (var i = 0; i < MIGRATE_CHUNK && (key = iterator.key()); i++) {
+            fn(key, iterator.value(), wb);
+            iterator.next();
+          }
+          hMain.write(wb, function (err) {
+            if (err) {
+              stepCallback(err);
+            } else if (key) {
+              migrateChunk();
+            } else {
+              stepCallback(null);
+            }
+          });
+        })();
       },
       callback
     );
   };
 
+  /**
+   * Rewrite JSON block records as binary ones (database revision 1.1).
+   */
+  var migrateBlockRecords = function migrateBlockRecords(callback) {
+    logger.info("LevelDB: Converting block records to rev. 1.1");
+
+    var converted = 0;
+    Step(
+      function () {
+        migrateEntries(hMain, function (key, value, wb) {
+          // Legacy records are JSON objects, so start with '{'
+          if (value[0] === 0x7b || value[0] === '{') {
+            var block = deserializeLegacyBlock(value);
+            if (block) {
+              wb.put(block.getHash(), serializeBlock(block));
+              converted++;
+            }
+          }
+        }, this);
+      },
+      function (err) {
+        if (err) throw err;
+
+        logger.info("LevelDB: Converted "+converted+" block records");
+        metadata.majorVersion = 1;
+        metadata.minorVersion = 1;
+        saveMetadata(this);
+      },
+      callback
+    );
+  };
+
+  /**
+   * Move the rev. 1.x records into the prefixed keyspace (revision 2.0).
+   */
+  var migrateKeyspace = function migrateKeyspace(callback) {
+    logger.info("LevelDB: Merging indexes into main.db for rev. 2.0");
+
+    var steps = [];
+    steps.push(function migrateMainStep() {
+      migrateEntries(hMain, function (key, value, wb) {
+        var newKey;
+        if (key.length == 32) {
+          newKey = (isBlockRecord(key, value) ? BLOCK_PREFIX : TX_PREFIX)
+            .concat(key);
+        } else if (key.length == 36) {
+          newKey = SPENT_PREFIX.concat(key);
+        } else {
+          // Unspent outputs were already prefixed
+          return;
+        }
+        wb.put(newKey, value);
+        wb.del(key);
+      }, this);
+    });
+    LEGACY_INDEXES.forEach(function (index) {
+      var db;
+      steps.push(function openIndexStep(err) {
+        if (err) throw err;
+
+        leveldb.open(prefix+index[0], defaultCreateOpts, this);
+      });
+      steps.push(function migrateIndexStep(err, indexDb) {
+        if (err) throw err;
+
+        db = indexDb;
+        migrateEntries(db, function (key, value, wb) {
+          wb.put(index[1].concat(key), value);
+        }, this);
+      });
+      steps.push(function closeIndexStep(err) {
+        if (err) throw err;
+
+        db.close(this);
+      });
+      steps.push(function destroyIndexStep(err) {
+        if (err) throw err;
+
+        DB.destroyDB(prefix+index[0], {});
+        this(null);
+      });
+    });
+    steps.push(function saveMetadataStep(err) {
+      if (err) throw err;
+
+      metadata.majorVersion = MAJOR_VERSION;
+      metadata.minorVersion = MINOR_VERSION;
+      saveMetadata(this);
+    });
+    steps.push(callback);
+
+    Step.apply(null, steps);
+  };
+
   var disconnect = this.disconnect = function disconnect(callback) {
     if (!connected) {
       callback(null);
       return;
     }
     Step(
-      function closeMainDb() {
-        hMain.close(this);
+      function commitPendingStep() {
+        commit(this);
       },
-      function closeBlockPrevIndexDb(err) {
+      function closeBlockFiles(err) {
         if (err) throw err;
-        hBlockPrevIndex.close(this);
+        blockFiles.close(this);
       },
-      function closeBlockHeightIndexDb(err) {
+      function closeMainDb(err) {
         if (err) throw err;
-        bBlockHeightIndex.close(this);
-      },
-      function closeBlockTxsIndexDb(err) {
-        if (err) throw err;
-        bBlockTxsIndex.close(this);
+        hMain.close(this);
       },
-      function closeTxAffectsIndexDb(err) {
+      function (err) {
         if (err) throw err;
-        bTxAffectsIndex.close(this);
+        connected = false;
+        this(null);
       },
       callback
     );
@@ -234,10 +511,7 @@ function LeveldbStorage(uri) {
       function (err) {
         if (err) throw err;
         DB.destroyDB(prefix+'main.db', {});
-        DB.destroyDB(prefix+'blockprev.db', {});
-        DB.destroyDB(prefix+'blockheight.db', {});
-        DB.destroyDB(prefix+'blocktx.db', {});
-        DB.destroyDB(prefix+'affects.db', {});
+        blockFiles.destroy();
         this(null);
       },
       function (err) {
@@ -252,10 +526,7 @@ function LeveldbStorage(uri) {
   this.dropDatabase = function (callback) {
     fs.unlink(prefix+'meta.json');
     DB.destroyDB(prefix+'main.db', {});
-    DB.destroyDB(prefix+'blockprev.db', {});
-    DB.destroyDB(prefix+'blockheight.db', {});
-    DB.destroyDB(prefix+'blocktx.db', {});
-    DB.destroyDB(prefix+'affects.db', {});
+    new BlockFiles(prefix+'blocks').destroy();
     callback(null);
   };
 
@@ -263,50 +534,313 @@ function LeveldbStorage(uri) {
     fs.writeFile(prefix+'meta.json', JSON.stringify(metadata), 'utf8', callback);
   };
 
-  this.saveBlock = function (block, callback) {
+  // Write batch
+  // ---------------------------------------------------------------------------
+  //
+  // All writes are collected into one batch which commit() hands to LevelDB
+  // as a single synced write. Until that write is done the values are served
+  // from memory, so readers never notice that a block isn't on disk yet.
+
+  var pendingBatch = null;
+  var pendingValues = {};
+  var pendingBlocks = 0;
+
+  // Values of batches that are being written, newest first
+  var committingValues = [];
+
+  // Number of blocks storeBlock() coalesces into one write
+  var blockBatchSize = 1;
+
+  // Where commit() gets unspent output changes from, see
+  // setUnspentOutputSource()
+  var unspentOutputSource = null;
+
+  var queuePut = function queuePut(key, value) {
+    if (!pendingBatch) {
+      pendingBatch = hMain.batch();
+    }
+    pendingBatch.put(key, value);
+    pendingValues[key.toString('binary')] = value;
+  };
+
+  var queueDel = function queueDel(key) {
+    if (!pendingBatch) {
+      pendingBatch = hMain.batch();
+    }
+    pendingBatch.del(key);
+    pendingValues[key.toString('binary')] = null;
+  };
+
+  /**
+   * Write all queued changes to the database.
+   */
+  var commit = this.commit = function commit(callback) {
+    if (unspentOutputSource) {
+      queueUnspentOutputs(unspentOutputSource());
+    }
+
+    if (!pendingBatch) {
+      callback(null);
+      return;
+    }
+
+    var wb = pendingBatch;
+    var values = pendingValues;
+    pendingBatch = null;
+    pendingValues = {};
+    pendingBlocks = 0;
+
+    committingValues.unshift(values);
+
+    // Index entries may only point at block data that is on disk
+    blockFiles.flush(function (err) {
+      if (err) {
+        committingValues.splice(committingValues.indexOf(values), 1);
+        callback(err);
+        return;
+      }
+
+      hMain.write(wb, syncWriteOpts, function (err) {
+        committingValues.splice(committingValues.indexOf(values), 1);
+        callback(err || null);
+      });
+    });
+  };
+
+  /**
+   * Set how many blocks storeBlock() may collect before writing them.
+   *
+   * Used during the initial block download, a crash loses at most this many
+   * blocks but never leaves a partially written one behind, see
+   * setUnspentOutputSource() for how unspent outputs keep up.
+   *
+   * If the new size makes the current batch full, it is written and the
+   * callback gets the result of the write.
+   */
+  var setBlockBatchSize = this.setBlockBatchSize =
+  function setBlockBatchSize(size, callback) {
+    blockBatchSize = Math.max(1, +size || 1);
+    if (pendingBlocks >= blockBatchSize) {
+      commit(callback);
+    } else {
+      callback(null);
+    }
+  };
+
+  var dbGet = function dbGet(key, callback) {
+    var binKey = key.toString('binary');
+    var values = pendingValues;
+    for (var i = -1; i < committingValues.length; i++) {
+      if (i >= 0) {
+        values = committingValues[i];
+      }
+      if (values.hasOwnProperty(binKey)) {
+        var value = values[binKey];
+        process.nextTick(function () {
+          callback(null, value);
+        });
+        return;
+      }
+    }
+    hMain.get(key, defaultGetOpts, callback);
+  };
+
+  /**
+   * Open an iterator on the main database after any queued changes have
+   * been written.
+   */
+  var getIterator = function getIterator(callback) {
+    commit(function (err) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      hMain.iterator({}, callback);
+    });
+  };
+
+  /**
+   * Queue a block's index records. Blocks that were written to the block
+   * files don't need the tx -> block index, their tx positions say it.
+   */
+  var queueBlock = function queueBlock(block, inFiles) {
     var hash = block.getHash();
-    var data = serializeBlock(block);
-    Step(
-      function () {
-        hMain.put(hash, data, this);
-      },
-      function (err) {
-        if (err) throw err;
+    queuePut(BLOCK_PREFIX.concat(hash), serializeBlock(block));
+    queuePut(HEIGHT_PREFIX.concat(formatHeightKey(block.height)), hash);
+    queuePut(PREV_PREFIX.concat(block.prev_hash), hash);
+    if (!inFiles) {
+      block.txs.forEach(function (txHash) {
+        queuePut(BLOCKTX_PREFIX.concat(txHash), hash);
+      });
+    }
+  };
 
-        // TODO: Encode as integer
-        var height = formatHeightKey(block.height);
-        bBlockHeightIndex.put(height, hash, this);
-      },
-      function (err) {
-        if (err) throw err;
+  /**
+   * Append a block to the block files and queue the positions of it and
+   * its transactions.
+   */
+  var queueBlockData = function queueBlockData(block, txs) {
+    var hash = block.getHash();
+    var header = block.getHeader();
+    var count = Binary.put().varint(txs.length).buffer();
+    var buffers = txs.map(function (tx) {
+      return tx.getBuffer();
+    });
 
-        hBlockPrevIndex.put(block.prev_hash, hash, this);
-      },
-      function (err) {
-        if (err) throw err;
+    var pos = blockFiles.append([header, count].concat(buffers));
+    queuePut(BLOCKPOS_PREFIX.concat(hash), encodePosition(pos));
+
+    var offset = pos.offset + header.length + count.length;
+    txs.forEach(function (tx, i) {
+      var txPos = {file: pos.file, offset: offset, length: buffers[i].length};
+      queuePut(TXPOS_PREFIX.concat(tx.getHash()), encodePosition(txPos, hash));
+      offset += buffers[i].length;
+    });
 
-        var wb = bBlockHeightIndex.batch();
-        block.txs.forEach(function (txHash) {
-          wb.put(txHash, hash);
+    var filePos = new Buffer(8);
+    Util.writeUInt32LE(filePos, blockFiles.file, 0);
+    Util.writeUInt32LE(filePos, blockFiles.end, 4);
+    queuePut(BLOCKFILES_KEY, filePos);
+  };
+
+  var queueTransactions = function queueTransactions(txs) {
+    txs.forEach(function (tx) {
+      queuePut(TX_PREFIX.concat(tx.getHash()), serializeTransaction(tx));
+    });
+  };
+
+  var queueConnectTransactions = function queueConnectTransactions(txs) {
+    txs.forEach(function (tx) {
+      var hash = tx.getHash();
+      if (!tx.isCoinBase()) {
+        tx.ins.forEach(function (txin) {
+          queuePut(SPENT_PREFIX.concat(txin.o), hash);
         });
-        bBlockTxsIndex.write(wb, this);
-      },
-      callback
-    );
+      }
+      if (tx.affects) {
+        tx.affects.forEach(function (affect) {
+          queuePut(AFFECTS_PREFIX.concat(affect).concat(hash), '');
+        });
+      }
+    });
+  };
+
+  /**
+   * Queue the address index rows for a block on the main chain.
+   *
+   * Each pubkey hash gets one row per block, keyed by height, so an
+   * address's whole history is a single range of keys. The pubkey hashes
+   * are remembered under the block hash for disconnecting it again.
+   */
+  var queueAddressIndex = function queueAddressIndex(block, txs) {
+    var entries = {}, hashes = [];
+    txs.forEach(function (tx, i) {
+      if (!tx.addressDeltas) {
+        return;
+      }
+
+      tx.addressDeltas.forEach(function (delta) {
+        var hash64 = delta.hash.toString('base64');
+        var entry = entries[hash64];
+        if (!entry) {
+          entry = entries[hash64] = {
+            hash: delta.hash,
+            value: 0,
+            unspent: 0,
+            positions: []
+          };
+          hashes.push(delta.hash);
+        }
+        entry.value += delta.value;
+        entry.unspent += delta.unspent;
+        if (entry.positions[entry.positions.length - 1] !== i) {
+          entry.positions.push(i);
+        }
+      });
+    });
+
+    if (!hashes.length) {
+      return;
+    }
+
+    var height = formatHeightKey(block.height);
+    var indexed = new Buffer(hashes.length * 20);
+    hashes.forEach(function (hash, i) {
+      var entry = entries[hash.toString('base64')];
+      queuePut(ADDRESS_PREFIX.concat(hash).concat(height),
+               encodeAddressRow(entry));
+      hash.copy(indexed, i * 20);
+    });
+    queuePut(ADDRBLOCK_PREFIX.concat(block.getHash()), indexed);
+  };
+
+  /**
+   * Queue the removal of a block's address index rows.
+   */
+  var queueAddressUnindex = function queueAddressUnindex(block, callback) {
+    var key = ADDRBLOCK_PREFIX.concat(block.getHash());
+    dbGet(key, function (err, indexed) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      if (indexed) {
+        var height = formatHeightKey(block.height);
+        for (var i = 0; i + 20 <= indexed.length; i += 20) {
+          queueDel(ADDRESS_PREFIX.concat(indexed.slice(i, i + 20))
+                   .concat(height));
+        }
+        queueDel(key);
+      }
+      callback(null);
+    });
+  };
+
+  this.saveBlock = function (block, callback) {
+    queueBlock(block);
+    commit(callback);
+  };
+
+  /**
+   * Save a block, its transactions and, if `connect` is set, their spent
+   * outputs as one atomic write. The block itself goes to the block files,
+   * the database only gets its index records.
+   *
+   * Up to setBlockBatchSize() blocks are written together. The records can
+   * be read back as soon as this returns, before the write is done.
+   *
+   * Only the callback of the block that fills the batch waits for the write.
+   * The others are called back right away, so with a batch size above one a
+   * block reported as saved may still be lost in a crash, together with the
+   * rest of its batch.
+   */
+  this.storeBlock = function (block, txs, connect, callback) {
+    queueBlockData(block, txs);
+    queueBlock(block, true);
+    if (connect) {
+      queueConnectTransactions(txs);
+      queueAddressIndex(block, txs);
+    }
+
+    if (++pendingBlocks >= blockBatchSize) {
+      commit(callback);
+    } else {
+      process.nextTick(function () {
+        callback(null);
+      });
+    }
   };
 
   this.saveTransaction = function (tx, callback) {
-    var hash = tx.getHash();
-    var data = serializeTransaction(tx);
-    hMain.put(hash, data, callback);
+    queueTransactions([tx]);
+    commit(callback);
   };
 
   this.saveTransactions = function (txs, callback) {
-    var wb = hMain.batch();
-    txs.forEach(function (tx) {
-      wb.put(tx.getHash(), serializeTransaction(tx));
-    });
-    hMain.write(wb, callback);
+    queueTransactions(txs);
+    commit(callback);
   };
 
   var connectTransaction = this.connectTransaction =
@@ -316,36 +850,34 @@ function LeveldbStorage(uri) {
 
   var connectTransactions = this.connectTransactions =
   function connectTransactions(txs, callback) {
-    Step(
-      function saveSpent() {
-        var wb = hMain.batch();
-        txs.forEach(function (tx) {
-          if (tx.isCoinBase()) {
-            return;
-          }
-          var hash = tx.getHash();
-          tx.ins.forEach(function (txin) {
-            wb.put(txin.o, hash);
-          });
-        });
-        hMain.write(wb, this);
-      },
-      function saveAffects(err) {
-        if (err) throw err;
+    queueConnectTransactions(txs);
+    commit(callback);
+  };
 
-        var wb = bTxAffectsIndex.batch();
-        txs.forEach(function (tx) {
-          if (tx.affects) {
-            tx.affects.forEach(function (affect) {
-              var key = affect.concat(tx.getHash());
-              wb.put(key, '');
-            });
-          }
-        });
-        bTxAffectsIndex.write(wb, this);
-      },
-      callback
-    );
+  /**
+   * Connect the transactions of a main chain block, updating the address
+   * index along with the spent outputs.
+   */
+  var connectBlock = this.connectBlock =
+  function connectBlock(block, txs, callback) {
+    queueConnectTransactions(txs);
+    queueAddressIndex(block, txs);
+    commit(callback);
+  };
+
+  /**
+   * Undo connectBlock() for a block leaving the main chain.
+   */
+  var disconnectBlock = this.disconnectBlock =
+  function disconnectBlock(block, txs, callback) {
+    queueAddressUnindex(block, function (err) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      disconnectTransactions(txs, callback);
+    });
   };
 
   var disconnectTransaction = this.disconnectTransaction =
@@ -355,18 +887,37 @@ function LeveldbStorage(uri) {
 
   var disconnectTransactions = this.disconnectTransactions =
   function disconnectTransactions(txs, callback) {
-    var wb = new hMain.batch();
     txs.forEach(function (tx) {
       tx.ins.forEach(function (txin) {
-        wb.del(txin.o);
+        queueDel(SPENT_PREFIX.concat(txin.o));
       });
     });
-    hMain.write(wb, callback);
+    commit(callback);
+  };
+
+  /**
+   * Load a serialized transaction, from the block files if it came with a
+   * block or from its own record otherwise.
+   */
+  var getTransactionData = function getTransactionData(hash, callback) {
+    dbGet(TXPOS_PREFIX.concat(hash), function (err, data) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      if (data) {
+        var pos = decodePosition(data);
+        blockFiles.read(pos.file, pos.offset, pos.length, callback);
+      } else {
+        dbGet(TX_PREFIX.concat(hash), callback);
+      }
+    });
   };
 
   var getTransactionByHash = this.getTransactionByHash =
   function getTransactionByHash(hash, callback) {
-    hMain.get(hash, defaultGetOpts, function (err, data) {
+    getTransactionData(hash, function (err, data) {
       if (err) {
         callback(err);
         return;
@@ -384,7 +935,7 @@ function LeveldbStorage(uri) {
       function () {
         var group = this.group();
         for (var i = 0, l = hashes.length; i < l; i++) {
-          hMain.get(hashes[i], defaultGetOpts, group());
+          getTransactionData(hashes[i], group());
         }
       },
       function (err, result) {
@@ -401,13 +952,86 @@ function LeveldbStorage(uri) {
     );
   };
 
+  /**
+   * Load transactions in their serialized form, ready to be sent to a peer.
+   */
+  var getRawTransactionsByHashes = this.getRawTransactionsByHashes =
+  function getRawTransactionsByHashes(hashes, callback) {
+    Step(
+      function () {
+        var group = this.group();
+        for (var i = 0, l = hashes.length; i < l; i++) {
+          getTransactionData(hashes[i], group());
+        }
+      },
+      function (err, result) {
+        if (err) throw err;
+        this(null, result.filter(function (tx) {
+          return !!tx;
+        }));
+      },
+      callback
+    );
+  };
+
   this.getOutputsByHashes = function (hashes, callback) {
     getTransactionsByHashes(hashes, callback);
   };
 
+  /**
+   * Load unspent outputs saved by saveUnspentOutputs.
+   *
+   * Calls back with the value + script Buffer or undefined for each outpoint.
+   */
+  var getUnspentOutputs = this.getUnspentOutputs =
+  function getUnspentOutputs(outpoints, callback) {
+    Step(
+      function () {
+        var group = this.group();
+        for (var i = 0, l = outpoints.length; i < l; i++) {
+          dbGet(UTXO_PREFIX.concat(outpoints[i]), group());
+        }
+      },
+      callback
+    );
+  };
+
+  var queueUnspentOutputs = function queueUnspentOutputs(changes) {
+    changes.forEach(function (change) {
+      var key = UTXO_PREFIX.concat(change.key);
+      if (change.value) {
+        queuePut(key, change.value);
+      } else {
+        queueDel(key);
+      }
+    });
+  };
+
+  /**
+   * Write a batch of changes from UtxoSet.flush().
+   */
+  var saveUnspentOutputs = this.saveUnspentOutputs =
+  function saveUnspentOutputs(changes, callback) {
+    queueUnspentOutputs(changes);
+    commit(callback);
+  };
+
+  /**
+   * Set a function that returns the pending unspent output changes, in the
+   * form UtxoSet.flush() returns them.
+   *
+   * commit() asks for them on every write, so the unspent outputs go to
+   * disk in the same atomic write as the blocks that changed them. The
+   * caller has to apply a block to its UTXO set before queueing the block.
+   */
+  var setUnspentOutputSource = this.setUnspentOutputSource =
+  function setUnspentOutputSource(source) {
+    unspentOutputSource = source;
+  };
+
   var getBlockByHash = this.getBlockByHash =
   function getBlockByHash(hash, callback) {
-    hMain.get(hash, defaultGetOpts, function getBlockByHashCallback(err, data) {
+    dbGet(BLOCK_PREFIX.concat(hash), function getBlockByHashCallback(err, data) {
       if (err) {
         callback(err);
         return;
@@ -421,6 +1045,28 @@ function LeveldbStorage(uri) {
     });
   };
 
+  /**
+   * Load a block in its serialized form, header and transactions, ready to
+   * be sent to a peer. Calls back with null for blocks that were stored
+   * before they went to the block files.
+   */
+  var getRawBlockByHash = this.getRawBlockByHash =
+  function getRawBlockByHash(hash, callback) {
+    dbGet(BLOCKPOS_PREFIX.concat(hash), function (err, data) {
+      if (err) {
+        callback(err);
+        return;
+      }
+
+      if (data) {
+        var pos = decodePosition(data);
+        blockFiles.read(pos.file, pos.offset, pos.length, callback);
+      } else {
+        callback(null, null);
+      }
+    });
+  };
+
   var getBlocksByHashes = this.getBlocksByHashes =
   function getBlocksByHashes(hashes, callback) {
     Step(
@@ -428,7 +1074,7 @@ function LeveldbStorage(uri) {
         var group = this.group();
         for (var i = 0, l = hashes.length; i < l; i++) {
           if (hashes[i]) {
-            hMain.get(hashes[i], defaultGetOpts, group());
+            dbGet(BLOCK_PREFIX.concat(hashes[i]), group());
           }
         }
       },
@@ -450,10 +1096,10 @@ function LeveldbStorage(uri) {
 
   var getBlockByHeight = this.getBlockByHeight =
   function getBlockByHeight(height, callback) {
-    height = formatHeightKey(height);
+    height = HEIGHT_PREFIX.concat(formatHeightKey(height));
     Step(
       function () {
-        bBlockHeightIndex.get(height, defaultGetOpts, this);
+        dbGet(height, this);
       },
       function (err, result) {
         if (err) throw err;
@@ -475,7 +1121,7 @@ function LeveldbStorage(uri) {
       function () {
         var group = this.group();
         for (var i = 0, l = heights.length; i < l; i++) {
-          bBlockHeightIndex.get(formatHeightKey(heights[i]), defaultGetOpts, group());
+          dbGet(HEIGHT_PREFIX.concat(formatHeightKey(heights[i])), group());
         }
       },
       function (err, hashes) {
@@ -506,7 +1152,7 @@ function LeveldbStorage(uri) {
       block = block.hash;
     }
 
-    hBlockPrevIndex.get(block, defaultGetOpts, function getBlockByPrevCallback(err, data) {
+    dbGet(PREV_PREFIX.concat(block), function getBlockByPrevCallback(err, data) {
       if (err) {
         callback(err);
         return;
@@ -526,7 +1172,7 @@ function LeveldbStorage(uri) {
     var iterator;
     Step(
       function () {
-        bBlockHeightIndex.iterator({}, this);
+        getIterator(this);
       },
       function (err, iter) {
         if (err) throw err;
@@ -537,6 +1183,11 @@ function LeveldbStorage(uri) {
       function (err) {
         if (err) throw err;
 
+        if (!hasPrefix(iterator.key(), HEIGHT_PREFIX)) {
+          this(null, null);
+          return;
+        }
+
         var hash = iterator.value();
         getBlockByHash(hash, this);
       },
@@ -555,7 +1206,7 @@ function LeveldbStorage(uri) {
     var iterator;
     steps.push(function() {
       var callback = this;
-      bBlockHeightIndex.iterator({}, function (err, iter) {
+      getIterator(function (err, iter) {
         if (err) throw err;
         iterator = iter;
         callback();
@@ -569,11 +1220,11 @@ function LeveldbStorage(uri) {
         if (err) throw err;
 
         var indexBin = iterator.key();
-        if (!indexBin) {
+        if (!hasPrefix(indexBin, HEIGHT_PREFIX)) {
           callback(new Error("Block chain empty or corrupted"));
           return;
         }
-        var index = parseHeightKey(indexBin);
+        var index = parseHeightKey(indexBin.slice(HEIGHT_PREFIX.length));
         start = index + start + 1;
 
         if (start < 0) start = 0;
@@ -585,16 +1236,15 @@ function LeveldbStorage(uri) {
     steps.push(function (err) {
       if (err) throw err;
 
-      iterator.seek(formatHeightKey(start), this);
+      iterator.seek(HEIGHT_PREFIX.concat(formatHeightKey(start)), this);
     });
 
     steps.push(function (err) {
       if (err) throw err;
 
-      var hash;
       var blocks = [];
-      while (limit > 0 && (hash = iterator.value())) {
-        blocks.push(hash);
+      while (limit > 0 && hasPrefix(iterator.key(), HEIGHT_PREFIX)) {
+        blocks.push(iterator.value());
 
         iterator.next(); limit--;
       }
@@ -606,6 +1256,51 @@ function LeveldbStorage(uri) {
     Step.apply(null, steps);
   };
 
+  /**
+   * Call `fn(hash, record)` for every stored block, in key order.
+   *
+   * Meant for building in-memory indexes at startup; the event loop gets a
+   * turn after every MIGRATE_CHUNK records.
+   */
+  var forEachBlockRecord = this.forEachBlockRecord =
+  function forEachBlockRecord(fn, callback) {
+    var iterator;
+    Step(
+      function () {
+        getIterator(this);
+      },
+      function (err, iter) {
+        if (err) throw err;
+
+        iterator = iter;
+        iterator.seek(BLOCK_PREFIX, this);
+      },
+      function (err) {
+        if (err) throw err;
+
+        var stepCallback = this;
+        (function readChunk() {
+          try {
+            for (var i = 0; i < MIGRATE_CHUNK; i++) {
+              var key = iterator.key();
+              if (!hasPrefix(key, BLOCK_PREFIX)) {
+                stepCallback(null);
+                return;
+              }
+              fn(key.slice(BLOCK_PREFIX.length), iterator.value());
+              iterator.next();
+            }
+          } catch (e) {
+            stepCallback(e);
+            return;
+          }
+          process.nextTick(readChunk);
+        })();
+      },
+      callback
+    );
+  };
+
   /**
    * Find the latest matching block from a locator.
    *
@@ -639,14 +1334,14 @@ function LeveldbStorage(uri) {
       function queryOutpointsStep() {
         var group = this.group();
         for (var i = 0, l = outpoints.length; i < l; i++) {
-          hMain.get(outpoints[i], defaultGetOpts, group());
+          dbGet(SPENT_PREFIX.concat(outpoints[i]), group());
         }
       },
       function reduceResultStep(err, results) {
         if (err) throw err;
 
         var count = results.reduce(function(sum, result){
-          return "string" === typeof result ? ++sum : sum;
+          return Buffer.isBuffer(result) ? ++sum : sum;
         }, 0);
         this(null, count);
       },
@@ -660,7 +1355,7 @@ function LeveldbStorage(uri) {
       function queryOutpointsStep() {
         var group = this.group();
         for (var i = 0, l = outpoints.length; i < l; i++) {
-          hMain.get(outpoints[i], defaultGetOpts, group());
+          dbGet(SPENT_PREFIX.concat(outpoints[i]), group());
         }
       },
       function reduceResultStep(err, results) {
@@ -718,8 +1413,61 @@ function LeveldbStorage(uri) {
   function getContainingBlock(txHash, callback)
   {
     Step(
-      function queryBlockTxsIndexStep() {
-        bBlockTxsIndex.get(txHash, defaultGetOpts, this);
+      function queryTxPositionStep() {
+        dbGet(TXPOS_PREFIX.concat(txHash), this);
+      },
+      function queryBlockTxsIndexStep(err, data) {
+        if (err) throw err;
+
+        if (data) {
+          this(null, decodePosition(data).blockHash);
+        } else {
+          dbGet(BLOCKTX_PREFIX.concat(txHash), this);
+        }
+      },
+      callback
+    );
+  };
+
+  /**
+   * Look up a pubkey hash in the address index with one range read.
+   *
+   * Calls back with {history, balance, unspent}: the (height, index) of
+   * every main chain transaction affecting it, oldest first, its balance in
+   * satoshis and the number of outputs it has unspent.
+   */
+  var getAddressIndex = this.getAddressIndex =
+  function getAddressIndex(pubKeyHash, callback)
+  {
+    var keyPrefix = ADDRESS_PREFIX.concat(pubKeyHash);
+    var iterator;
+    Step(
+      function getIteratorStep() {
+        getIterator(this);
+      },
+      function seekStep(err, iter) {
+        if (err) throw err;
+
+        iterator = iter;
+        iterator.seek(keyPrefix, this);
+      },
+      function iterateStep(err) {
+        if (err) throw err;
+
+        var result = {history: [], balance: 0, unspent: 0};
+        var key = iterator.key();
+        while (hasPrefix(key, keyPrefix)) {
+          var height = parseHeightKey(key.slice(keyPrefix.length));
+          var row = decodeAddressRow(iterator.value());
+          result.balance += row.value;
+          result.unspent += row.unspent;
+          row.positions.forEach(function (index) {
+            result.history.push({height: height, index: index});
+          });
+          iterator.next();
+          key = iterator.key();
+        }
+        this(null, result);
       },
       callback
     );
@@ -741,7 +1489,7 @@ function LeveldbStorage(uri) {
     var hashes = [];
     steps.push(function () {
       var callback = this;
-      bTxAffectsIndex.iterator(function (err, iter) {
+      getIterator(function (err, iter) {
         if (err) throw err;
         iterator = iter;
         callback();
@@ -749,18 +1497,18 @@ function LeveldbStorage(uri) {
     });
     // Get affected transactions for each supplied address
     addrHashes.forEach(function (addrHash) {
+      var keyPrefix = AFFECTS_PREFIX.concat(addrHash);
       steps.push(function rewindIteratorStep(err) {
         if (err) throw err;
 
-        iterator.seek(addrHash, this);
+        iterator.seek(keyPrefix, this);
       });
       steps.push(function iterateStep(err) {
         if (err) throw err;
 
         var key = iterator.key(), hashes = [];
-        while (Buffer.isBuffer(key) &&
-               key.slice(0, 20).equals(addrHash)) {
-          hashes.push(key.slice(20));
+        while (hasPrefix(key, keyPrefix)) {
+          hashes.push(key.slice(keyPrefix.length));
           iterator.next();
           key = iterator.key();
         }
@@ -774,3 +1522,7 @@ function LeveldbStorage(uri) {
 };
 
 util.inherits(LeveldbStorage, Storage);
+
+// Exposed for the tests
+LeveldbStorage.encodeAddressRow = encodeAddressRow;
+LeveldbStorage.decodeAddressRow = decodeAddressRow;
@@ -0,0 +1,29 @@
+var Util = require('../util.js');
+
+/**
+ * Miner backed by the native nonce search in native.cc.
+ *
+ * Has the same interface as JavaScriptMiner, but spreads the nonce space
+ * over `threads` worker threads (default: one per CPU).
+ */
+var NativeMiner = exports.NativeMiner = function NativeMiner(threads) {
+  this.miner = new Util.BitcoinMiner(threads);
+};
+
+NativeMiner.prototype.solve = function (header, target, callback) {
+  this.miner.solve(header, target, callback);
+};
+
+/**
+ * Abort the current search, the pending callback receives an error.
+ */
+NativeMiner.prototype.cancel = function () {
+  this.miner.cancel();
+};
+
+/**
+ * Hashes per second over the current (or last) search.
+ */
+NativeMiner.prototype.getHashRate = function () {
+  return this.miner.hashRate;
+};
@@ -13,6 +13,7 @@ var TransactionStore = require('./transactionstore').TransactionStore;
 var TransactionSender = require('./transactionsender').TransactionSender;
 var PeerManager = require('./peermanager').PeerManager;
 var BlockChainManager = require('./blockchainmanager').BlockChainManager;
+var BlockChainDownload = require('./blockchainmanager').BlockChainDownload;
 var JsonRpcServer = require('./rpc/jsonrpcserver').JsonRpcServer;
 var Util = require('./util');
 
@@ -93,6 +94,7 @@ var Node = function Node(cfg) {
   // Initialize components
   try {
     this.storage = Storage.get(storageUri);
+    this.storage.magicBytes = this.cfg.network.magicBytes;
     this.blockChain = new BlockChain(this.storage, this.cfg);
     this.txStore = new TransactionStore(this);
     this.txSender = new TransactionSender(this);
@@ -101,6 +103,9 @@ var Node = function Node(cfg) {
                                            this.peerManager);
     this.rpcServer = new JsonRpcServer(this);
 
+    // Inventory we have already dealt with, see handleInv()
+    this.seenInvs = this.createInvFilter(this.cfg.network.invFilterSize);
+
     this.addListener('stateChange', this.handleStateChange.bind(this));
     this.setupStateTransitions();
     this.setupCrossMessaging();
@@ -209,6 +214,9 @@ Node.prototype.addPeer = function (peer) {
 };
 
 Node.prototype.addConnection = function (conn) {
+  // Inventory this peer already has
+  conn.knownInvs = this.createInvFilter(this.cfg.network.peerInvFilterSize);
+
   conn.addListener('inv', this.handleInv.bind(this));
   conn.addListener('block', this.handleBlock.bind(this));
   conn.addListener('tx', this.handleTx.bind(this));
@@ -216,6 +224,12 @@ Node.prototype.addConnection = function (conn) {
   conn.addListener('getblocks', this.handleGetblocks.bind(this));
 };
 
+Node.prototype.createInvFilter = function (size) {
+  return new Util.RollingBloomFilter(size,
+                                     this.cfg.network.invFilterFpRate,
+                                     this.cfg.network.invFilterMaxBytes);
+};
+
 Node.prototype.getPeerManager = function () {
   return this.peerManager;
 };
@@ -242,9 +256,24 @@ Node.prototype.handleInv = function (e) {
   var toCheck = invs.length;
   var unknownInvs = new Array(invs.length);
 
+  // Runs once all invs are checked, which may happen synchronously
+  function requestUnknown() {
+    if (toCheck === 0 && unknownInvs.length) {
+      unknownInvs = unknownInvs.filter(function (hash) { return hash; });
+      if (unknownInvs.length) {
+        self.requestData(unknownInvs, e.conn);
+      }
+      unknownInvs = [];
+    }
+  }
+
   var lastBlock = null;
   for (var i = 0; i < invs.length; i++) {
     var method;
+
+    // Whatever a peer announces, it doesn't need announced back
+    e.conn.knownInvs.insert(invs[i].hash);
+
     switch (invs[i].type) {
     case 1: // Transaction
       toCheck--;
@@ -254,15 +283,30 @@ Node.prototype.handleInv = function (e) {
         continue;
       }
 
+      // Another peer announced it before and we have it by now
+      if (this.seenInvs.contains(invs[i].hash)) {
+        continue;
+      }
+
       // Check whether we know this transaction
       if (!this.txStore.isKnown(invs[i].hash)) {
         unknownInvs[i] = invs[i];
+      } else {
+        this.seenInvs.insert(invs[i].hash);
       }
 
       break;
     case 2: // Block
       lastBlock = i;
 
+      // Known blocks can be skipped, unless the peer may be able to fill
+      // in the parents of one of our orphans
+      if (this.seenInvs.contains(invs[i].hash) &&
+          !this.blockChain.isOrphan(invs[i].hash)) {
+        toCheck--;
+        continue;
+      }
+
       // This will asynchronously check all the blocks and transactions.
       // Finally, the last callback will trigger the 'getdata' request.
       this.blockChain.knowsBlock(invs[i].hash, (function (err, known) {
@@ -275,27 +319,48 @@ Node.prototype.handleInv = function (e) {
         } else {
           if (!known) {
             unknownInvs[this] = invs[this];
-          } else if (self.blockChain.isOrphan(invs[this].hash)) {
+          } else if (!self.blockChain.isOrphan(invs[this].hash)) {
+            self.seenInvs.insert(invs[this].hash);
+          } else {
             // This peer knows one of our orphan blocks. Execute a getblocks
             // request for the path to this block.
             self.bcManager.startDownload(invs[this].hash, null, e.conn);
           }
         }
 
-        if (toCheck === 0 && unknownInvs.length) {
-          unknownInvs = unknownInvs.filter(function (hash) { return hash; });
-          e.conn.sendGetData(unknownInvs);
-        }
+        requestUnknown();
       }).bind(i));
       break;
     default: // Unknown type
+      toCheck--;
       continue;
     }
   }
 
-  if (toCheck === 0 && unknownInvs.length) {
-    unknownInvs = unknownInvs.filter(function (hash) { return hash; });
-    e.conn.sendGetData(unknownInvs);
+  requestUnknown();
+};
+
+/**
+ * Request unknown objects announced by a peer.
+ *
+ * Transactions are requested from that peer directly, blocks are queued
+ * with the download scheduler which spreads them across all peers.
+ */
+Node.prototype.requestData = function (invs, conn) {
+  var blockHashes = [];
+  invs = invs.filter(function (inv) {
+    if (inv.type == 2) {
+      blockHashes.push(inv.hash);
+      return false;
+    }
+    return true;
+  });
+
+  if (invs.length) {
+    conn.sendGetData(invs);
+  }
+  if (blockHashes.length) {
+    this.bcManager.scheduler.enqueue(blockHashes);
   }
 };
 
@@ -313,8 +378,16 @@ Node.prototype.handleBlock = function (e) {
   block.hash = block.calcHash();
   block.size = e.message.size;
 
+  this.seenInvs.insert(block.hash);
+  e.conn.knownInvs.insert(block.hash);
+
   var callback = this.handleBlockAddCallback.bind(block);
 
+  // Blocks we asked the scheduler for are added in download order
+  if (this.bcManager.scheduler.receive(block, txs, e.conn, callback)) {
+    return;
+  }
+
   this.blockChain.add(block, txs, callback);
 };
 
@@ -340,6 +413,10 @@ Node.prototype.handleTx = function (e) {
 
   var tx = new Transaction(message);
 
+  // Invalid transactions aren't requested again either
+  this.seenInvs.insert(tx.getHash());
+  e.conn.knownInvs.insert(tx.getHash());
+
   if (this.txStore.isKnown(tx.getHash())) {
     return;
   }
@@ -380,43 +457,110 @@ Node.prototype.handleGetdata = function (e) {
       }
       break;
     case 2: // MSG_BLOCK
-      self.blockChain.getBlockByHash(inv.hash, function (err, block) {
-        if (err) {
-          logger.warn("Getdata failed, could not load block:\n" +
-                      (err.stack ? err.stack : err.toString()));
-          return;
-        }
-        self.storage.getTransactionsByHashes(block.txs, function (err, txs) {
+      if (self.storage.getRawBlockByHash) {
+        // Blocks kept in flat files go out exactly as they were stored
+        self.storage.getRawBlockByHash(inv.hash, function (err, data) {
           if (err) {
-            logger.warn("Getdata failed, could not load transactions:\n" +
+            logger.warn("Getdata failed, could not read block:\n" +
                         (err.stack ? err.stack : err.toString()));
             return;
           }
-          e.conn.sendBlock(block, txs);
+          if (data) {
+            e.conn.sendMessage('block', data);
+          } else {
+            sendStoredBlock(inv.hash);
+          }
         });
-      });
+      } else {
+        sendStoredBlock(inv.hash);
+      }
       break;
     }
   });
+
+  function sendStoredBlock(hash) {
+    self.blockChain.getBlockByHash(hash, function (err, block) {
+      if (err) {
+        logger.warn("Getdata failed, could not load block:\n" +
+                    (err.stack ? err.stack : err.toString()));
+        return;
+      }
+      // Serialized transactions go out without being parsed first
+      var storage = self.storage;
+      var getTxs = storage.getRawTransactionsByHashes ||
+        storage.getTransactionsByHashes;
+      getTxs.call(storage, block.txs, function (err, txs) {
+        if (err) {
+          logger.warn("Getdata failed, could not load transactions:\n" +
+                      (err.stack ? err.stack : err.toString()));
+          return;
+        }
+        e.conn.sendBlock(block, txs);
+      });
+    });
+  }
 };
 
 Node.prototype.handleGetblocks = function (e) {
-  this.blockChain.getBlockByLocator(e.message.starts, function (err, latestCommonBlock) {
-    console.log(latestCommonBlock);
-    // TODO: Implement
+  var limit = BlockChainDownload.MAX_BLOCKS_INV;
+  this.blockChain.getBlockHashesAfter(e.message.starts, e.message.stop, limit,
+                                      function (err, hashes) {
+    if (err) {
+      logger.error('Error while answering getblocks: '+
+                   (err.stack ? err.stack : err.toString()));
+      return;
+    }
+
+    if (hashes.length) {
+      e.conn.sendInv(hashes.map(function (hash) {
+        return {type: 2, hash: hash};
+      }));
+    }
   });
 };
 
 /**
  * Broadcast an inv to the network.
  *
- * This function sends an inv message to all active connections.
+ * This function sends an inv message to all active connections, leaving
+ * out items a peer already has. Peers that are missing the same items get
+ * the same message Buffer, so it is only assembled once.
  */
 Node.prototype.sendInv = function (inv) {
+  var invs = Connection.toInvs(inv);
+
+  var groups = {};
   var conns = this.peerManager.getActiveConnections();
   conns.forEach(function (conn) {
-    conn.sendInv(inv);
+    var unknown = [];
+    invs.forEach(function (item, i) {
+      if (!conn.knownInvs.contains(item.hash)) {
+        conn.knownInvs.insert(item.hash);
+        unknown.push(i);
+      }
+    });
+
+    if (unknown.length) {
+      var key = (conn.usesChecksum() ? 'c' : 'n') + unknown.join(',');
+      if (!groups[key]) {
+        groups[key] = {indexes: unknown, conns: []};
+      }
+      groups[key].conns.push(conn);
+    }
   });
+
+  for (var key in groups) {
+    var group = groups[key];
+    var first = group.conns[0];
+    var message = first.assemble(function (magic, checksum) {
+      return Util.buildInvMessage(magic, group.indexes.map(function (i) {
+        return invs[i];
+      }), checksum);
+    });
+    group.conns.forEach(function (conn) {
+      conn.writeMessage('inv', message);
+    });
+  }
 };
 
 /**
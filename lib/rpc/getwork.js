@@ -3,27 +3,13 @@ var Binary = require('binary');
 var logger = require('../logger');
 var Step = require('step');
 
-var newBlocksCache = {};
-var blockData = null;
+var WorkTemplate = require('../worktemplate').WorkTemplate;
+var WorkSource = require('../worktemplate').WorkSource;
+
+var workSource = new WorkSource();
 var lastPrevHeight = -1;
 var lastTxCount = 0;
 var lastTime = 0;
-var enonce = 0;
-var enoncePrevBlock = Util.NULL_HASH;
-
-function updateEnonce(block, txs, enonce) {
-  // Update coinbase tx script
-  txs[0].ins[0].script = Binary.put()
-    .word32le(block.bits)  // Difficulty bits
-    .word32le(enonce)      // Extra-nonce
-    .buffer();
-
-  // Update coinbase tx hash
-  txs[0].hash = txs[0].calcHash();
-
-  // Update merkle root
-  block.merkle_root = block.calcMerkleRoot(txs);
-};
 
 exports.getwork = function getwork(args, opt, callback) {
   if (args.length == 0) { // Request for work
@@ -41,10 +27,7 @@ exports.getwork = function getwork(args, opt, callback) {
     if (lastPrevHeight != +topBlock.height ||
         (lastTxCount != txCount && time - lastTime > 60)) {
       steps.push(function () {
-        if (lastPrevHeight != +topBlock.height) {
-          newBlocksCache = {};
-          lastPrevHeight = +topBlock.height;
-        }
+        lastPrevHeight = +topBlock.height;
 
         topBlock.prepareNextBlock(
           self.node.blockChain,
@@ -57,7 +40,8 @@ exports.getwork = function getwork(args, opt, callback) {
 
       steps.push(function (err, data) {
         if (err) throw err;
-        blockData = data;
+        workSource.setTemplate(new WorkTemplate(data.block, data.txs));
+        lastTxCount = txCount;
         lastTime = time;
         this(null);
       });
@@ -65,41 +49,24 @@ exports.getwork = function getwork(args, opt, callback) {
 
     steps.push(function (err) {
       if (err) throw err;
-      // TODO: Implement GetAdjustedTime
-      var timestamp = time;
-
-      blockData.block.timestamp = timestamp;
-
-      // Update extra nonce, start over at 1 when timestamp increases
-      if (enoncePrevBlock.compare(blockData.block.prev_hash) != 0) {
-        enonce = 0;
-        enoncePrevBlock = new Buffer(blockData.block.prev_hash);
+      if (!workSource.template) {
+        throw new Error('Block template not available.');
       }
-      ++enonce;
 
-      updateEnonce(blockData.block, blockData.txs, enonce);
-
-      var header = blockData.block.getHeader();
+      // TODO: Implement GetAdjustedTime
+      var unit = workSource.getWork(time);
+      var header = unit.template.getHeader(unit);
 
       var result = {
-        midstate: Util.encodeHex(Util.sha256midstate(header)),
+        midstate: Util.encodeHex(unit.midstate),
         data: Util.encodeHex(Util.reverseBytes32(header))
           + "0000008000000000000000000000000000000000000000000000000000000000"
           + "00000000000000000000000080020000",
-        target: Util.encodeHex(Util.decodeDiffBits(blockData.block.bits).reverse()),
+        target: unit.template.target,
         hash1: "0000000000000000000000000000000000000000000000000000000000000000"
           + "0000008000000000000000000000000000000000000000000000000000010000"
       };
 
-      var cache = {
-        block: blockData.block,
-        txs: blockData.txs,
-        time: timestamp,
-        enonce: enonce
-      };
-
-      newBlocksCache[blockData.block.merkle_root.toString('base64')] = cache;
-
       this(null, result);
     });
 
@@ -116,8 +83,8 @@ exports.getwork = function getwork(args, opt, callback) {
 
     data = Util.reverseBytes32(data);
 
-    var nb = newBlocksCache[data.slice(36,68).toString('base64')];
-    if (!nb) {
+    var unit = workSource.findWork(data.slice(36,68));
+    if (!unit) {
       this.log("getwork: Received stale solution");
       callback(null, false);
       return;
@@ -126,14 +93,11 @@ exports.getwork = function getwork(args, opt, callback) {
     // Extract nonce from data block
     var nonce = Binary.parse(data.slice(76, 80)).word32le('nonce').vars.nonce;
 
-    // Update stored block
-    nb.block.nonce = nonce;
-    nb.block.timestamp = nb.time;
-    updateEnonce(nb.block, nb.txs, nb.enonce);
+    // Rebuild the block
+    var nb = unit.template.createBlock(unit, nonce);
 
     // Check solution
     try {
-      nb.block.hash = nb.block.calcHash();
       nb.block.checkProofOfWork();
     } catch (e) {
       this.log("getwork: Received invalid solution:\n" +
@@ -147,7 +111,7 @@ exports.getwork = function getwork(args, opt, callback) {
       this.node.blockChain.add(nb.block, nb.txs, function (err) {
         if (err) {
           this.log("getwork: Error while adding new block to chain:\n" +
-                   (e.stack ? e.stack : e.toString()));
+                   (err.stack ? err.stack : err.toString()));
           callback(null, false);
           return;
         }
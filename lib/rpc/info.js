@@ -10,6 +10,36 @@ exports.getconnectioncount = function getconnectioncount(args, opt, callback) {
   callback(null, this.node.peerManager.getActiveConnections().length);
 };
 
+/**
+ * Block download statistics for each connected peer.
+ *
+ * Response:
+ *
+ * [{"peer": "10.0.0.1:8333", "inFlight": 12, "requested": 2412,
+ *   "received": 2400, "bytes": 1532230, "stalls": 0, "rate": 48211}]
+ *
+ * `rate` is the recent download speed in bytes per second.
+ */
+exports.getdownloadinfo = function getdownloadinfo(args, opt, callback) {
+  callback(null, this.node.bcManager.scheduler.getPeerStats());
+};
+
+/**
+ * Block processing statistics.
+ *
+ * Response:
+ *
+ * {"stages": {"verify": {"count": 120, "time": 5630, "avg": 47, "max": 310},
+ *             ...},
+ *  "queued": 14, "writing": 2}
+ *
+ * Stages are "prefetch", "connect", "verify", "store" (until the next block
+ * may start) and "write" (until the block is on disk), times in ms.
+ */
+exports.getpipelineinfo = function getpipelineinfo(args, opt, callback) {
+  callback(null, this.node.blockChain.getPipelineStats());
+};
+
 exports.getdifficulty = function getdifficulty(args, opt, callback) {
   callback(null, Util.calcDifficulty(this.node.blockChain.getTopBlock().bits));
 };
@@ -14,8 +14,7 @@ var COINBASE_OP = SchemaTransaction.COINBASE_OP;
 var VerificationError = require('../error').VerificationError;
 
 var BlockRules = exports.BlockRules = {
-  maxTimeOffset: 2 * 60 * 60,  // How far block timestamps can be into the future
-  largestHash: bignum(2).pow(256)
+  maxTimeOffset: 2 * 60 * 60  // How far block timestamps can be into the future
 };
 
 var Block = exports.Block =
@@ -35,9 +34,33 @@ function Block (data)
   this.size = data.size || 0;
   this.active = data.active || false;
   this.chainWork = data.chainWork || Util.EMPTY_BUFFER;
-  this.txs = data.txs || [];
+  if (data.txHashes) {
+    this._txHashes = data.txHashes;
+  } else {
+    this.txs = data.txs || [];
+  }
 };
 
+// Blocks loaded from storage carry their tx hashes packed in one Buffer,
+// most lookups never look at them so we only split them up on demand.
+Object.defineProperty(Block.prototype, 'txs', {
+  get: function () {
+    if ("undefined" === typeof this._txs) {
+      var txs = this._txs = [];
+      if (this._txHashes) {
+        for (var i = 0, l = this._txHashes.length; i < l; i += 32) {
+          txs.push(this._txHashes.slice(i, i + 32));
+        }
+      }
+    }
+    return this._txs;
+  },
+  set: function (value) {
+    this._txs = value;
+  },
+  enumerable: true
+});
+
 Block.prototype.getHeader = function getHeader() {
   put = Binary.put();
   put.word32le(this.version);
@@ -67,19 +90,10 @@ Block.prototype.getHash = function getHash() {
 };
 
 Block.prototype.checkProofOfWork = function checkProofOfWork() {
-  var target = Util.decodeDiffBits(this.bits);
-
-  // TODO: Create a compare method in node-buffertools that uses the correct
-  //       endian so we don't have to reverse both buffers before comparing.
-  this.hash.reverse();
-
-  if (this.hash.compare(target) > 0) {
+  if (!Util.checkProofOfWork(this.getHash(), +this.bits)) {
     throw new VerificationError('Difficulty target not met');
   }
 
-  // Return the hash to its normal order
-  this.hash.reverse();
-
   return true;
 };
 
@@ -89,10 +103,11 @@ Block.prototype.checkProofOfWork = function checkProofOfWork() {
  * Work is defined as the average number of tries required to meet this
  * block's difficulty target. For example a target that is greater than 5%
  * of all possible hashes would mean that 20 "work" is required to meet it.
+ *
+ * Returns a 32 byte big endian Buffer.
  */
 Block.prototype.getWork = function getWork() {
-  var target = Util.decodeDiffBits(this.bits, true);
-  return BlockRules.largestHash.div(target.add(1));
+  return Util.blockWork(+this.bits);
 };
 
 Block.prototype.checkTimestamp = function checkTimestamp() {
@@ -140,44 +155,50 @@ Block.prototype.getMerkleTree = function getMerkleTree(txs) {
   // again and so on upwards into the tree. The point of this scheme is to allow for
   // disk space savings later on.
   //
-  // This function is a direct translation of CBlock::BuildMerkleTree().
+  // The resulting list has the same layout as CBlock::BuildMerkleTree().
 
   if (txs.length == 0) {
     return [Util.NULL_HASH.slice(0)];
   }
 
-  // Start by adding all the hashes of the transactions as leaves of the tree.
-  var tree = txs.map(function (tx) {
-    return tx instanceof Transaction ? tx.getHash() : tx;
-  });
+  // The native module hashes the whole tree over one flat Buffer, we just
+  // split it back up into one Buffer per node.
+  var tree = Util.merkleTree(getTxHashes(txs));
 
-  var j = 0;
-  // Now step through each level ...
-  for (var size = txs.length; size > 1; size = Math.floor((size + 1) / 2)) {
-    // and for each leaf on that level ..
-    for (var i = 0; i < size; i += 2) {
-      var i2 = Math.min(i + 1, size - 1);
-      var a = tree[j + i];
-      var b = tree[j + i2];
-      tree.push(Util.twoSha256(a.concat(b)));
-    }
-    j += size;
+  var nodes = [];
+  for (var i = 0; i < tree.length; i += 32) {
+    nodes.push(tree.slice(i, i + 32));
   }
-
-  return tree;
+  return nodes;
 };
 
 Block.prototype.calcMerkleRoot = function calcMerkleRoot(txs) {
-  var tree = this.getMerkleTree(txs);
-  return tree[tree.length - 1];
+  if (txs.length == 0) {
+    return Util.NULL_HASH.slice(0);
+  }
+
+  return Util.merkleRoot(getTxHashes(txs));
 };
 
+/**
+ * Concatenate the hashes of a list of transactions (or plain hashes) into
+ * a single Buffer.
+ */
+function getTxHashes(txs) {
+  var hashes = new Buffer(txs.length * 32);
+  txs.forEach(function (tx, i) {
+    var hash = tx instanceof Transaction ? tx.getHash() : tx;
+    hash.copy(hashes, i * 32);
+  });
+  return hashes;
+}
+
 Block.prototype.checkMerkleRoot = function checkMerkleRoot(txs) {
   if (!this.merkle_root || !this.merkle_root.length) {
     throw new VerificationError('No merkle root');
   }
 
-  if (this.calcMerkleRoot().compare(this.merkle_root) == 0) {
+  if (this.calcMerkleRoot(txs).compare(this.merkle_root) != 0) {
     throw new VerificationError('Merkle root incorrect');
   }
 
@@ -219,9 +240,12 @@ Block.prototype.toString = function toString() {
  */
 Block.prototype.attachTo = function attachTo(parent) {
   this.height = parent.height + 1;
-  this.setChainWork(parent.getChainWork().add(this.getWork()));
+  this.chainWork = Util.chainWork(parent.chainWork, +this.bits);
 };
 
+/**
+ * Chain work is kept as a 32 byte big endian Buffer.
+ */
 Block.prototype.setChainWork = function setChainWork(chainWork) {
   if (Buffer.isBuffer(chainWork)) {
     // Nothing to do
@@ -231,18 +255,23 @@ Block.prototype.setChainWork = function setChainWork(chainWork) {
     throw new Error("Block.setChainWork(): Invalid datatype");
   }
 
+  if (chainWork.length != 32) {
+    // Adding nothing pads it to the full width
+    chainWork = Util.addWork(chainWork, Util.EMPTY_BUFFER);
+  }
+
   this.chainWork = chainWork;
 };
 
 Block.prototype.getChainWork = function getChainWork() {
-  return bignum.fromBuffer(this.chainWork);
+  return this.chainWork;
 };
 
 /**
  * Compares the chainWork of two blocks.
  */
 Block.prototype.moreWorkThan = function moreWorkThan(otherBlock) {
-  return this.getChainWork().cmp(otherBlock.getChainWork()) > 0;
+  return Util.compareWork(this.chainWork, otherBlock.chainWork) > 0;
 };
 
 /**
@@ -253,7 +282,6 @@ function getNextWork(blockChain, nextBlock, callback) {
   var self = this;
 
   var powLimit = blockChain.getMinDiff();
-  var powLimitTarget = Util.decodeDiffBits(powLimit, true);
 
   var targetTimespan = blockChain.getTargetTimespan();
   var targetSpacing = blockChain.getTargetSpacing();
@@ -329,19 +357,17 @@ function getNextWork(blockChain, nextBlock, callback) {
             actualTimespan = targetTimespan*4;
           }
 
-          var oldTarget = Util.decodeDiffBits(self.bits, true);
-          var newTarget = oldTarget.mul(actualTimespan).div(targetTimespan);
-
-          if (newTarget.cmp(powLimitTarget) > 0) {
-            newTarget = powLimitTarget;
-          }
+          var newBits = Util.retargetBits(+self.bits, actualTimespan,
+                                          targetTimespan, powLimit);
 
           logger.bchdbg('Difficulty retarget (target='+targetTimespan +
                         ', actual='+actualTimespan+')');
-          logger.bchdbg('Before: '+Util.encodeHex(oldTarget.toBuffer()));
-          logger.bchdbg('After:  '+Util.encodeHex(newTarget.toBuffer()));
+          logger.bchdbg('Before: '+
+                        Util.encodeHex(Util.decodeDiffBits(self.bits)));
+          logger.bchdbg('After:  '+
+                        Util.encodeHex(Util.decodeDiffBits(newBits)));
 
-          callback(null, Util.encodeDiffBits(newTarget));
+          callback(null, newBits);
         } catch (err) {
           callback(err);
         }
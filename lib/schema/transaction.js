@@ -10,10 +10,42 @@ var Step = require('step');
 var VerificationError = error.VerificationError;
 var MissingSourceError = error.MissingSourceError;
 
+// Row widths of the tables returned by Util.parseBlock/Util.parseTx
+var TX_ROW = 24;
+var TXIO_ROW = 12;
+
+/**
+ * Define a field that is decoded from a parsed table on first access.
+ *
+ * Objects built from a table keep only the table and their row index, so a
+ * block's worth of transactions doesn't turn into thousands of small Buffer
+ * slices up front. Assigning to the field replaces the decoded value.
+ */
+function defineTableField(proto, name, decode) {
+  var key = '_' + name;
+  Object.defineProperty(proto, name, {
+    get: function () {
+      if ("undefined" === typeof this[key] && this._table) {
+        this[key] = decode.call(this, this._table, this._index);
+      }
+      return this[key];
+    },
+    set: function (value) {
+      this[key] = value;
+    },
+    enumerable: true
+  });
+};
+
 var TransactionIn = exports.TransactionIn = function TransactionIn(data) {
   if ("object" !== typeof data) {
     data = {};
   }
+  if (data.table) {
+    this._table = data.table;
+    this._index = data.index;
+    return;
+  }
   if (data.o) {
     this.o = data.o;
   }
@@ -22,6 +54,23 @@ var TransactionIn = exports.TransactionIn = function TransactionIn(data) {
   this.q = data.q ? data.q : data.sequence;
 };
 
+defineTableField(TransactionIn.prototype, 'o', function (table, i) {
+  var pos = Util.readUInt32LE(table.ins, i * TXIO_ROW);
+  return table.buffer.slice(pos, pos + 36);
+});
+
+defineTableField(TransactionIn.prototype, 's', function (table, i) {
+  var pos = Util.readUInt32LE(table.ins, i * TXIO_ROW + 4);
+  var len = Util.readUInt32LE(table.ins, i * TXIO_ROW + 8);
+  return table.buffer.slice(pos, pos + len);
+});
+
+defineTableField(TransactionIn.prototype, 'q', function (table, i) {
+  var pos = Util.readUInt32LE(table.ins, i * TXIO_ROW + 4) +
+            Util.readUInt32LE(table.ins, i * TXIO_ROW + 8);
+  return Util.readUInt32LE(table.buffer, pos);
+});
+
 TransactionIn.prototype.getScript = function getScript() {
   return new Script(this.s);
 };
@@ -45,6 +94,15 @@ TransactionIn.prototype.serialize = function serialize() {
 };
 
 TransactionIn.prototype.getOutpointHash = function getOutpointIndex() {
+  if ("undefined" === typeof this._o && this._table) {
+    // Slice the hash straight from the table without decoding the outpoint
+    if (!this._outHashCache) {
+      var pos = Util.readUInt32LE(this._table.ins, this._index * TXIO_ROW);
+      this._outHashCache = this._table.buffer.slice(pos, pos + 32);
+    }
+    return this._outHashCache;
+  }
+
   if ("undefined" !== typeof this.o.outHashCache) {
     return this.o.outHashCache;
   }
@@ -71,10 +129,26 @@ var TransactionOut = exports.TransactionOut = function TransactionOut(data) {
   if ("object" !== typeof data) {
     data = {};
   }
+  if (data.table) {
+    this._table = data.table;
+    this._index = data.index;
+    return;
+  }
   this.v = data.v ? data.v : data.value;
   this.s = data.s ? data.s : data.script;
 };
 
+defineTableField(TransactionOut.prototype, 'v', function (table, i) {
+  var pos = Util.readUInt32LE(table.outs, i * TXIO_ROW);
+  return table.buffer.slice(pos, pos + 8);
+});
+
+defineTableField(TransactionOut.prototype, 's', function (table, i) {
+  var pos = Util.readUInt32LE(table.outs, i * TXIO_ROW + 4);
+  var len = Util.readUInt32LE(table.outs, i * TXIO_ROW + 8);
+  return table.buffer.slice(pos, pos + len);
+});
+
 TransactionOut.prototype.getScript = function getScript() {
   return new Script(this.s);
 };
@@ -96,6 +170,13 @@ var Transaction = exports.Transaction = function Transaction (data) {
   this.hash = data.hash || null;
   this.version = data.version;
   this.lock_time = data.lock_time;
+  if (data.table) {
+    // Inputs and outputs are created from the table when first accessed
+    this._table = data.table;
+    this._index = data.index;
+    this._buffer = data.buffer;
+    return;
+  }
   this.ins = Array.isArray(data.ins) ? data.ins.map(function (data) {
     var txin = new TransactionIn();
     txin.s = data.s;
@@ -112,6 +193,45 @@ var Transaction = exports.Transaction = function Transaction (data) {
   if (data.buffer) this._buffer = data.buffer;
 };
 
+defineTableField(Transaction.prototype, 'ins', function (table, i) {
+  var first = Util.readUInt32LE(table.txs, i * TX_ROW + 8);
+  var count = Util.readUInt32LE(table.txs, i * TX_ROW + 12);
+  var ins = [];
+  for (var j = 0; j < count; j++) {
+    ins.push(new TransactionIn({table: table, index: first + j}));
+  }
+  return ins;
+});
+
+defineTableField(Transaction.prototype, 'outs', function (table, i) {
+  var first = Util.readUInt32LE(table.txs, i * TX_ROW + 16);
+  var count = Util.readUInt32LE(table.txs, i * TX_ROW + 20);
+  var outs = [];
+  for (var j = 0; j < count; j++) {
+    outs.push(new TransactionOut({table: table, index: first + j}));
+  }
+  return outs;
+});
+
+/**
+ * Data for the constructor from row i of a parsed transaction table.
+ *
+ * The tables come from Util.parseBlock() or Util.parseTx(). Only the hash and
+ * the raw transaction are sliced here, everything else is decoded on demand.
+ */
+Transaction.dataFromTable = function dataFromTable(table, i) {
+  var start = Util.readUInt32LE(table.txs, i * TX_ROW);
+  var end = Util.readUInt32LE(table.txs, i * TX_ROW + 4);
+  return {
+    hash: table.hashes.slice(i * 32, i * 32 + 32),
+    version: Util.readUInt32LE(table.buffer, start),
+    lock_time: Util.readUInt32LE(table.buffer, end - 4),
+    buffer: table.buffer.slice(start, end),
+    table: table,
+    index: i
+  };
+};
+
 Transaction.prototype.isCoinBase = function () {
   return this.ins.length == 1 && this.ins[0].isCoinBase();
 };
@@ -245,7 +365,7 @@ Transaction.prototype.verify = function verify(txCache, blockChain, callback) {
 
         outpoints.push(txin.o);
 
-        self.verifyInput(n, txout.getScript(), group());
+        self.verifyInputStandard(n, txout.getScript(), group());
       });
     },
 
@@ -325,6 +445,23 @@ Transaction.prototype.verifyInput = function verifyInput(n, scriptPubKey, callba
                                   callback);
 };
 
+/**
+ * Verify an input, natively if its scripts follow a standard template.
+ *
+ * Pay-to-pubkey, pay-to-pubkey-hash and bare multisig inputs are checked by
+ * the SighashEngine in one call, everything else is handed to the
+ * ScriptInterpreter via verifyInput().
+ */
+Transaction.prototype.verifyInputStandard =
+function verifyInputStandard(n, scriptPubKey, callback) {
+  var engine = this.getSighashEngine();
+  if (engine.verifyStandard(n, scriptPubKey.getBuffer(), callback)) {
+    return;
+  }
+
+  this.verifyInput(n, scriptPubKey, callback);
+};
+
 /**
  * Returns an object containing all pubkey hashes affected by this transaction.
  *
@@ -400,12 +537,68 @@ Transaction.prototype.getAffectedKeys = function getAffectedKeys(txCache) {
   return affectedKeys;
 };
 
+/**
+ * What this transaction does to the pubkey hashes it pays or spends from,
+ * for the address index.
+ *
+ * `spent` holds the output each input spends (null for coinbase inputs or
+ * unknown outputs). Returns one {hash, value, unspent} entry per output
+ * paid to and per output spent from a pubkey hash.
+ */
+Transaction.prototype.getAddressDeltas = function getAddressDeltas(spent) {
+  var deltas = [];
+  var add = function (txout, sign) {
+    try {
+      var outPubKey = txout.getScript().simpleOutPubKeyHash();
+      if (outPubKey) {
+        deltas.push({
+          hash: outPubKey,
+          value: sign * Util.valueToNumber(txout.v),
+          unspent: sign
+        });
+      }
+    } catch (err) {
+      // Non-standard scripts just aren't indexed
+      logger.debug("Unable to determine address delta: " +
+                   (err.stack ? err.stack : ""+err));
+    }
+  };
+
+  this.outs.forEach(function (txout) {
+    add(txout, 1);
+  });
+  if (spent) {
+    spent.forEach(function (txout) {
+      if (txout) {
+        add(txout, -1);
+      }
+    });
+  }
+
+  return deltas;
+};
+
 var OP_CODESEPARATOR = 171;
 
 var SIGHASH_ALL = 1;
 var SIGHASH_NONE = 2;
 var SIGHASH_SINGLE = 3;
-var SIGHASH_ANYONECANPAY = 80;
+var SIGHASH_ANYONECANPAY = 0x80;
+
+/**
+ * Get the native signature hashing engine for this transaction.
+ *
+ * The engine parses the serialized transaction once and is reused for all
+ * inputs, as long as the serialized form doesn't change.
+ */
+Transaction.prototype.getSighashEngine = function getSighashEngine() {
+  var buffer = this.getBuffer();
+  if (!this._sighashEngine || this._sighashBuffer !== buffer) {
+    this._sighashEngine = new Util.SighashEngine(buffer);
+    this._sighashBuffer = buffer;
+  }
+  return this._sighashEngine;
+};
 
 Transaction.prototype.hashForSignature =
 function hashForSignature(script, inIndex, hashType) {
@@ -415,101 +608,12 @@ function hashForSignature(script, inIndex, hashType) {
                     "("+this.ins.length+" inputs)");
   }
 
-  // Clone transaction
-  var txTmp = new Transaction();
-  this.ins.forEach(function (txin, i) {
-    txTmp.ins.push(new TransactionIn(txin));
-  });
-  this.outs.forEach(function (txout) {
-    txTmp.outs.push(new TransactionOut(txout));
-  });
-  txTmp.version = this.version;
-  txTmp.lock_time = this.lock_time;
-
   // In case concatenating two scripts ends up with two codeseparators,
   // or an extra one at the end, this prevents all those possible
   // incompatibilities.
   script.findAndDelete(OP_CODESEPARATOR);
 
-  // Get mode portion of hashtype
-  var hashTypeMode = hashType & 0x1f;
-
-  // Generate modified transaction data for hash
-  var bytes = Binary.put();
-  bytes.word32le(this.version);
-
-  // Serialize inputs
-  if (hashType & SIGHASH_ANYONECANPAY) {
-    // Blank out all inputs except current one, not recommended for open
-    // transactions.
-    bytes.varint(1);
-    bytes.put(this.ins[inIndex].o);
-    bytes.varint(script.buffer.length);
-    bytes.put(script.buffer);
-    bytes.word32le(this.ins[inIndex].q);
-  } else {
-    bytes.varint(this.ins.length);
-    for (var i = 0, l = this.ins.length; i < l; i++) {
-      var txin = this.ins[i];
-      bytes.put(this.ins[i].o);
-
-      // Current input's script gets set to the script to be signed, all others
-      // get blanked.
-      if (inIndex === i) {
-        bytes.varint(script.buffer.length);
-        bytes.put(script.buffer);
-      } else {
-        bytes.varint(0);
-      }
-
-      if (hashTypeMode === SIGHASH_NONE && inIndex !== i) {
-        bytes.word32le(0);
-      } else {
-        bytes.word32le(this.ins[i].q);
-      }
-    }
-  }
-
-  // Serialize outputs
-  if (hashTypeMode === SIGHASH_NONE) {
-    bytes.varint(0);
-  } else {
-    var outsLen;
-    if (hashTypeMode === SIGHASH_SINGLE) {
-      // TODO: Untested
-      if (inIndex >= txTmp.outs.length) {
-        throw new Error("Transaction.hashForSignature(): SIGHASH_SINGLE " +
-                        "no corresponding txout found - out of bounds");
-      }
-      outsLen = inIndex + 1;
-    } else {
-      outsLen = this.outs.length;
-    }
-
-    // TODO: If hashTypeMode !== SIGHASH_SINGLE, we could memcpy this whole
-    //       section from the original transaction as is.
-    bytes.varint(outsLen);
-    for (var i = 0; i < outsLen; i++) {
-      if (hashTypeMode === SIGHASH_SINGLE && i !== inIndex) {
-        // Zero all outs except the one we want to keep
-        bytes.put(Util.INT64_MAX);
-        bytes.varint(0);
-      } else {
-        bytes.put(this.outs[i].v);
-        bytes.varint(this.outs[i].s.length);
-        bytes.put(this.outs[i].s);
-      }
-    }
-  }
-
-  bytes.word32le(this.lock_time);
-
-  var buffer = bytes.buffer();
-
-  // Append hashType
-  buffer = buffer.concat(new Buffer([parseInt(hashType), 0, 0, 0]));
-
-  return Util.twoSha256(buffer);
+  return this.getSighashEngine().hash(inIndex, script.buffer, +hashType);
 };
 
 /**
@@ -639,14 +743,72 @@ TransactionInputsCache.prototype.buffer = function buffer(blockChain, txStore, w
       }
     },
     indexTxs,
-    // Second find and index persistent transactions
+    // Second look up the outputs we still need in the UTXO cache
+    function findUnspentOutputs(err) {
+      if (err) throw err;
+
+      if ("function" !== typeof blockChain.getUnspentOutputs) {
+        this(null, [], []);
+        return;
+      }
+
+      var txins = [];
+      self.tx.ins.forEach(function (txin) {
+        if (txin.isCoinBase()) return;
+
+        if (missingTx[txin.getOutpointHash().toString('base64')]) {
+          txins.push(txin);
+        }
+      });
+
+      var callback = this;
+      blockChain.getUnspentOutputs(txins.map(function (txin) {
+        return txin.o;
+      }), function (err, outs) {
+        callback(err, txins, outs);
+      });
+    },
+    function indexUnspentOutputs(err, txins, outs) {
+      if (err) throw err;
+
+      // A source tx counts as found once all the outputs we need from it are
+      var found = {};
+      txins.forEach(function (txin, i) {
+        var hash64 = txin.getOutpointHash().toString('base64');
+        if (!outs[i]) {
+          found[hash64] = false;
+          return;
+        }
+        if (!self.txIndex[hash64]) {
+          self.txIndex[hash64] = {};
+        }
+        self.txIndex[hash64][txin.getOutpointIndex()] = outs[i];
+        if (!(hash64 in found)) {
+          found[hash64] = true;
+        }
+      });
+      Object.keys(found).forEach(function (hash64) {
+        if (found[hash64]) {
+          delete missingTx[hash64];
+        }
+      });
+
+      this(null);
+    },
+    // Finally find and index persistent transactions
     function findBlockChainTx(err) {
       if (err) throw err;
 
-      // TODO: Major speedup should be possible if we load only the outs and not
-      //       whole transactions.
+      var hashes = self.txList.filter(function (hash, i) {
+        return missingTx[self.txList64[i]];
+      });
+      if (!hashes.length) {
+        this(null, []);
+        return;
+      }
+
       var callback = this;
-      blockChain.getOutputsByHashes(self.txList, function (err, result) {
+      blockChain.getOutputsByHashes(hashes, function (err, result) {
         callback(err, result);
       });
     },
@@ -45,6 +45,22 @@ Settings.prototype.setStorageDefaults = function () {
   // the files under datadir. The actual default uri that is used is stored in
   // lib/storage.js.
   this.storage.uri = null;
+
+  // Memory budget of the unspent output cache in bytes
+  this.storage.utxoCacheSize = 64 * 1024 * 1024;
+
+  // During the initial block download, write this many blocks to the
+  // database at once (LevelDB only). A crash loses at most this many blocks,
+  // including ones that were already announced as saved. Their unspent
+  // output changes are part of the same write.
+  this.storage.blockBatchSize = 1;
+
+  // Number of block writes that may still be running while the following
+  // blocks are verified (LevelDB only).
+  this.storage.writeQueueLimit = 4;
+
+  // Number of queued blocks whose inputs are looked up ahead of time
+  this.storage.prefetchDepth = 8;
 };
 
 Settings.prototype.setJsonRpcDefaults = function () {
@@ -74,6 +90,41 @@ Settings.prototype.setNetworkDefaults = function () {
 
   // Size of receive buffer
   this.network.maxReceiveBuffer = 10*1000;
+
+  // Inventory we have seen lately, repeated announcements of these are
+  // ignored without looking them up
+  this.network.invFilterSize = 50000;
+
+  // Inventory each peer is known to have, nothing in here is announced to
+  // that peer again
+  this.network.peerInvFilterSize = 5000;
+
+  // False positive rate of both filters; a false positive means an item
+  // isn't requested from (or announced to) a peer
+  this.network.invFilterFpRate = 0.000001;
+
+  // Upper limit on the size of each filter in bytes, the false positive rate
+  // goes up if it is reached
+  this.network.invFilterMaxBytes = 1024 * 1024;
+
+  // Blocks being downloaded or waiting to be added to the chain at any time
+  this.network.downloadWindow = 512;
+
+  // Block requests outstanding per peer
+  this.network.downloadPerPeer = 32;
+
+  // Milliseconds until a block request is moved to another peer
+  this.network.downloadStallTimeout = 15000;
+
+  // Give up on a block after this many peers failed to deliver it
+  this.network.downloadMaxAttempts = 5;
+
+  // Ask peers for more block hashes once fewer than this many are left
+  this.network.downloadLowWater = 128;
+
+  // Transactions with missing inputs kept until the inputs arrive, the
+  // oldest are dropped first
+  this.network.maxOrphanTxs = 10000;
 };
 
 /**
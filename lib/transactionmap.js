@@ -7,7 +7,7 @@ var error = require('./error');
 var TransactionMap = exports.TransactionMap = function () {
   events.EventEmitter.call(this);
 
-  this.txIndex = {};
+  this.txIndex = new Util.HashTable();
 };
 
 util.inherits(TransactionMap, events.EventEmitter);
@@ -18,28 +18,11 @@ util.inherits(TransactionMap, events.EventEmitter);
  * @return Boolean Whether the transaction was new.
  */
 TransactionMap.prototype.add = function (tx) {
-  var hash = tx.hash.toString('binary');
-  var isNew = !this.txIndex[hash];
-  this.txIndex[hash] = tx;
-  return isNew;
+  return this.txIndex.set(tx.hash, tx);
 };
 
 TransactionMap.prototype.get = function (hash, callback) {
-  if ("string" === typeof hash) {
-    hash = new Buffer(hash, 'base64').toString('binary');
-  } else if (Buffer.isBuffer(hash)) {
-    hash = hash.toString('binary');
-  }
-
-  assert.equal(typeof hash, 'string');
-
-  var returnValue;
-
-  if (this.txIndex[hash]) {
-    returnValue = this.txIndex[hash];
-  } else {
-    returnValue = null;
-  }
+  var returnValue = this.txIndex.get(Util.hashKey(hash)) || null;
 
   if ("function" == typeof callback) {
     callback(null, returnValue);
@@ -49,34 +32,15 @@ TransactionMap.prototype.get = function (hash, callback) {
 };
 
 TransactionMap.prototype.getAll = function getAll() {
-  var self = this;
-  return Object.keys(this.txIndex).map(function (key) {
-    return self.txIndex[key];
-  });
+  return this.txIndex.values();
 };
 
 TransactionMap.prototype.remove = function (hash) {
-  if ("string" === typeof hash) {
-    hash = new Buffer(hash, 'base64').toString('binary');
-  } else if (Buffer.isBuffer(hash)) {
-    hash = hash.toString('binary');
-  }
-
-  assert.equal(typeof hash, 'string');
-
-  delete this.txIndex[hash];
+  this.txIndex.remove(Util.hashKey(hash));
 };
 
 TransactionMap.prototype.isKnown = function (hash) {
-  if ("string" === typeof hash) {
-    hash = new Buffer(hash, 'base64').toString('binary');
-  } else if (Buffer.isBuffer(hash)) {
-    hash = hash.toString('binary');
-  }
-
-  assert.equal(typeof hash, 'string');
-
-  return !!this.txIndex[hash];
+  return this.txIndex.has(Util.hashKey(hash));
 };
 
 TransactionMap.prototype.find = function (hashes, callback) {
@@ -114,5 +78,5 @@ TransactionMap.prototype.find = function (hashes, callback) {
 };
 
 TransactionMap.prototype.getCount = function () {
-  return Object.keys(this.txIndex).length;
+  return this.txIndex.count();
 };
@@ -11,11 +11,17 @@ var TransactionStore = exports.TransactionStore = function (node) {
 
   this.node = node;
   this.blockChain = node.getBlockChain();
-  this.txIndex = {};
+
+  // Verified transactions, or the callback queue while verifying
+  this.txIndex = new Util.HashTable();
   this.txIndexByKey = {};
 
-  this.orphanTxIndex = {};
-  this.orphanTxByPrev = {};
+  // Orphans, as {tx, prev} with the hash of the transaction they are
+  // waiting for, and the lists of orphans waiting for each transaction. The
+  // oldest orphans are dropped first when there are too many.
+  this.maxOrphans = node.cfg.network.maxOrphanTxs;
+  this.orphanTxIndex = new Util.HashTable();
+  this.orphanTxByPrev = new Util.HashTable();
 };
 
 util.inherits(TransactionStore, events.EventEmitter);
@@ -31,15 +37,16 @@ util.inherits(TransactionStore, events.EventEmitter);
 TransactionStore.prototype.add = function (tx, callback) {
   var self = this;
 
-  var txHash = tx.getHash().toString('base64');
+  var txHash = tx.getHash();
+  var entry = this.txIndex.get(txHash);
 
-  if (Array.isArray(this.txIndex[txHash])) {
+  if (Array.isArray(entry)) {
     // Transaction is currently being verified, add callback to queue
     if ("function" === typeof callback) {
-      this.txIndex[txHash].push(callback);
+      entry.push(callback);
     }
     return false;
-  } else if (this.txIndex[txHash]) {
+  } else if (entry) {
     // Transaction is already known and verified, call callback immediately
     if ("function" === typeof callback) {
       callback(null, tx);
@@ -51,15 +58,15 @@ TransactionStore.prototype.add = function (tx, callback) {
     }
 
     // Create a new queue of callbacks to run after verification
-    this.txIndex[txHash] = [callback];
+    this.txIndex.set(txHash, [callback]);
   } else {
     // No callbacks to call after verification
-    this.txIndex[txHash] = [];
+    this.txIndex.set(txHash, []);
   }
 
   function runCallbacks(err, tx) {
-    var callbackQueue = self.txIndex[txHash];
-    delete self.txIndex[txHash];
+    var callbackQueue = self.txIndex.get(txHash);
+    self.txIndex.remove(txHash);
     if (!Array.isArray(callbackQueue)) {
       // This should never happen and if it does indicates an error in
       // this library.
@@ -68,13 +75,11 @@ TransactionStore.prototype.add = function (tx, callback) {
     }
     if (!err) {
       // Transaction is valid, add to memory pool
-      self.txIndex[txHash] = tx;
-    } else {
-      // Transaction is not valid, remove from memory pool
-      // Note that the transaction may have been added to the orphan pool
-      // instead by the verification routine.
-      delete self.txIndex[txHash];
+      self.txIndex.set(txHash, tx);
     }
+    // Otherwise the transaction stays out of the memory pool. Note that it
+    // may have been added to the orphan pool instead by the verification
+    // routine.
     callbackQueue.forEach(function (cb) { cb(err, tx); });
   };
 
@@ -100,17 +105,12 @@ TransactionStore.prototype.add = function (tx, callback) {
             // Verification couldn't proceed because of a missing source
             // transaction. We'll add this one to the orphans and try
             // again later.
-            this.orphanTxIndex[txHash] = tx;
-
+            //
             // Note that we'll call the callback now instead of waiting for
             // the missing source transaction, because we might never get it.
             // If the caller needs to handle this case, they should check for
             // a MissingSourceError themselves.
-            if (!this.orphanTxByPrev[err.missingTxHash]) {
-              this.orphanTxByPrev[err.missingTxHash] = [tx];
-            } else {
-              this.orphanTxByPrev[err.missingTxHash].push(tx);
-            }
+            this.addOrphan(tx, Util.hashKey(err.missingTxHash));
           }
 
           runCallbacks(err, tx);
@@ -122,11 +122,12 @@ TransactionStore.prototype.add = function (tx, callback) {
         runCallbacks(err, tx);
 
         // Process any orphan transactions that are waiting for this one
-        if (this.orphanTxByPrev[txHash]) {
-          this.orphanTxByPrev[txHash].forEach(function (tx) {
+        var orphans = this.orphanTxByPrev.get(txHash);
+        if (orphans) {
+          orphans.slice().forEach(function (tx) {
+            self.removeOrphan(tx.getHash());
             self.add(tx);
           });
-          delete this.orphanTxByPrev[txHash];
         }
 
         var eventData = {
@@ -162,48 +163,39 @@ TransactionStore.prototype.add = function (tx, callback) {
 };
 
 TransactionStore.prototype.get = function (hash, callback) {
-  if (Buffer.isBuffer(hash)) {
-    hash = hash.toString('base64');
-  }
-
-  assert.equal(typeof hash, 'string');
+  var entry = this.txIndex.get(Util.hashKey(hash));
 
   // If the transaction is currently being verified, we'll return null.
-  if (Array.isArray(this.txIndex[hash])) {
+  if (Array.isArray(entry)) {
     // But if there is a callback we'll return the transaction as soon as
     // it's ready.
     if ("function" === typeof callback) {
-      this.txIndex[hash].push(callback);
+      entry.push(callback);
     }
     return null;
   } else {
     // Note that we will return undefined if the transaction is not known
     if ("function" === typeof callback) {
-      callback(null, this.txIndex[hash]);
+      callback(null, entry);
     }
-    return this.txIndex[hash];
+    return entry;
   }
 };
 
 TransactionStore.prototype.getAll = function getAll() {
-  var self = this;
-  return Object.keys(this.txIndex).map(function (key) {
-    return self.txIndex[key];
-  });
+  return this.txIndex.values();
 };
 
 TransactionStore.prototype.remove = function (hash) {
   var self = this;
-  if (Buffer.isBuffer(hash)) {
-    hash = hash.toString('base64');
-  }
+  hash = Util.hashKey(hash);
 
-  assert.equal(typeof hash, 'string');
+  var entry = this.txIndex.get(hash);
 
   // If the transaction is currently being verified, we'll wait and
     // delete it later.
-  if (Array.isArray(this.txIndex[hash])) {
-    this.txIndex[hash].push(function (err, tx) {
+  if (Array.isArray(entry)) {
+    entry.push(function (err, tx) {
       if (err) {
         // The transaction didn't make it anyway, we're done
         return;
@@ -211,13 +203,13 @@ TransactionStore.prototype.remove = function (hash) {
 
       self.remove(hash);
     });
-  } else if (this.txIndex[hash]) {
-    var tx = this.txIndex[hash];
-    delete this.txIndex[hash];
+  } else if (entry) {
+    var tx = entry;
+    this.txIndex.remove(hash);
     var eventData = {
       store: this,
       tx: tx,
-      txHash: hash
+      txHash: hash.toString('base64')
     };
     this.emit('txCancel', eventData);
 
@@ -235,16 +227,59 @@ TransactionStore.prototype.remove = function (hash) {
 };
 
 
-TransactionStore.prototype.isKnown = function (hash) {
-  if (Buffer.isBuffer(hash)) {
-    hash = hash.toString('base64');
+/**
+ * Keep a transaction until the one with hash `prev` arrives, dropping the
+ * oldest orphans if there are too many.
+ */
+TransactionStore.prototype.addOrphan = function (tx, prev) {
+  var txHash = tx.getHash();
+  if (this.orphanTxIndex.has(txHash)) {
+    return;
+  }
+
+  this.orphanTxIndex.set(txHash, {tx: tx, prev: prev});
+  var waiting = this.orphanTxByPrev.get(prev);
+  if (!waiting) {
+    this.orphanTxByPrev.set(prev, [tx]);
+  } else {
+    waiting.push(tx);
   }
 
-  assert.equal(typeof hash, 'string');
+  while (this.orphanTxIndex.count() > this.maxOrphans) {
+    this.removeOrphan(this.orphanTxIndex.oldest());
+  }
+};
+
+/**
+ * Forget an orphan, both by its own hash and in the list of the
+ * transaction it is waiting for.
+ */
+TransactionStore.prototype.removeOrphan = function (hash) {
+  var orphan = this.orphanTxIndex.get(hash);
+  if (!orphan) {
+    return;
+  }
+  this.orphanTxIndex.remove(hash);
+
+  var waiting = this.orphanTxByPrev.get(orphan.prev);
+  if (waiting) {
+    var i = waiting.indexOf(orphan.tx);
+    if (i != -1) {
+      waiting.splice(i, 1);
+    }
+    if (!waiting.length) {
+      this.orphanTxByPrev.remove(orphan.prev);
+    }
+  }
+};
+
+
+TransactionStore.prototype.isKnown = function (hash) {
+  hash = Util.hashKey(hash);
 
   // Note that a transaction will return true here even is it is still
   // being verified.
-  return !!(this.txIndex[hash] || this.orphanTxIndex[hash]);
+  return this.txIndex.has(hash) || this.orphanTxIndex.has(hash);
 };
 
 
@@ -293,7 +328,7 @@ TransactionStore.prototype.getByKey = function (pubKeyHash) {
     return [];
   } else {
     for (var i = 0, l = accIndex.length; i < l; i++) {
-      var tx = this.txIndex[accIndex[i]];
+      var tx = this.txIndex.get(accIndex[i]);
       if (tx) {
         // We use this opportunity to create a new index where the
         // tx that no longer exist in the pool are removed
@@ -338,8 +373,7 @@ TransactionStore.prototype.findByKey = function (pubKeyHashes, callback) {
  */
 TransactionStore.prototype.handleTxAdd = function (e) {
   // Remove transaction from memory pool
-  var txHash = e.tx.getHash().toString('base64');
-  this.remove(txHash);
+  this.remove(e.tx.getHash());
 
   // Notify other components about spent inputs
   if (!e.tx.isCoinBase()) {
@@ -354,5 +388,5 @@ TransactionStore.prototype.handleTxAdd = function (e) {
 };
 
 TransactionStore.prototype.getCount = function () {
-  return Object.keys(this.txIndex).length;
+  return this.txIndex.count();
 };
@@ -17,13 +17,34 @@ try {
 exports.ccmodule = ccmodule;
 
 exports.BitcoinKey = ccmodule.BitcoinKey;
+exports.SighashEngine = ccmodule.SighashEngine;
+exports.BitcoinMiner = ccmodule.BitcoinMiner;
+exports.MessageFramer = ccmodule.MessageFramer;
+exports.UtxoSet = ccmodule.UtxoSet;
+exports.BlockTree = ccmodule.BlockTree;
+exports.HashTable = ccmodule.HashTable;
+exports.RollingBloomFilter = ccmodule.RollingBloomFilter;
+
+/**
+ * Convert a hash given as a base64 string to the Buffer the native hash
+ * tables are keyed by. Buffers are passed through.
+ */
+var hashKey = exports.hashKey = function (hash) {
+  return Buffer.isBuffer(hash) ? hash : new Buffer(hash, 'base64');
+};
+
+// The native hash functions only take Buffers, strings are hashed as
+// 'binary' to match crypto.Hash#update.
+function toBuffer(data) {
+  return Buffer.isBuffer(data) ? data : new Buffer(data, 'binary');
+}
 
 var sha256 = exports.sha256 = function (data) {
-  return new Buffer(crypto.createHash('sha256').update(data).digest('binary'), 'binary');
+  return ccmodule.sha256(toBuffer(data));
 };
 
 var ripe160 = exports.ripe160 = function (data) {
-  return new Buffer(crypto.createHash('rmd160').update(data).digest('binary'), 'binary');
+  return ccmodule.ripemd160(toBuffer(data));
 };
 
 var sha1 = exports.sha1 = function (data) {
@@ -31,15 +52,94 @@ var sha1 = exports.sha1 = function (data) {
 };
 
 var twoSha256 = exports.twoSha256 = function (data) {
-  return sha256(sha256(data));
+  return ccmodule.double_sha256(toBuffer(data));
 };
 
 var sha256ripe160 = exports.sha256ripe160 = function (data) {
-  return ripe160(sha256(data));
+  return ccmodule.hash160(toBuffer(data));
 };
 
+/**
+ * Double SHA-256 of many Buffers at once.
+ *
+ * Uses the SIMD kernels where available. Returns one Buffer with the 32 byte
+ * hash of data[i] at offset 32 * i.
+ */
+var twoSha256Many = exports.twoSha256Many = ccmodule.double_sha256_many;
+
+/**
+ * Merkle root of a Buffer of concatenated 32 byte hashes.
+ */
+var merkleRoot = exports.merkleRoot = ccmodule.merkle_root;
+
+/**
+ * Full merkle tree of a Buffer of concatenated 32 byte hashes.
+ *
+ * Returns one Buffer containing all levels, leaves first and root last.
+ */
+var merkleTree = exports.merkleTree = ccmodule.merkle_tree;
+
 var sha256midstate = exports.sha256midstate = ccmodule.sha256_midstate;
 
+/**
+ * Prepare `count` getwork units that only differ in the coinbase extra nonce.
+ *
+ * workBatch(header, coinbase, offset, first, count, branch) writes extra
+ * nonces `first` and up as uint32 LE at `offset` of the serialized coinbase
+ * and folds each coinbase hash up `branch`, the sibling hashes of the
+ * coinbase in the merkle tree. Returns {roots, midstates} with 32 bytes per
+ * unit.
+ */
+var workBatch = exports.workBatch = ccmodule.work_batch;
+
+/**
+ * Parse the transactions of a raw block payload.
+ *
+ * Returns {buffer, txs, ins, outs, hashes, end}: flat tables of uint32 LE
+ * offsets into the payload and the hash of every transaction. See
+ * Transaction.dataFromTable() for turning rows into objects.
+ */
+var parseBlock = exports.parseBlock = ccmodule.parse_block;
+
+/**
+ * Parse a single transaction at an optional offset, same tables as
+ * parseBlock().
+ */
+var parseTx = exports.parseTx = ccmodule.parse_tx;
+
+/**
+ * Parse a chunk of a bitcoind blk*.dat file on the thread pool.
+ *
+ * Calls back with {blocks, end}. Each block has its `offset`, `length` and
+ * `hash` within the chunk and either parseBlock() tables (relative to the
+ * block) or an `error` if it failed the proof of work or merkle root check.
+ * Reading continues at `end`.
+ */
+var parseBlockFile = exports.parseBlockFile = ccmodule.parse_block_file;
+
+/**
+ * Encode a Block as a fixed-layout binary record for block storage.
+ */
+var encodeBlockRecord = exports.encodeBlockRecord = ccmodule.encode_block_record;
+
+/**
+ * Decode a block record into Block constructor data, with the transaction
+ * hashes packed into a single `txHashes` Buffer.
+ */
+var decodeBlockRecord = exports.decodeBlockRecord = ccmodule.decode_block_record;
+
+/**
+ * Assemble a P2P message, header and payload in one Buffer.
+ *
+ * buildMessage(magic, command, payload, checksum) takes the payload as a
+ * Buffer or an Array of Buffers. buildInvMessage(magic, invs, checksum)
+ * takes {type, hash} objects and buildBlockMessage(magic, header, txs,
+ * checksum) the 80 byte header and the serialized transactions.
+ */
+var buildMessage = exports.buildMessage = ccmodule.build_message;
+var buildInvMessage = exports.buildInvMessage = ccmodule.build_inv_message;
+var buildBlockMessage = exports.buildBlockMessage = ccmodule.build_block_message;
+
 var encodeHex = exports.encodeHex = function (buffer) {
   return buffer.slice(0).toHex().toString('ascii');
 };
@@ -53,6 +153,26 @@ var encodeBase58 = exports.encodeBase58 = ccmodule.base58_encode;
 
 var decodeBase58 = exports.decodeBase58 = ccmodule.base58_decode;
 
+var encodeBase58Many = exports.encodeBase58Many = ccmodule.base58_encode_many;
+
+// Invalid strings decode to null
+var decodeBase58Many = exports.decodeBase58Many = ccmodule.base58_decode_many;
+
+/**
+ * Base58 encode a Buffer with a four byte checksum appended.
+ *
+ * If a version is given, it is prepended as a single byte.
+ */
+var encodeBase58Check = exports.encodeBase58Check = ccmodule.base58check_encode;
+
+/**
+ * Decode a base58check string.
+ *
+ * Returns the payload without the checksum or null if the checksum doesn't
+ * match.
+ */
+var decodeBase58Check = exports.decodeBase58Check = ccmodule.base58check_decode;
+
 // DEPRECATED, use BitcoinKey
 var verifySig = exports.verifySig = function (sig, pubkey, hash) {
   var key = new ccmodule.BitcoinKey();
@@ -60,6 +180,37 @@ var verifySig = exports.verifySig = function (sig, pubkey, hash) {
   return key.verifySignatureSync(hash, sig);
 };
 
+/**
+ * Verify a list of signatures on the native thread pool.
+ *
+ * Takes an array of {pubkey, hash, sig} objects and calls back with an array
+ * of booleans, one per item.
+ */
+var verifyBatch = exports.verifyBatch = ccmodule.BitcoinKey.verifyBatch;
+
+/**
+ * Sign a list of hashes on the native thread pool.
+ *
+ * Takes an array of {priv, hash} objects and calls back with an array of
+ * DER signatures, one per item. Nonces follow RFC 6979, so signing the
+ * same hash with the same key always gives the same signature.
+ */
+var signBatch = exports.signBatch = ccmodule.BitcoinKey.signBatch;
+
+/**
+ * Statistics for the native cache of decoded public keys.
+ *
+ * Returns an object with the properties hits, misses, size and capacity.
+ */
+var pubKeyCacheStats = exports.pubKeyCacheStats = ccmodule.pubkey_cache_stats;
+
+/**
+ * Change the maximum number of decoded public keys kept in the cache.
+ *
+ * Setting this to zero disables the cache.
+ */
+var setPubKeyCacheSize = exports.setPubKeyCacheSize = ccmodule.pubkey_cache_set_size;
+
 /**
  * Format a block hash like the official client does.
  */
@@ -121,6 +272,14 @@ var valueToBigInt = exports.valueToBigInt = function (valueBuffer) {
   }
 };
 
+/**
+ * Value Buffer as a Number. Any amount of bitcoins fits into a double.
+ */
+var valueToNumber = exports.valueToNumber = function (valueBuffer) {
+  return readUInt32LE(valueBuffer, 0) +
+    readUInt32LE(valueBuffer, 4) * 4294967296;
+};
+
 var bigIntToValue = exports.bigIntToValue = function (valueBigInt) {
   if (Buffer.isBuffer(valueBigInt)) {
     return valueBigInt;
@@ -143,19 +302,12 @@ var formatValue = exports.formatValue = function (valueBuffer) {
   return integerPart+"."+decimalPart;
 };
 
-var pubKeyHashToAddress = exports.pubKeyHashToAddress = function (pubKeyHash) {
+var pubKeyHashToAddress = exports.pubKeyHashToAddress = function (pubKeyHash, version) {
   if (!pubKeyHash) {
     return "";
   }
 
-  var put = Binary.put();
-  // Version
-  put.word8le(0);
-  // Hash
-  put.put(pubKeyHash);
-  // Checksum (four bytes)
-  put.put(twoSha256(put.buffer()).slice(0,4));
-  return encodeBase58(put.buffer());
+  return encodeBase58Check(pubKeyHash, version || 0);
 };
 
 var addressToPubKeyHash = exports.addressToPubKeyHash = function (address) {
@@ -168,23 +320,19 @@ var addressToPubKeyHash = exports.addressToPubKeyHash = function (address) {
     return null;
   }
 
-  // Decode
-  var buffer = decodeBase58(address);
-
-  // Parse
-  var parser = Binary.parse(buffer);
-  parser.word8('version');
-  parser.buffer('hash', 20);
-  parser.buffer('checksum', 4);
-
-  // Check checksum
-  var checksum = twoSha256(buffer.slice(0, 21)).slice(0, 4);
-  if (checksum.compare(parser.vars.checksum) !== 0) {
+  // Decode and check checksum
+  var buffer = decodeBase58Check(address);
+  if (!buffer) {
     logger.warn("Checksum comparison failed");
     return null;
   }
+  if (buffer.length != 21) {
+    logger.warn("Not a valid Bitcoin address");
+    return null;
+  }
 
-  return parser.vars.hash;
+  // Skip version byte
+  return buffer.slice(1);
 };
 
 // Utility that synchronizes function calls based on a key
@@ -247,21 +395,16 @@ var generateNonce = exports.generateNonce = function () {
 /**
  * Decode difficulty bits.
  *
- * This function calculates the difficulty target given the difficulty bits.
+ * This function calculates the difficulty target given the difficulty bits,
+ * as a 32 byte big endian Buffer (or a bignum if `asBigInt` is set).
  */
 var decodeDiffBits = exports.decodeDiffBits = function (diffBits, asBigInt) {
-  diffBits = +diffBits;
-  var target = bignum(diffBits & 0xffffff);
-  target = target.shiftLeft(8*((diffBits >>> 24) - 3));
+  var targetBuf = ccmodule.decode_bits(+diffBits);
 
   if (asBigInt) {
-    return target;
+    return bignum.fromBuffer(targetBuf);
   }
 
-  // Convert to buffer
-  var diffBuf = target.toBuffer();
-  var targetBuf = new Buffer(32).clear();
-  diffBuf.copy(targetBuf, 32-diffBuf.length);
   return targetBuf;
 };
 
@@ -272,23 +415,51 @@ var decodeDiffBits = exports.decodeDiffBits = function (diffBits, asBigInt) {
  */
 var encodeDiffBits = exports.encodeDiffBits = function encodeDiffBits(target) {
   if (Buffer.isBuffer(target)) {
-    target = bignum.fromBuffer(target);
-  } else if ("function" === typeof target.toBuffer) { // duck-typing bignum
     // Nothing to do
+  } else if ("function" === typeof target.toBuffer) { // duck-typing bignum
+    target = target.toBuffer();
   } else {
     throw new Error("Incorrect variable type for difficulty");
   }
 
-  var mpiBuf = target.toBuffer("mpint");
-  var size = mpiBuf.length - 4;
+  return ccmodule.encode_bits(target);
+};
 
-  var compact = size << 24;
-  if (size >= 1) compact |= mpiBuf[4] << 16;
-  if (size >= 2) compact |= mpiBuf[5] <<  8;
-  if (size >= 3) compact |= mpiBuf[6]      ;
+/**
+ * Whether a block hash (in internal byte order) meets difficulty bits.
+ */
+var checkProofOfWork = exports.checkProofOfWork = ccmodule.check_proof_of_work;
 
-  return compact;
-};
+/**
+ * Work for a block with the given difficulty bits.
+ *
+ * Work is 2^256 / (target + 1), returned as a 32 byte big endian Buffer.
+ */
+var blockWork = exports.blockWork = ccmodule.block_work;
+
+/**
+ * Chain work of a block, given its parent's chain work and its own
+ * difficulty bits. Returns a 32 byte big endian Buffer.
+ */
+var chainWork = exports.chainWork = ccmodule.chain_work;
+
+/**
+ * Add two amounts of work, each a big endian Buffer of up to 32 bytes.
+ */
+var addWork = exports.addWork = ccmodule.add_work;
+
+/**
+ * Compare two amounts of work, returns -1, 0 or 1.
+ */
+var compareWork = exports.compareWork = ccmodule.compare_work;
+
+/**
+ * Difficulty bits for the next retarget period.
+ *
+ * retargetBits(bits, actualTimespan, targetTimespan, limitBits) scales the
+ * target by actual / target timespan, capped at the target of `limitBits`.
+ */
+var retargetBits = exports.retargetBits = ccmodule.retarget_bits;
 
 /**
  * Calculate "difficulty".
@@ -318,15 +489,29 @@ var reverseBytes32 = exports.reverseBytes32 = function (data) {
   return put.buffer();
 };
 
+var readUInt32LE = exports.readUInt32LE = function (buffer, offset) {
+  return (buffer[offset]           ) +
+         (buffer[offset + 1] <<   8) +
+         (buffer[offset + 2] <<  16) +
+         (buffer[offset + 3] * 0x1000000);
+};
+
+var writeUInt32LE = exports.writeUInt32LE = function (buffer, value, offset) {
+  buffer[offset] = value & 0xff;
+  buffer[offset + 1] = (value >>> 8) & 0xff;
+  buffer[offset + 2] = (value >>> 16) & 0xff;
+  buffer[offset + 3] = (value >>> 24) & 0xff;
+};
+
 var getVarIntSize = exports.getVarIntSize = function getVarIntSize(i) {
 
   if (i < 0xFD) {
     // unsigned char
     return 1;
-  } else if (i <= 1<<16) {
+  } else if (i <= 0xFFFF) {
     // unsigned short (LE)
     return 3;
-  } else if (i <= 1<<32) {
+  } else if (i <= 0xFFFFFFFF) {
     // unsigned int (LE)
     return 5;
   } else {
@@ -0,0 +1,189 @@
+var Util = require('./util');
+var Binary = require('binary');
+var LRU = require('lru-cache');
+var Block = require('./schema/block').Block;
+var Transaction = require('./schema/transaction').Transaction;
+
+/**
+ * A block template that getwork units are cut from.
+ *
+ * Units only differ in the extra nonce of the coinbase script. The merkle
+ * branch of the coinbase is computed once per template, so a new extra
+ * nonce costs log2(n) hashes for the merkle root plus one SHA-256 block for
+ * the midstate. Units are prepared in batches by Util.workBatch().
+ */
+var WorkTemplate = exports.WorkTemplate = function WorkTemplate(block, txs) {
+  this.block = block;
+  this.txs = txs;
+  this.nextEnonce = 1;
+
+  // Serialize the coinbase once, the extra nonce is patched in natively
+  var coinbase = txs[0];
+  coinbase.ins[0].s = WorkTemplate.getCoinbaseScript(block.bits, 0);
+  this.coinbase = coinbase.serialize();
+  coinbase.hash = coinbase.calcHash();
+  this.enonceOffset = 4 + Util.getVarIntSize(coinbase.ins.length) + 36 +
+    Util.getVarIntSize(coinbase.ins[0].s.length) + 4;
+
+  this.branch = WorkTemplate.getMerkleBranch(txs.map(function (tx) {
+    return tx.getHash();
+  }));
+
+  this.target =
+    Util.encodeHex(Util.decodeDiffBits(block.bits).reverse());
+};
+
+/**
+ * The coinbase script: difficulty bits followed by the extra nonce.
+ */
+WorkTemplate.getCoinbaseScript = function getCoinbaseScript(bits, enonce) {
+  return Binary.put()
+    .word32le(bits)    // Difficulty bits
+    .word32le(enonce)  // Extra-nonce
+    .buffer();
+};
+
+/**
+ * Sibling hashes of the first transaction in the merkle tree, from the
+ * leaves up, concatenated into one Buffer.
+ *
+ * None of them depend on the first transaction itself.
+ */
+WorkTemplate.getMerkleBranch = function getMerkleBranch(hashes) {
+  var leaves = new Buffer(hashes.length * 32);
+  hashes.forEach(function (hash, i) {
+    hash.copy(leaves, i * 32);
+  });
+  var tree = Util.merkleTree(leaves);
+
+  var siblings = [];
+  for (var start = 0, count = hashes.length; count > 1;
+       start += count, count = (count + 1) >> 1) {
+    siblings.push(tree.slice((start + 1) * 32, (start + 2) * 32));
+  }
+
+  var branch = new Buffer(siblings.length * 32);
+  siblings.forEach(function (hash, i) {
+    hash.copy(branch, i * 32);
+  });
+  return branch;
+};
+
+/**
+ * Cut `count` units of work with timestamp `time` from this template.
+ *
+ * Every unit has its own extra nonce, merkle root and midstate.
+ */
+WorkTemplate.prototype.getWork = function getWork(time, count) {
+  this.block.timestamp = time;
+  var header = this.block.getHeader();
+
+  var batch = Util.workBatch(header, this.coinbase, this.enonceOffset,
+                             this.nextEnonce, count, this.branch);
+
+  var units = [];
+  for (var i = 0; i < count; i++) {
+    units.push({
+      template: this,
+      enonce: this.nextEnonce + i,
+      time: time,
+      header: header,
+      root: batch.roots.slice(i * 32, i * 32 + 32),
+      midstate: batch.midstates.slice(i * 32, i * 32 + 32)
+    });
+  }
+  this.nextEnonce += count;
+
+  return units;
+};
+
+/**
+ * Block header of a unit, as handed out to the miner.
+ */
+WorkTemplate.prototype.getHeader = function getHeader(unit) {
+  var header = new Buffer(80);
+  unit.header.copy(header, 0);
+  unit.root.copy(header, 36);
+  return header;
+};
+
+/**
+ * Build the block for a solved unit.
+ *
+ * Returns {block, txs} with a copy of the coinbase, the template itself is
+ * left alone so its other units stay valid.
+ */
+WorkTemplate.prototype.createBlock = function createBlock(unit, nonce) {
+  var coinbase = new Transaction(this.txs[0]);
+  coinbase.ins[0].s = WorkTemplate.getCoinbaseScript(this.block.bits,
+                                                     unit.enonce);
+  coinbase.hash = coinbase.calcHash();
+
+  var txs = [coinbase].concat(this.txs.slice(1));
+
+  var block = new Block(this.block);
+  block.merkle_root = unit.root;
+  block.timestamp = unit.time;
+  block.nonce = nonce;
+  block.txs = txs.map(function (tx) {
+    return tx.getHash();
+  });
+  block.hash = block.calcHash();
+
+  return {block: block, txs: txs};
+};
+
+/**
+ * Hands out getwork units and finds them again when a solution comes in.
+ *
+ * Units are prepared `batchSize` at a time from the current template and
+ * remembered in an LRU cache, so work from replaced templates stays valid
+ * until it's pushed out by newer units.
+ */
+var WorkSource = exports.WorkSource = function WorkSource() {
+  this.batchSize = 64;      // Units prepared at once
+  this.maxUnits = 65536;    // Units remembered for solutions
+  this.maxWait = 5;         // Seconds a prepared unit may wait
+
+  this.template = null;
+  this.queue = [];
+  this.units = new LRU(this.maxUnits);
+};
+
+/**
+ * Switch to a new template.
+ *
+ * Units for a different previous block can't be used anymore and are
+ * forgotten.
+ */
+WorkSource.prototype.setTemplate = function setTemplate(template) {
+  if (this.template &&
+      this.template.block.prev_hash.compare(template.block.prev_hash) != 0) {
+    this.units = new LRU(this.maxUnits);
+  }
+  this.template = template;
+  this.queue = [];
+};
+
+/**
+ * Next unit of work with a timestamp close to `time`.
+ */
+WorkSource.prototype.getWork = function getWork(time) {
+  if (this.queue.length && this.queue[0].time < time - this.maxWait) {
+    this.queue = [];
+  }
+  if (!this.queue.length) {
+    this.queue = this.template.getWork(time, this.batchSize);
+  }
+
+  var unit = this.queue.shift();
+  this.units.set(unit.root.toString('base64'), unit);
+  return unit;
+};
+
+/**
+ * Find a unit handed out earlier by its merkle root.
+ */
+WorkSource.prototype.findWork = function findWork(root) {
+  return this.units.get(root.toString('base64')) || null;
+};
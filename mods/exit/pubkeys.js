@@ -112,9 +112,141 @@ Pubkeys.method('register', {
       return;
     }
 
+    function listenForKeys(data) {
+      pubKeyHashes.forEach(function (pubKeyHash) {
+        // Set up events for new transactions
+        var hash64 = pubKeyHash.toString('base64');
+        blockChain.addListener('txAdd:'+hash64, addTxToChain.bind(global, data));
+        blockChain.addListener('txRevoke:'+hash64, revokeTxFromChain.bind(global, data));
+      });
+    };
+
+    function generateChain(data, txs) {
+      // Sort transactions by height, then index
+      txs.sort(function (a,b) {
+        if (a.height == b.height) {
+          return a.index - b.index;
+        } else {
+          return a.height - b.height;
+        }
+      });
+
+      // Create a chain with only unique values
+      var curHash, lastHash, chainHash;
+      for (var i = 0; i < txs.length; i++) {
+        curHash = txs[i].tx.hash;
+        // Add first tx
+        if (i == 0) {
+          chainHash = curHash;
+
+          // Add only unique txs
+          // (we only need to check against the last one as they are sorted)
+        } else if (lastHash.compare(curHash) != 0) {
+          chainHash = Util.sha256(chainHash.concat(curHash));
+        } else {
+          continue;
+        }
+        data.chain.push({
+          hash: curHash,
+          chainHash: chainHash,
+          height: txs[i].height,
+          index: txs[i].index
+        });
+        lastHash = curHash;
+      }
+    };
+
+    /**
+     * Build the data from the address index.
+     *
+     * One range read per key yields the (height, index) positions of its
+     * transactions together with the balance, so only the blocks at those
+     * heights and the transactions themselves have to be loaded.
+     */
+    function getIndexedDataForKeys(storage, pubKeyHashes, callback) {
+      var positions = [];
+      var txPositions = {};
+      var blocks = {};
+      var data = new PubkeysData();
+      Step(
+        function getIndexStep() {
+          var group = this.group();
+          pubKeyHashes.forEach(function (pubKeyHash) {
+            storage.getAddressIndex(pubKeyHash, group());
+          });
+        },
+        function getBlocksStep(err, indexes) {
+          if (err) throw err;
+
+          data.accounts = pubKeyHashes.map(function (pubKeyHash, i) {
+            return {
+              pubKeyHash: pubKeyHash,
+              balance: indexes[i].balance,
+              unspent: indexes[i].unspent
+            };
+          });
+
+          var heights = [];
+          indexes.forEach(function (index) {
+            index.history.forEach(function (pos) {
+              if (!blocks.hasOwnProperty(pos.height)) {
+                blocks[pos.height] = null;
+                heights.push(pos.height);
+              }
+              positions.push(pos);
+            });
+          });
+
+          if (!heights.length) {
+            this(null, []);
+            return;
+          }
+
+          blockChain.getBlocksByHeights(heights, this);
+        },
+        function getTxsStep(err, blockList) {
+          if (err) throw err;
+
+          blockList.forEach(function (block) {
+            blocks[block.height] = block;
+          });
+
+          var txHashes = [];
+          positions.forEach(function (pos) {
+            var hash64 = blocks[pos.height].txs[pos.index].toString('base64');
+            if (!txPositions.hasOwnProperty(hash64)) {
+              txPositions[hash64] = pos;
+              txHashes.push(blocks[pos.height].txs[pos.index]);
+            }
+          });
+
+          storage.getTransactionsByHashes(txHashes, this);
+        },
+        function (err, txs) {
+          if (err) throw err;
+
+          listenForKeys(data);
+
+          data.chain = [];
+          generateChain(data, txs.map(function (tx) {
+            var pos = txPositions[tx.getHash().toString('base64')];
+            return {
+              tx: tx,
+              height: pos.height,
+              index: pos.index
+            };
+          }));
+
+          this(null, data);
+        },
+        callback
+      );
+    };
+
     function getDataForKeys(storage, pubKeyHashes, callback) {
-      for (var i = 0; i < pubKeyHashes.length; i++) {
-        var pubKeyHash = pubKeyHashes[i];
+      if ("function" === typeof storage.getAddressIndex) {
+        getIndexedDataForKeys(storage, pubKeyHashes, callback);
+        return;
       }
 
       var txs;
@@ -133,12 +265,7 @@ Pubkeys.method('register', {
 
           txs = txData;
 
-          pubKeyHashes.forEach(function (pubKeyHash) {
-            // Set up events for new transactions
-            var hash64 = pubKeyHash.toString('base64');
-            blockChain.addListener('txAdd:'+hash64, addTxToChain.bind(global, data));
-            blockChain.addListener('txRevoke:'+hash64, revokeTxFromChain.bind(global, data));
-          });
+          listenForKeys(data);
 
           data.accounts = pubKeyHashes.map(function (pubKeyHash) {
             return {pubKeyHash: pubKeyHash};
@@ -188,41 +315,10 @@ Pubkeys.method('register', {
           });
           this(null);
         },
-        function generateChain(err) {
+        function generateChainStep(err) {
           if (err) throw err;
 
-          // Sort transactions by height, then index
-          txs.sort(function (a,b) {
-            if (a.height == b.height) {
-              return a.index - b.index;
-            } else {
-              return a.height - b.height;
-            }
-          });
-
-          // Create a chain with only unique values
-          var curHash, lastHash, chainHash;
-          for (var i = 0; i < txs.length; i++) {
-            curHash = txs[i].tx.hash;
-            // Add first tx
-            if (i == 0) {
-              chainHash = curHash;
-
-              // Add only unique txs
-              // (we only need to check against the last one as they are sorted)
-            } else if (lastHash.compare(curHash) != 0) {
-              chainHash = Util.sha256(chainHash.concat(curHash));
-            } else {
-              continue;
-            }
-            data.chain.push({
-              hash: curHash,
-              chainHash: chainHash,
-              height: txs[i].height,
-              index: txs[i].index
-            });
-            lastHash = curHash;
-          }
+          generateChain(data, txs);
 
           this(null, data);
         },
@@ -1,7 +1,19 @@
 #include <cctype>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
 
 #include <v8.h>
 
@@ -13,6 +25,7 @@
 #include <openssl/buffer.h>
 #include <openssl/ecdsa.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
@@ -28,6 +41,15 @@ using namespace node;
                             String::New("Argument " #I " must be a function")));  \
   Local<Function> VAR = Local<Function>::Cast(args[I]);
 
+// Default number of decoded public keys to keep around
+#define PUBKEY_CACHE_SIZE 4096
+
+// Smallest number of signatures worth handing to a thread of its own
+#define VERIFY_BATCH_MIN_JOB 16
+
+// Same for signing, which costs about half as much as verifying
+#define SIGN_BATCH_MIN_JOB 32
+
 static Handle<Value> VException(const char *msg) {
     HandleScope scope;
     return ThrowException(Exception::Error(String::New(msg)));
@@ -47,845 +69,7863 @@ static Handle<Value> VException(const char *msg) {
 #endif
 
 
-int static inline EC_KEY_regenerate_key(EC_KEY *eckey, const BIGNUM *priv_key)
+int static FormatHashBlocks(void* pbuffer, unsigned int len)
 {
-  int ok = 0;
-  BN_CTX *ctx = NULL;
-  EC_POINT *pub_key = NULL;
-
-  if (!eckey) return 0;
-
-  const EC_GROUP *group = EC_KEY_get0_group(eckey);
-
-  if ((ctx = BN_CTX_new()) == NULL)
-    goto err;
-
-  pub_key = EC_POINT_new(group);
+  unsigned char* pdata = (unsigned char*)pbuffer;
+  unsigned int blocks = 1 + ((len + 8) / 64);
+  unsigned char* pend = pdata + 64 * blocks;
+  memset(pdata + len, 0, 64 * blocks - len);
+  pdata[len] = 0x80;
+  unsigned int bits = len * 8;
+  pend[-1] = (bits >> 0) & 0xff;
+  pend[-2] = (bits >> 8) & 0xff;
+  pend[-3] = (bits >> 16) & 0xff;
+  pend[-4] = (bits >> 24) & 0xff;
+  return blocks;
+}
 
-  if (pub_key == NULL)
-    goto err;
 
-  if (!EC_POINT_mul(group, pub_key, priv_key, NULL, NULL, ctx))
-    goto err;
+/**
+ * SHA-256 kernels
+ *
+ * Hashing is on most of our hot paths (tx ids, message checksums, merkle
+ * trees, OP_HASH160), so we keep our own compression function dispatch here
+ * rather than going through node's crypto module. Depending on the CPU we use
+ *
+ *   - the SHA extensions (SHA-NI), one message at a time,
+ *   - AVX2, eight messages in parallel (only for batches), or
+ *   - OpenSSL's SHA256_Transform.
+ *
+ * Each kernel is detected separately, there are CPUs with SHA-NI but no AVX2
+ * and the other way around. The kernel is picked per call: batches of eight
+ * or more messages go through AVX2 even if SHA-NI is available, single
+ * messages and leftovers through SHA-NI or OpenSSL.
+ *
+ * The SIMD kernels are compiled with per-function target attributes, so the
+ * module still loads on CPUs without them.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+  #define HAVE_SHA256_SIMD 1
+  #include <cpuid.h>
+  #include <immintrin.h>
+#endif
 
-  EC_KEY_set_private_key(eckey,priv_key);
-  EC_KEY_set_public_key(eckey,pub_key);
+enum sha256_kernel_t {
+  SHA256_KERNEL_OPENSSL = 0,
+  SHA256_KERNEL_AVX2 = 1,
+  SHA256_KERNEL_SHANI = 2
+};
 
-  ok = 1;
+static const char *SHA256_KERNEL_NAMES[] = { "openssl", "avx2", "shani" };
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
- err:
+static const uint32_t SHA256_IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
 
-  if (pub_key)
-    EC_POINT_free(pub_key);
-  if (ctx != NULL)
-    BN_CTX_free(ctx);
+static inline uint32_t
+read_be32(const unsigned char *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+    ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
 
-  return(ok);
+static inline void
+write_be32(unsigned char *p, uint32_t x)
+{
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
 }
 
-class BitcoinKey : ObjectWrap
+static void
+sha256_transform_openssl(uint32_t *state, const unsigned char *data, size_t blocks)
 {
-private:
+  SHA256_CTX c;
+  SHA256_Init(&c);
+  memcpy(&c.h, state, 32);
+  while (blocks--) {
+    SHA256_Transform(&c, data);
+    data += 64;
+  }
+  memcpy(state, &c.h, 32);
+}
 
-  const char *lastError;
-  EC_KEY *ec;
+#ifdef HAVE_SHA256_SIMD
 
-  bool hasPrivate;
-  bool hasPublic;
+// Four rounds, `w` holds the next four message words
+#define SHA256_SHANI_QROUND(w, k)                                          \
+  msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i *) &SHA256_K[k])); \
+  state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                     \
+  msg = _mm_shuffle_epi32(msg, 0x0E);                                      \
+  state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
 
-  void Generate()
-  {
-    if (!EC_KEY_generate_key(ec)) {
-      lastError = "Error from EC_KEY_generate_key";
-      return;
+// Replace w0 (words t-16..t-13) with words t..t+3 of the message schedule
+#define SHA256_SHANI_SCHEDULE(w0, w1, w2, w3)                              \
+  w0 = _mm_sha256msg2_epu32(                                               \
+    _mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), \
+    w3);
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_transform_shani(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+  const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                      0x0405060700010203ULL);
+
+  // Rearrange the state into the ABEF/CDGH layout sha256rnds2 wants
+  __m128i tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+  __m128i state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);
+  state1 = _mm_shuffle_epi32(state1, 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  while (blocks--) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i msg, m0, m1, m2, m3;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 0)), MASK);
+    SHA256_SHANI_QROUND(m0, 0);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), MASK);
+    SHA256_SHANI_QROUND(m1, 4);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), MASK);
+    SHA256_SHANI_QROUND(m2, 8);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), MASK);
+    SHA256_SHANI_QROUND(m3, 12);
+
+    for (int k = 16; k < 64; k += 16) {
+      SHA256_SHANI_SCHEDULE(m0, m1, m2, m3);
+      SHA256_SHANI_QROUND(m0, k);
+      SHA256_SHANI_SCHEDULE(m1, m2, m3, m0);
+      SHA256_SHANI_QROUND(m1, k + 4);
+      SHA256_SHANI_SCHEDULE(m2, m3, m0, m1);
+      SHA256_SHANI_QROUND(m2, k + 8);
+      SHA256_SHANI_SCHEDULE(m3, m0, m1, m2);
+      SHA256_SHANI_QROUND(m3, k + 12);
     }
 
-    hasPublic = true;
-    hasPrivate = true;
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += 64;
   }
 
-  struct verify_sig_baton_t {
-    // Parameters
-    BitcoinKey *key;
-    const unsigned char *digest;
-    const unsigned char *sig;
-    int digestLen;
-    int sigLen;
-    Persistent<Object> digestBuf;
-    Persistent<Object> sigBuf;
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
 
-    // Result
-    // -1 = error, 0 = bad sig, 1 = good
-    int result;
-    Persistent<Function> cb;
-  };
+  _mm_storeu_si128((__m128i *) &state[0], state0);
+  _mm_storeu_si128((__m128i *) &state[4], state1);
+}
 
-  int VerifySignature(const unsigned char *digest, int digest_len,
-                      const unsigned char *sig, int sig_len)
-  {
-    return ECDSA_verify(0, digest, digest_len, sig, sig_len, ec);
+#define SHA256_AVX2_ROTR(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+/**
+ * Run one compression round on eight independent states.
+ *
+ * state[j] holds word j of all eight lanes; blocks[l] points to the 64 byte
+ * block for lane l.
+ */
+__attribute__((target("avx2")))
+static void
+sha256_transform_avx2_8way(__m256i *state, const unsigned char **blocks)
+{
+  const __m256i BSWAP = _mm256_set_epi8(
+    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+  // Load each half block as a row and transpose, so that w[i] ends up holding
+  // message word i of every lane.
+  __m256i w[64];
+  for (int half = 0; half < 2; half++) {
+    __m256i r[8];
+    for (int l = 0; l < 8; l++) {
+      r[l] = _mm256_shuffle_epi8(
+        _mm256_loadu_si256((const __m256i *) (blocks[l] + 32 * half)), BSWAP);
+    }
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    __m256i *o = w + 8 * half;
+    o[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    o[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    o[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    o[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    o[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    o[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    o[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    o[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+  }
+  for (int i = 16; i < 64; i++) {
+    __m256i x = w[i - 15];
+    __m256i y = w[i - 2];
+    __m256i s0 = _mm256_xor_si256(
+      _mm256_xor_si256(SHA256_AVX2_ROTR(x, 7), SHA256_AVX2_ROTR(x, 18)),
+      _mm256_srli_epi32(x, 3));
+    __m256i s1 = _mm256_xor_si256(
+      _mm256_xor_si256(SHA256_AVX2_ROTR(y, 17), SHA256_AVX2_ROTR(y, 19)),
+      _mm256_srli_epi32(y, 10));
+    w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0),
+                            _mm256_add_epi32(w[i - 7], s1));
   }
 
-  EIO_CALLBACK(EIO_VerifySignature)
-  {
-    verify_sig_baton_t *b = static_cast<verify_sig_baton_t *>(req->data);
+  __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+  __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (int i = 0; i < 64; i++) {
+    __m256i S1 = _mm256_xor_si256(
+      _mm256_xor_si256(SHA256_AVX2_ROTR(e, 6), SHA256_AVX2_ROTR(e, 11)),
+      SHA256_AVX2_ROTR(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                  _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(
+      _mm256_add_epi32(_mm256_add_epi32(h, S1), ch),
+      _mm256_add_epi32(_mm256_set1_epi32(SHA256_K[i]), w[i]));
+    __m256i S0 = _mm256_xor_si256(
+      _mm256_xor_si256(SHA256_AVX2_ROTR(a, 2), SHA256_AVX2_ROTR(a, 13)),
+      SHA256_AVX2_ROTR(a, 22));
+    __m256i maj = _mm256_xor_si256(
+      _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+      _mm256_and_si256(b, c));
+    __m256i t2 = _mm256_add_epi32(S0, maj);
+
+    h = g; g = f; f = e;
+    e = _mm256_add_epi32(d, t1);
+    d = c; c = b; b = a;
+    a = _mm256_add_epi32(t1, t2);
+  }
 
-    b->result = b->key->VerifySignature(
-      b->digest, b->digestLen,
-      b->sig, b->sigLen
-    );
+  state[0] = _mm256_add_epi32(state[0], a);
+  state[1] = _mm256_add_epi32(state[1], b);
+  state[2] = _mm256_add_epi32(state[2], c);
+  state[3] = _mm256_add_epi32(state[3], d);
+  state[4] = _mm256_add_epi32(state[4], e);
+  state[5] = _mm256_add_epi32(state[5], f);
+  state[6] = _mm256_add_epi32(state[6], g);
+  state[7] = _mm256_add_epi32(state[7], h);
+}
 
-    EIO_RETURN;
+/**
+ * Double SHA-256 of eight messages that pad to the same number of blocks.
+ */
+__attribute__((target("avx2")))
+static void
+double_sha256_avx2_8way(const unsigned char **data, const size_t *len,
+                        unsigned char **out)
+{
+  // The last one or two blocks of every message, with padding applied
+  unsigned char tails[8][128];
+  size_t full[8];
+  size_t blocks = 0;
+
+  for (int l = 0; l < 8; l++) {
+    full[l] = len[l] / 64;
+    size_t rest = len[l] - full[l] * 64;
+    memcpy(tails[l], data[l] + full[l] * 64, rest);
+    blocks = full[l] + FormatHashBlocks(tails[l], rest);
+
+    // FormatHashBlocks only encodes the length of the tail
+    uint64_t bits = (uint64_t) len[l] * 8;
+    unsigned char *end = tails[l] + (blocks - full[l]) * 64;
+    write_be32(end - 8, (uint32_t) (bits >> 32));
+    write_be32(end - 4, (uint32_t) bits);
   }
 
-  ECDSA_SIG *Sign(const unsigned char *digest, int digest_len)
-  {
-    ECDSA_SIG *sig;
+  __m256i state[8];
+  for (int j = 0; j < 8; j++) {
+    state[j] = _mm256_set1_epi32(SHA256_IV[j]);
+  }
 
-    sig = ECDSA_do_sign(digest, digest_len, ec);
-    if (sig == NULL) {
-      // TODO: ERROR
+  const unsigned char *ptrs[8];
+  for (size_t b = 0; b < blocks; b++) {
+    for (int l = 0; l < 8; l++) {
+      ptrs[l] = b < full[l] ? data[l] + 64 * b : tails[l] + 64 * (b - full[l]);
     }
+    sha256_transform_avx2_8way(state, ptrs);
+  }
 
-    return sig;
+  // Second round: every message is now a 32 byte digest, i.e. one block
+  uint32_t words[8][8];
+  for (int j = 0; j < 8; j++) {
+    _mm256_storeu_si256((__m256i *) words[j], state[j]);
   }
+  for (int l = 0; l < 8; l++) {
+    for (int j = 0; j < 8; j++) {
+      write_be32(tails[l] + 4 * j, words[j][l]);
+    }
+    FormatHashBlocks(tails[l], 32);
+    ptrs[l] = tails[l];
+  }
+  for (int j = 0; j < 8; j++) {
+    state[j] = _mm256_set1_epi32(SHA256_IV[j]);
+  }
+  sha256_transform_avx2_8way(state, ptrs);
 
-public:
+  for (int j = 0; j < 8; j++) {
+    _mm256_storeu_si256((__m256i *) words[j], state[j]);
+  }
+  for (int l = 0; l < 8; l++) {
+    for (int j = 0; j < 8; j++) {
+      write_be32(out[l] + 4 * j, words[j][l]);
+    }
+  }
+}
 
-  static Persistent<FunctionTemplate> s_ct;
-  static void Init(Handle<Object> target)
-  {
-    HandleScope scope;
-    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+#endif /* HAVE_SHA256_SIMD */
 
-    s_ct = Persistent<FunctionTemplate>::New(t);
-    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
-    s_ct->SetClassName(String::NewSymbol("BitcoinKey"));
+#define SHA256_KERNEL_BIT(k) (1u << (k))
 
-    // Accessors
-    s_ct->InstanceTemplate()->SetAccessor(String::New("private"),
-                                          GetPrivate, SetPrivate);
-    s_ct->InstanceTemplate()->SetAccessor(String::New("public"),
-                                          GetPublic, SetPublic);
+/**
+ * Bitmask of the kernels this CPU supports, OpenSSL is always included.
+ */
+static unsigned int
+sha256_detect_kernels()
+{
+  unsigned int kernels = SHA256_KERNEL_BIT(SHA256_KERNEL_OPENSSL);
 
-    // Methods
-    NODE_SET_PROTOTYPE_METHOD(s_ct, "verifySignature", VerifySignature);
-    NODE_SET_PROTOTYPE_METHOD(s_ct, "verifySignatureSync", VerifySignatureSync);
-    NODE_SET_PROTOTYPE_METHOD(s_ct, "regenerateSync", RegenerateSync);
-    NODE_SET_PROTOTYPE_METHOD(s_ct, "toDER", ToDER);
-    NODE_SET_PROTOTYPE_METHOD(s_ct, "signSync", SignSync);
+#ifdef HAVE_SHA256_SIMD
+  unsigned int eax, ebx, ecx, edx;
 
-    // Static methods
-    NODE_SET_METHOD(s_ct->GetFunction(), "generateSync", GenerateSync);
-    NODE_SET_METHOD(s_ct->GetFunction(), "fromDER", FromDER);
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return kernels;
+  }
+  bool ssse3 = ecx & (1 << 9);
+  bool sse41 = ecx & (1 << 19);
+  bool osxsave = ecx & (1 << 27);
+  bool avx = ecx & (1 << 28);
 
-    target->Set(String::NewSymbol("BitcoinKey"),
-                s_ct->GetFunction());
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return kernels;
   }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  bool avx2 = ebx & (1 << 5);
+  bool sha = ebx & (1 << 29);
 
-  BitcoinKey() :
-    lastError(NULL),
-    hasPrivate(false),
-    hasPublic(false)
-  {
-    ec = EC_KEY_new_by_curve_name(NID_secp256k1);
-    if (ec == NULL) {
-      lastError = "Error from EC_KEY_new_by_curve_name";
-    }
+  if (sha && ssse3 && sse41) {
+    kernels |= SHA256_KERNEL_BIT(SHA256_KERNEL_SHANI);
   }
 
-  ~BitcoinKey()
-  {
-    EC_KEY_free(ec);
+  if (avx2 && avx && osxsave) {
+    // Make sure the OS saves the YMM registers
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) == 6) {
+      kernels |= SHA256_KERNEL_BIT(SHA256_KERNEL_AVX2);
+    }
   }
+#endif
 
-  static BitcoinKey*
-  New()
-  {
-    HandleScope scope;
+  return kernels;
+}
 
-    Local<Object> k = s_ct->GetFunction()->NewInstance(0, NULL);
-    if (k.IsEmpty()) return NULL;
+// Kernels the CPU supports and the ones we currently use
+static unsigned int sha256_supported_kernels = sha256_detect_kernels();
+static unsigned int sha256_enabled_kernels = sha256_supported_kernels;
 
-    return ObjectWrap::Unwrap<BitcoinKey>(k);
+static inline bool
+sha256_use_kernel(sha256_kernel_t kernel)
+{
+  return sha256_enabled_kernels & SHA256_KERNEL_BIT(kernel);
+}
+
+/**
+ * Run the compression function over `blocks` consecutive 64 byte blocks.
+ */
+static void
+sha256_transform(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+#ifdef HAVE_SHA256_SIMD
+  if (sha256_use_kernel(SHA256_KERNEL_SHANI)) {
+    sha256_transform_shani(state, data, blocks);
+    return;
   }
+#endif
+  sha256_transform_openssl(state, data, blocks);
+}
 
-  static Handle<Value>
-  New(const Arguments& args)
-  {
-    if (!args.IsConstructCall()) {
-      return FromConstructorTemplate(s_ct, args);
-    }
+/**
+ * Finish a hash whose first `len` bytes of data went through `state`
+ * already, except for the trailing `rest` bytes at `tail`.
+ */
+static void
+sha256_finish(uint32_t *state, const unsigned char *tail, size_t rest,
+              uint64_t len, unsigned char *out)
+{
+  unsigned char buf[128];
+  memcpy(buf, tail, rest);
+  int blocks = FormatHashBlocks(buf, rest);
 
-    HandleScope scope;
-    
-    BitcoinKey* key = new BitcoinKey();
-    if (key->lastError != NULL) {
-      return VException(key->lastError);
-    }
+  uint64_t bits = len * 8;
+  write_be32(buf + blocks * 64 - 8, (uint32_t) (bits >> 32));
+  write_be32(buf + blocks * 64 - 4, (uint32_t) bits);
 
-    key->Wrap(args.Holder());
+  sha256_transform(state, buf, blocks);
 
-    return scope.Close(args.This());
+  for (int j = 0; j < 8; j++) {
+    write_be32(out + 4 * j, state[j]);
   }
+}
 
-  static Handle<Value>
-  GenerateSync(const Arguments& args)
-  {
-    HandleScope scope;
+static void
+sha256_digest(const unsigned char *data, size_t len, unsigned char *out)
+{
+  uint32_t state[8];
+  memcpy(state, SHA256_IV, sizeof(state));
 
-    BitcoinKey* key = BitcoinKey::New();
+  size_t full = len / 64;
+  sha256_transform(state, data, full);
+  sha256_finish(state, data + full * 64, len - full * 64, len, out);
+}
 
-    key->Generate();
+static void
+double_sha256_digest(const unsigned char *data, size_t len, unsigned char *out)
+{
+  unsigned char hash1[SHA256_DIGEST_LENGTH];
+  sha256_digest(data, len, hash1);
+  sha256_digest(hash1, SHA256_DIGEST_LENGTH, out);
+}
 
-    if (key->lastError != NULL) {
-      return VException(key->lastError);
-    }
+static void
+hash160_digest(const unsigned char *data, size_t len, unsigned char *out)
+{
+  unsigned char hash1[SHA256_DIGEST_LENGTH];
+  sha256_digest(data, len, hash1);
+  RIPEMD160(hash1, SHA256_DIGEST_LENGTH, out);
+}
 
-    return scope.Close(key->handle_);
-  }
+static inline size_t
+sha256_padded_blocks(size_t len)
+{
+  return 1 + (len + 8) / 64;
+}
 
-  static Handle<Value>
-  GetPrivate(Local<String> property, const AccessorInfo& info)
-  {
-    HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
+struct sha256_job_order_t {
+  const size_t *len;
+  bool operator()(size_t a, size_t b) const {
+    return sha256_padded_blocks(len[a]) < sha256_padded_blocks(len[b]);
+  }
+};
 
-    if (!key->hasPrivate) {
-      return scope.Close(Null());
+/**
+ * Double SHA-256 of `count` messages, writing 32 bytes per message to `out`.
+ *
+ * With the AVX2 kernel, messages that pad to the same number of blocks are
+ * hashed eight at a time, the rest one by one.
+ */
+static void
+double_sha256_digest_many(const unsigned char **data, const size_t *len,
+                          size_t count, unsigned char *out)
+{
+#ifdef HAVE_SHA256_SIMD
+  if (sha256_use_kernel(SHA256_KERNEL_AVX2) && count >= 8) {
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+      order[i] = i;
+    }
+    sha256_job_order_t cmp;
+    cmp.len = len;
+    stable_sort(order.begin(), order.end(), cmp);
+
+    size_t i = 0;
+    while (i + 8 <= count) {
+      size_t blocks = sha256_padded_blocks(len[order[i]]);
+      if (sha256_padded_blocks(len[order[i + 7]]) != blocks) {
+        // Not enough messages of this size for a full group
+        size_t idx = order[i];
+        double_sha256_digest(data[idx], len[idx], out + 32 * idx);
+        i++;
+        continue;
+      }
+
+      const unsigned char *lane_data[8];
+      size_t lane_len[8];
+      unsigned char *lane_out[8];
+      for (int l = 0; l < 8; l++) {
+        size_t idx = order[i + l];
+        lane_data[l] = data[idx];
+        lane_len[l] = len[idx];
+        lane_out[l] = out + 32 * idx;
+      }
+      double_sha256_avx2_8way(lane_data, lane_len, lane_out);
+      i += 8;
     }
+    for (; i < count; i++) {
+      size_t idx = order[i];
+      double_sha256_digest(data[idx], len[idx], out + 32 * idx);
+    }
+    return;
+  }
+#endif
 
-    const BIGNUM *bn = EC_KEY_get0_private_key(key->ec);
-    int priv_size = BN_num_bytes(bn);
+  for (size_t i = 0; i < count; i++) {
+    double_sha256_digest(data[i], len[i], out + 32 * i);
+  }
+}
 
-    if (bn == NULL) {
-      // TODO: ERROR: "Error from EC_KEY_get0_private_key(pkey)"
-      return scope.Close(Null());
-    }
+/**
+ * Incremental SHA-256 on top of sha256_transform.
+ *
+ * The struct is plain data, so a partially fed hasher can be copied and
+ * resumed, which is how we reuse midstates for common prefixes.
+ */
+struct sha256_stream_t {
+  uint32_t state[8];
+  unsigned char buf[64];
+  size_t buflen;
+  uint64_t total;
+};
 
-    if (priv_size > 32) {
-      // TODO: ERROR: "Secret too large (Incorrect curve parameters?)"
-      return scope.Close(Null());
+static void
+sha256_stream_init(sha256_stream_t *s)
+{
+  memcpy(s->state, SHA256_IV, sizeof(s->state));
+  s->buflen = 0;
+  s->total = 0;
+}
+
+static void
+sha256_stream_update(sha256_stream_t *s, const unsigned char *data, size_t len)
+{
+  s->total += len;
+
+  if (s->buflen) {
+    size_t n = 64 - s->buflen < len ? 64 - s->buflen : len;
+    memcpy(s->buf + s->buflen, data, n);
+    s->buflen += n;
+    data += n;
+    len -= n;
+    if (s->buflen < 64) {
+      return;
     }
+    sha256_transform(s->state, s->buf, 1);
+    s->buflen = 0;
+  }
 
-    unsigned char *priv = (unsigned char *)malloc(32);
+  size_t blocks = len / 64;
+  if (blocks) {
+    sha256_transform(s->state, data, blocks);
+    data += blocks * 64;
+    len -= blocks * 64;
+  }
 
-    int n = BN_bn2bin(bn, &priv[32 - priv_size]);
+  memcpy(s->buf, data, len);
+  s->buflen = len;
+}
 
-    if (n != priv_size) {
-      // TODO: ERROR: "Error from BN_bn2bin(bn, &priv[32 - priv_size])"
-      return scope.Close(Null());
-    }
+static void
+sha256_stream_final(sha256_stream_t *s, unsigned char *out)
+{
+  sha256_finish(s->state, s->buf, s->buflen, s->total, out);
+}
 
-    Buffer *priv_buf = Buffer::New(32);
-    memcpy(Buffer::Data(priv_buf), priv, 32);
+/**
+ * Finish the stream and hash the result again.
+ */
+static void
+sha256_stream_final_double(sha256_stream_t *s, unsigned char *out)
+{
+  unsigned char hash1[SHA256_DIGEST_LENGTH];
+  sha256_stream_final(s, hash1);
+  sha256_digest(hash1, SHA256_DIGEST_LENGTH, out);
+}
 
-    free(priv);
 
-    return scope.Close(priv_buf->handle_);
+/**
+ * Bitcoin serialization helpers
+ */
+
+static size_t
+write_varint(unsigned char *p, uint64_t n)
+{
+  if (n < 0xfd) {
+    p[0] = n;
+    return 1;
+  } else if (n <= 0xffff) {
+    p[0] = 0xfd;
+    p[1] = n;
+    p[2] = n >> 8;
+    return 3;
+  } else if (n <= 0xffffffffULL) {
+    p[0] = 0xfe;
+    for (int i = 0; i < 4; i++) p[1 + i] = n >> (8 * i);
+    return 5;
+  } else {
+    p[0] = 0xff;
+    for (int i = 0; i < 8; i++) p[1 + i] = n >> (8 * i);
+    return 9;
   }
+}
 
-  static void
-  SetPrivate(Local<String> property, Local<Value> value, const AccessorInfo& info)
-  {
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
-    Handle<Object> buffer = value->ToObject();
+static inline uint32_t
+read_le32(const unsigned char *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void
+write_le32(unsigned char *p, uint32_t x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+/**
+ * Read a varint at `*p`, advancing the pointer.
+ *
+ * Returns false if the data ends before the varint does.
+ */
+static bool
+read_varint(const unsigned char **p, const unsigned char *end, uint64_t *n)
+{
+  if (*p >= end) return false;
+
+  unsigned char c = **p;
+  size_t size = c < 0xfd ? 0 : c == 0xfd ? 2 : c == 0xfe ? 4 : 8;
+  if ((size_t) (end - *p) < 1 + size) return false;
+
+  if (size == 0) {
+    *n = c;
+  } else {
+    *n = 0;
+    for (size_t i = 0; i < size; i++) {
+      *n |= (uint64_t) (*p)[1 + i] << (8 * i);
+    }
+  }
+  *p += 1 + size;
+  return true;
+}
+
+/**
+ * Skip `len` bytes at `*p`, returns false if there aren't enough.
+ */
+static inline bool
+skip_bytes(const unsigned char **p, const unsigned char *end, uint64_t len)
+{
+  if ((uint64_t) (end - *p) < len) return false;
+  *p += len;
+  return true;
+}
+
+
+int static inline EC_KEY_regenerate_key(EC_KEY *eckey, const BIGNUM *priv_key)
+{
+  int ok = 0;
+  BN_CTX *ctx = NULL;
+  EC_POINT *pub_key = NULL;
+
+  if (!eckey) return 0;
+
+  const EC_GROUP *group = EC_KEY_get0_group(eckey);
+
+  if ((ctx = BN_CTX_new()) == NULL)
+    goto err;
+
+  pub_key = EC_POINT_new(group);
+
+  if (pub_key == NULL)
+    goto err;
+
+  if (!EC_POINT_mul(group, pub_key, priv_key, NULL, NULL, ctx))
+    goto err;
+
+  EC_KEY_set_private_key(eckey,priv_key);
+  EC_KEY_set_public_key(eckey,pub_key);
+
+  ok = 1;
+
+ err:
+
+  if (pub_key)
+    EC_POINT_free(pub_key);
+  if (ctx != NULL)
+    BN_CTX_free(ctx);
+
+  return(ok);
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static void
+ECDSA_SIG_get0(const ECDSA_SIG *sig, const BIGNUM **pr, const BIGNUM **ps)
+{
+  if (pr) *pr = sig->r;
+  if (ps) *ps = sig->s;
+}
+
+static int
+ECDSA_SIG_set0(ECDSA_SIG *sig, BIGNUM *r, BIGNUM *s)
+{
+  BN_clear_free(sig->r);
+  BN_clear_free(sig->s);
+  sig->r = r;
+  sig->s = s;
+  return 1;
+}
+#endif
+
+/**
+ * One HMAC-SHA256 step of the RFC 6979 nonce generator:
+ * out = HMAC(key, v || [sep] || [x || h1]).
+ */
+static void
+rfc6979_hmac(const unsigned char *key, const unsigned char *v, int sep,
+             const unsigned char *x, const unsigned char *h1,
+             unsigned char *out)
+{
+  unsigned char data[32 + 1 + 32 + 32];
+  size_t len = 32;
+  memcpy(data, v, 32);
+  if (sep >= 0) {
+    data[len++] = (unsigned char) sep;
+  }
+  if (x) {
+    memcpy(data + len, x, 32);
+    memcpy(data + len + 32, h1, 32);
+    len += 64;
+  }
+
+  unsigned int out_len = 32;
+  HMAC(EVP_sha256(), key, 32, data, len, out, &out_len);
+}
+
+/**
+ * Sign a 32 byte digest with a nonce derived from the key and the digest
+ * as described in RFC 6979, so no randomness is needed and the same
+ * message always gets the same signature. S is normalized to the lower
+ * half of the curve order.
+ *
+ * Only reads `ec`, so it can run on a worker thread. Returns NULL on
+ * failure.
+ */
+static ECDSA_SIG *
+ecdsa_sign_rfc6979(EC_KEY *ec, const unsigned char *digest)
+{
+  const EC_GROUP *group = EC_KEY_get0_group(ec);
+  const BIGNUM *priv = EC_KEY_get0_private_key(ec);
+  if (group == NULL || priv == NULL) {
+    return NULL;
+  }
+
+  ECDSA_SIG *sig = NULL;
+  BN_CTX *ctx = BN_CTX_new();
+  EC_POINT *point = EC_POINT_new(group);
+  BIGNUM *order = BN_new(), *half = BN_new(), *e = BN_new();
+  BIGNUM *k = BN_new(), *r = BN_new(), *s = BN_new(), *x = BN_new();
+  unsigned char priv_bin[32], h1[32], K[32], V[32];
+
+  if (ctx == NULL || point == NULL || order == NULL || half == NULL ||
+      e == NULL || k == NULL || r == NULL || s == NULL || x == NULL ||
+      !EC_GROUP_get_order(group, order, ctx) ||
+      !BN_rshift1(half, order) ||
+      BN_num_bytes(priv) > 32 || BN_num_bytes(order) != 32) {
+    goto err;
+  }
+
+  // int2octets(priv) and bits2octets(digest)
+  memset(priv_bin, 0, 32);
+  BN_bn2bin(priv, priv_bin + 32 - BN_num_bytes(priv));
+  if (!BN_bin2bn(digest, 32, e) ||
+      (BN_cmp(e, order) >= 0 && !BN_sub(e, e, order))) {
+    goto err;
+  }
+  memset(h1, 0, 32);
+  BN_bn2bin(e, h1 + 32 - BN_num_bytes(e));
+
+  memset(V, 0x01, 32);
+  memset(K, 0x00, 32);
+  rfc6979_hmac(K, V, 0x00, priv_bin, h1, K);
+  rfc6979_hmac(K, V, -1, NULL, NULL, V);
+  rfc6979_hmac(K, V, 0x01, priv_bin, h1, K);
+  rfc6979_hmac(K, V, -1, NULL, NULL, V);
+
+  for (;;) {
+    rfc6979_hmac(K, V, -1, NULL, NULL, V);
+    if (!BN_bin2bn(V, 32, k)) {
+      goto err;
+    }
+
+    if (!BN_is_zero(k) && BN_cmp(k, order) < 0) {
+      // r = (k * G).x mod n
+      if (!EC_POINT_mul(group, point, k, NULL, NULL, ctx) ||
+          !EC_POINT_get_affine_coordinates_GFp(group, point, x, NULL, ctx) ||
+          !BN_nnmod(r, x, order, ctx)) {
+        goto err;
+      }
+
+      // s = k^-1 * (e + r * priv) mod n
+      if (!BN_is_zero(r)) {
+        if (!BN_mod_mul(s, r, priv, order, ctx) ||
+            !BN_mod_add(s, s, e, order, ctx) ||
+            !BN_mod_inverse(k, k, order, ctx) ||
+            !BN_mod_mul(s, s, k, order, ctx)) {
+          goto err;
+        }
+        if (!BN_is_zero(s)) {
+          break;
+        }
+      }
+    }
+
+    rfc6979_hmac(K, V, 0x00, NULL, NULL, K);
+    rfc6979_hmac(K, V, -1, NULL, NULL, V);
+  }
+
+  if (BN_cmp(s, half) > 0 && !BN_sub(s, order, s)) {
+    goto err;
+  }
+
+  sig = ECDSA_SIG_new();
+  if (sig != NULL) {
+    ECDSA_SIG_set0(sig, r, s);
+    r = s = NULL;
+  }
+
+ err:
+  OPENSSL_cleanse(priv_bin, sizeof(priv_bin));
+  OPENSSL_cleanse(K, sizeof(K));
+  OPENSSL_cleanse(V, sizeof(V));
+  if (point) EC_POINT_free(point);
+  if (ctx) BN_CTX_free(ctx);
+  BN_free(order);
+  BN_free(half);
+  BN_free(e);
+  BN_clear_free(k);
+  BN_free(r);
+  BN_free(s);
+  BN_free(x);
+
+  return sig;
+}
+
+/**
+ * DER encode a signature into a new Buffer. Returns NULL on failure.
+ */
+static Buffer *
+ecdsa_sig_to_buffer(ECDSA_SIG *sig)
+{
+  int der_size = i2d_ECDSA_SIG(sig, NULL);
+  if (der_size <= 0) {
+    return NULL;
+  }
+
+  Buffer *der_buf = Buffer::New(der_size);
+  unsigned char *der_end = (unsigned char *) Buffer::Data(der_buf);
+  if (i2d_ECDSA_SIG(sig, &der_end) != der_size) {
+    return NULL;
+  }
+  return der_buf;
+}
+
+/**
+ * Bounded LRU cache of decoded public keys.
+ *
+ * Decoding a pubkey (and especially decompressing a compressed one) costs
+ * about as much as the signature check itself. Busy addresses sign thousands
+ * of inputs per block, so we keep the decoded points around keyed by their
+ * serialized form. Entries hold an EC_POINT rather than a shared EC_KEY, so
+ * every caller still gets a private EC_KEY it can use without locking.
+ *
+ * Lookups happen both on the main thread and in eio workers, so all access
+ * goes through the mutex.
+ */
+class PubKeyCache
+{
+private:
+
+  struct entry_t {
+    string key;
+    EC_POINT *point;
+    point_conversion_form_t form;
+  };
+
+  typedef list<entry_t> entry_list_t;
+  typedef map<string, entry_list_t::iterator> entry_map_t;
+
+  pthread_mutex_t mutex;
+  const EC_GROUP *group;
+  EC_KEY *groupKey;
+
+  // Most recently used entries are at the front
+  entry_list_t entries;
+  entry_map_t index;
+
+  size_t capacity;
+
+  void Evict()
+  {
+    while (entries.size() > capacity) {
+      entry_t &last = entries.back();
+      index.erase(last.key);
+      EC_POINT_free(last.point);
+      entries.pop_back();
+    }
+  }
+
+public:
+
+  unsigned long hits;
+  unsigned long misses;
+
+  PubKeyCache(size_t capacity) :
+    capacity(capacity),
+    hits(0),
+    misses(0)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    groupKey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    group = EC_KEY_get0_group(groupKey);
+  }
+
+  ~PubKeyCache()
+  {
+    SetCapacity(0);
+    EC_KEY_free(groupKey);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  /**
+   * Set the public key of `ec` from its serialized form.
+   *
+   * Returns false if the data is not a valid public key, just like
+   * o2i_ECPublicKey.
+   */
+  bool Load(EC_KEY **ec, const unsigned char *data, size_t len)
+  {
+    string key((const char *) data, len);
+
+    pthread_mutex_lock(&mutex);
+    entry_map_t::iterator it = index.find(key);
+    if (it != index.end()) {
+      hits++;
+      entries.splice(entries.begin(), entries, it->second);
+      bool ok = EC_KEY_set_public_key(*ec, it->second->point);
+      EC_KEY_set_conv_form(*ec, it->second->form);
+      pthread_mutex_unlock(&mutex);
+      return ok;
+    }
+    misses++;
+    bool caching = capacity > 0;
+    pthread_mutex_unlock(&mutex);
+
+    // Decode outside the lock, this is the expensive part
+    const unsigned char *p = data;
+    if (!o2i_ECPublicKey(ec, &p, len)) {
+      return false;
+    }
+
+    if (!caching) {
+      return true;
+    }
+
+    EC_POINT *point = EC_POINT_dup(EC_KEY_get0_public_key(*ec), group);
+    if (point == NULL) {
+      return true;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (index.find(key) != index.end()) {
+      // Another thread beat us to it
+      pthread_mutex_unlock(&mutex);
+      EC_POINT_free(point);
+      return true;
+    }
+    entry_t entry;
+    entry.key = key;
+    entry.point = point;
+    entry.form = EC_KEY_get_conv_form(*ec);
+    entries.push_front(entry);
+    index[key] = entries.begin();
+    Evict();
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+  }
+
+  void SetCapacity(size_t newCapacity)
+  {
+    pthread_mutex_lock(&mutex);
+    capacity = newCapacity;
+    Evict();
+    pthread_mutex_unlock(&mutex);
+  }
+
+  Local<Object> GetStats()
+  {
+    HandleScope scope;
+    Local<Object> stats = Object::New();
+
+    pthread_mutex_lock(&mutex);
+    stats->Set(String::NewSymbol("hits"), Number::New(hits));
+    stats->Set(String::NewSymbol("misses"), Number::New(misses));
+    stats->Set(String::NewSymbol("size"), Integer::New(entries.size()));
+    stats->Set(String::NewSymbol("capacity"), Integer::New(capacity));
+    pthread_mutex_unlock(&mutex);
+
+    return scope.Close(stats);
+  }
+};
+
+static PubKeyCache *pubkey_cache_instance = NULL;
+static pthread_once_t pubkey_cache_once = PTHREAD_ONCE_INIT;
+
+static void
+pubkey_cache_create()
+{
+  pubkey_cache_instance = new PubKeyCache(PUBKEY_CACHE_SIZE);
+}
+
+/**
+ * The process wide pubkey cache. It is created on first use, from the main
+ * thread or a worker, so no EC_KEY is built during static initialization.
+ */
+static PubKeyCache &
+pubkey_cache()
+{
+  pthread_once(&pubkey_cache_once, pubkey_cache_create);
+  return *pubkey_cache_instance;
+}
+
+class BitcoinKey : ObjectWrap
+{
+private:
+
+  const char *lastError;
+  EC_KEY *ec;
+
+  bool hasPrivate;
+  bool hasPublic;
+
+  void Generate()
+  {
+    if (!EC_KEY_generate_key(ec)) {
+      lastError = "Error from EC_KEY_generate_key";
+      return;
+    }
+
+    hasPublic = true;
+    hasPrivate = true;
+  }
+
+  struct verify_sig_baton_t {
+    // Parameters
+    BitcoinKey *key;
+    const unsigned char *digest;
+    const unsigned char *sig;
+    int digestLen;
+    int sigLen;
+    Persistent<Object> digestBuf;
+    Persistent<Object> sigBuf;
+
+    // Result
+    // -1 = error, 0 = bad sig, 1 = good
+    int result;
+    Persistent<Function> cb;
+  };
+
+  int VerifySignature(const unsigned char *digest, int digest_len,
+                      const unsigned char *sig, int sig_len)
+  {
+    return ECDSA_verify(0, digest, digest_len, sig, sig_len, ec);
+  }
+
+  EIO_CALLBACK(EIO_VerifySignature)
+  {
+    verify_sig_baton_t *b = static_cast<verify_sig_baton_t *>(req->data);
+
+    b->result = b->key->VerifySignature(
+      b->digest, b->digestLen,
+      b->sig, b->sigLen
+    );
+
+    EIO_RETURN;
+  }
+
+  struct verify_batch_item_t {
+    // Offsets into the batch arena
+    unsigned int hash;
+    unsigned int pub;
+    unsigned int pubLen;
+    unsigned int sig;
+    unsigned int sigLen;
+  };
+
+  struct verify_batch_t {
+    // Parameters
+    //
+    // All pubkeys, hashes and signatures are copied into a single arena up
+    // front, so the worker threads never touch V8 memory and we don't have to
+    // hold a Persistent handle for every Buffer.
+    unsigned char *arena;
+    verify_batch_item_t *items;
+    unsigned int count;
+
+    // Result
+    // -1 = error, 0 = bad sig, 1 = good
+    signed char *results;
+
+    // Number of jobs that haven't reported back yet
+    int pending;
+    Persistent<Function> cb;
+  };
+
+  struct verify_batch_job_t {
+    verify_batch_t *batch;
+    unsigned int start;
+    unsigned int end;
+  };
+
+  EIO_CALLBACK(EIO_VerifyBatch)
+  {
+    verify_batch_job_t *job = static_cast<verify_batch_job_t *>(req->data);
+    verify_batch_t *b = job->batch;
+
+    // One EC_KEY per job, reused for each item
+    EC_KEY *ec = EC_KEY_new_by_curve_name(NID_secp256k1);
+
+    for (unsigned int i = job->start; i < job->end; i++) {
+      verify_batch_item_t *item = &b->items[i];
+
+      if (ec == NULL ||
+          !pubkey_cache().Load(&ec, b->arena + item->pub, item->pubLen)) {
+        b->results[i] = -1;
+        continue;
+      }
+
+      b->results[i] = ECDSA_verify(0, b->arena + item->hash, 32,
+                                   b->arena + item->sig, item->sigLen, ec);
+    }
+
+    if (ec != NULL) {
+      EC_KEY_free(ec);
+    }
+
+    EIO_RETURN;
+  }
+
+  ECDSA_SIG *Sign(const unsigned char *digest)
+  {
+    ECDSA_SIG *sig = ecdsa_sign_rfc6979(ec, digest);
+    if (sig == NULL) {
+      lastError = "Error while signing (invalid private key?)";
+    }
+
+    return sig;
+  }
+
+  struct sign_baton_t {
+    // Parameters
+    BitcoinKey *key;
+    unsigned char digest[32];
+
+    // Result
+    ECDSA_SIG *sig;
+    Persistent<Function> cb;
+  };
+
+  EIO_CALLBACK(EIO_Sign)
+  {
+    sign_baton_t *b = static_cast<sign_baton_t *>(req->data);
+
+    b->sig = ecdsa_sign_rfc6979(b->key->ec, b->digest);
+
+    EIO_RETURN;
+  }
+
+  struct sign_batch_t {
+    // Parameters
+    //
+    // 32 bytes of private key followed by the 32 byte hash for every item,
+    // copied up front like the verify batch arena.
+    unsigned char *arena;
+    unsigned int count;
+
+    // Result
+    ECDSA_SIG **sigs;
+
+    // Number of jobs that haven't reported back yet
+    int pending;
+    Persistent<Function> cb;
+  };
+
+  struct sign_batch_job_t {
+    sign_batch_t *batch;
+    unsigned int start;
+    unsigned int end;
+  };
+
+  EIO_CALLBACK(EIO_SignBatch)
+  {
+    sign_batch_job_t *job = static_cast<sign_batch_job_t *>(req->data);
+    sign_batch_t *b = job->batch;
+
+    // One EC_KEY per job, the private key is swapped for each item
+    EC_KEY *ec = EC_KEY_new_by_curve_name(NID_secp256k1);
+    BIGNUM *priv = BN_new();
+
+    for (unsigned int i = job->start; i < job->end; i++) {
+      unsigned char *item = b->arena + 64 * i;
+
+      if (ec == NULL || priv == NULL ||
+          !BN_bin2bn(item, 32, priv) ||
+          !EC_KEY_set_private_key(ec, priv)) {
+        continue;
+      }
+
+      b->sigs[i] = ecdsa_sign_rfc6979(ec, item + 32);
+    }
+
+    if (priv != NULL) {
+      BN_clear_free(priv);
+    }
+    if (ec != NULL) {
+      EC_KEY_free(ec);
+    }
+
+    EIO_RETURN;
+  }
+
+  struct generate_baton_t {
+    BitcoinKey *key;
+    Persistent<Function> cb;
+  };
+
+  EIO_CALLBACK(EIO_Generate)
+  {
+    generate_baton_t *b = static_cast<generate_baton_t *>(req->data);
+
+    b->key->Generate();
+
+    EIO_RETURN;
+  }
+
+public:
+
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("BitcoinKey"));
+
+    // Accessors
+    s_ct->InstanceTemplate()->SetAccessor(String::New("private"),
+                                          GetPrivate, SetPrivate);
+    s_ct->InstanceTemplate()->SetAccessor(String::New("public"),
+                                          GetPublic, SetPublic);
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "verifySignature", VerifySignature);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "verifySignatureSync", VerifySignatureSync);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "regenerateSync", RegenerateSync);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "toDER", ToDER);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "sign", Sign);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "signSync", SignSync);
+
+    // Static methods
+    NODE_SET_METHOD(s_ct->GetFunction(), "generate", Generate);
+    NODE_SET_METHOD(s_ct->GetFunction(), "generateSync", GenerateSync);
+    NODE_SET_METHOD(s_ct->GetFunction(), "fromDER", FromDER);
+    NODE_SET_METHOD(s_ct->GetFunction(), "verifyBatch", VerifyBatch);
+    NODE_SET_METHOD(s_ct->GetFunction(), "signBatch", SignBatch);
+
+    target->Set(String::NewSymbol("BitcoinKey"),
+                s_ct->GetFunction());
+  }
+
+  BitcoinKey() :
+    lastError(NULL),
+    hasPrivate(false),
+    hasPublic(false)
+  {
+    ec = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (ec == NULL) {
+      lastError = "Error from EC_KEY_new_by_curve_name";
+    }
+  }
+
+  ~BitcoinKey()
+  {
+    EC_KEY_free(ec);
+  }
+
+  static BitcoinKey*
+  New()
+  {
+    HandleScope scope;
+
+    Local<Object> k = s_ct->GetFunction()->NewInstance(0, NULL);
+    if (k.IsEmpty()) return NULL;
+
+    return ObjectWrap::Unwrap<BitcoinKey>(k);
+  }
+
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
+
+    HandleScope scope;
+    
+    BitcoinKey* key = new BitcoinKey();
+    if (key->lastError != NULL) {
+      return VException(key->lastError);
+    }
+
+    key->Wrap(args.Holder());
+
+    return scope.Close(args.This());
+  }
+
+  static Handle<Value>
+  GenerateSync(const Arguments& args)
+  {
+    HandleScope scope;
+
+    BitcoinKey* key = BitcoinKey::New();
+
+    key->Generate();
+
+    if (key->lastError != NULL) {
+      return VException(key->lastError);
+    }
+
+    return scope.Close(key->handle_);
+  }
+
+  /**
+   * Generate a key on the thread pool: BitcoinKey.generate(callback).
+   */
+  static Handle<Value>
+  Generate(const Arguments& args)
+  {
+    HandleScope scope;
+
+    REQ_FUN_ARG(0, cb);
+
+    BitcoinKey* key = BitcoinKey::New();
+    if (key == NULL) {
+      return VException("Could not create BitcoinKey");
+    }
+
+    generate_baton_t *baton = new generate_baton_t();
+    baton->key = key;
+    baton->cb = Persistent<Function>::New(cb);
+
+    key->Ref();
+
+    eio_custom(EIO_Generate, EIO_PRI_DEFAULT, GenerateCallback, baton);
+    ev_ref(EV_DEFAULT_UC);
+
+    return scope.Close(Undefined());
+  }
+
+  static int
+  GenerateCallback(eio_req *req)
+  {
+    HandleScope scope;
+    generate_baton_t *baton = static_cast<generate_baton_t *>(req->data);
+    ev_unref(EV_DEFAULT_UC);
+    baton->key->Unref();
+
+    Local<Value> argv[2];
+
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(Null());
+    if (baton->key->lastError != NULL) {
+      argv[0] = Exception::Error(String::New(baton->key->lastError));
+    } else {
+      argv[1] = Local<Value>::New(baton->key->handle_);
+    }
+
+    TryCatch try_catch;
+
+    baton->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    baton->cb.Dispose();
+
+    delete baton;
+    return 0;
+  }
+
+  static Handle<Value>
+  GetPrivate(Local<String> property, const AccessorInfo& info)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
+
+    if (!key->hasPrivate) {
+      return scope.Close(Null());
+    }
+
+    const BIGNUM *bn = EC_KEY_get0_private_key(key->ec);
+    if (bn == NULL) {
+      return VException("Error from EC_KEY_get0_private_key(pkey)");
+    }
+
+    int priv_size = BN_num_bytes(bn);
+    if (priv_size > 32) {
+      return VException("Secret too large (Incorrect curve parameters?)");
+    }
+
+    Buffer *priv_buf = Buffer::New(32);
+    unsigned char *priv = (unsigned char *) Buffer::Data(priv_buf);
+    memset(priv, 0, 32 - priv_size);
+
+    if (BN_bn2bin(bn, &priv[32 - priv_size]) != priv_size) {
+      return VException("Error from BN_bn2bin(bn, &priv[32 - priv_size])");
+    }
+
+    return scope.Close(priv_buf->handle_);
+  }
+
+  static void
+  SetPrivate(Local<String> property, Local<Value> value, const AccessorInfo& info)
+  {
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
+    Handle<Object> buffer = value->ToObject();
+    const unsigned char *data = (const unsigned char*) Buffer::Data(buffer);
+
+    BIGNUM *bn = BN_bin2bn(data,Buffer::Length(buffer),BN_new());
+    EC_KEY_set_private_key(key->ec, bn);
+    BN_clear_free(bn);
+
+    key->hasPrivate = true;
+  }
+
+  static Handle<Value>
+  GetPublic(Local<String> property, const AccessorInfo& info)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
+
+    if (!key->hasPublic) {
+      return scope.Close(Null());
+    }
+
+    // Export public
+    unsigned int pub_size = i2o_ECPublicKey(key->ec, NULL);
+    if (!pub_size) {
+      return VException("Error from i2o_ECPublicKey(key->ec, NULL)");
+    }
+
+    Buffer *pub_buf = Buffer::New(pub_size);
+    unsigned char *pub_end = (unsigned char *) Buffer::Data(pub_buf);
+
+    if (i2o_ECPublicKey(key->ec, &pub_end) != pub_size) {
+      return VException("Error from i2o_ECPublicKey(key->ec, &pub)");
+    }
+
+    return scope.Close(pub_buf->handle_);
+  }
+
+  static void
+  SetPublic(Local<String> property, Local<Value> value, const AccessorInfo& info)
+  {
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
+    Handle<Object> buffer = value->ToObject();
     const unsigned char *data = (const unsigned char*) Buffer::Data(buffer);
 
-    BIGNUM *bn = BN_bin2bn(data,Buffer::Length(buffer),BN_new());
-    EC_KEY_set_private_key(key->ec, bn);
-    BN_clear_free(bn);
+    if (!pubkey_cache().Load(&(key->ec), data, Buffer::Length(buffer))) {
+      // TODO: Error
+      return;
+    }
+
+    key->hasPublic = true;
+  }
+
+  static Handle<Value>
+  RegenerateSync(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+
+    if (!key->hasPrivate) {
+      return VException("Regeneration requires a private key.");
+    }
+
+    EC_KEY *old = key->ec;
+
+    key->ec = EC_KEY_new_by_curve_name(NID_secp256k1);
+    EC_KEY_regenerate_key(key->ec, EC_KEY_get0_private_key(old));
+
+    EC_KEY_free(old);
+
+    return scope.Close(Undefined());
+  }
+
+  static Handle<Value>
+  ToDER(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+
+    if (!key->hasPrivate || !key->hasPublic) {
+      return scope.Close(Null());
+    }
+
+    // Export DER
+    unsigned int der_size = i2d_ECPrivateKey(key->ec, NULL);
+    if (!der_size) {
+      return VException("Error from i2d_ECPrivateKey(key->ec, NULL)");
+    }
+
+    Buffer *der_buf = Buffer::New(der_size);
+    unsigned char *der_end = (unsigned char *) Buffer::Data(der_buf);
+
+    if (i2d_ECPrivateKey(key->ec, &der_end) != der_size) {
+      return VException("Error from i2d_ECPrivateKey(key->ec, &der_end)");
+    }
+
+    return scope.Close(der_buf->handle_);
+  }
+
+  static Handle<Value>
+  FromDER(const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() != 1) {
+      return VException("One argument expected: der");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'der' must be of type Buffer");
+    }
+
+    BitcoinKey* key = new BitcoinKey();
+    if (key->lastError != NULL) {
+      return VException(key->lastError);
+    }
+
+    Handle<Object> der_buf = args[0]->ToObject();
+    const unsigned char *data = (const unsigned char*) Buffer::Data(der_buf);
+
+    if (!d2i_ECPrivateKey(&(key->ec), &data, Buffer::Length(der_buf))) {
+      return VException("Error from d2i_ECPrivateKey(&key, &data, len)");
+    }
+    
+    key->hasPrivate = true;
+    key->hasPublic = true;
+
+    Handle<Function> cons = s_ct->GetFunction();
+    Handle<Value> external = External::New(key);
+    Handle<Value> result = cons->NewInstance(1, &external);
+
+    return scope.Close(result);
+  }
+
+  static Handle<Value>
+  VerifySignature(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+  
+    if (args.Length() != 3) {
+      return VException("Three arguments expected: hash, sig, callback");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'hash' must be of type Buffer");
+    }
+    if (!Buffer::HasInstance(args[1])) {
+      return VException("Argument 'sig' must be of type Buffer");
+    }
+    REQ_FUN_ARG(2, cb);
+    if (!key->hasPublic) {
+      return VException("BitcoinKey does not have a public key set");
+    }
+
+    Handle<Object> hash_buf = args[0]->ToObject();
+    Handle<Object> sig_buf = args[1]->ToObject();
+
+    if (Buffer::Length(hash_buf) != 32) {
+      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+    }
+
+    verify_sig_baton_t *baton = new verify_sig_baton_t();
+    baton->key = key;
+    baton->digest = (unsigned char *)Buffer::Data(hash_buf);
+    baton->digestLen = Buffer::Length(hash_buf);
+    baton->digestBuf = Persistent<Object>::New(hash_buf);
+    baton->sig = (unsigned char *)Buffer::Data(sig_buf);
+    baton->sigLen = Buffer::Length(sig_buf);
+    baton->sigBuf = Persistent<Object>::New(sig_buf);
+    baton->result = -1;
+    baton->cb = Persistent<Function>::New(cb);
+
+    key->Ref();
+
+    eio_custom(EIO_VerifySignature, EIO_PRI_DEFAULT, VerifySignatureCallback, baton);
+    ev_ref(EV_DEFAULT_UC);
+
+    return scope.Close(Undefined());
+  }
+
+  static int
+  VerifySignatureCallback(eio_req *req)
+  {
+    HandleScope scope;
+    verify_sig_baton_t *baton = static_cast<verify_sig_baton_t *>(req->data);
+    ev_unref(EV_DEFAULT_UC);
+    baton->key->Unref();
+    baton->digestBuf.Dispose();
+    baton->sigBuf.Dispose();
+
+    Local<Value> argv[2];
+
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(Null());
+    if (baton->result == -1) {
+      argv[0] = Exception::TypeError(String::New("Error during ECDSA_verify"));
+    } else if (baton->result == 0) {
+      // Signature invalid
+      argv[1] = Local<Value>::New(Boolean::New(false));
+    } else if (baton->result == 1) {
+      // Signature valid
+      argv[1] = Local<Value>::New(Boolean::New(true));
+    } else {
+      argv[0] = Exception::TypeError(
+        String::New("ECDSA_verify gave undefined return value"));
+    }
+
+    TryCatch try_catch;
+
+    baton->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    baton->cb.Dispose();
+
+    delete baton;
+    return 0;
+  }
+
+  /**
+   * Verify many signatures in one trip to the thread pool.
+   *
+   * Takes an array of {pubkey, hash, sig} objects and calls back with an
+   * array of booleans in the same order. The batch is split into one job per
+   * CPU, so a whole block's worth of signatures can be checked in parallel
+   * without paying for a baton and a BitcoinKey per signature.
+   *
+   * Like ScriptInterpreter's checkSig, a malformed pubkey or signature counts
+   * as an invalid signature rather than an error.
+   */
+  static Handle<Value>
+  VerifyBatch(const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() != 2) {
+      return VException("Two arguments expected: items, callback");
+    }
+    if (!args[0]->IsArray()) {
+      return VException("Argument 'items' must be an Array");
+    }
+    REQ_FUN_ARG(1, cb);
+
+    Local<Array> items = Local<Array>::Cast(args[0]);
+    unsigned int count = items->Length();
+
+    Local<String> pubkey_sym = String::NewSymbol("pubkey");
+    Local<String> hash_sym = String::NewSymbol("hash");
+    Local<String> sig_sym = String::NewSymbol("sig");
+
+    // First pass: validate and measure
+    size_t arena_size = 0;
+    for (unsigned int i = 0; i < count; i++) {
+      if (!items->Get(i)->IsObject()) {
+        return VException("Batch items must be objects");
+      }
+      Local<Object> item = items->Get(i)->ToObject();
+      Local<Value> pub = item->Get(pubkey_sym);
+      Local<Value> hash = item->Get(hash_sym);
+      Local<Value> sig = item->Get(sig_sym);
+
+      if (!Buffer::HasInstance(pub) ||
+          !Buffer::HasInstance(hash) ||
+          !Buffer::HasInstance(sig)) {
+        return VException("Batch items need Buffer properties 'pubkey', 'hash' and 'sig'");
+      }
+      if (Buffer::Length(hash->ToObject()) != 32) {
+        return VException("Property 'hash' must be Buffer of length 32 bytes");
+      }
+
+      arena_size += 32 +
+        Buffer::Length(pub->ToObject()) +
+        Buffer::Length(sig->ToObject());
+    }
+
+    verify_batch_t *batch = new verify_batch_t();
+    batch->count = count;
+    batch->arena = (unsigned char *)malloc(arena_size ? arena_size : 1);
+    batch->items = new verify_batch_item_t[count ? count : 1];
+    batch->results = new signed char[count ? count : 1];
+    batch->cb = Persistent<Function>::New(cb);
+
+    // Second pass: copy everything into the arena
+    unsigned int pos = 0;
+    for (unsigned int i = 0; i < count; i++) {
+      Local<Object> item = items->Get(i)->ToObject();
+      Local<Object> pub_buf = item->Get(pubkey_sym)->ToObject();
+      Local<Object> hash_buf = item->Get(hash_sym)->ToObject();
+      Local<Object> sig_buf = item->Get(sig_sym)->ToObject();
+
+      verify_batch_item_t *entry = &batch->items[i];
+
+      entry->hash = pos;
+      memcpy(batch->arena + pos, Buffer::Data(hash_buf), 32);
+      pos += 32;
+
+      entry->pub = pos;
+      entry->pubLen = Buffer::Length(pub_buf);
+      memcpy(batch->arena + pos, Buffer::Data(pub_buf), entry->pubLen);
+      pos += entry->pubLen;
+
+      entry->sig = pos;
+      entry->sigLen = Buffer::Length(sig_buf);
+      memcpy(batch->arena + pos, Buffer::Data(sig_buf), entry->sigLen);
+      pos += entry->sigLen;
+
+      batch->results[i] = -1;
+    }
+
+    // Split into one job per CPU, but don't bother spreading tiny batches
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int jobs = cpus > 0 ? (unsigned int) cpus : 1;
+    if (jobs > (count + VERIFY_BATCH_MIN_JOB - 1) / VERIFY_BATCH_MIN_JOB) {
+      jobs = (count + VERIFY_BATCH_MIN_JOB - 1) / VERIFY_BATCH_MIN_JOB;
+    }
+    if (jobs < 1) {
+      jobs = 1;
+    }
+
+    batch->pending = jobs;
+
+    unsigned int per_job = count / jobs;
+    unsigned int extra = count % jobs;
+    unsigned int start = 0;
+    for (unsigned int j = 0; j < jobs; j++) {
+      verify_batch_job_t *job = new verify_batch_job_t();
+      job->batch = batch;
+      job->start = start;
+      job->end = start + per_job + (j < extra ? 1 : 0);
+      start = job->end;
+
+      eio_custom(EIO_VerifyBatch, EIO_PRI_DEFAULT, VerifyBatchCallback, job);
+      ev_ref(EV_DEFAULT_UC);
+    }
+
+    return scope.Close(Undefined());
+  }
+
+  static int
+  VerifyBatchCallback(eio_req *req)
+  {
+    HandleScope scope;
+    verify_batch_job_t *job = static_cast<verify_batch_job_t *>(req->data);
+    verify_batch_t *batch = job->batch;
+    ev_unref(EV_DEFAULT_UC);
+
+    delete job;
+
+    // After-callbacks run on the main thread, so no locking needed here
+    if (--batch->pending > 0) {
+      return 0;
+    }
+
+    Local<Array> results = Array::New(batch->count);
+    for (unsigned int i = 0; i < batch->count; i++) {
+      results->Set(i, Boolean::New(batch->results[i] == 1));
+    }
+
+    Local<Value> argv[2];
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = results;
+
+    TryCatch try_catch;
+
+    batch->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    batch->cb.Dispose();
+
+    free(batch->arena);
+    delete [] batch->items;
+    delete [] batch->results;
+    delete batch;
+    return 0;
+  }
+
+  static Handle<Value>
+  VerifySignatureSync(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+  
+    if (args.Length() != 2) {
+      return VException("Two arguments expected: hash, sig");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'hash' must be of type Buffer");
+    }
+    if (!Buffer::HasInstance(args[1])) {
+      return VException("Argument 'sig' must be of type Buffer");
+    }
+    if (!key->hasPublic) {
+      return VException("BitcoinKey does not have a public key set");
+    }
+
+    Handle<Object> hash_buf = args[0]->ToObject();
+    Handle<Object> sig_buf = args[1]->ToObject();
+
+    const unsigned char *hash_data = (unsigned char *) Buffer::Data(hash_buf);
+    const unsigned char *sig_data = (unsigned char *) Buffer::Data(sig_buf);
+
+    unsigned int hash_len = Buffer::Length(hash_buf);
+    unsigned int sig_len = Buffer::Length(sig_buf);
+
+    if (hash_len != 32) {
+      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+    }
+
+    // Verify signature
+    int result = key->VerifySignature(hash_data, hash_len, sig_data, sig_len);
+
+    if (result == -1) {
+      return VException("Error during ECDSA_verify");
+    } else if (result == 0) {
+      // Signature invalid
+      return scope.Close(Boolean::New(false));
+    } else if (result == 1) {
+      // Signature valid
+      return scope.Close(Boolean::New(true));
+    } else {
+      return VException("ECDSA_verify gave undefined return value");
+    }
+  }
+
+  static Handle<Value>
+  SignSync(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+  
+    if (args.Length() != 1) {
+      return VException("One argument expected: hash");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'hash' must be of type Buffer");
+    }
+    if (!key->hasPrivate) {
+      return VException("BitcoinKey does not have a private key set");
+    }
+
+    Handle<Object> hash_buf = args[0]->ToObject();
+
+    const unsigned char *hash_data = (unsigned char *) Buffer::Data(hash_buf);
+
+    unsigned int hash_len = Buffer::Length(hash_buf);
+
+    if (hash_len != 32) {
+      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+    }
+
+    // Create signature
+    ECDSA_SIG *sig = key->Sign(hash_data);
+    if (sig == NULL) {
+      return VException(key->lastError);
+    }
+
+    // Export DER
+    Buffer *der_buf = ecdsa_sig_to_buffer(sig);
+    ECDSA_SIG_free(sig);
+    if (der_buf == NULL) {
+      return VException("Error from i2d_ECDSA_SIG(sig, &der_end)");
+    }
+
+    return scope.Close(der_buf->handle_);
+  }
+
+  /**
+   * Sign a hash on the thread pool: key.sign(hash, callback).
+   *
+   * Calls back with the DER encoded signature, which is the same one
+   * signSync would return.
+   */
+  static Handle<Value>
+  Sign(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+
+    if (args.Length() != 2) {
+      return VException("Two arguments expected: hash, callback");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'hash' must be of type Buffer");
+    }
+    REQ_FUN_ARG(1, cb);
+    if (!key->hasPrivate) {
+      return VException("BitcoinKey does not have a private key set");
+    }
+
+    Handle<Object> hash_buf = args[0]->ToObject();
+    if (Buffer::Length(hash_buf) != 32) {
+      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+    }
+
+    sign_baton_t *baton = new sign_baton_t();
+    baton->key = key;
+    memcpy(baton->digest, Buffer::Data(hash_buf), 32);
+    baton->sig = NULL;
+    baton->cb = Persistent<Function>::New(cb);
+
+    key->Ref();
+
+    eio_custom(EIO_Sign, EIO_PRI_DEFAULT, SignCallback, baton);
+    ev_ref(EV_DEFAULT_UC);
+
+    return scope.Close(Undefined());
+  }
+
+  static int
+  SignCallback(eio_req *req)
+  {
+    HandleScope scope;
+    sign_baton_t *baton = static_cast<sign_baton_t *>(req->data);
+    ev_unref(EV_DEFAULT_UC);
+    baton->key->Unref();
+
+    Local<Value> argv[2];
+
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(Null());
+    if (baton->sig == NULL) {
+      argv[0] = Exception::Error(
+        String::New("Error while signing (invalid private key?)"));
+    } else {
+      Buffer *der_buf = ecdsa_sig_to_buffer(baton->sig);
+      ECDSA_SIG_free(baton->sig);
+      if (der_buf == NULL) {
+        argv[0] = Exception::Error(
+          String::New("Error from i2d_ECDSA_SIG(sig, &der_end)"));
+      } else {
+        argv[1] = Local<Value>::New(der_buf->handle_);
+      }
+    }
+
+    TryCatch try_catch;
+
+    baton->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    baton->cb.Dispose();
+
+    delete baton;
+    return 0;
+  }
+
+  /**
+   * Sign many hashes in one trip to the thread pool.
+   *
+   * Takes an array of {priv, hash} objects, both 32 byte Buffers, and calls
+   * back with an array of DER encoded signatures in the same order. Like
+   * verifyBatch the work is split into one job per CPU. If any item can't
+   * be signed the callback gets an error naming the first one.
+   */
+  static Handle<Value>
+  SignBatch(const Arguments& args)
+  {
+    HandleScope scope;
+
+    if (args.Length() != 2) {
+      return VException("Two arguments expected: items, callback");
+    }
+    if (!args[0]->IsArray()) {
+      return VException("Argument 'items' must be an Array");
+    }
+    REQ_FUN_ARG(1, cb);
+
+    Local<Array> items = Local<Array>::Cast(args[0]);
+    unsigned int count = items->Length();
+
+    Local<String> priv_sym = String::NewSymbol("priv");
+    Local<String> hash_sym = String::NewSymbol("hash");
+
+    sign_batch_t *batch = new sign_batch_t();
+    batch->count = count;
+    batch->arena = (unsigned char *)malloc(count ? 64 * count : 1);
+    batch->sigs = new ECDSA_SIG *[count ? count : 1];
+
+    for (unsigned int i = 0; i < count; i++) {
+      batch->sigs[i] = NULL;
+
+      Local<Value> priv, hash;
+      if (items->Get(i)->IsObject()) {
+        Local<Object> item = items->Get(i)->ToObject();
+        priv = item->Get(priv_sym);
+        hash = item->Get(hash_sym);
+      }
+
+      if (priv.IsEmpty() ||
+          !Buffer::HasInstance(priv) ||
+          !Buffer::HasInstance(hash) ||
+          Buffer::Length(priv->ToObject()) != 32 ||
+          Buffer::Length(hash->ToObject()) != 32) {
+        OPENSSL_cleanse(batch->arena, 64 * i);
+        free(batch->arena);
+        delete [] batch->sigs;
+        delete batch;
+        return VException("Batch items need 32 byte Buffer properties "
+                          "'priv' and 'hash'");
+      }
+
+      memcpy(batch->arena + 64 * i, Buffer::Data(priv->ToObject()), 32);
+      memcpy(batch->arena + 64 * i + 32, Buffer::Data(hash->ToObject()), 32);
+    }
+
+    batch->cb = Persistent<Function>::New(cb);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int jobs = cpus > 0 ? (unsigned int) cpus : 1;
+    if (jobs > (count + SIGN_BATCH_MIN_JOB - 1) / SIGN_BATCH_MIN_JOB) {
+      jobs = (count + SIGN_BATCH_MIN_JOB - 1) / SIGN_BATCH_MIN_JOB;
+    }
+    if (jobs < 1) {
+      jobs = 1;
+    }
+
+    batch->pending = jobs;
+
+    unsigned int per_job = count / jobs;
+    unsigned int extra = count % jobs;
+    unsigned int start = 0;
+    for (unsigned int j = 0; j < jobs; j++) {
+      sign_batch_job_t *job = new sign_batch_job_t();
+      job->batch = batch;
+      job->start = start;
+      job->end = start + per_job + (j < extra ? 1 : 0);
+      start = job->end;
+
+      eio_custom(EIO_SignBatch, EIO_PRI_DEFAULT, SignBatchCallback, job);
+      ev_ref(EV_DEFAULT_UC);
+    }
+
+    return scope.Close(Undefined());
+  }
+
+  static int
+  SignBatchCallback(eio_req *req)
+  {
+    HandleScope scope;
+    sign_batch_job_t *job = static_cast<sign_batch_job_t *>(req->data);
+    sign_batch_t *batch = job->batch;
+    ev_unref(EV_DEFAULT_UC);
+
+    delete job;
+
+    if (--batch->pending > 0) {
+      return 0;
+    }
+
+    Local<Value> argv[2];
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(Null());
+
+    Local<Array> results = Array::New(batch->count);
+    for (unsigned int i = 0; i < batch->count; i++) {
+      Buffer *der_buf = NULL;
+      if (batch->sigs[i] != NULL) {
+        der_buf = ecdsa_sig_to_buffer(batch->sigs[i]);
+        ECDSA_SIG_free(batch->sigs[i]);
+      }
+
+      if (der_buf != NULL) {
+        results->Set(i, der_buf->handle_);
+      } else if (argv[0]->IsNull()) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Could not sign batch item %u", i);
+        argv[0] = Exception::Error(String::New(msg));
+      }
+    }
+    if (argv[0]->IsNull()) {
+      argv[1] = results;
+    }
+
+    TryCatch try_catch;
+
+    batch->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    batch->cb.Dispose();
+
+    OPENSSL_cleanse(batch->arena, 64 * batch->count);
+    free(batch->arena);
+    delete [] batch->sigs;
+    delete batch;
+    return 0;
+  }
+};
+
+Persistent<FunctionTemplate> BitcoinKey::s_ct;
+
+
+#define SIGHASH_ALL 1
+#define SIGHASH_NONE 2
+#define SIGHASH_SINGLE 3
+#define SIGHASH_ANYONECANPAY 0x80
+
+#define OP_0 0x00
+#define OP_PUSHDATA1 0x4c
+#define OP_PUSHDATA2 0x4d
+#define OP_PUSHDATA4 0x4e
+#define OP_1 0x51
+#define OP_16 0x60
+#define OP_DUP 0x76
+#define OP_EQUALVERIFY 0x88
+#define OP_HASH160 0xa9
+#define OP_CHECKSIG 0xac
+#define OP_CHECKMULTISIG 0xae
+
+// Limits enforced by the script interpreter
+#define MAX_SCRIPT_SIZE 10000
+#define MAX_PUSH_SIZE 520
+
+struct script_push_t {
+  const unsigned char *data;
+  size_t len;
+};
+
+/**
+ * Split a script that consists only of data pushes into its pushes.
+ *
+ * Returns false if the script contains any other opcode, a truncated push or
+ * a push the interpreter would reject.
+ */
+static bool
+parse_push_only(const unsigned char *script, size_t len,
+                vector<script_push_t> *pushes)
+{
+  const unsigned char *p = script;
+  const unsigned char *end = script + len;
+
+  while (p < end) {
+    unsigned char op = *p++;
+    size_t size;
+
+    if (op < OP_PUSHDATA1) {
+      size = op;
+    } else if (op == OP_PUSHDATA1) {
+      if (end - p < 1) return false;
+      size = p[0];
+      p += 1;
+    } else if (op == OP_PUSHDATA2) {
+      if (end - p < 2) return false;
+      size = p[0] | (p[1] << 8);
+      p += 2;
+    } else if (op == OP_PUSHDATA4) {
+      if (end - p < 4) return false;
+      size = read_le32(p);
+      p += 4;
+    } else {
+      return false;
+    }
+
+    if (size > MAX_PUSH_SIZE || (size_t) (end - p) < size) return false;
+
+    script_push_t push;
+    push.data = p;
+    push.len = size;
+    pushes->push_back(push);
+    p += size;
+  }
+
+  return true;
+}
+
+/**
+ * Signature hashing for one transaction.
+ *
+ * The legacy signature hash re-serializes the whole transaction for every
+ * input, with all input scripts but the one being signed blanked out. Doing
+ * that from JavaScript is quadratic in the number of inputs both in
+ * serialization and in hashing.
+ *
+ * This class parses the raw transaction once and precomputes the blanked
+ * inputs. It keeps a running SHA-256 midstate over the version and the blanked
+ * inputs before the current one, so hashing the inputs of a transaction in
+ * order only hashes each shared prefix once.
+ */
+class SighashEngine : ObjectWrap
+{
+private:
+
+  struct input_t {
+    size_t outpoint;
+    size_t script;
+    size_t scriptLen;
+    size_t sequence;
+  };
+
+  struct output_t {
+    size_t start;
+    size_t end;
+  };
+
+  struct cursor_t {
+    sha256_stream_t stream;
+    size_t pos;
+    bool valid;
+  };
+
+  // Raw transaction
+  vector<unsigned char> tx;
+
+  vector<input_t> ins;
+  vector<output_t> outs;
+
+  // The outputs section including its count
+  size_t outsStart;
+  size_t outsEnd;
+
+  size_t lockTime;
+
+  // Version and input count
+  unsigned char header[13];
+  size_t headerLen;
+
+  // Every input serialized with an empty script, once with its sequence
+  // intact and once with a zero sequence (for SIGHASH_NONE and SINGLE)
+  vector<unsigned char> blanked[2];
+
+  // Running midstates over header + blanked[k][0..pos)
+  cursor_t cursors[2];
+
+  struct standard_sig_t {
+    unsigned int sig;
+    unsigned int sigLen;
+    unsigned char hash[32];
+    // False for signatures that fail before ECDSA, e.g. empty ones
+    bool valid;
+  };
+
+  struct standard_key_t {
+    unsigned int pub;
+    unsigned int pubLen;
+  };
+
+  struct standard_verify_t {
+    // Parameters
+    //
+    // Signatures and keys are in the order the interpreter pops them off the
+    // stack, their bytes live in the arena.
+    vector<unsigned char> arena;
+    vector<standard_sig_t> sigs;
+    vector<standard_key_t> keys;
+    const char *error;
+
+    // Result
+    bool result;
+    Persistent<Function> cb;
+  };
+
+  const char *Parse()
+  {
+    const unsigned char *begin = &tx[0];
+    const unsigned char *end = begin + tx.size();
+    const unsigned char *p = begin;
+    uint64_t count, len;
+
+    if (!skip_bytes(&p, end, 4)) return "Transaction too short";
+
+    if (!read_varint(&p, end, &count)) return "Truncated input count";
+    if (count > tx.size() / 41) return "Input count too large";
+    ins.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      ins[i].outpoint = p - begin;
+      if (!skip_bytes(&p, end, 36)) return "Truncated outpoint";
+      if (!read_varint(&p, end, &len)) return "Truncated script length";
+      ins[i].script = p - begin;
+      ins[i].scriptLen = len;
+      if (!skip_bytes(&p, end, len)) return "Truncated input script";
+      ins[i].sequence = p - begin;
+      if (!skip_bytes(&p, end, 4)) return "Truncated sequence";
+    }
+
+    outsStart = p - begin;
+    if (!read_varint(&p, end, &count)) return "Truncated output count";
+    if (count > tx.size() / 9) return "Output count too large";
+    outs.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      outs[i].start = p - begin;
+      if (!skip_bytes(&p, end, 8)) return "Truncated output value";
+      if (!read_varint(&p, end, &len)) return "Truncated script length";
+      if (!skip_bytes(&p, end, len)) return "Truncated output script";
+      outs[i].end = p - begin;
+    }
+    outsEnd = p - begin;
+
+    lockTime = p - begin;
+    if (!skip_bytes(&p, end, 4)) return "Truncated lock time";
+    if (p != end) return "Trailing data after transaction";
+
+    return NULL;
+  }
+
+  void Precompute()
+  {
+    memcpy(header, &tx[0], 4);
+    headerLen = 4 + write_varint(header + 4, ins.size());
+
+    for (int k = 0; k < 2; k++) {
+      blanked[k].resize(41 * ins.size() + 1);
+      for (size_t i = 0; i < ins.size(); i++) {
+        unsigned char *b = &blanked[k][41 * i];
+        memcpy(b, &tx[ins[i].outpoint], 36);
+        b[36] = 0;
+        if (k) {
+          memset(b + 37, 0, 4);
+        } else {
+          memcpy(b + 37, &tx[ins[i].sequence], 4);
+        }
+      }
+      cursors[k].valid = false;
+    }
+  }
+
+  /**
+   * Get a hasher that has consumed the header and the first `n` blanked
+   * inputs.
+   */
+  void Prefix(int k, size_t n, sha256_stream_t *out)
+  {
+    cursor_t *c = &cursors[k];
+    if (!c->valid || c->pos > n) {
+      sha256_stream_init(&c->stream);
+      sha256_stream_update(&c->stream, header, headerLen);
+      c->pos = 0;
+      c->valid = true;
+    }
+    if (n > c->pos) {
+      sha256_stream_update(&c->stream, &blanked[k][41 * c->pos],
+                           41 * (n - c->pos));
+      c->pos = n;
+    }
+    *out = c->stream;
+  }
+
+public:
+
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("SighashEngine"));
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "hash", Hash);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "verifyStandard", VerifyStandard);
+
+    target->Set(String::NewSymbol("SighashEngine"),
+                s_ct->GetFunction());
+  }
+
+  /**
+   * Calculate the signature hash for input `n`.
+   *
+   * Returns an error message or NULL on success.
+   */
+  const char *Hash(size_t n, const unsigned char *script, size_t scriptLen,
+                   uint32_t hashType, unsigned char *out)
+  {
+    if (n >= ins.size()) {
+      return "Input index out of bounds";
+    }
+
+    int mode = hashType & 0x1f;
+    bool anyoneCanPay = hashType & SIGHASH_ANYONECANPAY;
+
+    // Like the reference client, SIGHASH_SINGLE without a matching output
+    // signs the number one instead of failing
+    if (mode == SIGHASH_SINGLE && n >= outs.size()) {
+      memset(out, 0, 32);
+      out[0] = 1;
+      return NULL;
+    }
+
+    sha256_stream_t s;
+    unsigned char tmp[9];
+    const input_t &in = ins[n];
+
+    // Inputs
+    int k = (mode == SIGHASH_NONE || mode == SIGHASH_SINGLE) ? 1 : 0;
+    if (anyoneCanPay) {
+      sha256_stream_init(&s);
+      sha256_stream_update(&s, header, 4);
+      tmp[0] = 1;
+      sha256_stream_update(&s, tmp, 1);
+    } else {
+      Prefix(k, n, &s);
+    }
+
+    sha256_stream_update(&s, &tx[in.outpoint], 36);
+    sha256_stream_update(&s, tmp, write_varint(tmp, scriptLen));
+    sha256_stream_update(&s, script, scriptLen);
+    sha256_stream_update(&s, &tx[in.sequence], 4);
+
+    if (!anyoneCanPay) {
+      sha256_stream_update(&s, &blanked[k][41 * (n + 1)],
+                           41 * (ins.size() - n - 1));
+    }
+
+    // Outputs
+    if (mode == SIGHASH_NONE) {
+      tmp[0] = 0;
+      sha256_stream_update(&s, tmp, 1);
+    } else if (mode == SIGHASH_SINGLE) {
+      sha256_stream_update(&s, tmp, write_varint(tmp, n + 1));
+
+      // All outputs before ours are replaced by value -1 and an empty script
+      memset(tmp, 0xff, 8);
+      tmp[8] = 0;
+      for (size_t i = 0; i < n; i++) {
+        sha256_stream_update(&s, tmp, 9);
+      }
+      sha256_stream_update(&s, &tx[outs[n].start],
+                           outs[n].end - outs[n].start);
+    } else {
+      sha256_stream_update(&s, &tx[outsStart], outsEnd - outsStart);
+    }
+
+    sha256_stream_update(&s, &tx[lockTime], 4);
+
+    write_le32(tmp, hashType);
+    sha256_stream_update(&s, tmp, 4);
+
+    sha256_stream_final_double(&s, out);
+
+    return NULL;
+  }
+
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
+
+    HandleScope scope;
+
+    if (args.Length() != 1) {
+      return VException("One argument expected: tx Buffer");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'tx' must be of type Buffer");
+    }
+
+    Handle<Object> tx_buf = args[0]->ToObject();
+    const unsigned char *data = (const unsigned char *) Buffer::Data(tx_buf);
+    size_t len = Buffer::Length(tx_buf);
+
+    SighashEngine *engine = new SighashEngine();
+    engine->tx.assign(data, data + len);
+
+    const char *err = len ? engine->Parse() : "Transaction too short";
+    if (err != NULL) {
+      delete engine;
+      return VException(err);
+    }
+    engine->Precompute();
+
+    engine->Wrap(args.Holder());
+
+    return scope.Close(args.This());
+  }
+
+  static Handle<Value>
+  Hash(const Arguments& args)
+  {
+    HandleScope scope;
+    SighashEngine *engine = ObjectWrap::Unwrap<SighashEngine>(args.This());
+
+    if (args.Length() != 3) {
+      return VException("Three arguments expected: inIndex, script, hashType");
+    }
+    if (!args[0]->IsNumber()) {
+      return VException("Argument 'inIndex' must be a Number");
+    }
+    if (!Buffer::HasInstance(args[1])) {
+      return VException("Argument 'script' must be of type Buffer");
+    }
+    if (!args[2]->IsNumber()) {
+      return VException("Argument 'hashType' must be a Number");
+    }
+
+    int64_t n = args[0]->IntegerValue();
+    Handle<Object> script_buf = args[1]->ToObject();
+
+    Buffer *hash_buf = Buffer::New(SHA256_DIGEST_LENGTH);
+    const char *err = engine->Hash(
+      n < 0 ? engine->ins.size() : (size_t) n,
+      (const unsigned char *) Buffer::Data(script_buf),
+      Buffer::Length(script_buf),
+      args[2]->Uint32Value(),
+      (unsigned char *) Buffer::Data(hash_buf));
+
+    if (err != NULL) {
+      return VException(err);
+    }
+
+    return scope.Close(hash_buf->handle_);
+  }
+  /**
+   * Match input `n` against a standard template and prepare its check.
+   *
+   * Understands pay-to-pubkey, pay-to-pubkey-hash and bare multisig with a
+   * push-only scriptSig. Returns false for anything else, or for corner cases
+   * where the interpreter's findAndDelete would change the script code, so
+   * the caller can fall back to the ScriptInterpreter.
+   */
+  bool PrepareStandard(size_t n, const unsigned char *spk, size_t spkLen,
+                       standard_verify_t *v)
+  {
+    if (n >= ins.size() || ins[n].scriptLen > MAX_SCRIPT_SIZE) {
+      return false;
+    }
+
+    vector<script_push_t> stack;
+    if (!parse_push_only(&tx[ins[n].script], ins[n].scriptLen, &stack)) {
+      return false;
+    }
+
+    // Pushes in the scriptPubKey, to rule out findAndDelete hits
+    vector<script_push_t> spkPushes;
+    vector<script_push_t> keys;
+    size_t sigsCount;
+
+    if ((spkLen == 35 || spkLen == 67) && spk[0] == spkLen - 2 &&
+        spk[spkLen - 1] == OP_CHECKSIG) {
+      // <pubkey> OP_CHECKSIG
+      if (stack.size() != 1) return false;
+      script_push_t key = { spk + 1, spkLen - 2 };
+      keys.push_back(key);
+      spkPushes.push_back(key);
+      sigsCount = 1;
+    } else if (spkLen == 25 && spk[0] == OP_DUP && spk[1] == OP_HASH160 &&
+               spk[2] == 20 && spk[23] == OP_EQUALVERIFY &&
+               spk[24] == OP_CHECKSIG) {
+      // OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY OP_CHECKSIG
+      if (stack.size() != 2) return false;
+      script_push_t hash = { spk + 3, 20 };
+      spkPushes.push_back(hash);
+
+      unsigned char pubHash[RIPEMD160_DIGEST_LENGTH];
+      hash160_digest(stack[1].data, stack[1].len, pubHash);
+      if (memcmp(pubHash, spk + 3, 20) != 0) {
+        v->error = "OP_EQUALVERIFY negative";
+        return true;
+      }
+      keys.push_back(stack[1]);
+      stack.pop_back();
+      sigsCount = 1;
+    } else if (spkLen >= 3 && spk[0] >= OP_1 && spk[0] <= OP_16 &&
+               spk[spkLen - 1] == OP_CHECKMULTISIG) {
+      // OP_m <pubkey>... OP_n OP_CHECKMULTISIG
+      const unsigned char *p = spk + 1;
+      const unsigned char *end = spk + spkLen - 2;
+      while (p < end && (*p == 33 || *p == 65) && end - p > *p) {
+        script_push_t key = { p + 1, *p };
+        spkPushes.push_back(key);
+        p += 1 + *p;
+      }
+      if (p != end || *end < OP_1 || *end > OP_16) return false;
+
+      sigsCount = spk[0] - OP_1 + 1;
+      if ((size_t) (*end - OP_1 + 1) != spkPushes.size() ||
+          sigsCount > spkPushes.size()) {
+        return false;
+      }
+      // The extra element popped by OP_CHECKMULTISIG plus the signatures
+      if (stack.size() != sigsCount + 1) return false;
+
+      for (size_t i = spkPushes.size(); i-- > 0; ) {
+        keys.push_back(spkPushes[i]);
+      }
+    } else {
+      return false;
+    }
+
+    // Signatures, top of the stack first
+    vector<script_push_t> sigs;
+    for (size_t i = 0; i < sigsCount; i++) {
+      sigs.push_back(stack[stack.size() - 1 - i]);
+    }
+
+    for (size_t i = 0; i < sigs.size(); i++) {
+      for (size_t j = 0; j < spkPushes.size(); j++) {
+        if (sigs[i].len == spkPushes[j].len &&
+            memcmp(sigs[i].data, spkPushes[j].data, sigs[i].len) == 0) {
+          return false;
+        }
+      }
+    }
+
+    // Copy out everything the worker needs
+    for (size_t i = 0; i < keys.size(); i++) {
+      standard_key_t key;
+      key.pub = v->arena.size();
+      key.pubLen = keys[i].len;
+      v->arena.insert(v->arena.end(), keys[i].data,
+                      keys[i].data + keys[i].len);
+      v->keys.push_back(key);
+    }
+
+    for (size_t i = 0; i < sigs.size(); i++) {
+      standard_sig_t sig;
+      sig.valid = sigs[i].len > 0;
+      sig.sig = v->arena.size();
+      sig.sigLen = sig.valid ? sigs[i].len - 1 : 0;
+      if (sig.valid) {
+        // The last byte is the hash type
+        uint32_t hashType = sigs[i].data[sigs[i].len - 1];
+        sig.valid = Hash(n, spk, spkLen, hashType, sig.hash) == NULL;
+        v->arena.insert(v->arena.end(), sigs[i].data,
+                        sigs[i].data + sig.sigLen);
+      }
+      v->sigs.push_back(sig);
+    }
+
+    return true;
+  }
+
+  EIO_CALLBACK(EIO_VerifyStandard)
+  {
+    standard_verify_t *v = static_cast<standard_verify_t *>(req->data);
+
+    if (v->error != NULL) {
+      EIO_RETURN;
+    }
+
+    EC_KEY *ec = EC_KEY_new_by_curve_name(NID_secp256k1);
+
+    // Same matching as OP_CHECKMULTISIG: each signature must match one of
+    // the keys left, in order, and we give up once there are more
+    // signatures than keys remaining.
+    size_t isig = 0, ikey = 0;
+    size_t sigsCount = v->sigs.size(), keysCount = v->keys.size();
+    bool success = true;
+    while (success && sigsCount > 0) {
+      const standard_sig_t &sig = v->sigs[isig];
+      const standard_key_t &key = v->keys[ikey];
+      bool ok = ec != NULL && sig.valid &&
+        pubkey_cache().Load(&ec, &v->arena[key.pub], key.pubLen) &&
+        ECDSA_verify(0, sig.hash, 32, &v->arena[0] + sig.sig, sig.sigLen,
+                     ec) == 1;
+      if (ok) {
+        isig++;
+        sigsCount--;
+      } else {
+        ikey++;
+        keysCount--;
+        if (sigsCount > keysCount) {
+          success = false;
+        }
+      }
+    }
+    v->result = success;
+
+    if (ec != NULL) {
+      EC_KEY_free(ec);
+    }
+
+    EIO_RETURN;
+  }
+
+  static int
+  VerifyStandardCallback(eio_req *req)
+  {
+    HandleScope scope;
+    standard_verify_t *v = static_cast<standard_verify_t *>(req->data);
+    ev_unref(EV_DEFAULT_UC);
+
+    Local<Value> argv[2];
+    if (v->error != NULL) {
+      argv[0] = Exception::Error(String::New(v->error));
+      argv[1] = Local<Value>::New(Undefined());
+    } else {
+      argv[0] = Local<Value>::New(Null());
+      argv[1] = Local<Value>::New(Boolean::New(v->result));
+    }
+
+    TryCatch try_catch;
+
+    v->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    v->cb.Dispose();
+    delete v;
+    return 0;
+  }
+
+  /**
+   * Verify input `n` against a standard scriptPubKey in one native call.
+   *
+   * Returns true and calls back with (err, result) like ScriptInterpreter
+   * would, or returns false without calling back if the scripts don't fit a
+   * standard template.
+   */
+  static Handle<Value>
+  VerifyStandard(const Arguments& args)
+  {
+    HandleScope scope;
+    SighashEngine *engine = ObjectWrap::Unwrap<SighashEngine>(args.This());
+
+    if (args.Length() != 3) {
+      return VException("Three arguments expected: inIndex, scriptPubKey, callback");
+    }
+    if (!args[0]->IsNumber()) {
+      return VException("Argument 'inIndex' must be a Number");
+    }
+    if (!Buffer::HasInstance(args[1])) {
+      return VException("Argument 'scriptPubKey' must be of type Buffer");
+    }
+    REQ_FUN_ARG(2, cb);
+
+    int64_t n = args[0]->IntegerValue();
+    Handle<Object> spk_buf = args[1]->ToObject();
+
+    standard_verify_t *v = new standard_verify_t();
+    v->error = NULL;
+    v->result = false;
+
+    bool handled = n >= 0 && engine->PrepareStandard(
+      (size_t) n,
+      (const unsigned char *) Buffer::Data(spk_buf),
+      Buffer::Length(spk_buf),
+      v);
+    if (!handled) {
+      delete v;
+      return scope.Close(False());
+    }
+
+    v->cb = Persistent<Function>::New(cb);
+
+    eio_custom(EIO_VerifyStandard, EIO_PRI_DEFAULT, VerifyStandardCallback, v);
+    ev_ref(EV_DEFAULT_UC);
+
+    return scope.Close(True());
+  }
+};
+
+Persistent<FunctionTemplate> SighashEngine::s_ct;
+
+
+// Number of nonces a miner thread takes from the nonce space at a time
+#define MINER_CHUNK (1 << 18)
+
+/**
+ * Proof-of-work search over the nonce field of a block header.
+ *
+ * The first 64 bytes of the header don't depend on the nonce, so we hash them
+ * once and only run the second block and the second hash per nonce. The
+ * search runs on its own threads rather than in the eio pool, which it would
+ * otherwise keep busy until a nonce is found, holding up file and database
+ * I/O. The threads take chunks of the nonce space from the shared baton and
+ * the last one to finish queues an eio job that joins them and calls back on
+ * the main thread.
+ */
+class BitcoinMiner : ObjectWrap
+{
+private:
+
+  struct solve_baton_t {
+    BitcoinMiner *miner;
+
+    // Midstate after the first 64 bytes of the header
+    uint32_t midstate[8];
+
+    // Last 16 bytes of the header with SHA-256 padding applied
+    unsigned char tail[64];
+
+    // Target, big endian like Util.decodeDiffBits returns it
+    unsigned char target[32];
+
+    Persistent<Object> headerBuf;
+    Persistent<Function> cb;
+
+    std::vector<pthread_t> threads;
+
+    // Set by workers on success and by cancel()
+    volatile int stop;
+
+    bool cancelled;
+
+    // The fields below are guarded by lock
+    pthread_mutex_t lock;
+
+    // Next nonce to hand out
+    uint64_t next;
+
+    // Threads that haven't finished yet
+    unsigned int running;
+
+    double hashes;
+    bool found;
+    uint32_t nonce;
+  };
+
+  unsigned int threads;
+  solve_baton_t *current;
+
+  // Statistics for the last search, see HashCount() for the current one
+  double hashes;
+  double startTime;
+  double endTime;
+
+  static double Now()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  /**
+   * Whether a hash in internal byte order is at or below a big endian target.
+   */
+  static bool MeetsTarget(const unsigned char *hash, const unsigned char *target)
+  {
+    for (int i = 0; i < 32; i++) {
+      if (hash[31 - i] != target[i]) {
+        return hash[31 - i] < target[i];
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Try `count` nonces starting at `start`. Returns the number of hashes
+   * done, stops early on a solution or when another thread sets the stop
+   * flag.
+   */
+  static uint64_t SolveRange(solve_baton_t *b, uint64_t start, uint64_t count,
+                             bool *found, uint32_t *result)
+  {
+    unsigned char block[64];
+    unsigned char digest[64];
+    unsigned char hash[32];
+    uint32_t state[8];
+
+    memcpy(block, b->tail, 64);
+    FormatHashBlocks(digest, 32);
+
+    *found = false;
+
+    for (uint64_t i = 0; i < count; i++) {
+      // Check for a solution from another thread or a cancel now and then
+      if ((i & 0xfff) == 0 && b->stop) {
+        return i;
+      }
+
+      uint32_t nonce = (uint32_t) (start + i);
+      write_le32(block + 12, nonce);
+
+      memcpy(state, b->midstate, 32);
+      sha256_transform(state, block, 1);
+      for (int j = 0; j < 8; j++) {
+        write_be32(digest + 4 * j, state[j]);
+      }
+
+      memcpy(state, SHA256_IV, 32);
+      sha256_transform(state, digest, 1);
+      for (int j = 0; j < 8; j++) {
+        write_be32(hash + 4 * j, state[j]);
+      }
+
+      if (MeetsTarget(hash, b->target)) {
+        *found = true;
+        *result = nonce;
+        b->stop = 1;
+        return i + 1;
+      }
+    }
+
+    return count;
+  }
+
+  static void *Worker(void *data)
+  {
+    solve_baton_t *b = static_cast<solve_baton_t *>(data);
+
+    for (;;) {
+      pthread_mutex_lock(&b->lock);
+      if (b->stop || b->next > 0xffffffffULL) {
+        pthread_mutex_unlock(&b->lock);
+        break;
+      }
+      uint64_t start = b->next;
+      uint64_t count = MINER_CHUNK;
+      if (start + count > 0x100000000ULL) {
+        count = 0x100000000ULL - start;
+      }
+      b->next += count;
+      pthread_mutex_unlock(&b->lock);
+
+      bool found;
+      uint32_t nonce;
+      uint64_t done = SolveRange(b, start, count, &found, &nonce);
+
+      pthread_mutex_lock(&b->lock);
+      b->hashes += done;
+      if (found && !b->found) {
+        b->found = true;
+        b->nonce = nonce;
+      }
+      pthread_mutex_unlock(&b->lock);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    bool last = --b->running == 0;
+    pthread_mutex_unlock(&b->lock);
+
+    if (last) {
+      eio_custom(EIO_Join, EIO_PRI_DEFAULT, SolveCallback, b);
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Wait for the threads of a search to exit. They are all past their
+   * search loop by the time this is queued.
+   */
+  EIO_CALLBACK(EIO_Join)
+  {
+    solve_baton_t *b = static_cast<solve_baton_t *>(req->data);
+
+    for (size_t i = 0; i < b->threads.size(); i++) {
+      pthread_join(b->threads[i], NULL);
+    }
+
+    EIO_RETURN;
+  }
+
+  static void DeleteBaton(solve_baton_t *baton)
+  {
+    baton->headerBuf.Dispose();
+    baton->cb.Dispose();
+    pthread_mutex_destroy(&baton->lock);
+
+    delete baton;
+  }
+
+  static int
+  SolveCallback(eio_req *req)
+  {
+    HandleScope scope;
+    solve_baton_t *baton = static_cast<solve_baton_t *>(req->data);
+    BitcoinMiner *miner = baton->miner;
+    ev_unref(EV_DEFAULT_UC);
+
+    miner->hashes = baton->hashes;
+    miner->endTime = Now();
+    miner->current = NULL;
+    miner->Unref();
+
+    Local<Value> argv[2];
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = Local<Value>::New(Null());
+
+    if (baton->found) {
+      // Write the nonce into the header, like the JavaScript miner does
+      write_le32((unsigned char *) Buffer::Data(baton->headerBuf) + 76,
+                 baton->nonce);
+      argv[1] = Integer::NewFromUnsigned(baton->nonce);
+    } else if (baton->cancelled) {
+      argv[0] = Exception::Error(String::New("Mining cancelled"));
+    } else {
+      argv[0] = Exception::Error(String::New("Nonce space exhausted"));
+    }
+
+    TryCatch try_catch;
+
+    baton->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+
+    DeleteBaton(baton);
+    return 0;
+  }
+
+  /**
+   * Hashes done so far in the current search, or in the last one.
+   */
+  double HashCount()
+  {
+    if (current == NULL) {
+      return hashes;
+    }
+
+    pthread_mutex_lock(&current->lock);
+    double count = current->hashes;
+    pthread_mutex_unlock(&current->lock);
+    return count;
+  }
+
+public:
+
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("BitcoinMiner"));
+
+    // Accessors
+    s_ct->InstanceTemplate()->SetAccessor(String::New("hashes"),
+                                          GetHashes);
+    s_ct->InstanceTemplate()->SetAccessor(String::New("hashRate"),
+                                          GetHashRate);
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "solve", Solve);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "cancel", Cancel);
+
+    target->Set(String::NewSymbol("BitcoinMiner"),
+                s_ct->GetFunction());
+  }
+
+  BitcoinMiner(unsigned int threads) :
+    threads(threads),
+    current(NULL),
+    hashes(0),
+    startTime(0),
+    endTime(0)
+  {
+  }
+
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
+
+    HandleScope scope;
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (args.Length() >= 1 && !args[0]->IsUndefined()) {
+      if (!args[0]->IsNumber() || args[0]->IntegerValue() < 1) {
+        return VException("Argument 'threads' must be a positive Number");
+      }
+      threads = args[0]->IntegerValue();
+    }
+    if (threads < 1) {
+      threads = 1;
+    }
+
+    BitcoinMiner *miner = new BitcoinMiner(threads);
+    miner->Wrap(args.Holder());
+
+    return scope.Close(args.This());
+  }
+
+  /**
+   * Search for a nonce that makes the header hash meet the target.
+   *
+   * Calls back with (err, nonce). The nonce is also written into the header.
+   */
+  static Handle<Value>
+  Solve(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinMiner *miner = ObjectWrap::Unwrap<BitcoinMiner>(args.This());
+
+    if (args.Length() != 3) {
+      return VException("Three arguments expected: header, target, callback");
+    }
+    if (!Buffer::HasInstance(args[0])) {
+      return VException("Argument 'header' must be of type Buffer");
+    }
+    if (!Buffer::HasInstance(args[1])) {
+      return VException("Argument 'target' must be of type Buffer");
+    }
+    REQ_FUN_ARG(2, cb);
+
+    Handle<Object> header_buf = args[0]->ToObject();
+    Handle<Object> target_buf = args[1]->ToObject();
+
+    if (Buffer::Length(header_buf) != 80) {
+      return VException("Argument 'header' must be Buffer of length 80 bytes");
+    }
+    if (Buffer::Length(target_buf) != 32) {
+      return VException("Argument 'target' must be Buffer of length 32 bytes");
+    }
+    if (miner->current != NULL) {
+      return VException("Miner is already running");
+    }
+
+    const unsigned char *header = (const unsigned char *) Buffer::Data(header_buf);
+
+    solve_baton_t *baton = new solve_baton_t();
+    baton->miner = miner;
+
+    memcpy(baton->midstate, SHA256_IV, 32);
+    sha256_transform(baton->midstate, header, 1);
+
+    memcpy(baton->tail, header + 64, 16);
+    FormatHashBlocks(baton->tail, 16);
+    // FormatHashBlocks only knows about the 16 bytes we gave it
+    write_be32(baton->tail + 60, 80 * 8);
+
+    memcpy(baton->target, Buffer::Data(target_buf), 32);
+
+    baton->headerBuf = Persistent<Object>::New(header_buf);
+    baton->cb = Persistent<Function>::New(cb);
+    baton->stop = 0;
+    baton->cancelled = false;
+    pthread_mutex_init(&baton->lock, NULL);
+    baton->next = 0;
+    baton->running = miner->threads;
+    baton->hashes = 0;
+    baton->found = false;
+
+    // Hold the lock so no thread can finish before all of them are started
+    pthread_mutex_lock(&baton->lock);
+    for (unsigned int i = 0; i < miner->threads; i++) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, Worker, baton) != 0) {
+        break;
+      }
+      baton->threads.push_back(thread);
+    }
+
+    if (baton->threads.size() < miner->threads) {
+      baton->stop = 1;
+      pthread_mutex_unlock(&baton->lock);
+      for (size_t i = 0; i < baton->threads.size(); i++) {
+        pthread_join(baton->threads[i], NULL);
+      }
+      DeleteBaton(baton);
+      return VException("Unable to start miner threads");
+    }
+
+    miner->current = baton;
+    miner->hashes = 0;
+    miner->startTime = miner->endTime = Now();
+    miner->Ref();
+    ev_ref(EV_DEFAULT_UC);
+
+    pthread_mutex_unlock(&baton->lock);
+
+    return scope.Close(Undefined());
+  }
+
+  static Handle<Value>
+  Cancel(const Arguments& args)
+  {
+    HandleScope scope;
+    BitcoinMiner *miner = ObjectWrap::Unwrap<BitcoinMiner>(args.This());
+
+    if (miner->current != NULL) {
+      miner->current->cancelled = true;
+      miner->current->stop = 1;
+    }
+
+    return scope.Close(Undefined());
+  }
+
+  static Handle<Value>
+  GetHashes(Local<String> property, const AccessorInfo& info)
+  {
+    HandleScope scope;
+    BitcoinMiner *miner = ObjectWrap::Unwrap<BitcoinMiner>(info.Holder());
+
+    return scope.Close(Number::New(miner->HashCount()));
+  }
+
+  /**
+   * Hashes per second over the current (or last) search.
+   */
+  static Handle<Value>
+  GetHashRate(Local<String> property, const AccessorInfo& info)
+  {
+    HandleScope scope;
+    BitcoinMiner *miner = ObjectWrap::Unwrap<BitcoinMiner>(info.Holder());
+
+    double end = miner->current != NULL ? Now() : miner->endTime;
+    double elapsed = end - miner->startTime;
+    return scope.Close(Number::New(elapsed > 0 ?
+                                   miner->HashCount() / elapsed : 0));
+  }
+};
+
+Persistent<FunctionTemplate> BitcoinMiner::s_ct;
+
+
+/**
+ * Incremental framer for the Bitcoin wire protocol.
+ *
+ * Socket chunks are kept as they arrive (no copying into a growing receive
+ * buffer). next() scans for the network magic, waits until a full message is
+ * buffered, verifies the checksum by hashing straight over the chunks and
+ * hands back the payload. Payloads inside a single chunk are returned as that
+ * chunk plus offsets, so JavaScript can take a slice without copying; only
+ * messages that straddle chunks get copied into a new Buffer.
+ */
+class MessageFramer : ObjectWrap
+{
+private:
+
+  struct chunk_t {
+    Persistent<Object> handle;
+    const unsigned char *data;
+    size_t len;
+  };
+
+  unsigned char magic[4];
+
+  deque<chunk_t> chunks;
+
+  // Bytes of chunks.front() that were already consumed
+  size_t offset;
+
+  // Total unconsumed bytes
+  size_t length;
+
+  unsigned char At(size_t pos)
+  {
+    pos += offset;
+    for (deque<chunk_t>::iterator it = chunks.begin(); ; it++) {
+      if (pos < it->len) return it->data[pos];
+      pos -= it->len;
+    }
+  }
+
+  /**
+   * Call fn(data, len) for each contiguous piece of [pos, pos + len).
+   */
+  template <class F>
+  void Each(size_t pos, size_t len, F &fn)
+  {
+    pos += offset;
+    for (deque<chunk_t>::iterator it = chunks.begin();
+         len > 0 && it != chunks.end(); it++) {
+      if (pos >= it->len) {
+        pos -= it->len;
+        continue;
+      }
+      size_t n = it->len - pos < len ? it->len - pos : len;
+      fn(it->data + pos, n);
+      len -= n;
+      pos = 0;
+    }
+  }
+
+  struct copy_fn_t {
+    unsigned char *dst;
+    void operator()(const unsigned char *data, size_t len) {
+      memcpy(dst, data, len);
+      dst += len;
+    }
+  };
+
+  struct hash_fn_t {
+    sha256_stream_t stream;
+    void operator()(const unsigned char *data, size_t len) {
+      sha256_stream_update(&stream, data, len);
+    }
+  };
+
+  void Copy(size_t pos, size_t len, unsigned char *dst)
+  {
+    copy_fn_t fn;
+    fn.dst = dst;
+    Each(pos, len, fn);
+  }
+
+  void Consume(size_t n)
+  {
+    length -= n;
+    n += offset;
+    while (!chunks.empty() && n >= chunks.front().len) {
+      n -= chunks.front().len;
+      chunks.front().handle.Dispose();
+      chunks.pop_front();
+    }
+    offset = chunks.empty() ? 0 : n;
+  }
+
+  /**
+   * Drop everything in front of the next magic. Returns the number of bytes
+   * skipped; false in `found` means we need more data.
+   */
+  size_t SkipToMagic(bool *found)
+  {
+    size_t skipped = 0;
+    *found = false;
+
+    while (length >= 4) {
+      const chunk_t &c = chunks.front();
+      const unsigned char *begin = c.data + offset;
+      const unsigned char *hit = (const unsigned char *)
+        memchr(begin, magic[0], c.len - offset);
+
+      // No candidate in this chunk at all, drop it
+      if (hit == NULL) {
+        size_t n = c.len - offset;
+        skipped += n;
+        Consume(n);
+        continue;
+      }
+
+      size_t n = hit - begin;
+      skipped += n;
+      Consume(n);
+
+      if (length < 4) {
+        break;
+      }
+      if (At(1) == magic[1] && At(2) == magic[2] && At(3) == magic[3]) {
+        *found = true;
+        break;
+      }
+
+      skipped++;
+      Consume(1);
+    }
+
+    return skipped;
+  }
+
+  struct frame_t {
+    char command[12];
+    size_t commandLen;
+    bool checksumOk;
+    size_t skipped;
+
+    // Payload position relative to the unconsumed data
+    size_t payloadPos;
+    size_t payloadLen;
+
+    // Chunk containing the whole payload, or chunks.end() if it straddles
+    // chunks (or is empty)
+    deque<chunk_t>::iterator chunk;
+    size_t chunkPos;
+  };
+
+  /**
+   * Find the next complete message. Nothing is consumed except garbage in
+   * front of it; the caller consumes payloadPos + payloadLen bytes once it is
+   * done with the frame.
+   */
+  bool NextFrame(bool checksummed, frame_t *f)
+  {
+    bool found;
+    f->skipped = SkipToMagic(&found);
+    if (!found) {
+      return false;
+    }
+
+    f->payloadPos = checksummed ? 24 : 20;
+    if (length < f->payloadPos) {
+      return false;
+    }
+
+    unsigned char header[24];
+    Copy(0, f->payloadPos, header);
+
+    f->payloadLen = read_le32(header + 16);
+    if (length - f->payloadPos < f->payloadLen) {
+      return false;
+    }
+
+    // Command is NUL padded
+    memcpy(f->command, header + 4, 12);
+    f->commandLen = 12;
+    while (f->commandLen > 0 && f->command[f->commandLen - 1] == 0) {
+      f->commandLen--;
+    }
+
+    f->checksumOk = true;
+    if (checksummed) {
+      hash_fn_t fn;
+      sha256_stream_init(&fn.stream);
+      Each(f->payloadPos, f->payloadLen, fn);
+      unsigned char hash[SHA256_DIGEST_LENGTH];
+      sha256_stream_final_double(&fn.stream, hash);
+      f->checksumOk = memcmp(hash, header + 20, 4) == 0;
+    }
+
+    f->chunk = chunks.end();
+    if (f->payloadLen > 0) {
+      size_t pos = offset + f->payloadPos;
+      deque<chunk_t>::iterator it = chunks.begin();
+      while (pos >= it->len) {
+        pos -= it->len;
+        it++;
+      }
+      if (pos + f->payloadLen <= it->len) {
+        f->chunk = it;
+        f->chunkPos = pos;
+      }
+    }
+
+    return true;
+  }
+
+public:
+
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("MessageFramer"));
+
+    // Accessors
+    s_ct->InstanceTemplate()->SetAccessor(String::New("length"),
+                                          GetLength);
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "next", Next);
+
+    target->Set(String::NewSymbol("MessageFramer"),
+                s_ct->GetFunction());
+  }
+
+  MessageFramer() :
+    offset(0),
+    length(0)
+  {
+  }
+
+  ~MessageFramer()
+  {
+    while (!chunks.empty()) {
+      chunks.front().handle.Dispose();
+      chunks.pop_front();
+    }
+  }
+
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
+
+    HandleScope scope;
+
+    if (args.Length() != 1) {
+      return VException("One argument expected: magic Buffer");
+    }
+    if (!Buffer::HasInstance(args[0]) ||
+        Buffer::Length(args[0]->ToObject()) != 4) {
+      return VException("Argument 'magic' must be Buffer of length 4 bytes");
+    }
+
+    MessageFramer *framer = new MessageFramer();
+    memcpy(framer->magic, Buffer::Data(args[0]->ToObject()), 4);
+    framer->Wrap(args.Holder());
+
+    return scope.Close(args.This());
+  }
+
+  /**
+   * Add a chunk of received data. The chunk is referenced, not copied, so it
+   * must not be modified afterwards.
+   */
+  static Handle<Value>
+  Push(const Arguments& args)
+  {
+    HandleScope scope;
+    MessageFramer *framer = ObjectWrap::Unwrap<MessageFramer>(args.This());
+
+    if (args.Length() != 1 || !Buffer::HasInstance(args[0])) {
+      return VException("One argument expected: data Buffer");
+    }
+
+    Handle<Object> buf = args[0]->ToObject();
+    if (Buffer::Length(buf) == 0) {
+      return scope.Close(Undefined());
+    }
+
+    chunk_t chunk;
+    chunk.handle = Persistent<Object>::New(buf);
+    chunk.data = (const unsigned char *) Buffer::Data(buf);
+    chunk.len = Buffer::Length(buf);
+    framer->chunks.push_back(chunk);
+    framer->length += chunk.len;
+
+    return scope.Close(Undefined());
+  }
+
+  /**
+   * Take the next complete message off the buffer.
+   *
+   * Takes a flag whether messages carry a checksum (protocol version 209 and
+   * up). Returns null if no complete message is buffered yet, otherwise an
+   * object with these properties:
+   *
+   *   command    - Command name
+   *   buffer     - Buffer containing the payload
+   *   start, end - Position of the payload within `buffer`
+   *   checksumOk - False if the checksum didn't match
+   *   skipped    - Number of garbage bytes skipped before the message
+   */
+  static Handle<Value>
+  Next(const Arguments& args)
+  {
+    HandleScope scope;
+    MessageFramer *framer = ObjectWrap::Unwrap<MessageFramer>(args.This());
+
+    bool checksummed = args.Length() >= 1 && args[0]->BooleanValue();
+
+    frame_t f;
+    if (!framer->NextFrame(checksummed, &f)) {
+      return scope.Close(Null());
+    }
+
+    Local<Object> frame = Object::New();
+    frame->Set(String::NewSymbol("command"),
+               String::New(f.command, f.commandLen));
+    frame->Set(String::NewSymbol("checksumOk"), Boolean::New(f.checksumOk));
+    frame->Set(String::NewSymbol("skipped"), Integer::New(f.skipped));
+
+    if (f.chunk != framer->chunks.end()) {
+      // Payload is contained in a single chunk, hand out the chunk itself
+      frame->Set(String::NewSymbol("buffer"), Local<Object>::New(f.chunk->handle));
+      frame->Set(String::NewSymbol("start"), Integer::New(f.chunkPos));
+      frame->Set(String::NewSymbol("end"), Integer::New(f.chunkPos + f.payloadLen));
+    } else {
+      Buffer *payload = Buffer::New(f.payloadLen);
+      framer->Copy(f.payloadPos, f.payloadLen,
+                   (unsigned char *) Buffer::Data(payload));
+      frame->Set(String::NewSymbol("buffer"), payload->handle_);
+      frame->Set(String::NewSymbol("start"), Integer::New(0));
+      frame->Set(String::NewSymbol("end"), Integer::New(f.payloadLen));
+    }
+
+    framer->Consume(f.payloadPos + f.payloadLen);
+
+    return scope.Close(frame);
+  }
+
+  static Handle<Value>
+  GetLength(Local<String> property, const AccessorInfo& info)
+  {
+    HandleScope scope;
+    MessageFramer *framer = ObjectWrap::Unwrap<MessageFramer>(info.Holder());
+
+    return scope.Close(Number::New(framer->length));
+  }
+};
+
+Persistent<FunctionTemplate> MessageFramer::s_ct;
+
+
+static const char* BASE58_ALPHABET = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+// Reverse lookup for BASE58_ALPHABET, -1 for characters outside it
+static const signed char BASE58_MAP[256] = {
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1, 0, 1, 2, 3, 4, 5, 6,  7, 8,-1,-1,-1,-1,-1,-1,
+  -1, 9,10,11,12,13,14,15, 16,-1,17,18,19,20,21,-1,
+  22,23,24,25,26,27,28,29, 30,31,32,-1,-1,-1,-1,-1,
+  -1,33,34,35,36,37,38,39, 40,41,42,43,-1,44,45,46,
+  47,48,49,50,51,52,53,54, 55,56,57,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1
+};
+
+// Inputs up to this size are converted using stack buffers only
+#define BASE58_STACK_SIZE 256
+
+static inline size_t
+base58_max_encoded(size_t len)
+{
+  // log(256) / log(58), rounded up
+  return len * 138 / 100 + 1;
+}
+
+/**
+ * Encode `len` bytes as base58 into `out`.
+ *
+ * `out` needs room for base58_max_encoded(len) characters plus one per
+ * leading zero byte, `scratch` for base58_max_encoded(len) bytes. Returns the
+ * number of characters written (no terminator).
+ */
+static size_t
+base58_encode_raw(const unsigned char *data, size_t len, char *out,
+                  unsigned char *scratch)
+{
+  // Leading zero bytes become leading '1's
+  size_t zeros = 0;
+  while (zeros < len && data[zeros] == 0) {
+    zeros++;
+  }
+
+  // Repeatedly multiply a big-endian base58 digit array by 256 and add the
+  // next byte. `used` tracks how many low digits are non-zero so far, which
+  // keeps each step proportional to the output produced.
+  size_t size = base58_max_encoded(len - zeros);
+  unsigned char *b58 = scratch;
+  memset(b58, 0, size);
+  size_t used = 0;
+
+  for (size_t i = zeros; i < len; i++) {
+    unsigned int carry = data[i];
+    size_t j = 0;
+    for (size_t k = size; k-- > 0 && (carry != 0 || j < used); j++) {
+      carry += 256 * b58[k];
+      b58[k] = carry % 58;
+      carry /= 58;
+    }
+    used = j;
+  }
+
+  size_t start = size - used;
+  size_t n = 0;
+  for (size_t i = 0; i < zeros; i++) {
+    out[n++] = BASE58_ALPHABET[0];
+  }
+  for (size_t i = start; i < size; i++) {
+    out[n++] = BASE58_ALPHABET[b58[i]];
+  }
+  return n;
+}
+
+/**
+ * Decode a base58 string into `out`.
+ *
+ * Leading and trailing whitespace is ignored. `out` and `scratch` need room
+ * for `len` bytes (at least one). Returns false on invalid characters, otherwise stores the decoded
+ * size in `out_len`.
+ */
+static bool
+base58_decode_raw(const char *str, size_t len, unsigned char *out,
+                  size_t *out_len, unsigned char *scratch)
+{
+  const char *p = str;
+  const char *end = str + len;
+
+  while (p < end && isspace(*p)) p++;
+  while (end > p && isspace(end[-1])) end--;
+
+  size_t zeros = 0;
+  while (p < end && *p == BASE58_ALPHABET[0]) {
+    zeros++;
+    p++;
+  }
+
+  // log(58) / log(256), rounded up
+  size_t size = (end - p) * 733 / 1000 + 1;
+  unsigned char *b256 = scratch;
+  memset(b256, 0, size);
+  size_t used = 0;
+
+  for (; p < end; p++) {
+    int carry = BASE58_MAP[(unsigned char) *p];
+    if (carry == -1) {
+      return false;
+    }
+    size_t j = 0;
+    for (size_t k = size; k-- > 0 && (carry != 0 || j < used); j++) {
+      carry += 58 * b256[k];
+      b256[k] = carry % 256;
+      carry /= 256;
+    }
+    used = j;
+  }
+
+  memset(out, 0, zeros);
+  memcpy(out + zeros, b256 + size - used, used);
+  *out_len = zeros + used;
+  return true;
+}
+
+/**
+ * Encode a Buffer as a V8 string, optionally with a version byte in front and
+ * a double SHA-256 checksum at the end.
+ */
+static Local<String>
+base58_encode_buffer(const unsigned char *data, size_t len,
+                     int version, bool check)
+{
+  HandleScope scope;
+
+  size_t total = len + (version >= 0 ? 1 : 0) + (check ? 4 : 0);
+
+  unsigned char stack_in[BASE58_STACK_SIZE + 5];
+  char stack_out[BASE58_STACK_SIZE * 2];
+  unsigned char stack_scratch[BASE58_STACK_SIZE * 2];
+  vector<unsigned char> heap_in, heap_scratch;
+  vector<char> heap_out;
+
+  unsigned char *in = stack_in;
+  char *out = stack_out;
+  unsigned char *scratch = stack_scratch;
+  if (total > BASE58_STACK_SIZE) {
+    heap_in.resize(total);
+    heap_out.resize(base58_max_encoded(total) + total);
+    heap_scratch.resize(base58_max_encoded(total));
+    in = &heap_in[0];
+    out = &heap_out[0];
+    scratch = &heap_scratch[0];
+  }
+
+  size_t pos = 0;
+  if (version >= 0) {
+    in[pos++] = version;
+  }
+  memcpy(in + pos, data, len);
+  pos += len;
+  if (check) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    double_sha256_digest(in, pos, hash);
+    memcpy(in + pos, hash, 4);
+    pos += 4;
+  }
+
+  size_t n = base58_encode_raw(in, pos, out, scratch);
+  return scope.Close(String::New(out, n));
+}
+
+/**
+ * Decode a V8 string, optionally verifying and stripping a checksum.
+ *
+ * Returns an empty handle if the string is not valid base58 (or the checksum
+ * doesn't match).
+ */
+static Local<Value>
+base58_decode_string(Handle<Value> value, bool check)
+{
+  HandleScope scope;
+
+  String::Utf8Value str(value->ToString());
+  size_t len = str.length();
+
+  unsigned char stack_out[BASE58_STACK_SIZE];
+  unsigned char stack_scratch[BASE58_STACK_SIZE];
+  vector<unsigned char> heap_out, heap_scratch;
+
+  unsigned char *out = stack_out;
+  unsigned char *scratch = stack_scratch;
+  if (len > BASE58_STACK_SIZE) {
+    heap_out.resize(len);
+    heap_scratch.resize(len);
+    out = &heap_out[0];
+    scratch = &heap_scratch[0];
+  }
+
+  size_t out_len;
+  if (!base58_decode_raw(*str, len, out, &out_len, scratch)) {
+    return Local<Value>();
+  }
+
+  if (check) {
+    if (out_len < 4) {
+      return Local<Value>();
+    }
+    out_len -= 4;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    double_sha256_digest(out, out_len, hash);
+    if (memcmp(hash, out + out_len, 4) != 0) {
+      return Local<Value>();
+    }
+  }
+
+  Buffer *buf = Buffer::New(out_len);
+  memcpy(Buffer::Data(buf), out, out_len);
+  return scope.Close(buf->handle_);
+}
+
+
+/**
+ * Binary address (version, hash160, checksum) for a public key.
+ *
+ * The checksum is the first four bytes of the double SHA-256, like in all
+ * base58check data. It used to be a single SHA-256, which gave addresses
+ * that no other client accepts.
+ */
+static Handle<Value>
+pubkey_to_address256 (const Arguments& args)
+{
+  HandleScope scope;
+  
+  if (args.Length() < 1 || args.Length() > 2) {
+    return VException("Arguments expected: pubkey Buffer[, version]");
+  }
+  if (!Buffer::HasInstance(args[0])) {
+    return VException("Argument 'pubkey' must be of type Buffer");
+  }
+  int version = 0;
+  if (args.Length() == 2 && !args[1]->IsUndefined()) {
+    if (!args[1]->IsNumber() ||
+        args[1]->IntegerValue() < 0 || args[1]->IntegerValue() > 255) {
+      return VException("Argument 'version' must be a Number from 0 to 255");
+    }
+    version = args[1]->IntegerValue();
+  }
+  v8::Handle<v8::Object> pub_buf = args[0]->ToObject();
+  
+  unsigned char *pub_data = (unsigned char *) Buffer::Data(pub_buf);
+  
+  // x = version + ripemd160(sha256(pubkey))
+  unsigned char address256[1 + RIPEMD160_DIGEST_LENGTH + 4];
+  address256[0] = version;
+  hash160_digest(pub_data, Buffer::Length(pub_buf), address256 + 1);
+  
+  // address256 = (x + sha256(sha256(x))[:4])
+  unsigned char hash3[SHA256_DIGEST_LENGTH];
+  double_sha256_digest(address256, 1 + RIPEMD160_DIGEST_LENGTH, hash3);
+  memcpy(
+    address256 + (1 + RIPEMD160_DIGEST_LENGTH),
+    hash3,
+    4);
+  
+  Buffer *address256_buf = Buffer::New(1 + RIPEMD160_DIGEST_LENGTH + 4);
+  memcpy(Buffer::Data(address256_buf), address256, 1 + RIPEMD160_DIGEST_LENGTH + 4);
+  return scope.Close(address256_buf->handle_);
+}
+
+
+static Handle<Value>
+base58_encode (const Arguments& args)
+{
+  HandleScope scope;
+  
+  if (args.Length() != 1) {
+    return VException("One argument expected: a Buffer");
+  }
+  if (!Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: a Buffer");
+  }
+  v8::Handle<v8::Object> buf = args[0]->ToObject();
+
+  return scope.Close(base58_encode_buffer(
+    (const unsigned char *) Buffer::Data(buf), Buffer::Length(buf), -1, false));
+}
+
+
+static Handle<Value>
+base58_decode (const Arguments& args)
+{
+  HandleScope scope;
+  
+  if (args.Length() != 1) {
+    return VException("One argument expected: a String");
+  }
+  if (!args[0]->IsString()) {
+    return VException("One argument expected: a String");
+  }
+
+  Local<Value> buf = base58_decode_string(args[0], false);
+  if (buf.IsEmpty()) {
+    return VException("Invalid base58 character");
+  }
+
+  return scope.Close(buf);
+}
+
+
+/**
+ * Encode each Buffer in an array, returns an array of strings.
+ */
+static Handle<Value>
+base58_encode_many (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsArray()) {
+    return VException("One argument expected: an Array of Buffers");
+  }
+  Local<Array> items = Local<Array>::Cast(args[0]);
+  uint32_t count = items->Length();
+
+  Local<Array> result = Array::New(count);
+  for (uint32_t i = 0; i < count; i++) {
+    Local<Value> item = items->Get(i);
+    if (!Buffer::HasInstance(item)) {
+      return VException("One argument expected: an Array of Buffers");
+    }
+    Local<Object> buf = item->ToObject();
+    result->Set(i, base58_encode_buffer(
+      (const unsigned char *) Buffer::Data(buf), Buffer::Length(buf),
+      -1, false));
+  }
+
+  return scope.Close(result);
+}
+
+
+/**
+ * Decode each string in an array, returns an array of Buffers.
+ *
+ * Invalid strings decode to null instead of throwing, so one bad entry
+ * doesn't fail the whole batch.
+ */
+static Handle<Value>
+base58_decode_many (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsArray()) {
+    return VException("One argument expected: an Array of Strings");
+  }
+  Local<Array> items = Local<Array>::Cast(args[0]);
+  uint32_t count = items->Length();
+
+  Local<Array> result = Array::New(count);
+  for (uint32_t i = 0; i < count; i++) {
+    Local<Value> item = items->Get(i);
+    if (!item->IsString()) {
+      return VException("One argument expected: an Array of Strings");
+    }
+    Local<Value> buf = base58_decode_string(item, false);
+    result->Set(i, buf.IsEmpty() ? Local<Value>::New(Null()) : buf);
+  }
+
+  return scope.Close(result);
+}
+
+
+/**
+ * Encode a Buffer with a four byte double SHA-256 checksum.
+ *
+ * If `version` is given it is prepended as a single byte first.
+ */
+static Handle<Value>
+base58check_encode (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || args.Length() > 2) {
+    return VException("Arguments expected: data Buffer[, version]");
+  }
+  if (!Buffer::HasInstance(args[0])) {
+    return VException("Argument 'data' must be of type Buffer");
+  }
+  int version = -1;
+  if (args.Length() == 2 && !args[1]->IsUndefined()) {
+    if (!args[1]->IsNumber() ||
+        args[1]->IntegerValue() < 0 || args[1]->IntegerValue() > 255) {
+      return VException("Argument 'version' must be a Number from 0 to 255");
+    }
+    version = args[1]->IntegerValue();
+  }
+  v8::Handle<v8::Object> buf = args[0]->ToObject();
+
+  return scope.Close(base58_encode_buffer(
+    (const unsigned char *) Buffer::Data(buf), Buffer::Length(buf),
+    version, true));
+}
+
+
+/**
+ * Decode a base58check string and verify its checksum.
+ *
+ * Returns the payload (including any version byte) without the checksum, or
+ * null if the string is not valid base58 or the checksum doesn't match.
+ */
+static Handle<Value>
+base58check_decode (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1) {
+    return VException("One argument expected: a String");
+  }
+  if (!args[0]->IsString()) {
+    return VException("One argument expected: a String");
+  }
+
+  Local<Value> buf = base58_decode_string(args[0], true);
+  if (buf.IsEmpty()) {
+    return scope.Close(Null());
+  }
+
+  return scope.Close(buf);
+}
+
+
+static Handle<Value>
+sha256_midstate (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1) {
+    return VException("One argument expected: data Buffer");
+  }
+  if (!Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: data Buffer");
+  }
+  v8::Handle<v8::Object> blk_buf = args[0]->ToObject();
+
+  // Reserve 64 extra bytes of memory for padding
+  unsigned int blk_len = Buffer::Length(blk_buf);
+  unsigned char *blk_data = (unsigned char *) malloc(blk_len + 64);
+
+  // Get block header
+  memcpy(blk_data, Buffer::Data(blk_buf), blk_len);
+
+  // Add SHA256 padding
+  FormatHashBlocks(blk_data, blk_len);
+
+  // Execute first half of first hash on block data
+  SHA256_CTX c;
+  SHA256_Init(&c);
+  SHA256_Transform(&c, blk_data);
+
+  // Note that we don't run SHA256_Final and return the middle state instead
+
+  Buffer *midstate_buf = Buffer::New(SHA256_DIGEST_LENGTH);
+  memcpy(Buffer::Data(midstate_buf), &c.h, SHA256_DIGEST_LENGTH);
+
+  free(blk_data);
+
+  return scope.Close(midstate_buf->handle_);
+}
+
+
+// Number of node pairs handed to double_sha256_digest_many at once
+#define MERKLE_CHUNK 64
+
+/**
+ * Hash one level of a merkle tree.
+ *
+ * Reads `count` 32 byte hashes from `in` and writes the (count + 1) / 2
+ * hashes of the next level to `out`. If the count is odd the last hash is
+ * paired with itself, like CBlock::BuildMerkleTree() does.
+ *
+ * `out` may equal `in`: pairs are hashed in chunks into a scratch area and
+ * output i is only written after inputs 2i and 2i + 1 have been consumed.
+ */
+static size_t
+merkle_level(const unsigned char *in, size_t count, unsigned char *out)
+{
+  size_t pairs = (count + 1) / 2;
+  const unsigned char *data[MERKLE_CHUNK];
+  size_t len[MERKLE_CHUNK];
+  unsigned char hashes[MERKLE_CHUNK * 32];
+  unsigned char odd[64];
+
+  for (size_t start = 0; start < pairs; start += MERKLE_CHUNK) {
+    size_t n = pairs - start < MERKLE_CHUNK ? pairs - start : MERKLE_CHUNK;
+
+    for (size_t i = 0; i < n; i++) {
+      size_t pos = 2 * (start + i);
+      if (pos + 1 < count) {
+        data[i] = in + 32 * pos;
+      } else {
+        memcpy(odd, in + 32 * pos, 32);
+        memcpy(odd + 32, in + 32 * pos, 32);
+        data[i] = odd;
+      }
+      len[i] = 64;
+    }
+
+    double_sha256_digest_many(data, len, n, hashes);
+    memcpy(out + 32 * start, hashes, 32 * n);
+  }
+
+  return pairs;
+}
+
+/**
+ * Total number of hashes in a merkle tree with `count` leaves.
+ */
+static size_t
+merkle_tree_size(size_t count)
+{
+  size_t total = count;
+  for (size_t size = count; size > 1; size = (size + 1) / 2) {
+    total += (size + 1) / 2;
+  }
+  return total;
+}
+
+
+static void
+ripemd160_digest(const unsigned char *data, size_t len, unsigned char *out)
+{
+  RIPEMD160(data, len, out);
+}
+
+typedef void (*digest_fn_t)(const unsigned char *, size_t, unsigned char *);
+
+static Handle<Value>
+hash_buffer (const Arguments& args, digest_fn_t fn, size_t digest_len)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1) {
+    return VException("One argument expected: data Buffer");
+  }
+  if (!Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: data Buffer");
+  }
+  v8::Handle<v8::Object> data_buf = args[0]->ToObject();
+
+  Buffer *hash_buf = Buffer::New(digest_len);
+  fn((const unsigned char *) Buffer::Data(data_buf), Buffer::Length(data_buf),
+     (unsigned char *) Buffer::Data(hash_buf));
+
+  return scope.Close(hash_buf->handle_);
+}
+
+static Handle<Value>
+sha256 (const Arguments& args)
+{
+  return hash_buffer(args, sha256_digest, SHA256_DIGEST_LENGTH);
+}
+
+static Handle<Value>
+ripemd160 (const Arguments& args)
+{
+  return hash_buffer(args, ripemd160_digest, RIPEMD160_DIGEST_LENGTH);
+}
+
+static Handle<Value>
+double_sha256 (const Arguments& args)
+{
+  return hash_buffer(args, double_sha256_digest, SHA256_DIGEST_LENGTH);
+}
+
+static Handle<Value>
+hash160 (const Arguments& args)
+{
+  return hash_buffer(args, hash160_digest, RIPEMD160_DIGEST_LENGTH);
+}
+
+/**
+ * Double SHA-256 of each Buffer in an array.
+ *
+ * Returns a single Buffer with the 32 byte hash of item i at offset 32 * i.
+ */
+static Handle<Value>
+double_sha256_many (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsArray()) {
+    return VException("One argument expected: an Array of Buffers");
+  }
+  Local<Array> items = Local<Array>::Cast(args[0]);
+  size_t count = items->Length();
+
+  vector<const unsigned char *> data(count ? count : 1);
+  vector<size_t> len(count ? count : 1);
+  for (size_t i = 0; i < count; i++) {
+    Local<Value> item = items->Get(i);
+    if (!Buffer::HasInstance(item)) {
+      return VException("One argument expected: an Array of Buffers");
+    }
+    data[i] = (const unsigned char *) Buffer::Data(item->ToObject());
+    len[i] = Buffer::Length(item->ToObject());
+  }
+
+  Buffer *hash_buf = Buffer::New(count * SHA256_DIGEST_LENGTH);
+  double_sha256_digest_many(&data[0], &len[0], count,
+                            (unsigned char *) Buffer::Data(hash_buf));
+
+  return scope.Close(hash_buf->handle_);
+}
+
+/**
+ * Calculate the merkle root for a Buffer of concatenated 32 byte hashes.
+ */
+static Handle<Value>
+merkle_root (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: hashes Buffer");
+  }
+  v8::Handle<v8::Object> hashes_buf = args[0]->ToObject();
+  size_t hashes_len = Buffer::Length(hashes_buf);
+
+  if (hashes_len == 0 || hashes_len % 32) {
+    return VException("Argument 'hashes' must be a non-empty multiple of 32 bytes");
+  }
+
+  // Work on a copy, each level overwrites the previous one
+  size_t count = hashes_len / 32;
+  unsigned char *level = (unsigned char *) malloc(hashes_len);
+  memcpy(level, Buffer::Data(hashes_buf), hashes_len);
+
+  while (count > 1) {
+    count = merkle_level(level, count, level);
+  }
+
+  Buffer *root_buf = Buffer::New(32);
+  memcpy(Buffer::Data(root_buf), level, 32);
+
+  free(level);
+
+  return scope.Close(root_buf->handle_);
+}
+
+/**
+ * Build the whole merkle tree for a Buffer of concatenated 32 byte hashes.
+ *
+ * Returns a Buffer with all levels of the tree one after the other, starting
+ * with the leaves and ending with the root.
+ */
+static Handle<Value>
+merkle_tree (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: hashes Buffer");
+  }
+  v8::Handle<v8::Object> hashes_buf = args[0]->ToObject();
+  size_t hashes_len = Buffer::Length(hashes_buf);
+
+  if (hashes_len == 0 || hashes_len % 32) {
+    return VException("Argument 'hashes' must be a non-empty multiple of 32 bytes");
+  }
+
+  size_t count = hashes_len / 32;
+  Buffer *tree_buf = Buffer::New(merkle_tree_size(count) * 32);
+  unsigned char *tree = (unsigned char *) Buffer::Data(tree_buf);
+  memcpy(tree, Buffer::Data(hashes_buf), hashes_len);
+
+  unsigned char *level = tree;
+  while (count > 1) {
+    unsigned char *next = level + 32 * count;
+    count = merkle_level(level, count, next);
+    level = next;
+  }
+
+  return scope.Close(tree_buf->handle_);
+}
+
+// Most getwork units prepared by a single work_batch call
+#define WORK_BATCH_MAX 4096
+
+/**
+ * Compute merkle roots and midstates for `count` getwork units that only
+ * differ in the extra nonce.
+ *
+ * Extra nonces `first` to `first + count - 1` are written as little endian
+ * uint32s at `offset` of the serialized coinbase. Each coinbase hash is then
+ * folded up `branch`, the concatenated sibling hashes of the coinbase from
+ * the leaves up, so a unit costs log2(n) hashes instead of a whole tree.
+ * Finally the header's first SHA-256 block is run with each merkle root.
+ *
+ * Writes 32 bytes per unit to both `roots` and `midstates`.
+ */
+static void
+prepare_work(const unsigned char *header, const unsigned char *coinbase,
+             size_t coinbase_len, size_t offset, uint32_t first, size_t count,
+             const unsigned char *branch, size_t branch_len,
+             unsigned char *roots, unsigned char *midstates)
+{
+  vector<unsigned char> coinbases(count * coinbase_len);
+  vector<unsigned char> pairs(count * 64);
+  vector<const unsigned char *> data(count);
+  vector<size_t> len(count);
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned char *p = &coinbases[i * coinbase_len];
+    memcpy(p, coinbase, coinbase_len);
+    write_le32(p + offset, first + (uint32_t) i);
+    data[i] = p;
+    len[i] = coinbase_len;
+  }
+  double_sha256_digest_many(&data[0], &len[0], count, roots);
+
+  // The coinbase is always the left node, its sibling the right one
+  for (size_t level = 0; level < branch_len / 32; level++) {
+    for (size_t i = 0; i < count; i++) {
+      memcpy(&pairs[i * 64], roots + i * 32, 32);
+      memcpy(&pairs[i * 64 + 32], branch + level * 32, 32);
+      data[i] = &pairs[i * 64];
+      len[i] = 64;
+    }
+    double_sha256_digest_many(&data[0], &len[0], count, roots);
+  }
+
+  // The first block of the header ends 28 bytes into the merkle root
+  unsigned char block[64];
+  memcpy(block, header, 64);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t state[8];
+    memcpy(block + 36, roots + i * 32, 28);
+    memcpy(state, SHA256_IV, sizeof(state));
+    sha256_transform(state, block, 1);
+    memcpy(midstates + i * 32, state, 32);
+  }
+}
+
+/**
+ * Prepare a batch of getwork units, see prepare_work().
+ *
+ * Returns {roots, midstates} with 32 bytes per unit in each Buffer.
+ */
+static Handle<Value>
+work_batch (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 6 || !Buffer::HasInstance(args[0]) ||
+      !Buffer::HasInstance(args[1]) || !args[2]->IsNumber() ||
+      !args[3]->IsNumber() || !args[4]->IsNumber() ||
+      !Buffer::HasInstance(args[5])) {
+    return VException("Six arguments expected: header Buffer, coinbase Buffer, "
+                      "offset, first, count, branch Buffer");
+  }
+  v8::Handle<v8::Object> header_buf = args[0]->ToObject();
+  v8::Handle<v8::Object> coinbase_buf = args[1]->ToObject();
+  v8::Handle<v8::Object> branch_buf = args[5]->ToObject();
+  size_t coinbase_len = Buffer::Length(coinbase_buf);
+  size_t branch_len = Buffer::Length(branch_buf);
+  int64_t offset = args[2]->IntegerValue();
+  int64_t count = args[4]->IntegerValue();
+
+  if (Buffer::Length(header_buf) != 80) {
+    return VException("Argument 'header' must be 80 bytes");
+  }
+  if (offset < 0 || (size_t) offset + 4 > coinbase_len) {
+    return VException("Argument 'offset' is outside of the coinbase");
+  }
+  if (count < 1 || count > WORK_BATCH_MAX) {
+    return VException("Argument 'count' is out of range");
+  }
+  if (branch_len % 32) {
+    return VException("Argument 'branch' must be a multiple of 32 bytes");
+  }
+
+  Buffer *roots_buf = Buffer::New(count * 32);
+  Buffer *midstates_buf = Buffer::New(count * 32);
+  prepare_work((const unsigned char *) Buffer::Data(header_buf),
+               (const unsigned char *) Buffer::Data(coinbase_buf),
+               coinbase_len, offset, args[3]->Uint32Value(), count,
+               (const unsigned char *) Buffer::Data(branch_buf), branch_len,
+               (unsigned char *) Buffer::Data(roots_buf),
+               (unsigned char *) Buffer::Data(midstates_buf));
+
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("roots"), roots_buf->handle_);
+  result->Set(String::NewSymbol("midstates"), midstates_buf->handle_);
+  return scope.Close(result);
+}
+
+static Handle<Value>
+sha256_kernel_list (unsigned int kernels)
+{
+  HandleScope scope;
+
+  Local<Array> names = Array::New();
+  unsigned int n = 0;
+  for (int k = SHA256_KERNEL_SHANI; k >= SHA256_KERNEL_OPENSSL; k--) {
+    if (kernels & SHA256_KERNEL_BIT(k)) {
+      names->Set(n++, String::New(SHA256_KERNEL_NAMES[k]));
+    }
+  }
+
+  return scope.Close(names);
+}
+
+/**
+ * Names of the SHA-256 kernels in use ("shani", "avx2", "openssl").
+ */
+static Handle<Value>
+sha256_kernel (const Arguments& args)
+{
+  HandleScope scope;
+  return scope.Close(sha256_kernel_list(sha256_enabled_kernels));
+}
+
+/**
+ * Names of the SHA-256 kernels the CPU supports.
+ */
+static Handle<Value>
+sha256_kernels (const Arguments& args)
+{
+  HandleScope scope;
+  return scope.Close(sha256_kernel_list(sha256_supported_kernels));
+}
+
+/**
+ * Restrict SHA-256 to one kernel, mostly useful for testing. OpenSSL stays
+ * available as the fallback. "auto" enables every supported kernel again.
+ *
+ * Returns false if the CPU doesn't support the requested kernel.
+ */
+static Handle<Value>
+sha256_set_kernel (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsString()) {
+    return VException("One argument expected: kernel name String");
+  }
+  String::AsciiValue name(args[0]->ToString());
+
+  if (strcmp(*name, "auto") == 0) {
+    sha256_enabled_kernels = sha256_supported_kernels;
+    return scope.Close(True());
+  }
+
+  for (int k = SHA256_KERNEL_OPENSSL; k <= SHA256_KERNEL_SHANI; k++) {
+    if (strcmp(*name, SHA256_KERNEL_NAMES[k]) == 0) {
+      if (!(sha256_supported_kernels & SHA256_KERNEL_BIT(k))) {
+        return scope.Close(False());
+      }
+      sha256_enabled_kernels = SHA256_KERNEL_BIT(k) |
+        SHA256_KERNEL_BIT(SHA256_KERNEL_OPENSSL);
+      return scope.Close(True());
+    }
+  }
+
+  return scope.Close(False());
+}
+
+static Handle<Value>
+pubkey_cache_stats (const Arguments& args)
+{
+  HandleScope scope;
+  return scope.Close(pubkey_cache().GetStats());
+}
+
+static Handle<Value>
+pubkey_cache_set_size (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return VException("One argument expected: size Number");
+  }
+  if (args[0]->IntegerValue() < 0) {
+    return VException("Cache size must not be negative");
+  }
+
+  pubkey_cache().SetCapacity(args[0]->IntegerValue());
+
+  return scope.Close(Undefined());
+}
+
+/**
+ * Flat offset tables for a run of serialized transactions.
+ *
+ * Every entry is a byte offset into the parsed buffer:
+ *
+ *   txs   start, end, first input, input count, first output, output count
+ *   ins   outpoint, script, script length (the sequence follows the script)
+ *   outs  value, script, script length
+ */
+#define TX_TABLE_WIDTH 6
+#define TXIO_TABLE_WIDTH 3
+
+struct tx_table_t {
+  vector<uint32_t> txs;
+  vector<uint32_t> ins;
+  vector<uint32_t> outs;
+};
+
+/**
+ * Parse `count` transactions at `*p`, appending them to `table`.
+ *
+ * Returns NULL on success or an error message if the data is malformed.
+ */
+static const char *
+parse_tx_table(const unsigned char *base, const unsigned char **p,
+               const unsigned char *end, uint64_t count, tx_table_t *table)
+{
+  // Smallest possible transaction is 10 bytes, smallest input 41 and
+  // smallest output 9, which bounds the counts before we trust them.
+  if (count > (uint64_t) (end - *p) / 10) {
+    return "Transaction count exceeds data size";
+  }
+
+  for (uint64_t i = 0; i < count; i++) {
+    const unsigned char *start = *p;
+    uint64_t n, len;
+
+    table->txs.push_back(start - base);
+    table->txs.push_back(0);
+
+    if (!skip_bytes(p, end, 4) || !read_varint(p, end, &n)) {
+      return "Transaction truncated";
+    }
+    if (n > (uint64_t) (end - *p) / 41) {
+      return "Input count exceeds data size";
+    }
+    table->txs.push_back(table->ins.size() / TXIO_TABLE_WIDTH);
+    table->txs.push_back(n);
+    for (uint64_t j = 0; j < n; j++) {
+      const unsigned char *outpoint = *p;
+      if (!skip_bytes(p, end, 36) || !read_varint(p, end, &len) ||
+          !skip_bytes(p, end, len) || !skip_bytes(p, end, 4)) {
+        return "Transaction input truncated";
+      }
+      table->ins.push_back(outpoint - base);
+      table->ins.push_back(*p - 4 - len - base);
+      table->ins.push_back(len);
+    }
+
+    if (!read_varint(p, end, &n)) {
+      return "Transaction truncated";
+    }
+    if (n > (uint64_t) (end - *p) / 9) {
+      return "Output count exceeds data size";
+    }
+    table->txs.push_back(table->outs.size() / TXIO_TABLE_WIDTH);
+    table->txs.push_back(n);
+    for (uint64_t j = 0; j < n; j++) {
+      const unsigned char *value = *p;
+      if (!skip_bytes(p, end, 8) || !read_varint(p, end, &len) ||
+          !skip_bytes(p, end, len)) {
+        return "Transaction output truncated";
+      }
+      table->outs.push_back(value - base);
+      table->outs.push_back(*p - len - base);
+      table->outs.push_back(len);
+    }
+
+    if (!skip_bytes(p, end, 4)) {
+      return "Transaction truncated";
+    }
+    table->txs[table->txs.size() - TX_TABLE_WIDTH + 1] = *p - base;
+  }
+
+  return NULL;
+}
+
+static Local<Object>
+uint32_table_buffer(const vector<uint32_t> &table)
+{
+  Buffer *buf = Buffer::New(table.size() * 4);
+  unsigned char *p = (unsigned char *) Buffer::Data(buf);
+  for (size_t i = 0; i < table.size(); i++) {
+    write_le32(p + 4 * i, table[i]);
+  }
+  return Local<Object>::New(buf->handle_);
+}
+
+/**
+ * Double SHA-256 every transaction of a parsed table into `out`, 32 bytes
+ * per transaction.
+ */
+static void
+tx_table_hashes(const unsigned char *base, const tx_table_t &table,
+                unsigned char *out)
+{
+  size_t count = table.txs.size() / TX_TABLE_WIDTH;
+
+  vector<const unsigned char *> data(count ? count : 1);
+  vector<size_t> len(count ? count : 1);
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t *tx = &table.txs[i * TX_TABLE_WIDTH];
+    data[i] = base + tx[0];
+    len[i] = tx[1] - tx[0];
+  }
+
+  double_sha256_digest_many(&data[0], &len[0], count, out);
+}
+
+/**
+ * Turn a parsed table into {buffer, txs, ins, outs, hashes, end}.
+ *
+ * The table entries are little endian uint32s, `hashes` holds the double
+ * SHA-256 of every transaction, 32 bytes each. They are computed here
+ * unless `hashes` passes them in.
+ */
+static Local<Object>
+tx_table_object(v8::Handle<v8::Object> source, const tx_table_t &table,
+                size_t end, const unsigned char *hashes = NULL)
+{
+  const unsigned char *base = (const unsigned char *) Buffer::Data(source);
+  size_t count = table.txs.size() / TX_TABLE_WIDTH;
+
+  Buffer *hash_buf = Buffer::New(count * SHA256_DIGEST_LENGTH);
+  if (hashes) {
+    memcpy(Buffer::Data(hash_buf), hashes, count * SHA256_DIGEST_LENGTH);
+  } else {
+    tx_table_hashes(base, table,
+                    (unsigned char *) Buffer::Data(hash_buf));
+  }
+
+  Local<Object> result = Object::New();
+  result->Set(String::New("buffer"), source);
+  result->Set(String::New("txs"), uint32_table_buffer(table.txs));
+  result->Set(String::New("ins"), uint32_table_buffer(table.ins));
+  result->Set(String::New("outs"), uint32_table_buffer(table.outs));
+  result->Set(String::New("hashes"), hash_buf->handle_);
+  result->Set(String::New("end"), Integer::NewFromUnsigned(end));
+  return result;
+}
+
+/**
+ * Parse the transactions of a raw block payload in one pass.
+ *
+ * Returns the offset tables described at tx_table_t plus the hash of
+ * every transaction, without creating any per-field objects.
+ */
+static Handle<Value>
+parse_block (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: block Buffer");
+  }
+  v8::Handle<v8::Object> block_buf = args[0]->ToObject();
+  const unsigned char *base = (const unsigned char *) Buffer::Data(block_buf);
+  const unsigned char *end = base + Buffer::Length(block_buf);
+  const unsigned char *p = base;
+
+  uint64_t count;
+  if (!skip_bytes(&p, end, 80) || !read_varint(&p, end, &count)) {
+    return VException("Block header truncated");
+  }
+
+  tx_table_t table;
+  const char *err = parse_tx_table(base, &p, end, count, &table);
+  if (err) {
+    return VException(err);
+  }
+
+  return scope.Close(tx_table_object(block_buf, table, p - base));
+}
+
+/**
+ * Parse a single transaction starting at an optional offset.
+ *
+ * Same result as parse_block, `end` is where the transaction stops.
+ */
+static Handle<Value>
+parse_tx (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+    return VException("Argument 'tx' must be of type Buffer");
+  }
+  v8::Handle<v8::Object> tx_buf = args[0]->ToObject();
+  const unsigned char *base = (const unsigned char *) Buffer::Data(tx_buf);
+  size_t len = Buffer::Length(tx_buf);
+
+  size_t offset = 0;
+  if (args.Length() > 1 && !args[1]->IsUndefined()) {
+    if (!args[1]->IsNumber() || args[1]->IntegerValue() < 0 ||
+        (size_t) args[1]->IntegerValue() > len) {
+      return VException("Argument 'offset' out of bounds");
+    }
+    offset = args[1]->IntegerValue();
+  }
+  const unsigned char *p = base + offset;
+
+  tx_table_t table;
+  const char *err = parse_tx_table(base, &p, base + len, 1, &table);
+  if (err) {
+    return VException(err);
+  }
+
+  return scope.Close(tx_table_object(tx_buf, table, p - base));
+}
+
+/**
+ * Fixed width 256 bit arithmetic
+ *
+ * Targets and chain work are unsigned 256 bit integers. JavaScript sees
+ * them as 32 byte big endian Buffers, here they are eight 32 bit limbs on
+ * the stack, least significant first. Nothing allocates, so proof of work
+ * checks and chain work comparisons don't touch the heap.
+ */
+struct uint256_t {
+  uint32_t limb[8];
+};
+
+/**
+ * Load a big endian number of up to 32 bytes.
+ */
+static void
+uint256_from_be(uint256_t *a, const unsigned char *p, size_t len)
+{
+  memset(a->limb, 0, sizeof(a->limb));
+  for (size_t i = 0; i < len; i++) {
+    size_t bit = 8 * (len - 1 - i);
+    a->limb[bit / 32] |= (uint32_t) p[i] << (bit % 32);
+  }
+}
+
+static void
+uint256_to_be(const uint256_t *a, unsigned char *p)
+{
+  for (int i = 0; i < 8; i++) {
+    write_be32(p + 4 * i, a->limb[7 - i]);
+  }
+}
+
+static int
+uint256_cmp(const uint256_t *a, const uint256_t *b)
+{
+  for (int i = 7; i >= 0; i--) {
+    if (a->limb[i] != b->limb[i]) {
+      return a->limb[i] < b->limb[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Number of significant bits.
+ */
+static int
+uint256_bits(const uint256_t *a)
+{
+  for (int i = 7; i >= 0; i--) {
+    if (a->limb[i]) {
+      int bits = 32 * i;
+      for (uint32_t x = a->limb[i]; x; x >>= 1) {
+        bits++;
+      }
+      return bits;
+    }
+  }
+  return 0;
+}
+
+/**
+ * a += b, modulo 2^256.
+ */
+static void
+uint256_add(uint256_t *a, const uint256_t *b)
+{
+  uint64_t carry = 0;
+  for (int i = 0; i < 8; i++) {
+    uint64_t sum = carry + a->limb[i] + b->limb[i];
+    a->limb[i] = (uint32_t) sum;
+    carry = sum >> 32;
+  }
+}
+
+/**
+ * a -= b, modulo 2^256.
+ */
+static void
+uint256_sub(uint256_t *a, const uint256_t *b)
+{
+  int64_t borrow = 0;
+  for (int i = 0; i < 8; i++) {
+    int64_t diff = (int64_t) a->limb[i] - b->limb[i] - borrow;
+    borrow = diff < 0;
+    a->limb[i] = (uint32_t) diff;
+  }
+}
+
+static void
+uint256_shift_left(uint256_t *a, unsigned int shift)
+{
+  uint256_t r;
+  memset(r.limb, 0, sizeof(r.limb));
+  int k = shift / 32;
+  shift %= 32;
+  for (int i = 0; i < 8; i++) {
+    if (i + k + 1 < 8 && shift) {
+      r.limb[i + k + 1] |= a->limb[i] >> (32 - shift);
+    }
+    if (i + k < 8) {
+      r.limb[i + k] |= a->limb[i] << shift;
+    }
+  }
+  *a = r;
+}
+
+static void
+uint256_shift_right(uint256_t *a, unsigned int shift)
+{
+  uint256_t r;
+  memset(r.limb, 0, sizeof(r.limb));
+  int k = shift / 32;
+  shift %= 32;
+  for (int i = 0; i < 8; i++) {
+    if (i - k - 1 >= 0 && shift) {
+      r.limb[i - k - 1] |= a->limb[i] << (32 - shift);
+    }
+    if (i - k >= 0) {
+      r.limb[i - k] |= a->limb[i] >> shift;
+    }
+  }
+  *a = r;
+}
+
+/**
+ * a *= m, modulo 2^256.
+ */
+static void
+uint256_mul32(uint256_t *a, uint32_t m)
+{
+  uint64_t carry = 0;
+  for (int i = 0; i < 8; i++) {
+    uint64_t product = carry + (uint64_t) a->limb[i] * m;
+    a->limb[i] = (uint32_t) product;
+    carry = product >> 32;
+  }
+}
+
+/**
+ * a /= d for a non-zero 32 bit divisor.
+ */
+static void
+uint256_div32(uint256_t *a, uint32_t d)
+{
+  uint64_t rem = 0;
+  for (int i = 7; i >= 0; i--) {
+    uint64_t cur = (rem << 32) | a->limb[i];
+    a->limb[i] = (uint32_t) (cur / d);
+    rem = cur % d;
+  }
+}
+
+/**
+ * a /= d by shift and subtract, d must not be zero.
+ */
+static void
+uint256_div(uint256_t *a, const uint256_t *d)
+{
+  uint256_t num = *a;
+  uint256_t div = *d;
+  uint256_t quot;
+  memset(quot.limb, 0, sizeof(quot.limb));
+
+  int shift = uint256_bits(&num) - uint256_bits(&div);
+  if (shift >= 0) {
+    uint256_shift_left(&div, shift);
+    for (; shift >= 0; shift--) {
+      if (uint256_cmp(&num, &div) >= 0) {
+        uint256_sub(&num, &div);
+        quot.limb[shift / 32] |= (uint32_t) 1 << (shift % 32);
+      }
+      uint256_shift_right(&div, 1);
+    }
+  }
+  *a = quot;
+}
+
+/**
+ * Expand compact difficulty bits: a 24 bit mantissa shifted by the byte
+ * count in the top 8 bits.
+ *
+ * Like Util.decodeDiffBits() always did, the sign bit counts as part of
+ * the mantissa and bits shifted past 256 are dropped.
+ */
+static void
+uint256_set_compact(uint256_t *a, uint32_t bits)
+{
+  int size = bits >> 24;
+  memset(a->limb, 0, sizeof(a->limb));
+  a->limb[0] = bits & 0x00ffffff;
+  if (size <= 3) {
+    uint256_shift_right(a, 8 * (3 - size));
+  } else {
+    uint256_shift_left(a, 8 * (size - 3) > 256 ? 256 : 8 * (size - 3));
+  }
+}
+
+/**
+ * Compact difficulty bits for a target, the inverse of set_compact.
+ */
+static uint32_t
+uint256_get_compact(const uint256_t *a)
+{
+  int size = (uint256_bits(a) + 7) / 8;
+  uint256_t m = *a;
+  if (size <= 3) {
+    uint256_shift_left(&m, 8 * (3 - size));
+  } else {
+    uint256_shift_right(&m, 8 * (size - 3));
+  }
+  uint32_t compact = m.limb[0] & 0x00ffffff;
+
+  // The mantissa is signed, keep its top bit clear
+  if (compact & 0x00800000) {
+    compact >>= 8;
+    size++;
+  }
+  return compact | (uint32_t) size << 24;
+}
+
+/**
+ * Expected number of hashes to meet `target`: 2^256 / (target + 1).
+ *
+ * 2^256 doesn't fit, so this computes ~target / (target + 1) + 1 instead.
+ * Zero targets get zero work.
+ */
+static void
+uint256_work(uint256_t *work, const uint256_t *target)
+{
+  uint256_t one, div;
+  memset(one.limb, 0, sizeof(one.limb));
+  one.limb[0] = 1;
+
+  memset(work->limb, 0, sizeof(work->limb));
+  if (uint256_bits(target) == 0) {
+    return;
+  }
+
+  div = *target;
+  uint256_add(&div, &one);
+  for (int i = 0; i < 8; i++) {
+    work->limb[i] = ~target->limb[i];
+  }
+  uint256_div(work, &div);
+  uint256_add(work, &one);
+}
+
+/**
+ * Expand compact difficulty bits into a 32 byte big endian target.
+ *
+ * Returns false for negative, zero or overflowing targets, which no block
+ * can meet.
+ */
+static bool
+compact_to_target(uint32_t bits, unsigned char *target)
+{
+  int size = bits >> 24;
+  uint32_t mantissa = bits & 0x007fffff;
+  if ((bits & 0x00800000) || mantissa == 0) {
+    return false;
+  }
+
+  memset(target, 0, 32);
+  for (int i = 0; i < 3; i++) {
+    unsigned char byte = (mantissa >> (8 * (2 - i))) & 0xff;
+    int pos = 32 - size + i;
+    if (pos < 0) {
+      if (byte) return false;
+    } else if (pos < 32) {
+      target[pos] = byte;
+    }
+  }
+
+  for (int i = 0; i < 32; i++) {
+    if (target[i]) return true;
+  }
+  return false;
+}
+
+/**
+ * Whether a hash in internal (little endian) byte order is at or below a
+ * big endian target.
+ */
+static bool
+hash_meets_target(const unsigned char *hash, const unsigned char *target)
+{
+  for (int i = 0; i < 32; i++) {
+    if (hash[31 - i] != target[i]) {
+      return hash[31 - i] < target[i];
+    }
+  }
+  return true;
+}
+
+/**
+ * Load a Buffer of at most 32 big endian bytes, leading zero bytes beyond
+ * that are tolerated. Returns false for anything longer or not a Buffer.
+ */
+static bool
+uint256_from_buffer(uint256_t *a, v8::Handle<v8::Value> value)
+{
+  if (!Buffer::HasInstance(value)) {
+    return false;
+  }
+  v8::Handle<v8::Object> buf = value->ToObject();
+  const unsigned char *p = (const unsigned char *) Buffer::Data(buf);
+  size_t len = Buffer::Length(buf);
+  while (len > 32 && *p == 0) {
+    p++;
+    len--;
+  }
+  if (len > 32) {
+    return false;
+  }
+  uint256_from_be(a, p, len);
+  return true;
+}
+
+static Handle<Value>
+uint256_buffer(const uint256_t *a)
+{
+  Buffer *buf = Buffer::New(32);
+  uint256_to_be(a, (unsigned char *) Buffer::Data(buf));
+  return buf->handle_;
+}
+
+/**
+ * Target for compact difficulty bits, as a 32 byte big endian Buffer.
+ */
+static Handle<Value>
+decode_bits (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return VException("One argument expected: bits Number");
+  }
+
+  uint256_t target;
+  uint256_set_compact(&target, args[0]->Uint32Value());
+  return scope.Close(uint256_buffer(&target));
+}
+
+/**
+ * Compact difficulty bits for a big endian target Buffer.
+ */
+static Handle<Value>
+encode_bits (const Arguments& args)
+{
+  HandleScope scope;
+
+  uint256_t target;
+  if (args.Length() != 1 || !uint256_from_buffer(&target, args[0])) {
+    return VException("One argument expected: target Buffer of up to 256 bits");
+  }
+
+  return scope.Close(Integer::NewFromUnsigned(uint256_get_compact(&target)));
+}
+
+/**
+ * Whether a block hash (internal byte order) meets its difficulty bits.
+ *
+ * Negative, zero and overflowing targets are never met.
+ */
+static Handle<Value>
+check_proof_of_work (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 2 || !Buffer::HasInstance(args[0]) ||
+      Buffer::Length(args[0]->ToObject()) != 32 || !args[1]->IsNumber()) {
+    return VException("Two arguments expected: hash Buffer, bits Number");
+  }
+
+  unsigned char target[32];
+  const unsigned char *hash =
+    (const unsigned char *) Buffer::Data(args[0]->ToObject());
+  bool ok = compact_to_target(args[1]->Uint32Value(), target) &&
+    hash_meets_target(hash, target);
+  return scope.Close(Boolean::New(ok));
+}
+
+/**
+ * Work that went into a block with the given difficulty bits, as a 32 byte
+ * big endian Buffer.
+ */
+static Handle<Value>
+block_work (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return VException("One argument expected: bits Number");
+  }
+
+  uint256_t target, work;
+  uint256_set_compact(&target, args[0]->Uint32Value());
+  uint256_work(&work, &target);
+  return scope.Close(uint256_buffer(&work));
+}
+
+/**
+ * Chain work of a block: its parent's chain work plus the work for its
+ * difficulty bits.
+ */
+static Handle<Value>
+chain_work (const Arguments& args)
+{
+  HandleScope scope;
+
+  uint256_t chain, target, work;
+  if (args.Length() != 2 || !uint256_from_buffer(&chain, args[0]) ||
+      !args[1]->IsNumber()) {
+    return VException("Two arguments expected: chain work Buffer, bits Number");
+  }
+
+  uint256_set_compact(&target, args[1]->Uint32Value());
+  uint256_work(&work, &target);
+  uint256_add(&chain, &work);
+  return scope.Close(uint256_buffer(&chain));
+}
+
+/**
+ * Sum of two big endian Buffers of up to 256 bits.
+ */
+static Handle<Value>
+add_work (const Arguments& args)
+{
+  HandleScope scope;
+
+  uint256_t a, b;
+  if (args.Length() != 2 || !uint256_from_buffer(&a, args[0]) ||
+      !uint256_from_buffer(&b, args[1])) {
+    return VException("Two arguments expected: Buffers of up to 256 bits");
+  }
+
+  uint256_add(&a, &b);
+  return scope.Close(uint256_buffer(&a));
+}
+
+/**
+ * Compare two big endian Buffers of up to 256 bits, returns -1, 0 or 1.
+ */
+static Handle<Value>
+compare_work (const Arguments& args)
+{
+  HandleScope scope;
+
+  uint256_t a, b;
+  if (args.Length() != 2 || !uint256_from_buffer(&a, args[0]) ||
+      !uint256_from_buffer(&b, args[1])) {
+    return VException("Two arguments expected: Buffers of up to 256 bits");
+  }
+
+  return scope.Close(Integer::New(uint256_cmp(&a, &b)));
+}
+
+/**
+ * Difficulty bits after a retarget period that took `actual` seconds
+ * instead of `timespan`, capped at the proof of work limit `limit`.
+ *
+ * The caller clamps `actual` to the allowed range.
+ */
+static Handle<Value>
+retarget_bits (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 4 || !args[0]->IsNumber() || !args[1]->IsNumber() ||
+      !args[2]->IsNumber() || !args[3]->IsNumber() ||
+      args[2]->Uint32Value() == 0) {
+    return VException("Four arguments expected: bits, actual timespan, "
+                      "target timespan, limit bits");
+  }
+
+  uint256_t target, limit;
+  uint256_set_compact(&target, args[0]->Uint32Value());
+  uint256_set_compact(&limit, args[3]->Uint32Value());
+
+  uint256_mul32(&target, args[1]->Uint32Value());
+  uint256_div32(&target, args[2]->Uint32Value());
+  if (uint256_cmp(&target, &limit) > 0) {
+    target = limit;
+  }
+
+  return scope.Close(Integer::NewFromUnsigned(uint256_get_compact(&target)));
+}
+
+/**
+ * Raw block files
+ *
+ * bitcoind's blk*.dat files are a sequence of frames: the network magic, the
+ * block size as a little endian uint32 and the serialized block. Unused
+ * space at the end of a file is zero filled.
+ */
+#define BLOCK_FILE_FRAME_HEADER 8
+#define BLOCK_FILE_MAX_BLOCK (32 * 1024 * 1024)
+
+// Smallest number of blocks worth handing to a thread of its own
+#define BLOCK_FILE_MIN_JOB 8
+
+struct block_frame_t {
+  // Block position within the chunk
+  size_t offset;
+  size_t length;
+
+  // Results
+  unsigned char hash[32];
+  tx_table_t table;
+  vector<unsigned char> hashes;
+  const char *error;
+};
+
+struct block_file_t {
+  Persistent<Object> chunk;
+  const unsigned char *data;
+  vector<block_frame_t> frames;
+  size_t end;
+
+  int pending;
+  Persistent<Function> cb;
+};
+
+struct block_file_job_t {
+  block_file_t *file;
+  size_t start;
+  size_t stop;
+};
+
+/**
+ * Find the complete frames in `data`. Returns the offset at which the
+ * caller should continue once more data is available.
+ */
+static size_t
+scan_block_frames(const unsigned char *data, size_t len,
+                  const unsigned char *magic, vector<block_frame_t> *frames)
+{
+  size_t pos = 0;
+  while (pos + BLOCK_FILE_FRAME_HEADER <= len) {
+    if (memcmp(data + pos, magic, 4)) {
+      // Padding or garbage, resynchronize on the next magic
+      pos++;
+      continue;
+    }
+
+    size_t length = read_le32(data + pos + 4);
+    if (length < 80 || length > BLOCK_FILE_MAX_BLOCK) {
+      pos++;
+      continue;
+    }
+    if (pos + BLOCK_FILE_FRAME_HEADER + length > len) {
+      break;
+    }
+
+    block_frame_t frame;
+    frame.offset = pos + BLOCK_FILE_FRAME_HEADER;
+    frame.length = length;
+    frame.error = NULL;
+    frames->push_back(frame);
+
+    pos += BLOCK_FILE_FRAME_HEADER + length;
+  }
+
+  // Keep a partial header for the next chunk, but don't hold on to padding
+  if (pos + BLOCK_FILE_FRAME_HEADER > len) {
+    size_t keep = pos;
+    while (keep < len && memcmp(data + keep, magic, len - keep < 4 ?
+                                len - keep : 4)) {
+      keep++;
+    }
+    pos = keep;
+  }
+  return pos;
+}
+
+/**
+ * Parse a block, check its proof of work and merkle root.
+ */
+static void
+check_block_frame(const unsigned char *data, block_frame_t *frame)
+{
+  const unsigned char *base = data + frame->offset;
+  const unsigned char *end = base + frame->length;
+  const unsigned char *p = base + 80;
+
+  double_sha256_digest(base, 80, frame->hash);
+
+  unsigned char target[32];
+  if (!compact_to_target(read_le32(base + 72), target)) {
+    frame->error = "Invalid difficulty bits";
+    return;
+  }
+  if (!hash_meets_target(frame->hash, target)) {
+    frame->error = "Difficulty target not met";
+    return;
+  }
+
+  uint64_t count;
+  if (!read_varint(&p, end, &count) || count == 0) {
+    frame->error = "Block has no transactions";
+    return;
+  }
+  frame->error = parse_tx_table(base, &p, end, count, &frame->table);
+  if (frame->error) {
+    return;
+  }
+  if (p != end) {
+    frame->error = "Block size doesn't match its transactions";
+    return;
+  }
+
+  frame->hashes.resize(32 * count);
+  tx_table_hashes(base, frame->table, &frame->hashes[0]);
+
+  vector<unsigned char> level(frame->hashes);
+  size_t n = count;
+  while (n > 1) {
+    n = merkle_level(&level[0], n, &level[0]);
+  }
+  if (memcmp(&level[0], base + 36, 32)) {
+    frame->error = "Merkle root incorrect";
+  }
+}
+
+EIO_CALLBACK(EIO_ParseBlockFile)
+{
+  block_file_job_t *job = static_cast<block_file_job_t *>(req->data);
+
+  for (size_t i = job->start; i < job->stop; i++) {
+    check_block_frame(job->file->data, &job->file->frames[i]);
+  }
+
+  EIO_RETURN;
+}
+
+static int
+ParseBlockFileCallback(eio_req *req)
+{
+  HandleScope scope;
+  block_file_job_t *job = static_cast<block_file_job_t *>(req->data);
+  block_file_t *file = job->file;
+  ev_unref(EV_DEFAULT_UC);
+
+  delete job;
+
+  if (--file->pending > 0) {
+    return 0;
+  }
+
+  Local<Array> blocks = Array::New(file->frames.size());
+  for (size_t i = 0; i < file->frames.size(); i++) {
+    block_frame_t *frame = &file->frames[i];
+    Local<Object> block;
+    if (frame->error) {
+      block = Object::New();
+      block->Set(String::New("error"), String::New(frame->error));
+    } else {
+      // Offsets in the table are relative to the block, the caller
+      // replaces `buffer` with a slice of the chunk.
+      block = tx_table_object(file->chunk, frame->table, frame->length,
+                              &frame->hashes[0]);
+    }
+    block->Set(String::New("offset"), Integer::NewFromUnsigned(frame->offset));
+    block->Set(String::New("length"), Integer::NewFromUnsigned(frame->length));
+    Buffer *hash_buf = Buffer::New(32);
+    memcpy(Buffer::Data(hash_buf), frame->hash, 32);
+    block->Set(String::New("hash"), hash_buf->handle_);
+    blocks->Set(i, block);
+  }
+
+  Local<Object> result = Object::New();
+  result->Set(String::New("blocks"), blocks);
+  result->Set(String::New("end"), Integer::NewFromUnsigned(file->end));
+
+  Local<Value> argv[2];
+  argv[0] = Local<Value>::New(Null());
+  argv[1] = result;
+
+  TryCatch try_catch;
+
+  file->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  file->cb.Dispose();
+  file->chunk.Dispose();
+
+  delete file;
+  return 0;
+}
+
+/**
+ * Parse a chunk of a blk*.dat file on the thread pool:
+ * parse_block_file(chunk, magic, callback).
+ *
+ * Calls back with {blocks, end}. Every complete frame in the chunk gives
+ * one entry in `blocks` with its `offset`, `length` and `hash`, plus either
+ * the parse_block tables or an `error` if the block is malformed, misses
+ * its difficulty target or has a wrong merkle root. Reading should resume
+ * at `end`, where the first incomplete frame starts.
+ */
+static Handle<Value>
+parse_block_file (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 3 || !Buffer::HasInstance(args[0]) ||
+      !Buffer::HasInstance(args[1]) ||
+      Buffer::Length(args[1]->ToObject()) != 4) {
+    return VException("Three arguments expected: chunk Buffer, magic Buffer "
+                      "of 4 bytes, callback");
+  }
+  REQ_FUN_ARG(2, cb);
+
+  v8::Handle<v8::Object> chunk = args[0]->ToObject();
+
+  block_file_t *file = new block_file_t();
+  file->data = (const unsigned char *) Buffer::Data(chunk);
+  file->end = scan_block_frames(file->data, Buffer::Length(chunk),
+                                (const unsigned char *)
+                                Buffer::Data(args[1]->ToObject()),
+                                &file->frames);
+  file->chunk = Persistent<Object>::New(chunk);
+  file->cb = Persistent<Function>::New(cb);
+
+  size_t count = file->frames.size();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t jobs = cpus > 0 ? (size_t) cpus : 1;
+  if (jobs > (count + BLOCK_FILE_MIN_JOB - 1) / BLOCK_FILE_MIN_JOB) {
+    jobs = (count + BLOCK_FILE_MIN_JOB - 1) / BLOCK_FILE_MIN_JOB;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  file->pending = jobs;
+
+  // Blocks vary a lot in size, so split by bytes rather than by count
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += file->frames[i].length;
+  }
+
+  size_t start = 0, done = 0;
+  for (size_t j = 0; j < jobs; j++) {
+    block_file_job_t *job = new block_file_job_t();
+    job->file = file;
+    job->start = start;
+
+    size_t share = total * (j + 1) / jobs;
+    while (start < count && (done < share || j == jobs - 1)) {
+      done += file->frames[start++].length;
+    }
+    job->stop = start;
+
+    eio_custom(EIO_ParseBlockFile, EIO_PRI_DEFAULT, ParseBlockFileCallback,
+               job);
+    ev_ref(EV_DEFAULT_UC);
+  }
+
+  return scope.Close(Undefined());
+}
+
+/**
+ * Fixed-layout block index record, all integers little endian:
+ *
+ *     0  80-byte block header
+ *    80  height
+ *    84  size
+ *    88  flags (BLOCK_RECORD_ACTIVE)
+ *    89  chain work, 32 bytes big endian
+ *   121  transaction count, followed by that many 32-byte hashes
+ */
+#define BLOCK_RECORD_SIZE 125
+#define BLOCK_RECORD_ACTIVE 1
+
+static bool
+record_buffer_field(v8::Handle<v8::Object> obj, const char *name,
+                    size_t len, unsigned char *out)
+{
+  Local<Value> value = obj->Get(String::New(name));
+  if (!Buffer::HasInstance(value)) {
+    return false;
+  }
+  v8::Handle<v8::Object> buf = value->ToObject();
+  if (Buffer::Length(buf) != len) {
+    return false;
+  }
+  memcpy(out, Buffer::Data(buf), len);
+  return true;
+}
+
+static uint32_t
+record_uint32_field(v8::Handle<v8::Object> obj, const char *name)
+{
+  return obj->Get(String::New(name))->Uint32Value();
+}
+
+/**
+ * Serialize a Block into the record layout above.
+ */
+static Handle<Value>
+encode_block_record (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsObject()) {
+    return VException("One argument expected: block Object");
+  }
+  Local<Object> block = args[0]->ToObject();
+
+  Local<Value> txs_val = block->Get(String::New("txs"));
+  if (!txs_val->IsArray()) {
+    return VException("Block 'txs' must be an Array");
+  }
+  Local<Array> txs = Local<Array>::Cast(txs_val);
+  uint32_t count = txs->Length();
+
+  Local<Value> work_val = block->Get(String::New("chainWork"));
+  if (!Buffer::HasInstance(work_val)) {
+    return VException("Block 'chainWork' must be of type Buffer");
+  }
+  v8::Handle<v8::Object> work_buf = work_val->ToObject();
+  const unsigned char *work = (const unsigned char *) Buffer::Data(work_buf);
+  size_t work_len = Buffer::Length(work_buf);
+  while (work_len > 32 && *work == 0) {
+    work++;
+    work_len--;
+  }
+  if (work_len > 32) {
+    return VException("Block 'chainWork' exceeds 256 bits");
+  }
+
+  Buffer *record = Buffer::New(BLOCK_RECORD_SIZE + 32 * count);
+  unsigned char *p = (unsigned char *) Buffer::Data(record);
+
+  write_le32(p, record_uint32_field(block, "version"));
+  if (!record_buffer_field(block, "prev_hash", 32, p + 4) ||
+      !record_buffer_field(block, "merkle_root", 32, p + 36)) {
+    return VException("Block hashes must be 32 byte Buffers");
+  }
+  write_le32(p + 68, record_uint32_field(block, "timestamp"));
+  write_le32(p + 72, record_uint32_field(block, "bits"));
+  write_le32(p + 76, record_uint32_field(block, "nonce"));
+  write_le32(p + 80, record_uint32_field(block, "height"));
+  write_le32(p + 84, record_uint32_field(block, "size"));
+  p[88] = block->Get(String::New("active"))->BooleanValue() ?
+    BLOCK_RECORD_ACTIVE : 0;
+  memset(p + 89, 0, 32 - work_len);
+  memcpy(p + 89 + 32 - work_len, work, work_len);
+  write_le32(p + 121, count);
+
+  for (uint32_t i = 0; i < count; i++) {
+    Local<Value> hash = txs->Get(i);
+    if (!Buffer::HasInstance(hash) ||
+        Buffer::Length(hash->ToObject()) != 32) {
+      return VException("Transaction hashes must be 32 byte Buffers");
+    }
+    memcpy(p + BLOCK_RECORD_SIZE + 32 * i, Buffer::Data(hash->ToObject()), 32);
+  }
+
+  return scope.Close(record->handle_);
+}
+
+static Local<Object>
+record_slice(const unsigned char *data, size_t len)
+{
+  Buffer *buf = Buffer::New(len);
+  memcpy(Buffer::Data(buf), data, len);
+  return Local<Object>::New(buf->handle_);
+}
+
+/**
+ * Decode a block record into the fields the Block constructor takes.
+ *
+ * The block hash is recomputed from the header. Transaction hashes are
+ * returned packed in a single Buffer as `txHashes`.
+ */
+static Handle<Value>
+decode_block_record (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !Buffer::HasInstance(args[0])) {
+    return VException("One argument expected: record Buffer");
+  }
+  v8::Handle<v8::Object> record = args[0]->ToObject();
+  const unsigned char *p = (const unsigned char *) Buffer::Data(record);
+  size_t len = Buffer::Length(record);
+
+  if (len < BLOCK_RECORD_SIZE) {
+    return VException("Block record truncated");
+  }
+  uint32_t count = read_le32(p + 121);
+  if (count != (len - BLOCK_RECORD_SIZE) / 32 ||
+      (len - BLOCK_RECORD_SIZE) % 32) {
+    return VException("Block record length does not match its tx count");
+  }
+
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  double_sha256_digest(p, 80, hash);
+
+  Local<Object> result = Object::New();
+  result->Set(String::New("hash"), record_slice(hash, SHA256_DIGEST_LENGTH));
+  result->Set(String::New("version"), Integer::NewFromUnsigned(read_le32(p)));
+  result->Set(String::New("prev_hash"), record_slice(p + 4, 32));
+  result->Set(String::New("merkle_root"), record_slice(p + 36, 32));
+  result->Set(String::New("timestamp"), Integer::NewFromUnsigned(read_le32(p + 68)));
+  result->Set(String::New("bits"), Integer::NewFromUnsigned(read_le32(p + 72)));
+  result->Set(String::New("nonce"), Integer::NewFromUnsigned(read_le32(p + 76)));
+  result->Set(String::New("height"), Integer::NewFromUnsigned(read_le32(p + 80)));
+  result->Set(String::New("size"), Integer::NewFromUnsigned(read_le32(p + 84)));
+  result->Set(String::New("active"),
+              Boolean::New(p[88] & BLOCK_RECORD_ACTIVE));
+  result->Set(String::New("chainWork"), record_slice(p + 89, 32));
+  result->Set(String::New("txHashes"),
+              record_slice(p + BLOCK_RECORD_SIZE, 32 * count));
+  return scope.Close(result);
+}
+
+
+/**
+ * Outgoing protocol messages
+ *
+ * Messages are assembled in a single Buffer: the 24 byte header (magic,
+ * zero-padded command, payload length and checksum) directly followed by
+ * the payload. Peers older than version 209 expect no checksum, which
+ * makes the header 20 bytes.
+ */
+#define MESSAGE_COMMAND_SIZE 12
+#define MESSAGE_CHECKSUM_SIZE 4
+
+struct message_t {
+  Buffer *buf;
+  unsigned char *payload;
+  size_t len;
+  bool checksum;
+};
+
+/**
+ * Allocate a message for a payload of `len` bytes and write its header,
+ * except for the checksum which message_end() fills in.
+ */
+static const char *
+message_begin(Handle<Value> magic, Handle<Value> command, size_t len,
+              bool checksum, message_t *msg)
+{
+  if (!Buffer::HasInstance(magic) || Buffer::Length(magic->ToObject()) != 4) {
+    return "Argument 'magic' must be a 4 byte Buffer";
+  }
+  String::AsciiValue name(command->ToString());
+  if (name.length() > MESSAGE_COMMAND_SIZE) {
+    return "Command name too long";
+  }
+  if (len > 0xffffffffULL) {
+    return "Payload too large";
+  }
+
+  size_t header_len = 4 + MESSAGE_COMMAND_SIZE + 4 +
+    (checksum ? MESSAGE_CHECKSUM_SIZE : 0);
+  msg->buf = Buffer::New(header_len + len);
+  msg->len = len;
+  msg->checksum = checksum;
+
+  unsigned char *p = (unsigned char *) Buffer::Data(msg->buf);
+  memcpy(p, Buffer::Data(magic->ToObject()), 4);
+  memset(p + 4, 0, MESSAGE_COMMAND_SIZE);
+  memcpy(p + 4, *name, name.length());
+  write_le32(p + 4 + MESSAGE_COMMAND_SIZE, len);
+  msg->payload = p + header_len;
+  return NULL;
+}
+
+static void
+message_end(message_t *msg)
+{
+  if (msg->checksum) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    double_sha256_digest(msg->payload, msg->len, hash);
+    memcpy(msg->payload - MESSAGE_CHECKSUM_SIZE, hash, MESSAGE_CHECKSUM_SIZE);
+  }
+}
+
+/**
+ * Copy the Buffers in `parts` to `out`, or with `out` NULL just add up
+ * their lengths. Returns false if an element isn't a Buffer.
+ */
+static bool
+message_parts(Local<Array> parts, unsigned char *out, size_t *len)
+{
+  *len = 0;
+  for (uint32_t i = 0; i < parts->Length(); i++) {
+    Local<Value> part = parts->Get(i);
+    if (!Buffer::HasInstance(part)) {
+      return false;
+    }
+    size_t part_len = Buffer::Length(part->ToObject());
+    if (out) {
+      memcpy(out + *len, Buffer::Data(part->ToObject()), part_len);
+    }
+    *len += part_len;
+  }
+  return true;
+}
+
+/**
+ * Assemble a message: build_message(magic, command, payload, checksum).
+ *
+ * The payload may be a Buffer or an Array of Buffers to concatenate.
+ */
+static Handle<Value>
+build_message (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 4) {
+    return VException("Four arguments expected: magic Buffer, command String, "
+                      "payload Buffer or Array, checksum Boolean");
+  }
+
+  Local<Array> parts;
+  if (args[2]->IsArray()) {
+    parts = Local<Array>::Cast(args[2]);
+  } else {
+    parts = Array::New(1);
+    parts->Set(0, args[2]);
+  }
+
+  size_t len;
+  if (!message_parts(parts, NULL, &len)) {
+    return VException("Argument 'payload' must be a Buffer or an Array of "
+                      "Buffers");
+  }
+
+  message_t msg;
+  const char *err = message_begin(args[0], args[1], len,
+                                  args[3]->BooleanValue(), &msg);
+  if (err) {
+    return VException(err);
+  }
+  message_parts(parts, msg.payload, &len);
+  message_end(&msg);
+
+  return scope.Close(msg.buf->handle_);
+}
+
+/**
+ * Assemble an inv message from {type, hash} objects:
+ * build_inv_message(magic, invs, checksum).
+ *
+ * Broadcasts build this once and write the same Buffer to every peer.
+ */
+static Handle<Value>
+build_inv_message (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 3 || !args[1]->IsArray()) {
+    return VException("Three arguments expected: magic Buffer, invs Array, "
+                      "checksum Boolean");
+  }
+  Local<Array> invs = Local<Array>::Cast(args[1]);
+  uint32_t count = invs->Length();
+
+  unsigned char varint[9];
+  size_t varint_len = write_varint(varint, count);
+
+  message_t msg;
+  const char *err = message_begin(args[0], String::New("inv"),
+                                  varint_len + 36 * (size_t) count,
+                                  args[2]->BooleanValue(), &msg);
+  if (err) {
+    return VException(err);
+  }
+
+  unsigned char *p = msg.payload;
+  memcpy(p, varint, varint_len);
+  p += varint_len;
+  for (uint32_t i = 0; i < count; i++, p += 36) {
+    Local<Value> inv = invs->Get(i);
+    if (!inv->IsObject()) {
+      return VException("Inventory entries must be Objects");
+    }
+    Local<Object> obj = inv->ToObject();
+    write_le32(p, obj->Get(String::New("type"))->Uint32Value());
+    if (!record_buffer_field(obj, "hash", 32, p + 4)) {
+      return VException("Inventory hashes must be 32 byte Buffers");
+    }
+  }
+  message_end(&msg);
+
+  return scope.Close(msg.buf->handle_);
+}
+
+/**
+ * Assemble a block message from its header and the serialized
+ * transactions: build_block_message(magic, header, txs, checksum).
+ */
+static Handle<Value>
+build_block_message (const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 4 || !Buffer::HasInstance(args[1]) ||
+      Buffer::Length(args[1]->ToObject()) != 80 || !args[2]->IsArray()) {
+    return VException("Four arguments expected: magic Buffer, header Buffer "
+                      "of 80 bytes, txs Array, checksum Boolean");
+  }
+  Local<Array> txs = Local<Array>::Cast(args[2]);
+
+  size_t txs_len;
+  if (!message_parts(txs, NULL, &txs_len)) {
+    return VException("Transactions must be Buffers");
+  }
+
+  unsigned char varint[9];
+  size_t varint_len = write_varint(varint, txs->Length());
+
+  message_t msg;
+  const char *err = message_begin(args[0], String::New("block"),
+                                  80 + varint_len + txs_len,
+                                  args[3]->BooleanValue(), &msg);
+  if (err) {
+    return VException(err);
+  }
+
+  memcpy(msg.payload, Buffer::Data(args[1]->ToObject()), 80);
+  memcpy(msg.payload + 80, varint, varint_len);
+  message_parts(txs, msg.payload + 80 + varint_len, &txs_len);
+  message_end(&msg);
+
+  return scope.Close(msg.buf->handle_);
+}
+
+
+// Default memory budget of a UtxoSet in bytes
+#define UTXO_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+// Approximate bookkeeping cost per entry on top of its value and script
+#define UTXO_ENTRY_OVERHEAD 160
+
+/**
+ * In-memory cache of unspent transaction outputs.
+ *
+ * Entries are keyed by the 36 byte outpoint (tx hash + output index) and map
+ * to the serialized output (8 byte value + script). The output data lives in
+ * one arena instead of a Buffer per output, which gets compacted once more
+ * than half of it is garbage.
+ *
+ * Changes are tracked so they can be written back to the database in one
+ * batch: flush() returns every new or spent output since the last flush.
+ * Clean entries are evicted least recently used first when the cache goes
+ * over its memory budget; dirty entries stay until they have been flushed.
+ */
+class UtxoSet : ObjectWrap
+{
+private:
+
+  enum {
+    // Changed since the last flush
+    UTXO_DIRTY = 1,
+    // Not in the database yet, can be dropped without a write when spent
+    UTXO_FRESH = 2,
+    // Spent, kept as a tombstone until the deletion is flushed
+    UTXO_SPENT = 4
+  };
+
+  struct entry_t {
+    string key;
+    size_t data;
+    size_t len;
+    unsigned char flags;
+  };
+
+  typedef list<entry_t> entry_list_t;
+  typedef map<string, entry_list_t::iterator> entry_map_t;
+
+  // Most recently used entries are at the front
+  entry_list_t entries;
+  entry_map_t index;
+
+  vector<unsigned char> arena;
+  size_t garbage;
+
+  size_t budget;
+  size_t dirty;
+
+  unsigned long hits;
+  unsigned long misses;
+
+  size_t Usage()
+  {
+    return arena.size() - garbage + entries.size() * UTXO_ENTRY_OVERHEAD;
+  }
+
+  void Release(entry_t &entry)
+  {
+    garbage += entry.len;
+    entry.len = 0;
+  }
+
+  void Erase(entry_map_t::iterator it)
+  {
+    entry_t &entry = *it->second;
+    Release(entry);
+    if (entry.flags & UTXO_DIRTY) {
+      dirty--;
+    }
+    entries.erase(it->second);
+    index.erase(it);
+  }
+
+  void Compact()
+  {
+    if (garbage < arena.size() / 2) {
+      return;
+    }
+
+    vector<unsigned char> next;
+    next.reserve(arena.size() - garbage);
+    for (entry_list_t::iterator it = entries.begin();
+         it != entries.end(); it++) {
+      size_t pos = next.size();
+      next.insert(next.end(), arena.begin() + it->data,
+                  arena.begin() + it->data + it->len);
+      it->data = pos;
+    }
+    arena.swap(next);
+    garbage = 0;
+  }
+
+  void Evict()
+  {
+    // Walk from the least recently used end, skipping unflushed entries
+    entry_list_t::iterator it = entries.end();
+    while (Usage() > budget && it != entries.begin()) {
+      it--;
+      if (it->flags & UTXO_DIRTY) {
+        continue;
+      }
+      entry_list_t::iterator victim = it++;
+      Release(*victim);
+      index.erase(victim->key);
+      entries.erase(victim);
+    }
+    Compact();
+  }
+
+  void Put(const string &key, const unsigned char *data, size_t len,
+           unsigned char flags)
+  {
+    entry_map_t::iterator it = index.find(key);
+    if (it != index.end()) {
+      // An output is only fresh if the database has never seen it. Replacing
+      // a tombstone or a loaded entry means there is a row to overwrite or,
+      // once it is spent again, to delete.
+      if (it->second->flags & UTXO_FRESH) {
+        flags |= UTXO_FRESH;
+      } else {
+        flags &= ~UTXO_FRESH;
+      }
+      Erase(it);
+    }
+
+    entry_t entry;
+    entry.key = key;
+    entry.data = arena.size();
+    entry.len = len;
+    entry.flags = flags;
+    arena.insert(arena.end(), data, data + len);
+    if (flags & UTXO_DIRTY) {
+      dirty++;
+    }
+
+    entries.push_front(entry);
+    index[key] = entries.begin();
+  }
+
+  void Spend(const string &key)
+  {
+    entry_map_t::iterator it = index.find(key);
+    if (it != index.end() && (it->second->flags & UTXO_FRESH)) {
+      // Never written, so there is nothing to delete
+      Erase(it);
+      return;
+    }
+    Put(key, NULL, 0, UTXO_DIRTY | UTXO_SPENT);
+  }
+
+  /**
+   * Apply a serialized transaction: spend its inputs and add its outputs, or
+   * with `undo` remove its outputs again and restore the outputs its inputs
+   * spent from `spent`, one value + script per input. Empty strings are
+   * skipped.
+   */
+  const char *Apply(const unsigned char *tx, size_t len,
+                    const unsigned char *hash, bool undo,
+                    const vector<string> *spent)
+  {
+    tx_table_t table;
+    const unsigned char *p = tx;
+    const char *err = parse_tx_table(tx, &p, tx + len, 1, &table);
+    if (err) {
+      return err;
+    }
+
+    static const unsigned char coinbase[36] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0xff, 0xff, 0xff, 0xff
+    };
+
+    uint32_t inCount = table.txs[3];
+    uint32_t outCount = table.txs[5];
+    bool isCoinbase = inCount == 1 &&
+      memcmp(tx + table.ins[0], coinbase, 36) == 0;
+
+    if (undo && spent && spent->size() != inCount) {
+      return "Expected one spent output per input";
+    }
+
+    if (!undo && !isCoinbase) {
+      for (uint32_t i = 0; i < inCount; i++) {
+        Spend(string((const char *) tx + table.ins[3 * i], 36));
+      }
+    }
+
+    unsigned char key[36];
+    memcpy(key, hash, 32);
+    for (uint32_t i = 0; i < outCount; i++) {
+      write_le32(key + 32, i);
+      string k((const char *) key, 36);
+      if (undo) {
+        Spend(k);
+      } else {
+        size_t start = table.outs[3 * i];
+        size_t end = table.outs[3 * i + 1] + table.outs[3 * i + 2];
+
+        // Stored as value + script, without the script length
+        vector<unsigned char> data(tx + start, tx + start + 8);
+        data.insert(data.end(), tx + table.outs[3 * i + 1], tx + end);
+        Put(k, &data[0], data.size(), UTXO_DIRTY | UTXO_FRESH);
+      }
+    }
+
+    if (undo && spent && !isCoinbase) {
+      for (uint32_t i = 0; i < inCount; i++) {
+        const string &out = (*spent)[i];
+        if (out.empty()) {
+          continue;
+        }
+
+        // The row may have been deleted by a flush, so it is never fresh
+        Put(string((const char *) tx + table.ins[3 * i], 36),
+            (const unsigned char *) out.data(), out.size(), UTXO_DIRTY);
+      }
+    }
+
+    Evict();
+    return NULL;
+  }
+
+public:
+
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("UtxoSet"));
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "get", Get);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "load", Load);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "connect", Connect);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "disconnect", Disconnect);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "flush", Flush);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setBudget", SetBudget);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
+
+    target->Set(String::NewSymbol("UtxoSet"),
+                s_ct->GetFunction());
+  }
+
+  UtxoSet(size_t budget) :
+    garbage(0),
+    budget(budget),
+    dirty(0),
+    hits(0),
+    misses(0)
+  {
+  }
+
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
+
+    HandleScope scope;
+
+    size_t budget = UTXO_DEFAULT_BUDGET;
+    if (args.Length() > 0 && !args[0]->IsUndefined() && !args[0]->IsNull()) {
+      if (!args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+        return VException("Argument 'budget' must be a non-negative Number");
+      }
+      budget = args[0]->IntegerValue();
+    }
+
+    UtxoSet *set = new UtxoSet(budget);
+    set->Wrap(args.Holder());
+
+    return scope.Close(args.This());
+  }
+
+  /**
+   * Look up an outpoint.
+   *
+   * Returns a Buffer with the 8 byte value followed by the script, null if
+   * the output is known to be spent or undefined if it isn't cached.
+   */
+  static Handle<Value>
+  Get(const Arguments& args)
+  {
+    HandleScope scope;
+    UtxoSet *set = ObjectWrap::Unwrap<UtxoSet>(args.This());
+
+    if (args.Length() != 1 || !Buffer::HasInstance(args[0]) ||
+        Buffer::Length(args[0]->ToObject()) != 36) {
+      return VException("One argument expected: outpoint Buffer of 36 bytes");
+    }
+
+    string key(Buffer::Data(args[0]->ToObject()), 36);
+    entry_map_t::iterator it = set->index.find(key);
+    if (it == set->index.end()) {
+      set->misses++;
+      return scope.Close(Undefined());
+    }
+
+    set->hits++;
+    set->entries.splice(set->entries.begin(), set->entries, it->second);
+    entry_t &entry = *it->second;
+    if (entry.flags & UTXO_SPENT) {
+      return scope.Close(Null());
+    }
+
+    Buffer *out_buf = Buffer::New(entry.len);
+    memcpy(Buffer::Data(out_buf), &set->arena[entry.data], entry.len);
+
+    return scope.Close(out_buf->handle_);
+  }
+
+  /**
+   * Cache an output that was read from the database.
+   */
+  static Handle<Value>
+  Load(const Arguments& args)
+  {
+    HandleScope scope;
+    UtxoSet *set = ObjectWrap::Unwrap<UtxoSet>(args.This());
+
+    if (args.Length() != 2 || !Buffer::HasInstance(args[0]) ||
+        Buffer::Length(args[0]->ToObject()) != 36 ||
+        !Buffer::HasInstance(args[1])) {
+      return VException("Two arguments expected: outpoint Buffer of 36 bytes, output Buffer");
+    }
+
+    string key(Buffer::Data(args[0]->ToObject()), 36);
+    if (set->index.find(key) == set->index.end()) {
+      Handle<Object> out_buf = args[1]->ToObject();
+      set->Put(key, (const unsigned char *) Buffer::Data(out_buf),
+               Buffer::Length(out_buf), 0);
+      set->Evict();
+    }
+
+    return scope.Close(Undefined());
+  }
+
+  static Handle<Value>
+  ApplyTx(const Arguments& args, bool undo)
+  {
+    HandleScope scope;
+    UtxoSet *set = ObjectWrap::Unwrap<UtxoSet>(args.This());
+
+    if (args.Length() < 2 || args.Length() > (undo ? 3 : 2)) {
+      return VException(undo ?
+        "Two or three arguments expected: tx hash, tx Buffer, spent outputs Array" :
+        "Two arguments expected: tx hash, tx Buffer");
+    }
+    if (!Buffer::HasInstance(args[0]) ||
+        Buffer::Length(args[0]->ToObject()) != 32) {
+      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+    }
+    if (!Buffer::HasInstance(args[1])) {
+      return VException("Argument 'tx' must be of type Buffer");
+    }
+
+    vector<string> spent;
+    bool hasSpent = args.Length() > 2 && !args[2]->IsUndefined();
+    if (hasSpent) {
+      if (!args[2]->IsArray()) {
+        return VException("Argument 'spent' must be an Array");
+      }
+      Local<Array> spent_arr = Local<Array>::Cast(args[2]);
+      for (uint32_t i = 0; i < spent_arr->Length(); i++) {
+        Local<Value> out = spent_arr->Get(i);
+        if (out->IsNull() || out->IsUndefined()) {
+          spent.push_back(string());
+        } else if (Buffer::HasInstance(out) &&
+                   Buffer::Length(out->ToObject()) >= 8) {
+          spent.push_back(string(Buffer::Data(out->ToObject()),
+                                 Buffer::Length(out->ToObject())));
+        } else {
+          return VException("Spent outputs must be Buffers of at least 8 bytes or null");
+        }
+      }
+    }
+
+    Handle<Object> tx_buf = args[1]->ToObject();
+    const char *err = set->Apply(
+      (const unsigned char *) Buffer::Data(tx_buf),
+      Buffer::Length(tx_buf),
+      (const unsigned char *) Buffer::Data(args[0]->ToObject()),
+      undo, hasSpent ? &spent : NULL);
+    if (err) {
+      return VException(err);
+    }
+
+    return scope.Close(Undefined());
+  }
+
+  /**
+   * Spend the inputs of a transaction and add its outputs.
+   */
+  static Handle<Value>
+  Connect(const Arguments& args)
+  {
+    return ApplyTx(args, false);
+  }
+
+  /**
+   * Remove the outputs of a transaction that is no longer in the chain and
+   * put back the outputs it spent, given as an Array with a value + script
+   * Buffer (or null) per input.
+   */
+  static Handle<Value>
+  Disconnect(const Arguments& args)
+  {
+    return ApplyTx(args, true);
+  }
+
+  /**
+   * Collect all changes since the last flush and mark them clean.
+   *
+   * Returns an Array of {key, value} objects, `value` being null for outputs
+   * that have been spent and need to be deleted.
+   */
+  static Handle<Value>
+  Flush(const Arguments& args)
+  {
+    HandleScope scope;
+    UtxoSet *set = ObjectWrap::Unwrap<UtxoSet>(args.This());
+
+    Local<String> key_sym = String::NewSymbol("key");
+    Local<String> value_sym = String::NewSymbol("value");
+
+    Local<Array> changes = Array::New(set->dirty);
+    unsigned int n = 0;
+    entry_list_t::iterator it = set->entries.begin();
+    while (it != set->entries.end()) {
+      entry_list_t::iterator entry = it++;
+      if (!(entry->flags & UTXO_DIRTY)) {
+        continue;
+      }
+
+      Local<Object> change = Object::New();
+      Buffer *key_buf = Buffer::New(entry->key.size());
+      memcpy(Buffer::Data(key_buf), entry->key.data(), entry->key.size());
+      change->Set(key_sym, key_buf->handle_);
+
+      if (entry->flags & UTXO_SPENT) {
+        change->Set(value_sym, Null());
+        set->Erase(set->index.find(entry->key));
+      } else {
+        Buffer *value_buf = Buffer::New(entry->len);
+        memcpy(Buffer::Data(value_buf), &set->arena[entry->data], entry->len);
+        change->Set(value_sym, value_buf->handle_);
+        entry->flags = 0;
+        set->dirty--;
+      }
+      changes->Set(n++, change);
+    }
+
+    set->Evict();
+
+    return scope.Close(changes);
+  }
+
+  static Handle<Value>
+  SetBudget(const Arguments& args)
+  {
+    HandleScope scope;
+    UtxoSet *set = ObjectWrap::Unwrap<UtxoSet>(args.This());
+
+    if (args.Length() != 1 || !args[0]->IsNumber() ||
+        args[0]->IntegerValue() < 0) {
+      return VException("One argument expected: budget Number");
+    }
+
+    set->budget = args[0]->IntegerValue();
+    set->Evict();
+
+    return scope.Close(Undefined());
+  }
+
+  /**
+   * Cache statistics: {entries, dirty, usage, budget, hits, misses}.
+   */
+  static Handle<Value>
+  Stats(const Arguments& args)
+  {
+    HandleScope scope;
+    UtxoSet *set = ObjectWrap::Unwrap<UtxoSet>(args.This());
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("entries"), Integer::New(set->entries.size()));
+    stats->Set(String::NewSymbol("dirty"), Integer::New(set->dirty));
+    stats->Set(String::NewSymbol("usage"), Number::New(set->Usage()));
+    stats->Set(String::NewSymbol("budget"), Number::New(set->budget));
+    stats->Set(String::NewSymbol("hits"), Number::New(set->hits));
+    stats->Set(String::NewSymbol("misses"), Number::New(set->misses));
+
+    return scope.Close(stats);
+  }
+};
+
+Persistent<FunctionTemplate> UtxoSet::s_ct;
+
+
+// Initial number of hash slots in a BlockTree, must be a power of two
+#define BLOCK_TREE_MIN_SLOTS 1024
+
+// Number of locator entries taken one block apart before the step doubles
+#define BLOCK_TREE_LOCATOR_DENSE 10
+
+static inline int
+invert_lowest_one(int n)
+{
+  return n & (n - 1);
+}
+
+/**
+ * Height a block's skip pointer points to.
+ *
+ * Any lower height would work; this one makes ancestor lookups take
+ * O(log n) steps while most skip pointers are shared by nearby blocks.
+ */
+static inline int
+block_tree_skip_height(int height)
+{
+  if (height < 2) {
+    return 0;
+  }
+  return (height & 1) ?
+    invert_lowest_one(invert_lowest_one(height - 1)) + 1 :
+    invert_lowest_one(height);
+}
+
+/**
+ * Slot of a 32 byte hash in an open addressing table of `mask + 1` slots.
+ *
+ * Block and transaction hashes are as good as random, except for the zero
+ * bytes at the end of block hashes, so their leading bits are used as is.
+ */
+static inline size_t
+hash_bucket(const unsigned char *hash, size_t mask)
+{
+  return (read_le32(hash) ^ read_le32(hash + 4)) & mask;
+}
+
+/**
+ * In-memory index of all known block headers.
+ *
+ * Entries live in one flat array and refer to each other by position:
+ * `parent` is the previous block and `skip` an ancestor further back, so an
+ * ancestor at any height is found in O(log n) steps. Hashes are looked up
+ * through an open addressing table of positions. The active chain is kept
+ * as an array from height to position, so locators and getblocks replies
+ * don't need to touch the database.
+ */
+class BlockTree : ObjectWrap
+{
+private:
+
+  struct entry_t {
+    unsigned char hash[32];
+    unsigned char prev[32];
+    // Big endian, so it compares with memcmp
+    unsigned char work[32];
+    int32_t parent;
+    int32_t skip;
+    uint32_t height;
+    uint32_t status;
+  };
+
+  vector<entry_t> entries;
+
+  // Positions in `entries`, -1 marks an empty slot
+  vector<int32_t> slots;
+
+  // Position of the active chain's block at each height
+  vector<int32_t> chain;
+
+  int32_t
+  Find(const unsigned char *hash)
+  {
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash_bucket(hash, mask); slots[i] != -1;
+         i = (i + 1) & mask) {
+      if (memcmp(entries[slots[i]].hash, hash, 32) == 0) {
+        return slots[i];
+      }
+    }
+    return -1;
+  }
+
+  void
+  Place(vector<int32_t> &table, int32_t pos)
+  {
+    size_t mask = table.size() - 1;
+    size_t i = hash_bucket(entries[pos].hash, mask);
+    while (table[i] != -1) {
+      i = (i + 1) & mask;
+    }
+    table[i] = pos;
+  }
+
+  void
+  Grow()
+  {
+    vector<int32_t> next(slots.size() * 2, -1);
+    for (size_t pos = 0; pos < entries.size(); pos++) {
+      Place(next, pos);
+    }
+    slots.swap(next);
+  }
+
+  bool
+  OnChain(int32_t pos)
+  {
+    uint32_t height = entries[pos].height;
+    return height < chain.size() && chain[height] == pos;
+  }
+
+  int32_t
+  Ancestor(int32_t pos, uint32_t height)
+  {
+    if (pos == -1 || height > entries[pos].height) {
+      return -1;
+    }
+    if (OnChain(pos)) {
+      return chain[height];
+    }
+
+    int target = height;
+    int walk = entries[pos].height;
+    while (pos != -1 && walk > target) {
+      const entry_t &entry = entries[pos];
+      int skip = block_tree_skip_height(walk);
+      int skip_prev = block_tree_skip_height(walk - 1);
+      // Only take the skip pointer if the parent's doesn't get us closer
+      if (entry.skip != -1 &&
+          (skip == target ||
+           (skip > target && !(skip_prev < skip - 2 && skip_prev >= target)))) {
+        pos = entry.skip;
+        walk = skip;
+      } else {
+        pos = entry.parent;
+        walk--;
+      }
+    }
+    return pos;
+  }
+
+  /**
+   * Resolve an entry's parent and skip pointer.
+   */
+  void
+  Link(int32_t pos)
+  {
+    entry_t &entry = entries[pos];
+    if (entry.parent == -1 && entry.height > 0) {
+      int32_t parent = Find(entry.prev);
+      if (parent != -1 && entries[parent].height + 1 == entry.height) {
+        entry.parent = parent;
+      }
+    }
+    entry.skip = entry.parent == -1 ? -1 :
+      Ancestor(entry.parent, block_tree_skip_height(entry.height));
+  }
+
+  /**
+   * Add a header, returns false if it was already indexed.
+   */
+  bool
+  Insert(const unsigned char *hash, const unsigned char *prev,
+         uint32_t height, const unsigned char *work, uint32_t status,
+         bool link)
+  {
+    if (Find(hash) != -1) {
+      return false;
+    }
+
+    if ((entries.size() + 1) * 2 > slots.size()) {
+      Grow();
+    }
+
+    entry_t entry;
+    memcpy(entry.hash, hash, 32);
+    memcpy(entry.prev, prev, 32);
+    memcpy(entry.work, work, 32);
+    entry.parent = -1;
+    entry.skip = -1;
+    entry.height = height;
+    entry.status = status;
+
+    int32_t pos = entries.size();
+    entries.push_back(entry);
+    Place(slots, pos);
+    if (link) {
+      Link(pos);
+    }
+    return true;
+  }
+
+  /**
+   * Make `pos` the tip of the active chain.
+   */
+  void
+  SetTip(int32_t pos)
+  {
+    if (pos == -1) {
+      chain.clear();
+      return;
+    }
+
+    chain.resize(entries[pos].height + 1, -1);
+    while (pos != -1 && chain[entries[pos].height] != pos) {
+      chain[entries[pos].height] = pos;
+      pos = entries[pos].parent;
+    }
+  }
+
+  int32_t
+  LastCommon(int32_t a, int32_t b)
+  {
+    if (entries[a].height > entries[b].height) {
+      a = Ancestor(a, entries[b].height);
+    } else {
+      b = Ancestor(b, entries[a].height);
+    }
+    while (a != b && a != -1 && b != -1) {
+      a = entries[a].parent;
+      b = entries[b].parent;
+    }
+    return a == b ? a : -1;
+  }
+
+  size_t
+  Usage()
+  {
+    return entries.capacity() * sizeof(entry_t) +
+      (slots.capacity() + chain.capacity()) * sizeof(int32_t);
+  }
+
+  static bool
+  HashArg(Handle<Value> value, const unsigned char **hash)
+  {
+    if (!Buffer::HasInstance(value) || Buffer::Length(value->ToObject()) != 32) {
+      return false;
+    }
+    *hash = (const unsigned char *) Buffer::Data(value->ToObject());
+    return true;
+  }
+
+  Local<Value>
+  HashAt(int32_t pos)
+  {
+    if (pos == -1) {
+      return Local<Value>::New(Null());
+    }
+    return record_slice(entries[pos].hash, 32);
+  }
+
+  Local<Array>
+  HashList(const vector<int32_t> &list)
+  {
+    Local<Array> result = Array::New(list.size());
+    for (size_t i = 0; i < list.size(); i++) {
+      result->Set(i, HashAt(list[i]));
+    }
+    return result;
+  }
+
+public:
+
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("BlockTree"));
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "add", Add);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "addRecord", AddRecord);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "link", LinkAll);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "has", Has);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "get", Get);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setStatus", SetStatus);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setTip", SetTipMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "tip", Tip);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "atHeight", AtHeight);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "ancestor", AncestorMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "findFork", FindFork);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "locator", Locator);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "getBlocks", GetBlocks);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
+
+    target->Set(String::NewSymbol("BlockTree"),
+                s_ct->GetFunction());
+  }
+
+  BlockTree() :
+    slots(BLOCK_TREE_MIN_SLOTS, -1)
+  {
+  }
+
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
+
+    HandleScope scope;
+
+    BlockTree *tree = new BlockTree();
+    tree->Wrap(args.Holder());
+
+    return scope.Close(args.This());
+  }
+
+  /**
+   * Index a header: add(hash, prevHash, height, chainWork[, status]).
+   *
+   * Returns false if the block was already in the tree.
+   */
+  static Handle<Value>
+  Add(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    const unsigned char *hash, *prev;
+    if (args.Length() < 4 ||
+        !HashArg(args[0], &hash) || !HashArg(args[1], &prev) ||
+        !args[2]->IsNumber() || !Buffer::HasInstance(args[3])) {
+      return VException("Arguments expected: hash Buffer, prevHash Buffer, "
+                        "height Number, chainWork Buffer[, status Number]");
+    }
+
+    v8::Handle<v8::Object> work_buf = args[3]->ToObject();
+    const unsigned char *p = (const unsigned char *) Buffer::Data(work_buf);
+    size_t len = Buffer::Length(work_buf);
+    while (len > 32 && *p == 0) {
+      p++;
+      len--;
+    }
+    if (len > 32) {
+      return VException("Argument 'chainWork' exceeds 256 bits");
+    }
+    unsigned char work[32];
+    memset(work, 0, 32 - len);
+    memcpy(work + 32 - len, p, len);
+
+    uint32_t status = args.Length() > 4 ? args[4]->Uint32Value() : 0;
+
+    bool added = tree->Insert(hash, prev, args[2]->Uint32Value(), work,
+                              status, true);
+    return scope.Close(Boolean::New(added));
+  }
+
+  /**
+   * Index a header from a database block record.
+   *
+   * Records are usually loaded in key order, so parents aren't linked until
+   * link() is called.
+   */
+  static Handle<Value>
+  AddRecord(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    if (args.Length() != 1 || !Buffer::HasInstance(args[0]) ||
+        Buffer::Length(args[0]->ToObject()) < BLOCK_RECORD_SIZE) {
+      return VException("One argument expected: block record Buffer");
+    }
+    const unsigned char *p =
+      (const unsigned char *) Buffer::Data(args[0]->ToObject());
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    double_sha256_digest(p, 80, hash);
+
+    bool added = tree->Insert(hash, p + 4, read_le32(p + 80), p + 89,
+                              p[88], false);
+    return scope.Close(Boolean::New(added));
+  }
+
+  /**
+   * Resolve parents and skip pointers after a bulk load.
+   *
+   * Returns the number of blocks whose parent is missing.
+   */
+  static Handle<Value>
+  LinkAll(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    // Ancestors have to be linked before their descendants
+    vector<pair<uint32_t, int32_t> > order;
+    order.reserve(tree->entries.size());
+    for (size_t pos = 0; pos < tree->entries.size(); pos++) {
+      order.push_back(make_pair(tree->entries[pos].height, (int32_t) pos));
+    }
+    sort(order.begin(), order.end());
+
+    uint32_t unlinked = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+      tree->Link(order[i].second);
+      const entry_t &entry = tree->entries[order[i].second];
+      if (entry.parent == -1 && entry.height > 0) {
+        unlinked++;
+      }
+    }
+
+    return scope.Close(Integer::NewFromUnsigned(unlinked));
+  }
+
+  static Handle<Value>
+  Has(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
+
+    return scope.Close(Boolean::New(tree->Find(hash) != -1));
+  }
+
+  /**
+   * Look up a header: {hash, prev_hash, height, chainWork, status, active},
+   * or null if it isn't indexed.
+   */
+  static Handle<Value>
+  Get(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
+
+    int32_t pos = tree->Find(hash);
+    if (pos == -1) {
+      return scope.Close(Null());
+    }
+    const entry_t &entry = tree->entries[pos];
+
+    Local<Object> result = Object::New();
+    result->Set(String::New("hash"), record_slice(entry.hash, 32));
+    result->Set(String::New("prev_hash"), record_slice(entry.prev, 32));
+    result->Set(String::New("height"), Integer::NewFromUnsigned(entry.height));
+    result->Set(String::New("chainWork"), record_slice(entry.work, 32));
+    result->Set(String::New("status"), Integer::NewFromUnsigned(entry.status));
+    result->Set(String::New("active"), Boolean::New(tree->OnChain(pos)));
+    return scope.Close(result);
+  }
+
+  static Handle<Value>
+  SetStatus(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 2 || !HashArg(args[0], &hash) ||
+        !args[1]->IsNumber()) {
+      return VException("Two arguments expected: hash Buffer, status Number");
+    }
+
+    int32_t pos = tree->Find(hash);
+    if (pos != -1) {
+      tree->entries[pos].status = args[1]->Uint32Value();
+    }
+
+    return scope.Close(Boolean::New(pos != -1));
+  }
+
+  /**
+   * Make a block the tip of the active chain.
+   */
+  static Handle<Value>
+  SetTipMethod(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
 
-    key->hasPrivate = true;
+    int32_t pos = tree->Find(hash);
+    if (pos == -1) {
+      return VException("Block is not in the tree");
+    }
+    tree->SetTip(pos);
+
+    return scope.Close(Undefined());
   }
 
   static Handle<Value>
-  GetPublic(Local<String> property, const AccessorInfo& info)
+  Tip(const Arguments& args)
   {
     HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
 
-    if (!key->hasPublic) {
+    if (tree->chain.empty()) {
       return scope.Close(Null());
     }
+    return scope.Close(tree->HashAt(tree->chain.back()));
+  }
 
-    // Export public
-    unsigned int pub_size = i2o_ECPublicKey(key->ec, NULL);
-    if (!pub_size) {
-      // TODO: ERROR: "Error from i2o_ECPublicKey(key->ec, NULL)"
-      return scope.Close(Null());
+  /**
+   * Hash of the active chain's block at a height, or null.
+   */
+  static Handle<Value>
+  AtHeight(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    if (args.Length() != 1 || !args[0]->IsNumber()) {
+      return VException("One argument expected: height Number");
     }
-    unsigned char *pub_begin, *pub_end;
-    pub_begin = pub_end = (unsigned char *)malloc(pub_size);
 
-    if (i2o_ECPublicKey(key->ec, &pub_end) != pub_size) {
-      // TODO: ERROR: "Error from i2o_ECPublicKey(key->ec, &pub)"
+    int64_t height = args[0]->IntegerValue();
+    if (height < 0 || height >= (int64_t) tree->chain.size()) {
       return scope.Close(Null());
     }
-    Buffer *pub_buf = Buffer::New(pub_size);
-    memcpy(Buffer::Data(pub_buf), pub_begin, pub_size);
-
-    free(pub_begin);
-
-    return scope.Close(pub_buf->handle_);
+    return scope.Close(tree->HashAt(tree->chain[height]));
   }
 
-  static void
-  SetPublic(Local<String> property, Local<Value> value, const AccessorInfo& info)
+  /**
+   * Hash of a block's ancestor at a height, or null.
+   */
+  static Handle<Value>
+  AncestorMethod(const Arguments& args)
   {
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(info.Holder());
-    Handle<Object> buffer = value->ToObject();
-    const unsigned char *data = (const unsigned char*) Buffer::Data(buffer);
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
 
-    if (!o2i_ECPublicKey(&(key->ec), &data, Buffer::Length(buffer))) {
-      // TODO: Error
-      return;
+    const unsigned char *hash;
+    if (args.Length() != 2 || !HashArg(args[0], &hash) ||
+        !args[1]->IsNumber() || args[1]->IntegerValue() < 0) {
+      return VException("Two arguments expected: hash Buffer, height Number");
     }
 
-    key->hasPublic = true;
+    int32_t pos = tree->Find(hash);
+    return scope.Close(tree->HashAt(tree->Ancestor(pos,
+                                                   args[1]->Uint32Value())));
   }
 
+  /**
+   * Find the last common block of two branches.
+   *
+   * Returns {fork, disconnect, connect}: the blocks from `oldHash` back to
+   * the fork, newest first, and the blocks from the fork up to `newHash`,
+   * oldest first. Returns null if the branches don't meet in the tree.
+   */
   static Handle<Value>
-  RegenerateSync(const Arguments& args)
+  FindFork(const Arguments& args)
   {
     HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
 
-    if (!key->hasPrivate) {
-      return VException("Regeneration requires a private key.");
+    const unsigned char *old_hash, *new_hash;
+    if (args.Length() != 2 ||
+        !HashArg(args[0], &old_hash) || !HashArg(args[1], &new_hash)) {
+      return VException("Two arguments expected: oldHash Buffer, "
+                        "newHash Buffer");
     }
 
-    EC_KEY *old = key->ec;
+    int32_t old_pos = tree->Find(old_hash);
+    int32_t new_pos = tree->Find(new_hash);
+    if (old_pos == -1 || new_pos == -1) {
+      return scope.Close(Null());
+    }
+    int32_t fork = tree->LastCommon(old_pos, new_pos);
+    if (fork == -1) {
+      return scope.Close(Null());
+    }
 
-    key->ec = EC_KEY_new_by_curve_name(NID_secp256k1);
-    EC_KEY_regenerate_key(key->ec, EC_KEY_get0_private_key(old));
+    vector<int32_t> disconnect, connect;
+    for (int32_t pos = old_pos; pos != fork; pos = tree->entries[pos].parent) {
+      disconnect.push_back(pos);
+    }
+    for (int32_t pos = new_pos; pos != fork; pos = tree->entries[pos].parent) {
+      connect.push_back(pos);
+    }
+    reverse(connect.begin(), connect.end());
 
-    EC_KEY_free(old);
+    Local<Object> result = Object::New();
+    result->Set(String::New("fork"), tree->HashAt(fork));
+    result->Set(String::New("disconnect"), tree->HashList(disconnect));
+    result->Set(String::New("connect"), tree->HashList(connect));
+    return scope.Close(result);
+  }
 
-    return scope.Close(Undefined());
+  /**
+   * Build a block locator, starting at `hash` or the active tip.
+   *
+   * The first blocks are taken one apart, then the step doubles; the
+   * genesis block always comes last.
+   */
+  static Handle<Value>
+  Locator(const Arguments& args)
+  {
+    HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
+
+    int32_t pos = tree->chain.empty() ? -1 : tree->chain.back();
+    if (args.Length() > 0 && !args[0]->IsUndefined() && !args[0]->IsNull()) {
+      const unsigned char *hash;
+      if (!HashArg(args[0], &hash)) {
+        return VException("Argument 'hash' must be a 32 byte Buffer");
+      }
+      pos = tree->Find(hash);
+    }
+
+    vector<int32_t> locator;
+    int step = 1;
+    while (pos != -1) {
+      locator.push_back(pos);
+      int height = tree->entries[pos].height;
+      if (height == 0) {
+        break;
+      }
+      if (locator.size() > BLOCK_TREE_LOCATOR_DENSE) {
+        step *= 2;
+      }
+      pos = tree->Ancestor(pos, max(height - step, 0));
+    }
+
+    return scope.Close(tree->HashList(locator));
   }
 
+  /**
+   * Answer a getblocks request: getBlocks(locator, stopHash, limit).
+   *
+   * Returns the hashes of the active chain following the first locator
+   * entry on it, up to and including `stopHash` and at most `limit` long.
+   */
   static Handle<Value>
-  ToDER(const Arguments& args)
+  GetBlocks(const Arguments& args)
   {
     HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
 
-    if (!key->hasPrivate || !key->hasPublic) {
-      return scope.Close(Null());
+    if (args.Length() != 3 || !args[0]->IsArray() || !args[2]->IsNumber()) {
+      return VException("Three arguments expected: locator Array, "
+                        "stopHash Buffer, limit Number");
     }
+    Local<Array> locator = Local<Array>::Cast(args[0]);
 
-    // Export DER
-    unsigned int der_size = i2d_ECPrivateKey(key->ec, NULL);
-    if (!der_size) {
-      // TODO: ERROR: "Error from i2d_ECPrivateKey(key->ec, NULL)"
-      return scope.Close(Null());
+    int32_t stop = -1;
+    const unsigned char *stop_hash;
+    if (HashArg(args[1], &stop_hash)) {
+      stop = tree->Find(stop_hash);
     }
-    unsigned char *der_begin, *der_end;
-    der_begin = der_end = (unsigned char *)malloc(der_size);
 
-    if (i2d_ECPrivateKey(key->ec, &der_end) != der_size) {
-      // TODO: ERROR: "Error from i2d_ECPrivateKey(key->ec, &der_end)"
-      return scope.Close(Null());
+    // Without a match the peer starts over after the genesis block
+    uint32_t start = 1;
+    for (uint32_t i = 0; i < locator->Length(); i++) {
+      const unsigned char *hash;
+      if (!HashArg(locator->Get(i), &hash)) {
+        return VException("Locator entries must be 32 byte Buffers");
+      }
+      int32_t pos = tree->Find(hash);
+      if (pos != -1 && tree->OnChain(pos)) {
+        start = tree->entries[pos].height + 1;
+        break;
+      }
     }
-    Buffer *der_buf = Buffer::New(der_size);
-    memcpy(Buffer::Data(der_buf), der_begin, der_size);
 
-    free(der_begin);
+    vector<int32_t> blocks;
+    uint32_t limit = args[2]->Uint32Value();
+    for (uint32_t height = start;
+         height < tree->chain.size() && blocks.size() < limit; height++) {
+      blocks.push_back(tree->chain[height]);
+      if (tree->chain[height] == stop) {
+        break;
+      }
+    }
 
-    return scope.Close(der_buf->handle_);
+    return scope.Close(tree->HashList(blocks));
   }
 
+  /**
+   * Index statistics: {entries, height, usage}.
+   */
   static Handle<Value>
-  FromDER(const Arguments& args)
+  Stats(const Arguments& args)
   {
     HandleScope scope;
+    BlockTree *tree = ObjectWrap::Unwrap<BlockTree>(args.This());
 
-    if (args.Length() != 1) {
-      return VException("One argument expected: der");
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("entries"),
+               Integer::NewFromUnsigned(tree->entries.size()));
+    stats->Set(String::NewSymbol("height"),
+               Integer::New((int32_t) tree->chain.size() - 1));
+    stats->Set(String::NewSymbol("usage"), Number::New(tree->Usage()));
+
+    return scope.Close(stats);
+  }
+};
+
+Persistent<FunctionTemplate> BlockTree::s_ct;
+
+
+// Initial number of slots in a HashTable, must be a power of two
+#define HASH_TABLE_MIN_SLOTS 64
+
+/**
+ * Map from 32 byte hashes to JavaScript values.
+ *
+ * Keys are stored inline and found through an open addressing table, so
+ * lookups don't create strings. Entries are also kept in a list from oldest
+ * to newest; with a limit set, the oldest entry is dropped once the table
+ * is full. In LRU mode reading an entry makes it the newest one.
+ */
+class HashTable : ObjectWrap
+{
+private:
+
+  struct entry_t {
+    unsigned char hash[32];
+    Persistent<Value> value;
+    // Neighbours in age order, or the next free entry
+    int32_t older;
+    int32_t newer;
+  };
+
+  vector<entry_t> entries;
+
+  // Positions in `entries`, -1 marks an empty slot
+  vector<int32_t> slots;
+
+  int32_t oldest;
+  int32_t newest;
+  int32_t free_list;
+  size_t count;
+
+  size_t limit;
+  bool lru;
+
+  size_t
+  FindSlot(const unsigned char *hash)
+  {
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash_bucket(hash, mask); slots[i] != -1;
+         i = (i + 1) & mask) {
+      if (memcmp(entries[slots[i]].hash, hash, 32) == 0) {
+        return i;
+      }
     }
-    if (!Buffer::HasInstance(args[0])) {
-      return VException("Argument 'der' must be of type Buffer");
+    return (size_t) -1;
+  }
+
+  void
+  Place(vector<int32_t> &table, int32_t pos)
+  {
+    size_t mask = table.size() - 1;
+    size_t i = hash_bucket(entries[pos].hash, mask);
+    while (table[i] != -1) {
+      i = (i + 1) & mask;
     }
+    table[i] = pos;
+  }
 
-    BitcoinKey* key = new BitcoinKey();
-    if (key->lastError != NULL) {
-      return VException(key->lastError);
+  void
+  Resize(size_t size)
+  {
+    vector<int32_t> next(size, -1);
+    for (int32_t pos = oldest; pos != -1; pos = entries[pos].newer) {
+      Place(next, pos);
     }
+    slots.swap(next);
+  }
 
-    Handle<Object> der_buf = args[0]->ToObject();
-    const unsigned char *data = (const unsigned char*) Buffer::Data(der_buf);
+  /**
+   * Empty a slot, moving later entries of the same probe run back so no
+   * tombstones are needed.
+   */
+  void
+  ClearSlot(size_t i)
+  {
+    size_t mask = slots.size() - 1;
+    size_t j = i;
+    for (;;) {
+      slots[i] = -1;
+      size_t k;
+      do {
+        j = (j + 1) & mask;
+        if (slots[j] == -1) {
+          return;
+        }
+        k = hash_bucket(entries[slots[j]].hash, mask);
+        // Entries whose home slot lies cyclically in (i, j] stay put
+      } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
 
-    if (!d2i_ECPrivateKey(&(key->ec), &data, Buffer::Length(der_buf))) {
-      return VException("Error from d2i_ECPrivateKey(&key, &data, len)");
+  void
+  Unlink(int32_t pos)
+  {
+    entry_t &entry = entries[pos];
+    if (entry.older != -1) {
+      entries[entry.older].newer = entry.newer;
+    } else {
+      oldest = entry.newer;
     }
-    
-    key->hasPrivate = true;
-    key->hasPublic = true;
+    if (entry.newer != -1) {
+      entries[entry.newer].older = entry.older;
+    } else {
+      newest = entry.older;
+    }
+  }
 
-    Handle<Function> cons = s_ct->GetFunction();
-    Handle<Value> external = External::New(key);
-    Handle<Value> result = cons->NewInstance(1, &external);
+  void
+  Append(int32_t pos)
+  {
+    entries[pos].older = newest;
+    entries[pos].newer = -1;
+    if (newest != -1) {
+      entries[newest].newer = pos;
+    } else {
+      oldest = pos;
+    }
+    newest = pos;
+  }
 
-    return scope.Close(result);
+  void
+  Erase(size_t slot)
+  {
+    int32_t pos = slots[slot];
+    ClearSlot(slot);
+    Unlink(pos);
+    entries[pos].value.Dispose();
+    entries[pos].value.Clear();
+    entries[pos].newer = free_list;
+    free_list = pos;
+    count--;
   }
 
-  static Handle<Value>
-  VerifySignature(const Arguments& args)
+  void
+  Evict()
   {
-    HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
-  
-    if (args.Length() != 3) {
-      return VException("Three arguments expected: hash, sig, callback");
+    while (limit && count > limit) {
+      Erase(FindSlot(entries[oldest].hash));
     }
-    if (!Buffer::HasInstance(args[0])) {
-      return VException("Argument 'hash' must be of type Buffer");
+  }
+
+  /**
+   * Add or replace an entry, returns true if the key was new.
+   */
+  bool
+  Set(const unsigned char *hash, Handle<Value> value)
+  {
+    size_t slot = FindSlot(hash);
+    if (slot != (size_t) -1) {
+      int32_t pos = slots[slot];
+      entries[pos].value.Dispose();
+      entries[pos].value = Persistent<Value>::New(value);
+      if (lru) {
+        Unlink(pos);
+        Append(pos);
+      }
+      return false;
     }
-    if (!Buffer::HasInstance(args[1])) {
-      return VException("Argument 'sig' must be of type Buffer");
+
+    if ((count + 1) * 2 > slots.size()) {
+      Resize(slots.size() * 2);
     }
-    REQ_FUN_ARG(2, cb);
-    if (!key->hasPublic) {
-      return VException("BitcoinKey does not have a public key set");
+
+    int32_t pos;
+    if (free_list != -1) {
+      pos = free_list;
+      free_list = entries[pos].newer;
+    } else {
+      pos = entries.size();
+      entries.push_back(entry_t());
     }
+    memcpy(entries[pos].hash, hash, 32);
+    entries[pos].value = Persistent<Value>::New(value);
+    Append(pos);
+    Place(slots, pos);
+    count++;
+
+    Evict();
+    return true;
+  }
 
-    Handle<Object> hash_buf = args[0]->ToObject();
-    Handle<Object> sig_buf = args[1]->ToObject();
+  void
+  Clear()
+  {
+    for (int32_t pos = oldest; pos != -1; pos = entries[pos].newer) {
+      entries[pos].value.Dispose();
+    }
+    entries.clear();
+    slots.assign(HASH_TABLE_MIN_SLOTS, -1);
+    oldest = newest = free_list = -1;
+    count = 0;
+  }
 
-    if (Buffer::Length(hash_buf) != 32) {
-      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+  static bool
+  HashArg(Handle<Value> value, const unsigned char **hash)
+  {
+    if (!Buffer::HasInstance(value) || Buffer::Length(value->ToObject()) != 32) {
+      return false;
     }
+    *hash = (const unsigned char *) Buffer::Data(value->ToObject());
+    return true;
+  }
 
-    verify_sig_baton_t *baton = new verify_sig_baton_t();
-    baton->key = key;
-    baton->digest = (unsigned char *)Buffer::Data(hash_buf);
-    baton->digestLen = Buffer::Length(hash_buf);
-    baton->digestBuf = Persistent<Object>::New(hash_buf);
-    baton->sig = (unsigned char *)Buffer::Data(sig_buf);
-    baton->sigLen = Buffer::Length(sig_buf);
-    baton->sigBuf = Persistent<Object>::New(sig_buf);
-    baton->result = -1;
-    baton->cb = Persistent<Function>::New(cb);
+public:
 
-    key->Ref();
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
 
-    eio_custom(EIO_VerifySignature, EIO_PRI_DEFAULT, VerifySignatureCallback, baton);
-    ev_ref(EV_DEFAULT_UC);
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("HashTable"));
 
-    return scope.Close(Undefined());
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "set", SetMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "get", Get);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "has", Has);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "remove", Remove);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "keys", Keys);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "values", Values);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "count", Count);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "oldest", Oldest);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "clear", ClearMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setLimit", SetLimit);
+
+    target->Set(String::NewSymbol("HashTable"),
+                s_ct->GetFunction());
   }
 
-  static int
-  VerifySignatureCallback(eio_req *req)
+  HashTable(size_t limit, bool lru) :
+    slots(HASH_TABLE_MIN_SLOTS, -1),
+    oldest(-1),
+    newest(-1),
+    free_list(-1),
+    count(0),
+    limit(limit),
+    lru(lru)
   {
-    HandleScope scope;
-    verify_sig_baton_t *baton = static_cast<verify_sig_baton_t *>(req->data);
-    ev_unref(EV_DEFAULT_UC);
-    baton->key->Unref();
-    baton->digestBuf.Dispose();
-    baton->sigBuf.Dispose();
+  }
 
-    Local<Value> argv[2];
+  ~HashTable()
+  {
+    Clear();
+  }
 
-    argv[0] = Local<Value>::New(Null());
-    argv[1] = Local<Value>::New(Null());
-    if (baton->result == -1) {
-      argv[0] = Exception::TypeError(String::New("Error during ECDSA_verify"));
-    } else if (baton->result == 0) {
-      // Signature invalid
-      argv[1] = Local<Value>::New(Boolean::New(false));
-    } else if (baton->result == 1) {
-      // Signature valid
-      argv[1] = Local<Value>::New(Boolean::New(true));
-    } else {
-      argv[0] = Exception::TypeError(
-        String::New("ECDSA_verify gave undefined return value"));
+  /**
+   * new HashTable([limit[, lru]])
+   *
+   * A limit of 0 means the table grows without bounds.
+   */
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
     }
 
-    TryCatch try_catch;
-
-    baton->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    HandleScope scope;
 
-    if (try_catch.HasCaught()) {
-      FatalException(try_catch);
+    size_t limit = 0;
+    if (args.Length() > 0 && !args[0]->IsUndefined() && !args[0]->IsNull()) {
+      if (!args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+        return VException("Argument 'limit' must be a non-negative Number");
+      }
+      limit = args[0]->IntegerValue();
     }
+    bool lru = args.Length() > 1 && args[1]->BooleanValue();
 
-    baton->cb.Dispose();
+    HashTable *table = new HashTable(limit, lru);
+    table->Wrap(args.Holder());
 
-    delete baton;
-    return 0;
+    return scope.Close(args.This());
   }
 
+  /**
+   * Store a value, returns false if the key was already present.
+   */
   static Handle<Value>
-  VerifySignatureSync(const Arguments& args)
+  SetMethod(const Arguments& args)
   {
     HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
-  
-    if (args.Length() != 2) {
-      return VException("Two arguments expected: hash, sig");
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 2 || !HashArg(args[0], &hash)) {
+      return VException("Two arguments expected: hash Buffer, value");
     }
-    if (!Buffer::HasInstance(args[0])) {
-      return VException("Argument 'hash' must be of type Buffer");
+
+    return scope.Close(Boolean::New(table->Set(hash, args[1])));
+  }
+
+  /**
+   * Look up a value, returns undefined for unknown keys.
+   */
+  static Handle<Value>
+  Get(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
     }
-    if (!Buffer::HasInstance(args[1])) {
-      return VException("Argument 'sig' must be of type Buffer");
+
+    size_t slot = table->FindSlot(hash);
+    if (slot == (size_t) -1) {
+      return scope.Close(Undefined());
     }
-    if (!key->hasPublic) {
-      return VException("BitcoinKey does not have a public key set");
+
+    int32_t pos = table->slots[slot];
+    if (table->lru) {
+      table->Unlink(pos);
+      table->Append(pos);
     }
+    return scope.Close(table->entries[pos].value);
+  }
 
-    Handle<Object> hash_buf = args[0]->ToObject();
-    Handle<Object> sig_buf = args[1]->ToObject();
+  static Handle<Value>
+  Has(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
 
-    const unsigned char *hash_data = (unsigned char *) Buffer::Data(hash_buf);
-    const unsigned char *sig_data = (unsigned char *) Buffer::Data(sig_buf);
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
 
-    unsigned int hash_len = Buffer::Length(hash_buf);
-    unsigned int sig_len = Buffer::Length(sig_buf);
+    return scope.Close(Boolean::New(table->FindSlot(hash) != (size_t) -1));
+  }
 
-    if (hash_len != 32) {
-      return VException("Argument 'hash' must be Buffer of length 32 bytes");
-    }
+  /**
+   * Delete an entry, returns whether it existed.
+   */
+  static Handle<Value>
+  Remove(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
 
-    // Verify signature
-    int result = key->VerifySignature(hash_data, hash_len, sig_data, sig_len);
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
 
-    if (result == -1) {
-      return VException("Error during ECDSA_verify");
-    } else if (result == 0) {
-      // Signature invalid
+    size_t slot = table->FindSlot(hash);
+    if (slot == (size_t) -1) {
       return scope.Close(Boolean::New(false));
-    } else if (result == 1) {
-      // Signature valid
-      return scope.Close(Boolean::New(true));
-    } else {
-      return VException("ECDSA_verify gave undefined return value");
     }
+    table->Erase(slot);
+
+    if (table->count * 8 < table->slots.size() &&
+        table->slots.size() > HASH_TABLE_MIN_SLOTS) {
+      table->Resize(table->slots.size() / 2);
+    }
+
+    return scope.Close(Boolean::New(true));
   }
 
+  /**
+   * All keys, oldest first.
+   */
   static Handle<Value>
-  SignSync(const Arguments& args)
+  Keys(const Arguments& args)
   {
     HandleScope scope;
-    BitcoinKey* key = node::ObjectWrap::Unwrap<BitcoinKey>(args.This());
-  
-    if (args.Length() != 1) {
-      return VException("One argument expected: hash");
-    }
-    if (!Buffer::HasInstance(args[0])) {
-      return VException("Argument 'hash' must be of type Buffer");
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
+
+    Local<Array> result = Array::New(table->count);
+    uint32_t i = 0;
+    for (int32_t pos = table->oldest; pos != -1;
+         pos = table->entries[pos].newer) {
+      result->Set(i++, record_slice(table->entries[pos].hash, 32));
     }
-    if (!key->hasPrivate) {
-      return VException("BitcoinKey does not have a private key set");
+    return scope.Close(result);
+  }
+
+  /**
+   * All values, oldest first.
+   */
+  static Handle<Value>
+  Values(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
+
+    Local<Array> result = Array::New(table->count);
+    uint32_t i = 0;
+    for (int32_t pos = table->oldest; pos != -1;
+         pos = table->entries[pos].newer) {
+      result->Set(i++, table->entries[pos].value);
     }
+    return scope.Close(result);
+  }
 
-    Handle<Object> hash_buf = args[0]->ToObject();
+  static Handle<Value>
+  Count(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
 
-    const unsigned char *hash_data = (unsigned char *) Buffer::Data(hash_buf);
+    return scope.Close(Integer::NewFromUnsigned(table->count));
+  }
 
-    unsigned int hash_len = Buffer::Length(hash_buf);
+  /**
+   * The oldest key, or undefined if the table is empty. Lets callers with
+   * related tables drop entries themselves instead of setting a limit.
+   */
+  static Handle<Value>
+  Oldest(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
 
-    if (hash_len != 32) {
-      return VException("Argument 'hash' must be Buffer of length 32 bytes");
+    if (table->oldest == -1) {
+      return scope.Close(Undefined());
     }
+    return scope.Close(record_slice(table->entries[table->oldest].hash, 32));
+  }
 
-    // Create signature
-    ECDSA_SIG *sig = key->Sign(hash_data, hash_len);
+  static Handle<Value>
+  ClearMethod(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
 
-    // Export DER
-    unsigned int der_size = i2d_ECDSA_SIG(sig, NULL);
-    if (!der_size) {
-      // TODO: ERROR: "Error from i2d_ECPrivateKey(key->ec, NULL)"
-      return scope.Close(Null());
-    }
-    unsigned char *der_begin, *der_end;
-    der_begin = der_end = (unsigned char *)malloc(der_size);
+    table->Clear();
 
-    if (i2d_ECDSA_SIG(sig, &der_end) != der_size) {
-      // TODO: ERROR: "Error from i2d_ECPrivateKey(key->ec, &der_end)"
-      return scope.Close(Null());
+    return scope.Close(Undefined());
+  }
+
+  static Handle<Value>
+  SetLimit(const Arguments& args)
+  {
+    HandleScope scope;
+    HashTable *table = ObjectWrap::Unwrap<HashTable>(args.This());
+
+    if (args.Length() != 1 || !args[0]->IsNumber() ||
+        args[0]->IntegerValue() < 0) {
+      return VException("One argument expected: limit Number");
     }
-    Buffer *der_buf = Buffer::New(der_size);
-    memcpy(Buffer::Data(der_buf), der_begin, der_size);
 
-    free(der_begin);
-    ECDSA_SIG_free(sig);
+    table->limit = args[0]->IntegerValue();
+    table->Evict();
 
-    return scope.Close(der_buf->handle_);
+    return scope.Close(Undefined());
   }
 };
 
-Persistent<FunctionTemplate> BitcoinKey::s_ct;
+Persistent<FunctionTemplate> HashTable::s_ct;
 
 
-static Handle<Value>
-pubkey_to_address256 (const Arguments& args)
+// Most hash functions a RollingBloomFilter uses, whatever the rate
+#define BLOOM_MAX_HASH_FUNCS 50
+
+static inline uint64_t
+bloom_mix64(uint64_t k)
 {
-  HandleScope scope;
-  
-  if (args.Length() != 1) {
-    return VException("One argument expected: pubkey Buffer");
-  }
-  if (!Buffer::HasInstance(args[0])) {
-    return VException("One argument expected: pubkey Buffer");
-  }
-  v8::Handle<v8::Object> pub_buf = args[0]->ToObject();
-  
-  unsigned char *pub_data = (unsigned char *) Buffer::Data(pub_buf);
-  
-  // sha256(pubkey)
-  unsigned char hash1[SHA256_DIGEST_LENGTH];
-  SHA256_CTX c;
-  SHA256_Init(&c);
-  SHA256_Update(&c, pub_data, Buffer::Length(pub_buf));
-  SHA256_Final(hash1, &c);
-  
-  // ripemd160(sha256(pubkey))
-  unsigned char hash2[RIPEMD160_DIGEST_LENGTH];
-  RIPEMD160_CTX c2;
-  RIPEMD160_Init(&c2);
-  RIPEMD160_Update(&c2, hash1, SHA256_DIGEST_LENGTH);
-  RIPEMD160_Final(hash2, &c2);
-  
-  // x = '\x00' + ripemd160(sha256(pubkey))
-  // LATER: make the version an optional argument
-  unsigned char address256[1 + RIPEMD160_DIGEST_LENGTH + 4];
-  address256[0] = 0;
-  memcpy(address256 + 1, hash2, RIPEMD160_DIGEST_LENGTH);
-  
-  // sha256(x)
-  unsigned char hash3[SHA256_DIGEST_LENGTH];
-  SHA256_CTX c3;
-  SHA256_Init(&c3);
-  SHA256_Update(&c3, address256, 1 + RIPEMD160_DIGEST_LENGTH);
-  SHA256_Final(hash3, &c3);
-  
-  // address256 = (x + sha256(x)[:4])
-  memcpy(
-    address256 + (1 + RIPEMD160_DIGEST_LENGTH),
-    hash3,
-    4);
-  
-  Buffer *address256_buf = Buffer::New(1 + RIPEMD160_DIGEST_LENGTH + 4);
-  memcpy(Buffer::Data(address256_buf), address256, 1 + RIPEMD160_DIGEST_LENGTH + 4);
-  return scope.Close(address256_buf->handle_);
+  // MurmurHash3 finalizer
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
 }
 
+static inline uint64_t
+bloom_read64(const unsigned char *p)
+{
+  return (uint64_t) read_le32(p) | ((uint64_t) read_le32(p + 4) << 32);
+}
 
-static const char* BASE58_ALPHABET = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+/**
+ * Bloom filter that remembers roughly the last `elements` hashes.
+ *
+ * Entries are added in generations of half the capacity. Every filter bit
+ * is stored as a two bit generation number, and when a fourth generation
+ * starts, the bits of the oldest one are wiped. So anything among the last
+ * `elements` insertions is always found, older entries fade out, and the
+ * false positive rate holds no matter how many hashes go in.
+ *
+ * Keys are 32 byte hashes. Those are random already, so the bit positions
+ * come from mixing them with a secret random tweak, which keeps peers from
+ * picking hashes that collide on purpose.
+ */
+class RollingBloomFilter : ObjectWrap
+{
+private:
 
+  // Pairs of words: the low and the high generation bit of 64 filter bits
+  vector<uint64_t> data;
 
-static Handle<Value>
-base58_encode (const Arguments& args)
-{
-  HandleScope scope;
-  
-  if (args.Length() != 1) {
-    return VException("One argument expected: a Buffer");
+  uint32_t hash_funcs;
+  uint32_t per_generation;
+  uint32_t this_generation;
+  uint32_t generation;
+  uint64_t tweak;
+
+  void
+  Positions(const unsigned char *key, uint32_t n, uint32_t *pos, int *bit)
+  {
+    // Double hashing: h1 + n * h2 for the n-th hash function
+    uint64_t x = bloom_mix64(bloom_read64(key) ^
+                             bloom_mix64(bloom_read64(key + 8) ^ tweak));
+    uint32_t h = (uint32_t) (x >> 32) + n * ((uint32_t) x | 1);
+    *bit = h & 0x3f;
+    // Scale the upper bits to the number of words, the lower ones are in use
+    *pos = (uint32_t) (((uint64_t) h * data.size()) >> 32);
   }
-  if (!Buffer::HasInstance(args[0])) {
-    return VException("One argument expected: a Buffer");
+
+  void
+  Reset()
+  {
+    RAND_bytes((unsigned char *) &tweak, sizeof(tweak));
+    this_generation = 0;
+    generation = 1;
+    fill(data.begin(), data.end(), 0);
   }
-  v8::Handle<v8::Object> buf = args[0]->ToObject();
-  
-  unsigned char *buf_data = (unsigned char *) Buffer::Data(buf);
-  int buf_length = Buffer::Length(buf);
-  
-  BN_CTX *ctx = BN_CTX_new();
-  
-  BIGNUM *bn = BN_bin2bn(buf_data, buf_length, NULL);
-  
-  BIGNUM *bn58 = BN_new();
-  BN_set_word(bn58, 58);
-  
-  BIGNUM *bn0 = BN_new();
-  BN_set_word(bn0, 0);
-  
-  BIGNUM *dv = BN_new();
-  BIGNUM *rem = BN_new();
-  
-  // TODO: compute safe length
-  char *str = new char[100];
-  unsigned int c;
-  int i, j, j2;
-  
-  i = 0;
-  while (BN_cmp(bn, bn0) > 0) {
-    if (!BN_div(dv, rem, bn, bn58, ctx)) {
-      return VException("BN_div failed");
+
+  void
+  Insert(const unsigned char *key)
+  {
+    if (this_generation == per_generation) {
+      this_generation = 0;
+      if (++generation == 4) {
+        generation = 1;
+      }
+
+      // Wipe the bits of the generation whose number is being reused
+      uint64_t mask1 = 0 - (uint64_t) (generation & 1);
+      uint64_t mask2 = 0 - (uint64_t) (generation >> 1);
+      for (size_t p = 0; p < data.size(); p += 2) {
+        uint64_t p1 = data[p], p2 = data[p + 1];
+        uint64_t keep = (p1 ^ mask1) | (p2 ^ mask2);
+        data[p] = p1 & keep;
+        data[p + 1] = p2 & keep;
+      }
     }
-    if (bn != dv) {
-      BN_free(bn);
-      bn = dv;
+    this_generation++;
+
+    for (uint32_t n = 0; n < hash_funcs; n++) {
+      uint32_t pos;
+      int bit;
+      Positions(key, n, &pos, &bit);
+      uint64_t one = (uint64_t) 1 << bit;
+      data[pos & ~1U] = (data[pos & ~1U] & ~one) |
+        ((uint64_t) (generation & 1) << bit);
+      data[pos | 1] = (data[pos | 1] & ~one) |
+        ((uint64_t) (generation >> 1) << bit);
     }
-    c = BN_get_word(rem);
-    str[i] = BASE58_ALPHABET[c];
-    i++;
   }
-  
-  // Leading zeros
-  for (j = 0; j < buf_length; j++) {
-    if (buf_data[j] != 0) {
-      break;
+
+  bool
+  Contains(const unsigned char *key)
+  {
+    for (uint32_t n = 0; n < hash_funcs; n++) {
+      uint32_t pos;
+      int bit;
+      Positions(key, n, &pos, &bit);
+      if (!(((data[pos & ~1U] | data[pos | 1]) >> bit) & 1)) {
+        return false;
+      }
     }
-    str[i] = BASE58_ALPHABET[0];
-    i++;
-  }
-  
-  // Terminator
-  str[i] = 0;
-  
-  // Reverse string
-  int numSwaps = (i / 2);
-  char tmp;
-  for (j = 0; j < numSwaps; j++) {
-    j2 = i - 1 - j;
-    tmp = str[j];
-    str[j] = str[j2];
-    str[j2] = tmp;
+    return true;
   }
-  
-  BN_free(bn);
-  BN_free(bn58);
-  BN_free(bn0);
-  BN_free(rem);
-  BN_CTX_free(ctx);
-  
-  Local<String> ret = String::New(str);
-  delete [] str;
-  return scope.Close(ret);
-}
-
 
-static Handle<Value>
-base58_decode (const Arguments& args)
-{
-  HandleScope scope;
-  
-  if (args.Length() != 1) {
-    return VException("One argument expected: a String");
+  /**
+   * Expected false positive rate with the filter at capacity.
+   */
+  double
+  FpRate()
+  {
+    double bits = data.size() * 32.0;
+    double elements = per_generation * 3.0;
+    return pow(1.0 - exp(-1.0 * hash_funcs * elements / bits), hash_funcs);
   }
-  if (!args[0]->IsString()) {
-    return VException("One argument expected: a String");
+
+  static bool
+  HashArg(Handle<Value> value, const unsigned char **hash)
+  {
+    if (!Buffer::HasInstance(value) || Buffer::Length(value->ToObject()) != 32) {
+      return false;
+    }
+    *hash = (const unsigned char *) Buffer::Data(value->ToObject());
+    return true;
   }
-  
-  BN_CTX *ctx = BN_CTX_new();
-  
-  BIGNUM *bn58 = BN_new();
-  BN_set_word(bn58, 58);
-  
-  BIGNUM *bn = BN_new();
-  BN_set_word(bn, 0);
 
-  BIGNUM *bnChar = BN_new();
+public:
 
-  String::Utf8Value str(args[0]->ToString());
-  char *psz = *str;
-  
-  while (isspace(*psz))
-    psz++;
-  
-  // Convert big endian string to bignum
-  for (const char* p = psz; *p; p++) {
-    const char* p1 = strchr(BASE58_ALPHABET, *p);
-    if (p1 == NULL) {
-      while (isspace(*p))
-        p++;
-      if (*p != '\0')
-        return VException("Error");
-      break;
+  static Persistent<FunctionTemplate> s_ct;
+  static void Init(Handle<Object> target)
+  {
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+    s_ct = Persistent<FunctionTemplate>::New(t);
+    s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+    s_ct->SetClassName(String::NewSymbol("RollingBloomFilter"));
+
+    // Methods
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "insert", InsertMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "contains", ContainsMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "reset", ResetMethod);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
+
+    target->Set(String::NewSymbol("RollingBloomFilter"),
+                s_ct->GetFunction());
+  }
+
+  RollingBloomFilter(uint32_t elements, double fp_rate, size_t max_bytes)
+  {
+    double log_fp = log(fp_rate);
+    hash_funcs = max(1, min((int) floor(log_fp / log(0.5) + 0.5),
+                            BLOOM_MAX_HASH_FUNCS));
+    per_generation = (elements + 1) / 2;
+    double max_elements = per_generation * 3.0;
+    double bits = ceil(-1.0 * hash_funcs * max_elements /
+                       log(1.0 - exp(log_fp / hash_funcs)));
+
+    // Two storage bits per filter bit, in pairs of 64 bit words
+    size_t words = ((size_t) (bits + 63) / 64) * 2;
+    if (max_bytes && words * sizeof(uint64_t) > max_bytes) {
+      words = max((size_t) 2, max_bytes / sizeof(uint64_t) & ~(size_t) 1);
+
+      // Fewer hash functions are better for an overfull filter
+      hash_funcs = max(1, min((int) floor(words * 32.0 / max_elements *
+                                          log(2.0) + 0.5),
+                              (int) hash_funcs));
     }
-    BN_set_word(bnChar, p1 - BASE58_ALPHABET);
-    if (!BN_mul(bn, bn, bn58, ctx))
-      return VException("BN_mul failed");
-    if (!BN_add(bn, bn, bnChar))
-      return VException("BN_add failed");
+    data.resize(words);
+
+    Reset();
   }
 
-  // Get bignum as little endian data
-  unsigned int tmpLen = BN_num_bytes(bn);
-  unsigned char *tmp = (unsigned char *)malloc(tmpLen);
-  BN_bn2bin(bn, tmp);
+  /**
+   * new RollingBloomFilter(elements, fpRate[, maxBytes])
+   *
+   * With `maxBytes` the filter is made smaller if needed, at the cost of
+   * a higher false positive rate (see stats()).
+   */
+  static Handle<Value>
+  New(const Arguments& args)
+  {
+    if (!args.IsConstructCall()) {
+      return FromConstructorTemplate(s_ct, args);
+    }
 
-  // Trim off sign byte if present
-  if (tmpLen >= 2 && tmp[tmpLen-1] == 0 && tmp[tmpLen-2] >= 0x80)
-    tmpLen--;
-  
-  // Restore leading zeros
-  int nLeadingZeros = 0;
-  for (const char* p = psz; *p == BASE58_ALPHABET[0]; p++)
-    nLeadingZeros++;
-
-  // Allocate buffer and zero it
-  Buffer *buf = Buffer::New(nLeadingZeros + tmpLen);
-  char* data = Buffer::Data(buf);
-  memset(data, 0, nLeadingZeros + tmpLen);
-  memcpy(data+nLeadingZeros, tmp, tmpLen);
-
-  BN_free(bn58);
-  BN_free(bn);
-  BN_free(bnChar);
-  BN_CTX_free(ctx);
-  free(tmp);
+    HandleScope scope;
 
-  return scope.Close(buf->handle_);
-}
+    if (args.Length() < 2 || !args[0]->IsNumber() || !args[1]->IsNumber()) {
+      return VException("Arguments expected: elements Number, fpRate Number"
+                        "[, maxBytes Number]");
+    }
 
+    int64_t elements = args[0]->IntegerValue();
+    double fp_rate = args[1]->NumberValue();
+    if (elements < 1 || elements > 0x7fffffff) {
+      return VException("Argument 'elements' out of range");
+    }
+    if (!(fp_rate > 0 && fp_rate < 1)) {
+      return VException("Argument 'fpRate' must be between 0 and 1");
+    }
 
-int static FormatHashBlocks(void* pbuffer, unsigned int len)
-{
-  unsigned char* pdata = (unsigned char*)pbuffer;
-  unsigned int blocks = 1 + ((len + 8) / 64);
-  unsigned char* pend = pdata + 64 * blocks;
-  memset(pdata + len, 0, 64 * blocks - len);
-  pdata[len] = 0x80;
-  unsigned int bits = len * 8;
-  pend[-1] = (bits >> 0) & 0xff;
-  pend[-2] = (bits >> 8) & 0xff;
-  pend[-3] = (bits >> 16) & 0xff;
-  pend[-4] = (bits >> 24) & 0xff;
-  return blocks;
-}
+    size_t max_bytes = 0;
+    if (args.Length() > 2 && !args[2]->IsUndefined() && !args[2]->IsNull()) {
+      if (!args[2]->IsNumber() || args[2]->IntegerValue() < 0) {
+        return VException("Argument 'maxBytes' must be a non-negative Number");
+      }
+      max_bytes = args[2]->IntegerValue();
+    }
 
-static Handle<Value>
-sha256_midstate (const Arguments& args)
-{
-  HandleScope scope;
+    RollingBloomFilter *filter =
+      new RollingBloomFilter(elements, fp_rate, max_bytes);
+    filter->Wrap(args.Holder());
 
-  if (args.Length() != 1) {
-    return VException("One argument expected: data Buffer");
+    return scope.Close(args.This());
   }
-  if (!Buffer::HasInstance(args[0])) {
-    return VException("One argument expected: data Buffer");
+
+  static Handle<Value>
+  InsertMethod(const Arguments& args)
+  {
+    HandleScope scope;
+    RollingBloomFilter *filter =
+      ObjectWrap::Unwrap<RollingBloomFilter>(args.This());
+
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
+
+    filter->Insert(hash);
+
+    return scope.Close(Undefined());
   }
-  v8::Handle<v8::Object> blk_buf = args[0]->ToObject();
 
-  // Reserve 64 extra bytes of memory for padding
-  unsigned int blk_len = Buffer::Length(blk_buf);
-  unsigned char *blk_data = (unsigned char *) malloc(blk_len + 64);
+  static Handle<Value>
+  ContainsMethod(const Arguments& args)
+  {
+    HandleScope scope;
+    RollingBloomFilter *filter =
+      ObjectWrap::Unwrap<RollingBloomFilter>(args.This());
 
-  // Get block header
-  memcpy(blk_data, Buffer::Data(blk_buf), blk_len);
+    const unsigned char *hash;
+    if (args.Length() != 1 || !HashArg(args[0], &hash)) {
+      return VException("One argument expected: hash Buffer");
+    }
 
-  // Add SHA256 padding
-  FormatHashBlocks(blk_data, blk_len);
+    return scope.Close(Boolean::New(filter->Contains(hash)));
+  }
 
-  // Execute first half of first hash on block data
-  SHA256_CTX c;
-  SHA256_Init(&c);
-  SHA256_Transform(&c, blk_data);
+  static Handle<Value>
+  ResetMethod(const Arguments& args)
+  {
+    HandleScope scope;
+    RollingBloomFilter *filter =
+      ObjectWrap::Unwrap<RollingBloomFilter>(args.This());
 
-  // Note that we don't run SHA256_Final and return the middle state instead
+    filter->Reset();
 
-  Buffer *midstate_buf = Buffer::New(SHA256_DIGEST_LENGTH);
-  memcpy(Buffer::Data(midstate_buf), &c.h, SHA256_DIGEST_LENGTH);
+    return scope.Close(Undefined());
+  }
 
-  free(blk_data);
+  /**
+   * Filter statistics: {bytes, hashFuncs, capacity, fpRate}.
+   */
+  static Handle<Value>
+  Stats(const Arguments& args)
+  {
+    HandleScope scope;
+    RollingBloomFilter *filter =
+      ObjectWrap::Unwrap<RollingBloomFilter>(args.This());
+
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("bytes"),
+               Number::New(filter->data.size() * sizeof(uint64_t)));
+    stats->Set(String::NewSymbol("hashFuncs"),
+               Integer::NewFromUnsigned(filter->hash_funcs));
+    stats->Set(String::NewSymbol("capacity"),
+               Integer::NewFromUnsigned(filter->per_generation * 2));
+    stats->Set(String::NewSymbol("fpRate"), Number::New(filter->FpRate()));
+
+    return scope.Close(stats);
+  }
+};
 
-  return scope.Close(midstate_buf->handle_);
-}
+Persistent<FunctionTemplate> RollingBloomFilter::s_ct;
 
 
 extern "C" void
@@ -893,8 +7933,48 @@ init (Handle<Object> target)
 {
   HandleScope scope;
   BitcoinKey::Init(target);
+  SighashEngine::Init(target);
+  BitcoinMiner::Init(target);
+  MessageFramer::Init(target);
+  UtxoSet::Init(target);
+  BlockTree::Init(target);
+  HashTable::Init(target);
+  RollingBloomFilter::Init(target);
   target->Set(String::New("pubkey_to_address256"), FunctionTemplate::New(pubkey_to_address256)->GetFunction());
   target->Set(String::New("base58_encode"), FunctionTemplate::New(base58_encode)->GetFunction());
   target->Set(String::New("base58_decode"), FunctionTemplate::New(base58_decode)->GetFunction());
+  target->Set(String::New("base58_encode_many"), FunctionTemplate::New(base58_encode_many)->GetFunction());
+  target->Set(String::New("base58_decode_many"), FunctionTemplate::New(base58_decode_many)->GetFunction());
+  target->Set(String::New("base58check_encode"), FunctionTemplate::New(base58check_encode)->GetFunction());
+  target->Set(String::New("base58check_decode"), FunctionTemplate::New(base58check_decode)->GetFunction());
   target->Set(String::New("sha256_midstate"), FunctionTemplate::New(sha256_midstate)->GetFunction());
+  target->Set(String::New("sha256"), FunctionTemplate::New(sha256)->GetFunction());
+  target->Set(String::New("ripemd160"), FunctionTemplate::New(ripemd160)->GetFunction());
+  target->Set(String::New("double_sha256"), FunctionTemplate::New(double_sha256)->GetFunction());
+  target->Set(String::New("hash160"), FunctionTemplate::New(hash160)->GetFunction());
+  target->Set(String::New("double_sha256_many"), FunctionTemplate::New(double_sha256_many)->GetFunction());
+  target->Set(String::New("merkle_root"), FunctionTemplate::New(merkle_root)->GetFunction());
+  target->Set(String::New("merkle_tree"), FunctionTemplate::New(merkle_tree)->GetFunction());
+  target->Set(String::New("work_batch"), FunctionTemplate::New(work_batch)->GetFunction());
+  target->Set(String::New("sha256_kernel"), FunctionTemplate::New(sha256_kernel)->GetFunction());
+  target->Set(String::New("sha256_kernels"), FunctionTemplate::New(sha256_kernels)->GetFunction());
+  target->Set(String::New("sha256_set_kernel"), FunctionTemplate::New(sha256_set_kernel)->GetFunction());
+  target->Set(String::New("pubkey_cache_stats"), FunctionTemplate::New(pubkey_cache_stats)->GetFunction());
+  target->Set(String::New("pubkey_cache_set_size"), FunctionTemplate::New(pubkey_cache_set_size)->GetFunction());
+  target->Set(String::New("parse_block"), FunctionTemplate::New(parse_block)->GetFunction());
+  target->Set(String::New("parse_tx"), FunctionTemplate::New(parse_tx)->GetFunction());
+  target->Set(String::New("parse_block_file"), FunctionTemplate::New(parse_block_file)->GetFunction());
+  target->Set(String::New("decode_bits"), FunctionTemplate::New(decode_bits)->GetFunction());
+  target->Set(String::New("encode_bits"), FunctionTemplate::New(encode_bits)->GetFunction());
+  target->Set(String::New("check_proof_of_work"), FunctionTemplate::New(check_proof_of_work)->GetFunction());
+  target->Set(String::New("block_work"), FunctionTemplate::New(block_work)->GetFunction());
+  target->Set(String::New("chain_work"), FunctionTemplate::New(chain_work)->GetFunction());
+  target->Set(String::New("add_work"), FunctionTemplate::New(add_work)->GetFunction());
+  target->Set(String::New("compare_work"), FunctionTemplate::New(compare_work)->GetFunction());
+  target->Set(String::New("retarget_bits"), FunctionTemplate::New(retarget_bits)->GetFunction());
+  target->Set(String::New("encode_block_record"), FunctionTemplate::New(encode_block_record)->GetFunction());
+  target->Set(String::New("decode_block_record"), FunctionTemplate::New(decode_block_record)->GetFunction());
+  target->Set(String::New("build_message"), FunctionTemplate::New(build_message)->GetFunction());
+  target->Set(String::New("build_inv_message"), FunctionTemplate::New(build_inv_message)->GetFunction());
+  target->Set(String::New("build_block_message"), FunctionTemplate::New(build_block_message)->GetFunction());
 }
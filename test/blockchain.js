@@ -4,7 +4,7 @@ var vows = require('vows'),
 var Storage = require('../lib/storage').Storage;
 var Settings = require('../lib/settings').Settings;
 var BlockChain = require('../lib/blockchain').BlockChain;
-var Miner = require('../lib/miner/javascript.js').JavaScriptMiner;
+var Miner = require('../lib/miner/native.js').NativeMiner;
 var encodeHex = require('../lib/util').encodeHex;
 
 var Block = require('../lib/schema/block').Block;
@@ -21,7 +21,7 @@ try {
 } catch (e) {}
 
 if (leveldbAvailable) {
-  testEngine("LevelDB", 'leveldb:///tmp/unittest_blockchain');
+  testEngine("LevelDB", 'leveldb:///tmp/unittest_blockchain', true);
 }
 
 var mongodbAvailable = false;
@@ -36,9 +36,9 @@ if (mongodbAvailable) {
   testEngine("MongoDB", 'mongodb://localhost/bitcointest_blockchain');
 }
 
-function testEngine(label, uri) {
+function testEngine(label, uri, pipelined) {
   var storage;
-  vows.describe(label + ' Block Chain').addBatch({
+  var suite = vows.describe(label + ' Block Chain').addBatch({
     'A block chain storage': {
       topic: function () {
         storage = Storage.get(uri);
@@ -307,12 +307,184 @@ function testEngine(label, uri) {
         }
       }
     }
-  }).export(module);
+  });
+
+  // Engines with storeBlock() verify blocks while earlier ones are written
+  if (pipelined) {
+    suite.addBatch({
+      'A chain downloaded through the write pipeline': {
+        topic: makeTestChain({
+          blocks: [
+            // O -> A -> B -> C -> D -> E -> F -> G -> H
+            ['O', 'A'],
+            ['A', 'B'],
+            ['B', 'C'],
+            ['C', 'D'],
+            ['D', 'E'],
+            ['E', 'F'],
+            ['F', 'G'],
+            ['G', 'H']
+          ],
+          queued: true,
+          configure: function (chain) {
+            chain.cfg.storage.writeQueueLimit = 2;
+            chain.cfg.storage.prefetchDepth = 3;
+          }
+        }),
+
+        'has H as the top block': function (topic) {
+          assert.equal(topic.chain.getTopBlock().height, 8);
+          assert.equal(encodeHex(topic.chain.getTopBlock().getHash()),
+                       encodeHex(topic.blocks.H.getHash()));
+        },
+
+        'adds every block': function (topic) {
+          'ABCDEFGH'.split('').forEach(function (name) {
+            assert.isNull(topic.errors[name]);
+          });
+        },
+
+        'saves the blocks in order': function (topic) {
+          var saved = topic.events.filter(function (args) {
+            return args[0] == 'blockSave';
+          }).map(function (args) {
+            return encodeHex(args[1].block.getHash());
+          });
+          assert.deepEqual(saved, 'ABCDEFGH'.split('').map(function (name) {
+            return encodeHex(topic.blocks[name].getHash());
+          }));
+        },
+
+        'prefetches queued blocks': function (topic) {
+          var stats = topic.chain.getPipelineStats();
+          assert.ok(stats.stages.prefetch.count > 0);
+          assert.equal(stats.queued, 0);
+        }
+      }
+    }).addBatch({
+      'A chain whose block write fails': {
+        topic: makeTestChain({
+          blocks: [
+            // O -> A -> B -> C -> D -> E -> F
+            ['O', 'A'],
+            ['A', 'B'],
+            ['B', 'C'],
+            ['C', 'D'],
+            ['D', 'E'],
+            ['E', 'F']
+          ],
+          queued: true,
+          configure: function (chain) {
+            chain.cfg.storage.writeQueueLimit = 8;
+
+            // Fail the write of the third block after it was handed off
+            var storeBlock = storage.storeBlock;
+            var count = 0;
+            storage.storeBlock = function (block, txs, connect, callback) {
+              if (++count < 3) {
+                storeBlock.apply(this, arguments);
+                return;
+              }
+              storage.storeBlock = storeBlock;
+              process.nextTick(function () {
+                callback(new Error('Disk full'));
+              });
+            };
+          }
+        }),
+
+        'adds the blocks up to it': function (topic) {
+          assert.isNull(topic.errors.A);
+          assert.isNull(topic.errors.B);
+          assert.isNull(topic.errors.C);
+        },
+
+        'fails the next block with the write error': function (topic) {
+          assert.equal(topic.errors.D.message, 'Disk full');
+        },
+
+        'does not advance past it': function (topic) {
+          assert.equal(encodeHex(topic.chain.getTopBlock().getHash()),
+                       encodeHex(topic.blocks.C.getHash()));
+        },
+
+        'when a block is added again': {
+          topic: function (topic) {
+            var callback = this.callback;
+            topic.chain.add(topic.blocks.D, topic.blockTxs.D, function (err) {
+              callback(null, err);
+            });
+          },
+
+          'fails it as well': function (err) {
+            assert.equal(err.message, 'Disk full');
+          }
+        }
+      }
+    }).addBatch({
+      'A chain whose batch write fails': {
+        topic: makeTestChain({
+          blocks: [
+            // O -> A -> B -> C -> D -> E -> F
+            ['O', 'A'],
+            ['A', 'B'],
+            ['B', 'C'],
+            ['C', 'D'],
+            ['D', 'E'],
+            ['E', 'F']
+          ],
+          queued: true,
+          configure: function (chain) {
+            // Fail the write that resizing the batch triggers for the third
+            // block
+            var setBlockBatchSize = storage.setBlockBatchSize;
+            var count = 0;
+            storage.setBlockBatchSize = function (size, callback) {
+              if (++count < 3) {
+                setBlockBatchSize.apply(this, arguments);
+                return;
+              }
+              storage.setBlockBatchSize = setBlockBatchSize;
+              process.nextTick(function () {
+                callback(new Error('Disk full'));
+              });
+            };
+          }
+        }),
+
+        'adds the blocks up to it': function (topic) {
+          assert.isNull(topic.errors.A);
+          assert.isNull(topic.errors.B);
+          assert.isNull(topic.errors.C);
+        },
+
+        'fails the next block with the write error': function (topic) {
+          assert.equal(topic.errors.D.message, 'Disk full');
+        },
+
+        'when a block is added again': {
+          topic: function (topic) {
+            var callback = this.callback;
+            topic.chain.add(topic.blocks.D, topic.blockTxs.D, function (err) {
+              callback(null, err);
+            });
+          },
+
+          'fails it as well': function (err) {
+            assert.equal(err.message, 'Disk full');
+          }
+        }
+      }
+    });
+  }
+
+  suite.export(module);
 
   function makeTestChain(descriptor) {
     var blocks = {};
     var blockTxs = {};
     var events = [];
+    var errors = {};
 
     var callback = this.callback;
 
@@ -393,6 +565,10 @@ function testEngine(label, uri) {
       steps.push(function setupTest(err, chain) {
         if (err) throw err;
 
+        if (descriptor.configure) {
+          descriptor.configure(chain);
+        }
+
         // Monkey-patch a mechanism onto the block chain captures all events.
         chain.__emit = chain.emit;
         chain.emit = function captureEvent() {
@@ -404,8 +580,31 @@ function testEngine(label, uri) {
         this(null, chain);
       });
 
-      // Simulate block download
-      if (Array.isArray(descriptor.blocks)) {
+      // Simulate block download, either one block at a time or with all
+      // of them queued at once
+      if (Array.isArray(descriptor.blocks) && descriptor.queued) {
+        steps.push(function simulateQueuedDownload(err, chain) {
+          if (err) throw err;
+
+          var group = this.group();
+          descriptor.blocks.forEach(function (blockDesc) {
+            var callback = group();
+            chain.add(
+              blocks[blockDesc.name],
+              blockTxs[blockDesc.name],
+              function (err) {
+                errors[blockDesc.name] = err || null;
+                callback(null, chain);
+              }
+            );
+          });
+        });
+        steps.push(function (err, chains) {
+          if (err) throw err;
+
+          this(null, chains[0]);
+        });
+      } else if (Array.isArray(descriptor.blocks)) {
         descriptor.blocks.forEach(function (blockDesc) {
           steps.push(function simulateDownload(err, chain) {
             if (err) throw err;
@@ -435,7 +634,9 @@ function testEngine(label, uri) {
 
         topic.chain = chain;
         topic.blocks = blocks;
+        topic.blockTxs = blockTxs;
         topic.events = events;
+        topic.errors = errors;
 
         this(null, topic);
       });
@@ -0,0 +1,207 @@
+var vows = require('vows'),
+    assert = require('assert');
+
+var fs = require('fs');
+var BlockFiles = require('../lib/db/blockfiles').BlockFiles;
+
+var MAGIC = new Buffer([0xf9, 0xbe, 0xb4, 0xd9]);
+
+function createBlockFiles(name) {
+  var blockFiles = new BlockFiles('/tmp/unittest_blockfiles_' + name, MAGIC);
+  blockFiles.destroy();
+  blockFiles.open(0, 0);
+  return blockFiles;
+}
+
+function createData(length, fill) {
+  var data = new Buffer(length);
+  data.fill(fill);
+  return data;
+}
+
+function readFile(blockFiles, pos, callback) {
+  blockFiles.read(pos.file, pos.offset, pos.length, callback);
+}
+
+vows.describe('BlockFiles').addBatch({
+  'A block that is still being written': {
+    topic: function () {
+      var callback = this.callback;
+      var blockFiles = createBlockFiles('pending');
+      var pos = blockFiles.append([createData(80, 1), createData(20, 2)]);
+      var pending = blockFiles.writes.length;
+      readFile(blockFiles, pos, function (err, data) {
+        var tx = {file: pos.file, offset: pos.offset + 80, length: 20};
+        readFile(blockFiles, tx, function (err2, txData) {
+          callback(err || err2, {
+            pos: pos,
+            pending: pending,
+            data: data,
+            txData: txData
+          });
+        });
+      });
+    },
+    'is placed after the frame header': function (topic) {
+      assert.deepEqual(topic.pos, {file: 0, offset: 8, length: 100});
+    },
+    'is served from memory': function (topic) {
+      assert.equal(topic.pending, 1);
+      assert.equal(topic.data.length, 100);
+      assert.equal(topic.data[0], 1);
+      assert.equal(topic.data[99], 2);
+    },
+    'can be read in parts': function (topic) {
+      assert.equal(topic.txData.toString('hex'),
+                   createData(20, 2).toString('hex'));
+    }
+  },
+  'Block files at their size limit': {
+    topic: function () {
+      var callback = this.callback;
+      var blockFiles = createBlockFiles('rollover');
+      blockFiles.maxFileSize = 100;
+      blockFiles.chunkSize = 64;
+
+      var positions = [1, 2, 3].map(function (n) {
+        return blockFiles.append([createData(40, n)]);
+      });
+      blockFiles.flush(function (err) {
+        if (err) {
+          callback(err);
+          return;
+        }
+        readFile(blockFiles, positions[2], function (err, data) {
+          callback(err, {
+            blockFiles: blockFiles,
+            positions: positions,
+            data: data
+          });
+        });
+      });
+    },
+    'start a new file': function (topic) {
+      assert.deepEqual(topic.positions.map(function (pos) {
+        return pos.file;
+      }), [0, 0, 1]);
+      assert.equal(topic.positions[1].offset, 56);
+      assert.equal(topic.positions[2].offset, 8);
+    },
+    'grow in chunks': function (topic) {
+      var blockFiles = topic.blockFiles;
+      assert.equal(fs.statSync(blockFiles.getPath(0)).size, 128);
+      assert.equal(fs.statSync(blockFiles.getPath(1)).size, 64);
+    },
+    'read blocks back from disk': function (topic) {
+      assert.equal(topic.data.toString('hex'),
+                   createData(40, 3).toString('hex'));
+    }
+  },
+  'Several queued flushes': {
+    topic: function () {
+      var callback = this.callback;
+      var blockFiles = createBlockFiles('flush');
+      blockFiles.maxFileSize = 100;
+
+      // Record which files are synced and whether they still had writes
+      // running at the time
+      var syncs = [];
+      var fsync = fs.fsync;
+      fs.fsync = function (fd, cb) {
+        var file = null;
+        for (var i in blockFiles.fds) {
+          if (blockFiles.fds[i] === fd) {
+            file = +i;
+          }
+        }
+        syncs.push({
+          file: file,
+          pending: blockFiles.writes.some(function (write) {
+            return write.file === file;
+          })
+        });
+        fsync.apply(fs, arguments);
+      };
+
+      var order = [];
+      var pending = [];
+      var flushed = function (n) {
+        return function (err) {
+          order.push(n);
+          pending.push(blockFiles.writes.length);
+          if (n == 3) {
+            fs.fsync = fsync;
+            callback(err, {order: order, pending: pending, syncs: syncs});
+          }
+        };
+      };
+      blockFiles.append([createData(60, 1)]);
+      blockFiles.flush(flushed(1));
+      blockFiles.append([createData(60, 2)]);
+      blockFiles.flush(flushed(2));
+      blockFiles.flush(flushed(3));
+    },
+    'call back in order': function (topic) {
+      assert.deepEqual(topic.order, [1, 2, 3]);
+    },
+    'wait for the writes issued before them': function (topic) {
+      assert.equal(topic.pending[1], 0);
+      assert.equal(topic.pending[2], 0);
+    },
+    'sync each file after its last write': function (topic) {
+      [0, 1].forEach(function (file) {
+        var last = topic.syncs.filter(function (sync) {
+          return sync.file === file;
+        }).pop();
+        assert.isObject(last);
+        assert.isFalse(last.pending);
+      });
+    }
+  },
+  'Reopened block files': {
+    topic: function () {
+      var callback = this.callback;
+      var blockFiles = createBlockFiles('reopen');
+      var first = blockFiles.append([createData(30, 1)]);
+      var end = blockFiles.end;
+      var lost = blockFiles.append([createData(30, 2)]);
+
+      blockFiles.close(function (err) {
+        if (err) {
+          callback(err);
+          return;
+        }
+
+        // Only the first block made it into the index
+        var reopened = new BlockFiles(blockFiles.dir, MAGIC);
+        reopened.open(0, end);
+        var pos = reopened.append([createData(30, 3)]);
+        reopened.flush(function (err) {
+          if (err) {
+            callback(err);
+            return;
+          }
+          readFile(reopened, first, function (err, firstData) {
+            readFile(reopened, pos, function (err2, data) {
+              callback(err || err2, {
+                lost: lost,
+                pos: pos,
+                firstData: firstData,
+                data: data
+              });
+            });
+          });
+        });
+      });
+    },
+    'overwrite the uncommitted tail': function (topic) {
+      assert.deepEqual(topic.pos, topic.lost);
+      assert.equal(topic.data.toString('hex'),
+                   createData(30, 3).toString('hex'));
+    },
+    'keep the committed blocks': function (topic) {
+      assert.equal(topic.firstData.toString('hex'),
+                   createData(30, 1).toString('hex'));
+    }
+  }
+}).export(module);
@@ -0,0 +1,193 @@
+var vows = require('vows'),
+    assert = require('assert');
+
+var events = require('events');
+var Settings = require('../lib/settings').Settings;
+var BlockScheduler = require('../lib/blockscheduler').BlockScheduler;
+
+function createChain() {
+  var chain = {
+    cfg: new Settings(),
+    added: [],
+    getQueueCount: function () {
+      return 0;
+    },
+    add: function (block, txs, callback) {
+      chain.added.push(block.n);
+      callback(null);
+    }
+  };
+  return chain;
+}
+
+function createConn(name) {
+  var conn = new events.EventEmitter();
+  conn.peer = name;
+  conn.active = true;
+  conn.socket = {writable: true};
+  conn.requests = [];
+  conn.sendGetData = function (invs) {
+    invs.forEach(function (inv) {
+      conn.requests.push(inv.hash);
+    });
+  };
+  return conn;
+}
+
+function createHashes(count) {
+  var hashes = [];
+  for (var i = 0; i < count; i++) {
+    var hash = new Buffer(32);
+    hash.fill(0);
+    hash[0] = i;
+    hashes.push(hash);
+  }
+  return hashes;
+}
+
+function createBlock(hash) {
+  return {
+    n: hash[0],
+    size: 1000,
+    getHash: function () {
+      return hash;
+    }
+  };
+}
+
+// Answer a peer's requests, newest first, until it has none left
+function deliver(scheduler, conn) {
+  while (conn.requests.length) {
+    var hashes = conn.requests.splice(0).reverse();
+    hashes.forEach(function (hash) {
+      scheduler.receive(createBlock(hash), [], conn, function () {});
+    });
+  }
+}
+
+// Make outstanding requests, optionally only those to `conn`, look older
+// than the stall timeout
+function expire(scheduler, conn) {
+  for (var hash64 in scheduler.entries) {
+    var entry = scheduler.entries[hash64];
+    if (!conn || entry.conn === conn) {
+      entry.requested -= scheduler.stallTimeout + 1;
+    }
+  }
+}
+
+function createScheduler(chain, maxPerPeer) {
+  var scheduler = new BlockScheduler(chain, null);
+  scheduler.maxPerPeer = maxPerPeer;
+  scheduler.on('needMore', function () {});
+  return scheduler;
+}
+
+vows.describe('BlockScheduler').addBatch({
+  'A scheduler with a stalled peer': {
+    topic: function () {
+      var chain = createChain();
+      var scheduler = createScheduler(chain, 2);
+      var a = createConn('a'), b = createConn('b');
+      scheduler.addConnection(a);
+      scheduler.addConnection(b);
+      scheduler.enqueue(createHashes(4));
+
+      var before = a.requests.length;
+      deliver(scheduler, b);
+      expire(scheduler);
+      scheduler.checkStalled();
+      deliver(scheduler, b);
+
+      return {chain: chain, scheduler: scheduler, a: a, before: before};
+    },
+    'reads its limits from the settings': function (topic) {
+      assert.equal(topic.scheduler.windowSize,
+                   topic.chain.cfg.network.downloadWindow);
+      assert.equal(topic.scheduler.stallTimeout,
+                   topic.chain.cfg.network.downloadStallTimeout);
+    },
+    'requests blocks from both peers': function (topic) {
+      assert.equal(topic.before, 2);
+    },
+    'moves the requests to the other peer': function (topic) {
+      assert.deepEqual(topic.chain.added, [0, 1, 2, 3]);
+    },
+    'counts the stall against the peer': function (topic) {
+      var stats = topic.scheduler.getPeerStats();
+      assert.equal(stats[0].peer, 'a');
+      assert.equal(stats[0].stalls, 2);
+      assert.equal(stats[0].inFlight, 0);
+    }
+  },
+  'A scheduler that gives up on a block': {
+    topic: function () {
+      var chain = createChain();
+      var scheduler = createScheduler(chain, 2);
+      scheduler.maxAttempts = 1;
+      var a = createConn('a'), b = createConn('b');
+      scheduler.addConnection(a);
+      scheduler.addConnection(b);
+      scheduler.enqueue(createHashes(4));
+
+      // Peer b doesn't answer, a still has the first block outstanding
+      expire(scheduler, b);
+      scheduler.checkStalled();
+
+      var result = {chain: chain, scheduler: scheduler, a: a};
+      try {
+        b.emit('disconnect');
+      } catch (err) {
+        result.err = err;
+      }
+      return result;
+    },
+    'forgets the blocks': function (topic) {
+      var hashes = createHashes(4);
+      assert.equal(topic.scheduler.sequence.length, 2);
+      assert.isTrue(topic.scheduler.isKnown(hashes[0]));
+      assert.isFalse(topic.scheduler.isKnown(hashes[1]));
+      assert.isFalse(topic.scheduler.isKnown(hashes[3]));
+    },
+    'survives peers disconnecting afterwards': function (topic) {
+      assert.isUndefined(topic.err);
+    },
+    'frees their place in the download window': function (topic) {
+      var scheduler = topic.scheduler;
+      var c = createConn('c');
+      scheduler.windowSize = 4;
+      scheduler.addConnection(c);
+      scheduler.enqueue(createHashes(6).slice(4));
+      assert.equal(c.requests.length, 2);
+    },
+    'passes the remaining blocks on': function (topic) {
+      deliver(topic.scheduler, topic.a);
+      assert.deepEqual(topic.chain.added, [0, 2]);
+    }
+  },
+  'A scheduler losing a peer': {
+    topic: function () {
+      var chain = createChain();
+      var scheduler = createScheduler(chain, 3);
+      var a = createConn('a'), b = createConn('b');
+      scheduler.addConnection(a);
+      scheduler.addConnection(b);
+      scheduler.enqueue(createHashes(6));
+
+      var requested = a.requests.length;
+      a.emit('disconnect');
+      deliver(scheduler, b);
+
+      return {chain: chain, scheduler: scheduler, requested: requested};
+    },
+    'hands its requests to the remaining peer': function (topic) {
+      assert.equal(topic.requested, 3);
+      assert.deepEqual(topic.chain.added, [0, 1, 2, 3, 4, 5]);
+    },
+    'drops the peer from the stats': function (topic) {
+      var stats = topic.scheduler.getPeerStats();
+      assert.equal(stats.length, 1);
+      assert.equal(stats[0].peer, 'b');
+    }
+  }
+}).export(module);
@@ -0,0 +1,114 @@
+var vows = require('vows'),
+    assert = require('assert');
+
+var events = require('events');
+var Util = require('../lib/util');
+var Settings = require('../lib/settings').Settings;
+var Connection = require('../lib/connection').Connection;
+var Transaction = require('../lib/schema/transaction').Transaction;
+
+var MAGIC = Util.decodeHex('f9beb4d9');
+
+function buildMessage(command, payload) {
+  var header = new Buffer(24);
+  header.fill(0);
+  MAGIC.copy(header, 0);
+  header.write(command, 4, 'ascii');
+  header[16] = payload.length & 0xff;
+  header[17] = payload.length >> 8 & 0xff;
+  header[18] = payload.length >> 16 & 0xff;
+  header[19] = payload.length >> 24 & 0xff;
+  Util.twoSha256(payload).copy(header, 20, 0, 4);
+  return header.concat(payload);
+}
+
+vows.describe('Connection').addBatch({
+  'A message framer': {
+    topic: function () {
+      var payload = new Buffer(300);
+      for (var i = 0; i < payload.length; i++) payload[i] = i & 0xff;
+
+      var stream = new Buffer([1, 2, 3]).concat(
+        buildMessage('inv', payload),
+        buildMessage('verack', new Buffer(0)),
+        buildMessage('tx', payload.slice(0, 10))
+      );
+      // Corrupt the checksum of the last message
+      stream[stream.length - 10 - 4] ^= 1;
+
+      // Feed the data in awkwardly sized chunks
+      var framer = new Util.MessageFramer(MAGIC);
+      var frames = [];
+      for (var pos = 0; pos < stream.length; pos += 7) {
+        framer.push(stream.slice(pos, Math.min(pos + 7, stream.length)));
+        var frame;
+        while ((frame = framer.next(true))) {
+          frames.push(frame);
+        }
+      }
+      return {frames: frames, payload: payload, framer: framer};
+    },
+
+    'returns every message': function (topic) {
+      assert.equal(topic.frames.length, 3);
+      assert.equal(topic.frames[0].command, 'inv');
+      assert.equal(topic.frames[1].command, 'verack');
+      assert.equal(topic.frames[2].command, 'tx');
+    },
+
+    'skips garbage in front of a message': function (topic) {
+      assert.equal(topic.frames[0].skipped, 3);
+    },
+
+    'reassembles payloads across chunks': function (topic) {
+      var frame = topic.frames[0];
+      assert.equal(frame.buffer.slice(frame.start, frame.end).toHex(),
+                   topic.payload.toHex());
+    },
+
+    'verifies checksums': function (topic) {
+      assert.isTrue(topic.frames[0].checksumOk);
+      assert.isTrue(topic.frames[1].checksumOk);
+      assert.isFalse(topic.frames[2].checksumOk);
+    },
+
+    'consumes all data': function (topic) {
+      assert.equal(topic.framer.length, 0);
+    }
+  },
+
+  'A transaction changed after hashing': {
+    topic: function () {
+      var socket = new events.EventEmitter();
+      var sent = [];
+      socket.write = function (data) {
+        sent.push(data);
+      };
+      var conn = new Connection({cfg: new Settings()}, socket, 'test');
+
+      var outpoint = new Buffer(36);
+      outpoint.fill(0);
+      var value = new Buffer(8);
+      value.fill(0);
+
+      var tx = new Transaction({
+        version: 1,
+        lock_time: 0,
+        ins: [{o: outpoint, s: Util.decodeHex('51'), q: 0xffffffff}],
+        outs: [{v: value, s: Util.decodeHex('51')}]
+      });
+      tx.getHash();
+      tx.lock_time = 5;
+
+      conn.sendTx(tx);
+      return {tx: tx, sent: sent};
+    },
+
+    'is sent as it is now': function (topic) {
+      assert.equal(topic.sent.length, 1);
+      assert.equal(topic.sent[0].slice(24).toHex(),
+                   topic.tx.serialize().toHex());
+      assert.equal(topic.sent[0][topic.sent[0].length - 4], 5);
+    }
+  }
+}).export(module);
@@ -0,0 +1,143 @@
+var vows = require('vows'),
+    assert = require('assert');
+
+var NativeMiner = require('../lib/miner/native').NativeMiner;
+var Util = require('../lib/util');
+var Block = require('../lib/schema/block').Block;
+var Transaction = require('../lib/schema/transaction').Transaction;
+var WorkTemplate = require('../lib/worktemplate').WorkTemplate;
+var WorkSource = require('../lib/worktemplate').WorkSource;
+
+vows.describe('Miner').addBatch({
+  'The native miner': {
+    topic: function () {
+      var header = new Buffer(80);
+      for (var i = 0; i < 80; i++) header[i] = i * 3 & 0xff;
+
+      // Roughly one in 4096 hashes meets this target
+      var target = new Buffer(32);
+      target.fill(0xff);
+      target[0] = 0;
+      target[1] = 0x0f;
+
+      var miner = new NativeMiner();
+      var callback = this.callback;
+      miner.solve(header, target, function (err, nonce) {
+        callback(err, {
+          header: header,
+          target: target,
+          nonce: nonce,
+          miner: miner
+        });
+      });
+    },
+
+    'finds a nonce that meets the target': function (topic) {
+      var hash = Util.twoSha256(topic.header);
+      hash.reverse();
+      assert.isTrue(hash.compare(topic.target) <= 0);
+    },
+
+    'writes the nonce into the header': function (topic) {
+      assert.equal(topic.header[76] +
+                   (topic.header[77] << 8) +
+                   (topic.header[78] << 16) +
+                   (topic.header[79] * 0x1000000), topic.nonce);
+    },
+
+    'reports a hash rate': function (topic) {
+      assert.isTrue(topic.miner.getHashRate() >= 0);
+    }
+  },
+
+  'A native miner with more threads than the eio pool': {
+    topic: function () {
+      var header = new Buffer(80);
+      header.fill(0);
+
+      // Nothing meets this target
+      var target = new Buffer(32);
+      target.fill(0);
+
+      var miner = new NativeMiner(8);
+      var callback = this.callback;
+      var result = {};
+      miner.solve(header, target, function (err) {
+        result.err = err;
+        callback(null, result);
+      });
+
+      // File I/O still gets through while it is mining
+      require('fs').stat(__filename, function (err, stats) {
+        result.stats = stats;
+        miner.cancel();
+      });
+    },
+
+    'does not hold up file I/O': function (topic) {
+      assert.isObject(topic.stats);
+    },
+
+    'can be cancelled': function (topic) {
+      assert.equal(topic.err.message, 'Mining cancelled');
+    }
+  },
+
+  'A work template': {
+    topic: function () {
+      var block = new Block({
+        version: 1,
+        prev_hash: Util.twoSha256(new Buffer('prev')),
+        bits: 0x1d00ffff,
+        height: 1000
+      });
+      var txs = [block.createCoinbaseTx(Util.decodeHex(
+        "049e2f1d8802bff257fac96004726d4f453acaa6d35af96b1c3cc4d9b99af05d" +
+        "ffa185140849ee2f2fa336007304459ac73b27fa13a422da41c08c80a6b3839cb6"
+      ))];
+      for (var i = 0; i < 6; i++) {
+        txs.push(new Transaction({hash: Util.twoSha256(new Buffer([i]))}));
+      }
+
+      var source = new WorkSource();
+      source.setTemplate(new WorkTemplate(block, txs));
+      var units = [];
+      for (var j = 0; j < 3; j++) {
+        units.push(source.getWork(1300000000));
+      }
+      return {source: source, units: units};
+    },
+
+    'hands out a different merkle root every time': function (topic) {
+      var roots = topic.units.map(function (unit) {
+        return unit.root.toString('base64');
+      });
+      assert.notEqual(roots[0], roots[1]);
+      assert.notEqual(roots[1], roots[2]);
+    },
+
+    'matches the merkle root of the rebuilt block': function (topic) {
+      topic.units.forEach(function (unit) {
+        var nb = unit.template.createBlock(unit, 0);
+        assert.equal(nb.block.calcMerkleRoot(nb.txs).toString('hex'),
+                     unit.root.toString('hex'));
+        assert.equal(nb.txs[0].getHash().toString('hex'),
+                     nb.txs[0].calcHash().toString('hex'));
+      });
+    },
+
+    'computes the midstate of the header': function (topic) {
+      topic.units.forEach(function (unit) {
+        var header = unit.template.getHeader(unit);
+        assert.equal(unit.midstate.toString('hex'),
+                     Util.sha256midstate(header).toString('hex'));
+      });
+    },
+
+    'finds units by their merkle root': function (topic) {
+      topic.units.forEach(function (unit) {
+        assert.strictEqual(topic.source.findWork(unit.root), unit);
+      });
+    }
+  }
+}).export(module);
@@ -124,6 +124,132 @@ vows.describe('BitcoinKey').addBatch({
         assert.isTrue(topic);
       }
     }
+  },
+
+  'A batch of signatures': {
+    topic: function () {
+      var pubkey = decodeHex("04a19c1f07c7a0868d86dbb37510305843cc730eb3bea8a99d92131f44950cecd923788419bfef2f635fad621d753f30d4b4b63b29da44b4f3d92db974537ad5a4");
+      var hash = decodeHex("230aba77ccde46bb17fcb0295a92c0cc42a6ea9f439aaadeb0094625f49e6ed8");
+      var sig = decodeHex("3046022100a3ee5408f0003d8ef00ff2e0537f54ba09771626ff70dca1f01296b05c510e85022100d4dc70a5bb50685b65833a97e536909a6951dd247a2fdbde6688c33ba6d6407501");
+      var badHash = decodeHex("330aba77ccde46bb17fcb0295a92c0cc42a6ea9f439aaadeb0094625f49e6ed8");
+
+      var items = [];
+      for (var i = 0; i < 40; i++) {
+        items.push({pubkey: pubkey, hash: (i % 3) ? hash : badHash, sig: sig});
+      }
+      // Malformed pubkey
+      items.push({pubkey: new Buffer([4, 1, 2]), hash: hash, sig: sig});
+
+      BitcoinKey.verifyBatch(items, this.callback);
+    },
+
+    'returns one result per item': function (topic) {
+      assert.equal(topic.length, 41);
+    },
+
+    'returns results in order': function (topic) {
+      for (var i = 0; i < 40; i++) {
+        assert.equal(topic[i], !!(i % 3));
+      }
+    },
+
+    'treats a malformed pubkey as invalid': function (topic) {
+      assert.isFalse(topic[40]);
+    }
+  },
+
+  'A signing key': {
+    topic: function () {
+      var key = new BitcoinKey();
+      key.private = decodeHex("0000000000000000000000000000000000000000000000000000000000000001");
+      key.regenerateSync();
+      return key;
+    },
+
+    'signs deterministically (RFC 6979)': function (topic) {
+      var hash = Util.sha256(new Buffer("Satoshi Nakamoto"));
+      assert.equal(encodeHex(topic.signSync(hash)),
+                   "3044" +
+                   "0220934b1ea10a4b3c1757e2b0c017d0b6143ce3c9a7e6a4a49860d7a6ab210ee3d8" +
+                   "02202442ce9d2b916064108014783e923ec36b49743e2ffa1c4496f01a512aafd9e5");
+    },
+
+    'signing asynchronously': {
+      topic: function (topic) {
+        var hash = Util.sha256(new Buffer("Satoshi Nakamoto"));
+        var callback = this.callback;
+        topic.sign(hash, function (err, sig) {
+          callback(err, {sig: sig, expected: topic.signSync(hash)});
+        });
+      },
+
+      'gives the same signature': function (topic) {
+        assert.equal(encodeHex(topic.sig), encodeHex(topic.expected));
+      }
+    },
+
+    'signing a batch': {
+      topic: function (topic) {
+        var items = [];
+        for (var i = 0; i < 70; i++) {
+          items.push({priv: topic.private, hash: Util.sha256(new Buffer("tx"+i))});
+        }
+        var callback = this.callback;
+        BitcoinKey.signBatch(items, function (err, sigs) {
+          callback(err, {key: topic, items: items, sigs: sigs});
+        });
+      },
+
+      'returns valid signatures in order': function (topic) {
+        assert.equal(topic.sigs.length, 70);
+        topic.items.forEach(function (item, i) {
+          assert.isTrue(topic.key.verifySignatureSync(item.hash, topic.sigs[i]));
+        });
+      }
+    }
+  },
+
+  'A key generated asynchronously': {
+    topic: function () {
+      BitcoinKey.generate(this.callback);
+    },
+
+    'is a BitcoinKey': function (topic) {
+      assert.instanceOf(topic, BitcoinKey);
+    },
+
+    'can sign': function (topic) {
+      var hash = Util.sha256(new Buffer("hello"));
+      assert.isTrue(topic.verifySignatureSync(hash, topic.signSync(hash)));
+    }
+  },
+
+  'The pubkey cache': {
+    topic: function () {
+      var pubkey = decodeHex("02a32efde012298e69e3601eb94fceb84c900efecdca8abc6a46f20a810acf18b7");
+      var key = new BitcoinKey();
+      var before = ccmodule.pubkey_cache_stats();
+      key.public = pubkey;
+      key.public = pubkey;
+      return {
+        before: before,
+        after: ccmodule.pubkey_cache_stats(),
+        pubkey: pubkey,
+        key: key
+      };
+    },
+
+    'counts a hit for a repeated pubkey': function (topic) {
+      assert.equal(topic.after.hits - topic.before.hits, 1);
+    },
+
+    'is bounded': function (topic) {
+      assert.isTrue(topic.after.size <= topic.after.capacity);
+    },
+
+    'preserves the compressed form': function (topic) {
+      assert.equal(encodeHex(topic.key.public), encodeHex(topic.pubkey));
+    }
   }
 }).export(module);
 
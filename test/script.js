@@ -281,6 +281,85 @@ suite.addBatch({ "Script with": {
   txTest("0100000002ab9f97d24b612e7fbf27ba5d29f0c7201ddca2db0dde304965a4c7691d77a3bb000000008c493046022100866e834a7d2609a3a22a9c5ff13e301b4ad9f7fcb65dc3e8b27d07f3fc02084b022100eec81365b922db5707058379a1038dc0c8c6d547a31b494b2f05e607a62b9505014104c56c2ccd35260cef7b79c742b0cfc076f2e709f10191b9058a9116f18801834c5b14ace9aa99bc480092da29fc3f4dd8eccae151304cadfbcf07d4047d2e32d5ffffffffbe521dc4280bff0dfee92c3606d2e1c748ec9ed8692cfc35a8f5c631a2d63cc901000000d300483045022100c044d2877e14ffd0d1a832fd65f8670937d26c15e9049d384febdfe53616a29d022073983873504caf70c9468147497dddc027cb895ab2548095069daeca5dc0c083014c87514104cbcdfa318634d9a31a0d43e0e266914cde11ae9eb15d39ebcb9d5169483826dd74a0af31b36fea6648e1d55862a7d7799f5b3f44bb4901b0ab555c648cb509044104338517576bf89b220338e01e171b366ad261bd07e9480b4e179a0c9580b91c9debecabd840141d4bb4a8da498c1a30c59fbce0a798bde6a3cda397aa93de600752aeffffffff0270d75d00000000001976a9142869126e5a899e9d5e68acab40a91f7366bbe36088ac80f0fa02000000001976a9145ce6be8588bcdd09376e20eb7c0994ac0b6b142188b000000000", [OP_DUP, OP_HASH160, "c0c8d884f47c6e206c0bea693764b5e495c65d11", OP_EQUALVERIFY, OP_NOP1], 1, [0, '3045022100c044d2877e14ffd0d1a832fd65f8670937d26c15e9049d384febdfe53616a29d022073983873504caf70c9468147497dddc027cb895ab2548095069daeca5dc0c08301', '514104cbcdfa318634d9a31a0d43e0e266914cde11ae9eb15d39ebcb9d5169483826dd74a0af31b36fea6648e1d55862a7d7799f5b3f44bb4901b0ab555c648cb509044104338517576bf89b220338e01e171b366ad261bd07e9480b4e179a0c9580b91c9debecabd840141d4bb4a8da498c1a30c59fbce0a798bde6a3cda397aa93de600752ae'])
 }});
 
+suite.addBatch({ "Standard script checked natively": {
+  'P2PKH':
+  standardTest(function () {
+    var key = BitcoinKey.generateSync();
+    var scriptPubKey = payToPubKeyHash(key);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: Script.fromChunks([signInput(scriptPubKey, key), key.public])
+    };
+  }, true, true),
+
+  'P2PKH with the wrong signature':
+  standardTest(function () {
+    var key = BitcoinKey.generateSync();
+    var otherKey = BitcoinKey.generateSync();
+    var scriptPubKey = payToPubKeyHash(key);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: Script.fromChunks([signInput(scriptPubKey, otherKey),
+                                    key.public])
+    };
+  }, true, false),
+
+  'P2PKH with the wrong pubkey':
+  standardTest(function () {
+    var key = BitcoinKey.generateSync();
+    var otherKey = BitcoinKey.generateSync();
+    var scriptPubKey = payToPubKeyHash(key);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: Script.fromChunks([signInput(scriptPubKey, otherKey),
+                                    otherKey.public])
+    };
+  }, true, false),
+
+  'multisig':
+  standardTest(function () {
+    var keys = generateKeys(3);
+    var scriptPubKey = payToMultisig(2, keys);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: signMultisig(scriptPubKey, keys.slice(0, 2), spendingTx())
+    };
+  }, true, true),
+
+  'multisig with the wrong signature':
+  standardTest(function () {
+    var keys = generateKeys(3);
+    var otherKey = BitcoinKey.generateSync();
+    var scriptPubKey = payToMultisig(2, keys);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: signMultisig(scriptPubKey, [keys[0], otherKey], spendingTx())
+    };
+  }, true, false),
+
+  'multisig with the signatures out of order':
+  standardTest(function () {
+    var keys = generateKeys(3);
+    var scriptPubKey = payToMultisig(2, keys);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: signMultisig(scriptPubKey, [keys[1], keys[0]], spendingTx())
+    };
+  }, true, false),
+
+  'multisig with too few signatures':
+  // The stack doesn't match the template, so the engine hands the input
+  // back to the interpreter
+  standardTest(function () {
+    var keys = generateKeys(3);
+    var scriptPubKey = payToMultisig(2, keys);
+    return {
+      scriptPubKey: scriptPubKey,
+      scriptSig: signMultisig(scriptPubKey, keys.slice(0, 1), spendingTx())
+    };
+  }, false, false)
+}});
+
 suite.addBatch(generateSuite('script_valid.json'));
 suite.addBatch(generateSuite('script_invalid.json', true));
 
@@ -529,3 +608,105 @@ function signMultisig(scriptPubkey, keys, tx) {
 
   return Script.fromTestData(scriptData);
 };
+
+function generateKeys(count) {
+  var keys = [];
+  for (var i = 0; i < count; i++) {
+    keys.push(BitcoinKey.generateSync());
+  }
+  return keys;
+};
+
+function payToPubKeyHash(key) {
+  return Script.fromChunks([OP_DUP, OP_HASH160,
+                            Util.sha256ripe160(key.public),
+                            OP_EQUALVERIFY, OP_CHECKSIG]);
+};
+
+function payToMultisig(sigCount, keys) {
+  return Script.fromChunks([].concat(
+    [sigCount+80],
+    keys.map(function (key) {
+      return key.public;
+    }),
+    [keys.length+80, OP_CHECKMULTISIG]
+  ));
+};
+
+// Signature with SIGHASH_ALL appended, for input 0 of spendingTx()
+function signInput(scriptPubKey, key) {
+  var hash = spendingTx().hashForSignature(scriptPubKey, 0, 1);
+  var sig = key.signSync(hash);
+  var sigData = new Buffer(sig.length+1);
+  sig.copy(sigData);
+  sigData[sigData.length-1] = 1;
+  return sigData;
+};
+
+// A complete transaction, as the SighashEngine parses the serialized form.
+// The scriptSig is blanked out for signature hashes, so the signatures made
+// against the unsigned transaction are valid for the signed one.
+function spendingTx(scriptSig) {
+  var outpoint = new Buffer(36);
+  outpoint.fill(0);
+  return new Transaction({
+    version: 1,
+    lock_time: 0,
+    ins: [{
+      o: outpoint,
+      s: scriptSig ? scriptSig.getBuffer() : new Buffer(0),
+      q: 0xffffffff
+    }],
+    outs: [{
+      v: Util.decodeHex('00e1f50500000000'),
+      s: new Buffer(0)
+    }]
+  });
+};
+
+// Verifies a spend with SighashEngine.verifyStandard() and with the
+// ScriptInterpreter, so the two can be compared
+function standardTest(setup, handled, expectedResult) {
+  return {
+    'topic': function () {
+      var cb = this.callback;
+      var scripts = setup();
+      var tx = spendingTx(scripts.scriptSig);
+      var results = {};
+
+      function done(name) {
+        return function (e, result) {
+          results[name] = !e && !!result;
+          if ("undefined" !== typeof results['native'] &&
+              "undefined" !== typeof results.interpreter) {
+            cb(null, results);
+          }
+        };
+      }
+
+      results.handled = tx.getSighashEngine().verifyStandard(
+        0, scripts.scriptPubKey.getBuffer(), done('native'));
+      if (!results.handled) {
+        // What Transaction.verifyInputStandard() falls back to
+        tx.verifyInput(0, scripts.scriptPubKey, done('native'));
+      }
+      ScriptInterpreter.verify(scripts.scriptSig, scripts.scriptPubKey,
+                               tx, 0, 0, done('interpreter'));
+
+      // Async topics must not return a value
+      return;
+    },
+
+    'is checked by the expected path': function (topic) {
+      assert.equal(topic.handled, handled);
+    },
+
+    'agrees with the interpreter': function (topic) {
+      assert.equal(topic['native'], topic.interpreter);
+    },
+
+    'has the expected result': function (topic) {
+      assert.equal(topic['native'], expectedResult);
+    }
+  };
+};
@@ -2,10 +2,12 @@ var vows = require('vows'),
     assert = require('assert');
 
 var Storage = require('../lib/storage').Storage;
-var encodeHex = require('../lib/util').encodeHex;
+var Util = require('../lib/util');
+var encodeHex = Util.encodeHex;
 
 var Block = require('../lib/schema/block').Block;
 var Transaction = require('../lib/schema/transaction').Transaction;
+var TransactionOut = require('../lib/schema/transaction').TransactionOut;
 
 var Step = require('step');
 
@@ -56,6 +58,7 @@ try {
 
 if (leveldbAvailable) {
   testEngine("LevelDB", 'leveldb:///tmp/unittest_storage');
+  testLeveldb('leveldb:///tmp/unittest_storage_leveldb');
 }
 
 var mongodbAvailable = false;
@@ -428,3 +431,569 @@ function testEngine(label, uri) {
     }
   }).export(module);
 };
+
+// Satoshi amount as an 8 byte little endian value
+function satoshis(amount) {
+  var value = new Buffer(8);
+  var high = Math.floor(amount / 4294967296);
+  Util.writeUInt32LE(value, amount - high * 4294967296, 0);
+  Util.writeUInt32LE(value, high, 4);
+  return value;
+}
+
+function payToPubKeyHash(pubKeyHash) {
+  return Util.decodeHex('76a914').concat(pubKeyHash, Util.decodeHex('88ac'));
+}
+
+function createTx(ins, outs) {
+  return new Transaction({
+    version: 1,
+    lock_time: 0,
+    ins: ins.map(function (o) {
+      return {o: o, s: Util.decodeHex('51'), q: 0xffffffff};
+    }),
+    outs: outs.map(function (out) {
+      return {v: satoshis(out[1]), s: payToPubKeyHash(out[0])};
+    })
+  });
+}
+
+function createBlock(nonce, height, prevHash, txs) {
+  var data = {
+    nonce: nonce,
+    height: height,
+    active: true,
+    txs: txs.map(function (tx) {
+      return tx.getHash();
+    })
+  };
+  if (prevHash) {
+    data.prev_hash = prevHash;
+  }
+  return new Block(data);
+}
+
+function testLeveldb(uri) {
+  var LeveldbStorage = require('../lib/db/leveldb/storage').LeveldbStorage;
+  var COINBASE_OP = require('../lib/schema/transaction').COINBASE_OP;
+
+  var keyA = Util.sha256ripe160(new Buffer('a'));
+  var keyB = Util.sha256ripe160(new Buffer('b'));
+
+  // Block 1 pays 50 BTC to A, block 2 pays 50 BTC to B and moves A's coins
+  // to B (30 BTC) and back to A (20 BTC).
+  var coinbase1 = createTx([COINBASE_OP], [[keyA, 50e8]]);
+  var coinbase2 = createTx([COINBASE_OP], [[keyB, 50e8]]);
+  var payment = createTx(
+    [coinbase1.getHash().concat(Util.decodeHex('00000000'))],
+    [[keyB, 30e8], [keyA, 20e8]]
+  );
+  coinbase1.addressDeltas = coinbase1.getAddressDeltas([null]);
+  coinbase2.addressDeltas = coinbase2.getAddressDeltas([null]);
+  payment.addressDeltas = payment.getAddressDeltas([coinbase1.outs[0]]);
+
+  var block1 = new Block({nonce: 101, height: 1, active: true});
+  var block2 = new Block({nonce: 102, height: 2, active: true});
+
+  var getIndexes = function (storage, callback) {
+    Step(
+      function () {
+        storage.getAddressIndex(keyA, this.parallel());
+        storage.getAddressIndex(keyB, this.parallel());
+      },
+      function (err, a, b) {
+        callback(err, {a: a, b: b});
+      }
+    );
+  };
+
+  vows.describe('LevelDB Storage internals').addBatch({
+    'An address index row': {
+      topic: function () {
+        var entries = [
+          {value: -123456789012, unspent: -3, positions: [0, 5, 300, 70000]},
+          {value: Math.pow(2, 40) + 7, unspent: 2, positions: [1]},
+          {value: 0, unspent: 0, positions: []}
+        ];
+        return {
+          entries: entries,
+          decoded: entries.map(function (entry) {
+            return LeveldbStorage.decodeAddressRow(
+              LeveldbStorage.encodeAddressRow(entry));
+          })
+        };
+      },
+      'keeps negative values': function (topic) {
+        assert.deepEqual(topic.decoded[0], topic.entries[0]);
+      },
+      'keeps values above 2^32': function (topic) {
+        assert.deepEqual(topic.decoded[1], topic.entries[1]);
+      },
+      'can be empty': function (topic) {
+        assert.deepEqual(topic.decoded[2], topic.entries[2]);
+      }
+    },
+    'An address index': {
+      topic: function () {
+        var callback = this.callback;
+        var storage = Storage.get(uri);
+        var result = {};
+
+        Step(
+          function connectStep() {
+            storage.connect(this);
+          },
+          function emptyStep(err) {
+            if (err) throw err;
+            storage.emptyDatabase(this);
+          },
+          function connectBlock1(err) {
+            if (err) throw err;
+            storage.connectBlock(block1, [coinbase1], this);
+          },
+          function connectBlock2(err) {
+            if (err) throw err;
+            storage.connectBlock(block2, [coinbase2, payment], this);
+          },
+          function getConnected(err) {
+            if (err) throw err;
+            getIndexes(storage, this);
+          },
+          function disconnectBlock2(err, indexes) {
+            if (err) throw err;
+            result.connected = indexes;
+            storage.disconnectBlock(block2, [coinbase2, payment], this);
+          },
+          function getDisconnected(err) {
+            if (err) throw err;
+            getIndexes(storage, this);
+          },
+          function (err, indexes) {
+            result.disconnected = indexes;
+            callback(err, result);
+          }
+        );
+      },
+      'lists the transactions of an address in chain order': function (topic) {
+        assert.deepEqual(topic.connected.a.history,
+                         [{height: 1, index: 0}, {height: 2, index: 1}]);
+        assert.deepEqual(topic.connected.b.history,
+                         [{height: 2, index: 0}, {height: 2, index: 1}]);
+      },
+      'sums up balances and unspent outputs': function (topic) {
+        assert.equal(topic.connected.a.balance, 20e8);
+        assert.equal(topic.connected.a.unspent, 1);
+        assert.equal(topic.connected.b.balance, 80e8);
+        assert.equal(topic.connected.b.unspent, 2);
+      },
+      'forgets disconnected blocks': function (topic) {
+        assert.deepEqual(topic.disconnected.a,
+                         {history: [{height: 1, index: 0}],
+                          balance: 50e8, unspent: 1});
+        assert.deepEqual(topic.disconnected.b,
+                         {history: [], balance: 0, unspent: 0});
+      }
+    }
+  }).addBatch({
+    'A stored block': {
+      topic: function () {
+        var callback = this.callback;
+        var storage = Storage.get(uri + '_blocks');
+        var txs = [coinbase1, payment];
+        var block = createBlock(103, 1, null, txs);
+        var result = {block: block, txs: txs};
+
+        Step(
+          function connectStep() {
+            storage.connect(this);
+          },
+          function emptyStep(err) {
+            if (err) throw err;
+            storage.emptyDatabase(this);
+          },
+          function storeStep(err) {
+            if (err) throw err;
+            storage.storeBlock(block, txs, false, this);
+          },
+          function getStep(err) {
+            if (err) throw err;
+            storage.getRawBlockByHash(block.getHash(), this.parallel());
+            storage.getTransactionByHash(payment.getHash(), this.parallel());
+            storage.getContainingBlock(payment.getHash(), this.parallel());
+          },
+          function (err, raw, tx, blockHash) {
+            result.raw = raw;
+            result.tx = tx;
+            result.blockHash = blockHash;
+            callback(err, result);
+          }
+        );
+      },
+      'can be read back whole': function (topic) {
+        var expected = topic.block.getHeader().concat(
+          new Buffer([topic.txs.length]),
+          topic.txs[0].serialize(),
+          topic.txs[1].serialize()
+        );
+        assert.equal(encodeHex(topic.raw), encodeHex(expected));
+      },
+      'has its transactions found by position': function (topic) {
+        assert.equal(encodeHex(topic.tx.getHash()),
+                     encodeHex(payment.getHash()));
+        assert.equal(encodeHex(topic.blockHash),
+                     encodeHex(topic.block.getHash()));
+      }
+    }
+  }).addBatch({
+    'A batch of stored blocks': {
+      topic: function () {
+        var callback = this.callback;
+        var storage = Storage.get(uri + '_batch');
+        var blockA = createBlock(201, 1, null, [coinbase1]);
+        var blockB = createBlock(202, 2, blockA.getHash(), [coinbase2]);
+        var keyA = new Buffer('b').concat(blockA.getHash());
+        var result = {blockA: blockA, blockB: blockB};
+
+        Step(
+          function connectStep() {
+            storage.connect(this);
+          },
+          function emptyStep(err) {
+            if (err) throw err;
+            storage.emptyDatabase(this);
+          },
+          function batchStep(err) {
+            if (err) throw err;
+            storage.setBlockBatchSize(3, this);
+          },
+          function storeStep(err) {
+            if (err) throw err;
+            storage.storeBlock(blockA, [coinbase1], false, this.parallel());
+            storage.storeBlock(blockB, [coinbase2], false, this.parallel());
+          },
+          function getPendingStep(err) {
+            if (err) throw err;
+            storage.hMain.get(keyA, {as_buffer: true}, this.parallel());
+            storage.getBlockByHeight(2, this.parallel());
+          },
+          function commitStep(err, onDisk, block) {
+            if (err) throw err;
+            result.pendingOnDisk = onDisk;
+            result.pendingBlock = block;
+            storage.setBlockBatchSize(1, this);
+          },
+          function getWrittenStep(err) {
+            if (err) throw err;
+            storage.hMain.get(keyA, {as_buffer: true}, this);
+          },
+          function iterateStep(err, onDisk) {
+            if (err) throw err;
+            result.writtenOnDisk = onDisk;
+            storage.hMain.iterator({}, this);
+          },
+          function firstStep(err, iterator) {
+            if (err) throw err;
+            result.iterator = iterator;
+            iterator.first(this);
+          },
+          function (err) {
+            if (!err) {
+              var iterator = result.iterator;
+              var key;
+              result.keys = [];
+              while ((key = iterator.key())) {
+                result.keys.push(key);
+                iterator.next();
+              }
+            }
+            callback(err, result);
+          }
+        );
+      },
+      'are served from memory until the batch is full': function (topic) {
+        assert.isTrue(!topic.pendingOnDisk);
+        assert.equal(encodeHex(topic.pendingBlock.getHash()),
+                     encodeHex(topic.blockB.getHash()));
+      },
+      'are written when the batch size drops': function (topic) {
+        assert.isTrue(!!topic.writtenOnDisk);
+      },
+      'use prefixed keys': function (topic) {
+        var prefixes = {};
+        topic.keys.forEach(function (key) {
+          assert.include('btsupxafomhkz', String.fromCharCode(key[0]));
+          prefixes[String.fromCharCode(key[0])] = true;
+        });
+        assert.deepEqual(Object.keys(prefixes).sort(),
+                         ['b', 'f', 'm', 'o', 'p', 'z']);
+      },
+      'keep the height index last': function (topic) {
+        var last = topic.keys[topic.keys.length - 1];
+        assert.equal(encodeHex(last), '7a00000002');
+      }
+    }
+  }).addBatch({
+    'Unspent output changes': {
+      topic: function () {
+        var callback = this.callback;
+        var storage = Storage.get(uri + '_utxo');
+        var blockA = createBlock(401, 1, null, [coinbase1]);
+        var blockB = createBlock(402, 2, blockA.getHash(), [coinbase2]);
+        var outA = coinbase1.getHash().concat(Util.decodeHex('00000000'));
+        var outB = coinbase2.getHash().concat(Util.decodeHex('00000000'));
+        var value = satoshis(50e8).concat(Util.decodeHex('51'));
+        var keyA = new Buffer('u').concat(outA);
+        var keyB = new Buffer('u').concat(outB);
+        var result = {};
+
+        // Changes as the chain's UtxoSet would report them for each block
+        var changes = [];
+        storage.setUnspentOutputSource(function () {
+          return changes.splice(0);
+        });
+
+        Step(
+          function connectStep() {
+            storage.connect(this);
+          },
+          function emptyStep(err) {
+            if (err) throw err;
+            storage.emptyDatabase(this);
+          },
+          function batchStep(err) {
+            if (err) throw err;
+            storage.setBlockBatchSize(2, this);
+          },
+          function storeAStep(err) {
+            if (err) throw err;
+            changes.push({key: outA, value: value});
+            storage.storeBlock(blockA, [coinbase1], true, this);
+          },
+          function getPendingStep(err) {
+            if (err) throw err;
+            storage.hMain.get(keyA, {as_buffer: true}, this);
+          },
+          function storeBStep(err, onDisk) {
+            if (err) throw err;
+            result.pending = onDisk;
+            changes.push({key: outB, value: value});
+            storage.storeBlock(blockB, [coinbase2], true, this);
+          },
+          function getWrittenStep(err) {
+            if (err) throw err;
+            storage.hMain.get(keyA, {as_buffer: true}, this.parallel());
+            storage.hMain.get(keyB, {as_buffer: true}, this.parallel());
+          },
+          function closeStep(err, a, b) {
+            if (err) throw err;
+            result.written = [a, b];
+            changes.push({key: outA, value: null});
+            storage.disconnect(this);
+          },
+          function reconnectStep(err) {
+            if (err) throw err;
+            storage.connect(this);
+          },
+          function getClosedStep(err) {
+            if (err) throw err;
+            storage.getUnspentOutputs([outA, outB], this);
+          },
+          function (err, outs) {
+            result.closed = outs;
+            storage.setUnspentOutputSource(null);
+            callback(err, result);
+          }
+        );
+      },
+      'wait for the batch of their block': function (topic) {
+        assert.isTrue(!topic.pending);
+      },
+      'are written with it': function (topic) {
+        assert.isTrue(!!topic.written[0]);
+        assert.isTrue(!!topic.written[1]);
+      },
+      'are written when the storage closes': function (topic) {
+        assert.isTrue(!topic.closed[0]);
+        assert.isTrue(!!topic.closed[1]);
+      }
+    }
+  }).addBatch({
+    'A connected spend': {
+      topic: function () {
+        var callback = this.callback;
+        var storage = Storage.get(uri + '_spent');
+
+        // Spends coinbase1's output like the payment in block 2 does
+        var conflict = createTx(
+          [coinbase1.getHash().concat(Util.decodeHex('00000000'))],
+          [[keyA, 50e8]]
+        );
+
+        // Let the scripts pass, so only the spent output can fail it
+        var txCache = {txIndex: {}};
+        txCache.txIndex[coinbase1.getHash().toString('base64')] = [
+          new TransactionOut({v: satoshis(50e8), s: Util.decodeHex('51')})
+        ];
+
+        var result = {};
+
+        Step(
+          function connectStep() {
+            storage.connect(this);
+          },
+          function emptyStep(err) {
+            if (err) throw err;
+            storage.emptyDatabase(this);
+          },
+          function connectBlock1(err) {
+            if (err) throw err;
+            storage.connectBlock(block1, [coinbase1], this);
+          },
+          function connectBlock2(err) {
+            if (err) throw err;
+            storage.connectBlock(block2, [coinbase2, payment], this);
+          },
+          function countStep(err) {
+            if (err) throw err;
+            storage.countConflictingTransactions(
+              [conflict.ins[0].o, coinbase2.getHash().concat(
+                Util.decodeHex('00000000'))],
+              this
+            );
+          },
+          function verifyStep(err, count) {
+            if (err) throw err;
+            result.count = count;
+            var next = this;
+            conflict.verify(txCache, storage, function (err) {
+              next(null, err);
+            });
+          },
+          function (err, verifyErr) {
+            result.verifyErr = verifyErr;
+            callback(err, result);
+          }
+        );
+      },
+      'counts the spent output': function (topic) {
+        assert.equal(topic.count, 1);
+      },
+      'rejects a conflicting transaction': function (topic) {
+        assert.instanceOf(topic.verifyErr, Error);
+        assert.include(topic.verifyErr.message,
+                       Util.formatHashAlt(payment.getHash()));
+      }
+    }
+  }).addBatch({
+    'A rev. 1.1 database': {
+      topic: function () {
+        var callback = this.callback;
+        var leveldb = require('leveldb');
+        var fs = require('fs');
+        var prefix = '/tmp/unittest_storage_rev1_';
+        var block = createBlock(301, 1, null, [coinbase1, payment]);
+        var outpoint = payment.ins[0].o;
+        var result = {block: block};
+
+        // Write the records the way rev. 1.1 did: unprefixed keys in
+        // main.db and one database per index
+        var writeDb = function (name, records, callback) {
+          leveldb.DB.destroyDB(prefix + name, {});
+          leveldb.open(prefix + name, {create_if_missing: true},
+                       function (err, db) {
+            if (err) {
+              callback(err);
+              return;
+            }
+            var wb = db.batch();
+            records.forEach(function (record) {
+              wb.put(record[0], record[1]);
+            });
+            db.write(wb, function (err) {
+              if (err) {
+                callback(err);
+                return;
+              }
+              db.close(callback);
+            });
+          });
+        };
+        var storage;
+
+        Step(
+          function writeMainStep() {
+            fs.writeFileSync(prefix + 'meta.json', JSON.stringify({
+              majorVersion: 1,
+              minorVersion: 1
+            }));
+            writeDb('main.db', [
+              [block.getHash(), Util.encodeBlockRecord(block)],
+              [coinbase1.getHash(), coinbase1.serialize()],
+              [payment.getHash(), payment.serialize()],
+              [outpoint, payment.getHash()]
+            ], this.parallel());
+            writeDb('blockheight.db', [
+              [new Buffer([0, 0, 0, 1]), block.getHash()]
+            ], this.parallel());
+            writeDb('blockprev.db', [
+              [block.prev_hash, block.getHash()]
+            ], this.parallel());
+            writeDb('blocktx.db', [
+              [coinbase1.getHash(), block.getHash()],
+              [payment.getHash(), block.getHash()]
+            ], this.parallel());
+            writeDb('affects.db', [], this.parallel());
+          },
+          function connectStep(err) {
+            if (err) throw err;
+            storage = Storage.get('leveldb://' + prefix);
+            storage.connect(this);
+          },
+          function getStep(err) {
+            if (err) throw err;
+            storage.getBlockByHeight(1, this.parallel());
+            storage.getBlockByPrev(block.prev_hash, this.parallel());
+            storage.getTransactionByHash(payment.getHash(), this.parallel());
+            storage.getContainingBlock(coinbase1.getHash(), this.parallel());
+            storage.getConflictingTransactions([outpoint], this.parallel());
+          },
+          function (err, byHeight, byPrev, tx, blockHash, conflicts) {
+            if (!err) {
+              result.byHeight = byHeight;
+              result.byPrev = byPrev;
+              result.tx = tx;
+              result.blockHash = blockHash;
+              result.conflicts = conflicts;
+              result.metadata =
+                JSON.parse(fs.readFileSync(prefix + 'meta.json', 'utf8'));
+              result.legacy = require('path')
+                .existsSync(prefix + 'blockheight.db');
+            }
+            callback(err, result);
+          }
+        );
+      },
+      'is upgraded to rev. 2.0': function (topic) {
+        assert.equal(topic.metadata.majorVersion, 2);
+        assert.equal(topic.metadata.minorVersion, 0);
+        assert.isFalse(topic.legacy);
+      },
+      'keeps its blocks': function (topic) {
+        var hash = encodeHex(topic.block.getHash());
+        assert.equal(encodeHex(topic.byHeight.getHash()), hash);
+        assert.equal(encodeHex(topic.byPrev.getHash()), hash);
+      },
+      'keeps its transactions': function (topic) {
+        assert.equal(encodeHex(topic.tx.getHash()),
+                     encodeHex(payment.getHash()));
+        assert.equal(encodeHex(topic.blockHash),
+                     encodeHex(topic.block.getHash()));
+      },
+      'keeps its spent outputs': function (topic) {
+        assert.equal(topic.conflicts.length, 1);
+        assert.equal(encodeHex(topic.conflicts[0].getHash()),
+                     encodeHex(payment.getHash()));
+      }
+    }
+  }).export(module);
+};
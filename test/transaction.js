@@ -23,6 +23,27 @@ vows.describe('Transaction').addBatch({
       assert.instanceOf(topic, Transaction);
     },
 
+    'has the parsed hash': function (topic) {
+      assert.equal(encodeHex(topic.getHash()), encodeHex(topic.calcHash()));
+    },
+
+    'decodes inputs and outputs from the parsed table': function (topic) {
+      assert.equal(topic.ins.length, 1);
+      assert.equal(topic.outs.length, 2);
+      assert.equal(encodeHex(topic.ins[0].getOutpointHash()),
+                   "c997a5e56e104102fa209c6a852dd90660a20b2d9c352423edce25857fcd3704");
+      assert.equal(topic.ins[0].getOutpointIndex(), 0);
+      assert.equal(topic.ins[0].q, 0xffffffff);
+      assert.equal(topic.ins[0].s.length, 72);
+      assert.equal(encodeHex(topic.outs[0].v), "00ca9a3b00000000");
+      assert.equal(topic.outs[1].s.length, 67);
+    },
+
+    'serializes back to the original data': function (topic) {
+      var raw = encodeHex(topic.getBuffer());
+      assert.equal(encodeHex(new Transaction(topic).serialize()), raw);
+    },
+
     'hashes for signature correctly': function (topic) {
       var scriptData = decodeHex("410411db93e1dcdb8a016b49840f8c53bc1eb68a382e97b1482ecad7b148a6909a5cb2e0eaddfb84ccf9744464f82e160bfa9b8b64f9d4c03f999b8643f656b412a3ac");
       var script = new Script(scriptData);
@@ -30,7 +51,97 @@ vows.describe('Transaction').addBatch({
       assert.equal(
         encodeHex(hash),
         "7a05c6145f10101e9d6325494245adf1297d80f8f38d4d576d57cdba220bcb19");
+    },
+
+    'reuses its sighash engine': function (topic) {
+      assert.strictEqual(topic.getSighashEngine(), topic.getSighashEngine());
+    },
+
+    'verified natively against its standard scriptPubKey': {
+      topic: function (tx) {
+        var scriptData = decodeHex("410411db93e1dcdb8a016b49840f8c53bc1eb68a382e97b1482ecad7b148a6909a5cb2e0eaddfb84ccf9744464f82e160bfa9b8b64f9d4c03f999b8643f656b412a3ac");
+        var handled = tx.getSighashEngine().verifyStandard(0, scriptData, this.callback);
+        if (!handled) {
+          this.callback(new Error("Standard script not recognized"));
+        }
+      },
+
+      'is valid': function (result) {
+        assert.isTrue(result);
+      }
+    },
+
+    'verified natively against the wrong pubkey': {
+      topic: function (tx) {
+        var scriptData = decodeHex("2102a32efde012298e69e3601eb94fceb84c900efecdca8abc6a46f20a810acf18b7ac");
+        tx.getSighashEngine().verifyStandard(0, scriptData, this.callback);
+      },
+
+      'is invalid': function (result) {
+        assert.isFalse(result);
+      }
+    },
+
+    'leaves nonstandard scripts to the interpreter': function (topic) {
+      var called = false;
+      var handled = topic.getSighashEngine().verifyStandard(0, decodeHex("51"), function () {
+        called = true;
+      });
+      assert.isFalse(handled);
+      assert.isFalse(called);
+    },
+
+    'hashes for signature consistently with a reused engine': function (topic) {
+      var scriptData = decodeHex("410411db93e1dcdb8a016b49840f8c53bc1eb68a382e97b1482ecad7b148a6909a5cb2e0eaddfb84ccf9744464f82e160bfa9b8b64f9d4c03f999b8643f656b412a3ac");
+      var first = topic.hashForSignature(new Script(scriptData), 0, 1);
+      var second = topic.hashForSignature(new Script(scriptData), 0, 1);
+      assert.equal(encodeHex(first), encodeHex(second));
+    }
+  },
+  'A transaction with three inputs and two outputs': {
+    topic: function () {
+      // Inputs with different sequence numbers and scripts, so blanking them
+      // out shows in the hash. The expected hashes come from a straight port
+      // of the reference client's SignatureHash().
+      var txData = decodeHex("0100000003cbf23a4798bf04e2f3c8fbda3f8fbc6bea48f3480e98a0146119322811f6479b010000000151ffffffff9c21b02981cdc19c0dacf77de6e6d6c8d6f6b3d9356f59139ade76a6f6a101ce00000000025152feffffff8c9b1501cdccb05a89cb68873daf34ac22cc247813f5b1aaa433b77a5d2e6d510700000000050000000200f2052a010000001976a914111111111111111111111111111111111111111188ac3930000000000000016ad5010000");
+      return new Transaction(Connection.parseTx(txData));
+    },
+
+    'hashes for SIGHASH_ALL': function (topic) {
+      assert.equal(hashForSignature(topic, 0, 0x01),
+        "6e39ead48f0d1d2f08b177dd289c216d64e8a8715b90ed56a03be508bd622fe8");
+    },
+
+    'hashes for SIGHASH_NONE': function (topic) {
+      assert.equal(hashForSignature(topic, 1, 0x02),
+        "2efe551d38a7dc127476efc6af12514331b981cf37214763d8c6b937d9c0d371");
+    },
+
+    'hashes for SIGHASH_SINGLE': function (topic) {
+      assert.equal(hashForSignature(topic, 1, 0x03),
+        "e81ed17a4f1595e169b58fcfc658e85744971eb44c99b09c1e2eed08fb05b4c7");
+    },
+
+    'hashes SIGHASH_SINGLE without a matching output as one': function (topic) {
+      assert.equal(hashForSignature(topic, 2, 0x03),
+        "0100000000000000000000000000000000000000000000000000000000000000");
+    },
+
+    'hashes for SIGHASH_ANYONECANPAY': function (topic) {
+      assert.equal(hashForSignature(topic, 1, 0x81),
+        "6ee59881bc8b43b179bba61c65f1e97bc1e1259e062bcdb7b8d13e42ea871362");
+      assert.equal(hashForSignature(topic, 2, 0x82),
+        "5411cdd202f8e822ae5f48ca9371f4f486b5dc359c9b37d936629d8432d84740");
+      assert.equal(hashForSignature(topic, 0, 0x83),
+        "13a682feca6f92d7f3b4d19e17101128d3536a8c922ed1a45b016dc71c58eb15");
     }
   }
 }).export(module);
 
+// Signature hash for an input, signed against a pay-to-pubkey-hash script
+function hashForSignature(tx, inIndex, hashType) {
+  var script = new Script(decodeHex(
+    "76a914222222222222222222222222222222222222222288ac"));
+  return encodeHex(tx.hashForSignature(script, inIndex, hashType));
+}
+
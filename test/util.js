@@ -2,9 +2,11 @@ var vows = require('vows'),
     assert = require('assert');
 
 var Binary = require('binary');
+var crypto = require('crypto');
 var bignum = require('bignum');
 
 var Util = require('../lib/util');
+var Block = require('../lib/schema/block').Block;
 var logger = require('../lib/logger');
 
 logger.disable();
@@ -21,6 +23,51 @@ vows.describe('Bitcoin Utils').addBatch({
     'is re-encoded correctly': function (topic) {
       var addrHash = Util.addressToPubKeyHash(topic);
       assert.equal(Util.pubKeyHashToAddress(addrHash), topic);
+    },
+    'is rejected with a bad checksum': function (topic) {
+      assert.isNull(Util.addressToPubKeyHash(topic.slice(0, -1) + 'Y'));
+    },
+    'is encoded with a different version byte': function (topic) {
+      var addrHash = Util.addressToPubKeyHash(topic);
+      var testnet = Util.pubKeyHashToAddress(addrHash, 111);
+      assert.equal(Util.decodeBase58Check(testnet)[0], 111);
+    }
+  },
+
+  'A public key': {
+    // The genesis block's coinbase key
+    topic: Util.decodeHex('04678afdb0fe5548271967f1a67130b7105cd6a828e039' +
+                          '09a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51e' +
+                          'c112de5c384df7ba0b8d578a4c702b6bf11d5f'),
+    'gives its address with a double SHA-256 checksum': function (topic) {
+      var address256 = Util.ccmodule.pubkey_to_address256(topic);
+      assert.equal(address256.toHex(), '0062e907b15cbf27d5425399ebf6f0fb50' +
+                   'ebb88f18c29b7d93');
+      assert.equal(Util.encodeBase58(address256),
+                   '1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa');
+    },
+    'gives its address for another version byte': function (topic) {
+      var address256 = Util.ccmodule.pubkey_to_address256(topic, 111);
+      assert.equal(address256.toHex(), '6f62e907b15cbf27d5425399ebf6f0fb50' +
+                   'ebb88f18dc7031b3');
+    }
+  },
+
+  'Base58': {
+    topic: Util.decodeHex('00000102030405fffefd'),
+    'keeps leading zeros': function (topic) {
+      assert.equal(Util.encodeBase58(topic).substr(0, 2), '11');
+    },
+    'round trips': function (topic) {
+      var str = Util.encodeBase58(topic);
+      assert.equal(Util.decodeBase58(str).toHex(), topic.toHex());
+    },
+    'round trips in batches': function (topic) {
+      var strs = Util.encodeBase58Many([topic, topic.slice(2)]);
+      var bufs = Util.decodeBase58Many(strs.concat(['0OIl']));
+      assert.equal(bufs[0].toHex(), topic.toHex());
+      assert.equal(bufs[1].toHex(), topic.slice(2).toHex());
+      assert.isNull(bufs[2]);
     }
   },
 
@@ -43,6 +90,39 @@ vows.describe('Bitcoin Utils').addBatch({
       var reencoded = Util.encodeDiffBits(decoded);
       assert.equal(reencoded,
                    topic);
+    },
+    'give the work of a block': function (topic) {
+      assert.equal(Util.blockWork(0x1d00ffff).toHex(),
+                   "00000000000000000000000000000000" +
+                   "00000000000000000000000100010001");
+      assert.equal(bignum.fromBuffer(Util.blockWork(topic)).toString(16),
+                   bignum(2).pow(256).div(
+                     Util.decodeDiffBits(topic, true).add(1)).toString(16));
+    },
+    'add up to chain work': function (topic) {
+      var parent = Util.blockWork(0x1d00ffff);
+      var work = Util.chainWork(parent, topic);
+      assert.equal(work.length, 32);
+      assert.equal(work.toHex(),
+                   Util.addWork(parent, Util.blockWork(topic)).toHex());
+      assert.equal(Util.compareWork(work, parent), 1);
+      assert.equal(Util.compareWork(parent, work), -1);
+      assert.equal(Util.compareWork(work, work), 0);
+    },
+    'are checked against block hashes': function (topic) {
+      var hash = Util.decodeDiffBits(topic).reverse();
+      assert.isTrue(Util.checkProofOfWork(hash, topic));
+      hash[0]++;
+      assert.isFalse(Util.checkProofOfWork(hash, topic));
+    },
+    'are retargeted within the limit': function (topic) {
+      var timespan = 14 * 24 * 60 * 60;
+      assert.equal(Util.retargetBits(topic, timespan, timespan, 0x1d00ffff),
+                   topic);
+      assert.equal(Util.retargetBits(topic, timespan * 4, timespan,
+                                     0x1d00ffff), 0x1b10132c);
+      assert.equal(Util.retargetBits(0x1d00ffff, timespan * 4, timespan,
+                                     0x1d00ffff), 0x1d00ffff);
     }
   },
 
@@ -58,5 +138,483 @@ vows.describe('Bitcoin Utils').addBatch({
                    "2a7ce7ed41c789515649417421a5f260" +
                    "576461a477d440cda7355ddbab651f8c");
     }
+  },
+
+  'Native hashing': {
+    topic: function () {
+      var data = [];
+      for (var i = 0; i < 150; i++) {
+        var buf = new Buffer(i * 7 % 200);
+        for (var j = 0; j < buf.length; j++) buf[j] = (i + j * 31) & 0xff;
+        data.push(buf);
+      }
+      return data;
+    },
+    'matches crypto for double SHA-256': function (topic) {
+      topic.forEach(function (buf) {
+        var first = crypto.createHash('sha256').update(buf.toString('binary')).digest('binary');
+        var expected = crypto.createHash('sha256').update(first).digest('hex');
+        assert.equal(Util.twoSha256(buf).toHex(), expected);
+      });
+    },
+    'matches crypto for hash160': function (topic) {
+      topic.forEach(function (buf) {
+        var first = crypto.createHash('sha256').update(buf.toString('binary')).digest('binary');
+        var expected = crypto.createHash('rmd160').update(first).digest('hex');
+        assert.equal(Util.sha256ripe160(buf).toHex(), expected);
+      });
+    },
+    'gives the same batch results with every kernel': function (topic) {
+      var expected = topic.map(function (buf) {
+        return Util.twoSha256(buf).toHex();
+      }).join('');
+      Util.ccmodule.sha256_kernels().forEach(function (kernel) {
+        assert.ok(Util.ccmodule.sha256_set_kernel(kernel));
+        assert.equal(Util.twoSha256Many(topic).toHex(), expected);
+      });
+      Util.ccmodule.sha256_set_kernel('auto');
+      assert.equal(Util.twoSha256Many(topic).toHex(), expected);
+    },
+    'gives the known digests with every kernel': function (topic) {
+      // FIPS 180-2 test vectors: one block, two blocks and a million bytes.
+      // Eight copies go through twoSha256Many() so the AVX2 kernel hashes
+      // them in its eight-way lanes.
+      var million = new Buffer(1000000);
+      million.fill(0x61);
+      var vectors = [
+        [new Buffer('abc', 'binary'),
+         'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad',
+         '4f8b42c22dd3729b519ba6f68d2da7cc5b2d606d05daed5ad5128cc03e6c6358'],
+        [new Buffer('abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq',
+                    'binary'),
+         '248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1',
+         '0cffe17f68954dac3a84fb1458bd5ec99209449749b2b308b7cb55812f9563af'],
+        [million,
+         'cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0',
+         '80d1189477563e1b5206b2749f1afe4807e5705e8bd77887a60187a712156688']
+      ];
+      Util.ccmodule.sha256_kernels().forEach(function (kernel) {
+        assert.ok(Util.ccmodule.sha256_set_kernel(kernel));
+        vectors.forEach(function (vector) {
+          assert.equal(Util.sha256(vector[0]).toHex(), vector[1], kernel);
+          assert.equal(Util.twoSha256(vector[0]).toHex(), vector[2], kernel);
+
+          var copies = [], expected = '';
+          for (var i = 0; i < 8; i++) {
+            copies.push(vector[0]);
+            expected += vector[2];
+          }
+          assert.equal(Util.twoSha256Many(copies).toHex(), expected, kernel);
+        });
+      });
+      Util.ccmodule.sha256_set_kernel('auto');
+    },
+    'only accepts supported kernels': function (topic) {
+      var supported = Util.ccmodule.sha256_kernels();
+      assert.include(supported, 'openssl');
+      ['openssl', 'avx2', 'shani'].forEach(function (kernel) {
+        assert.equal(Util.ccmodule.sha256_set_kernel(kernel),
+                     supported.indexOf(kernel) != -1);
+      });
+      assert.isFalse(Util.ccmodule.sha256_set_kernel('sse2'));
+      Util.ccmodule.sha256_set_kernel('auto');
+    }
+  },
+
+  'A merkle tree with three leaves': {
+    topic: function () {
+      var leaves = [];
+      for (var i = 0; i < 3; i++) {
+        leaves.push(Util.sha256(new Buffer([i])));
+      }
+      return leaves;
+    },
+    'has the same layout as BuildMerkleTree': function (topic) {
+      var a = Util.twoSha256(topic[0].concat(topic[1]));
+      var b = Util.twoSha256(topic[2].concat(topic[2]));
+      var root = Util.twoSha256(a.concat(b));
+      var expected = topic[0].concat(topic[1], topic[2], a, b, root);
+
+      var leaves = topic[0].concat(topic[1], topic[2]);
+      assert.equal(Util.merkleTree(leaves).toHex(), expected.toHex());
+    },
+    'has a root matching the last node of the tree': function (topic) {
+      var leaves = topic[0].concat(topic[1], topic[2]);
+      var tree = Util.merkleTree(leaves);
+      assert.equal(Util.merkleRoot(leaves).toHex(),
+                   tree.slice(tree.length - 32).toHex());
+    }
+  },
+
+  'A UTXO set': {
+    topic: function () {
+      // Tx f4184fc596403b9d638783cf57adfe4c75c605f6356fbc91338530e9831e9e16
+      var tx = Util.decodeHex("0100000001c997a5e56e104102fa209c6a852dd90660a20b2d9c352423edce25857fcd3704000000004847304402204e45e16932b8af514961a1d3a1a25fdf3f4f7732e9d624c6c61548ab5fb8cd410220181522ec8eca07de4860a4acdd12909d831cc56cbbac4622082221a8768d1d0901ffffffff0200ca9a3b00000000434104ae1a62fe09c5f51b13905f07f06b99a2f7159b2225f374cd378d71302fa28414e7aab37397f554a7df5f142c21c1b7303b8a0626f1baded5c72a704f7e6cd84cac00286bee0000000043410411db93e1dcdb8a016b49840f8c53bc1eb68a382e97b1482ecad7b148a6909a5cb2e0eaddfb84ccf9744464f82e160bfa9b8b64f9d4c03f999b8643f656b412a3ac00000000");
+      var hash = Util.twoSha256(tx);
+      var prevOut = Util.decodeHex("c997a5e56e104102fa209c6a852dd90660a20b2d9c352423edce25857fcd370400000000");
+
+      var set = new Util.UtxoSet();
+      set.load(prevOut, Util.decodeHex("00f2052a01000000"));
+      set.connect(hash, tx);
+
+      return {
+        set: set,
+        out0: hash.concat(Util.decodeHex("00000000")),
+        out1: hash.concat(Util.decodeHex("01000000")),
+        prevOut: prevOut
+      };
+    },
+    'returns new outputs as value and script': function (topic) {
+      var out = topic.set.get(topic.out1);
+      assert.equal(out.slice(0, 8).toHex(), "00286bee00000000");
+      assert.equal(out.length, 8 + 67);
+    },
+    'marks spent outputs': function (topic) {
+      assert.isNull(topic.set.get(topic.prevOut));
+    },
+    'doesn\'t know other outputs': function (topic) {
+      assert.isUndefined(topic.set.get(Util.NULL_HASH.concat(Util.decodeHex("00000000"))));
+    },
+    'flushes puts and deletes': {
+      topic: function (topic) {
+        return {changes: topic.set.flush(), utxo: topic};
+      },
+      'once each': function (topic) {
+        var byKey = {};
+        topic.changes.forEach(function (change) {
+          byKey[change.key.toHex()] = change.value;
+        });
+        assert.equal(topic.changes.length, 3);
+        assert.isNull(byKey[topic.utxo.prevOut.toHex()]);
+        assert.equal(byKey[topic.utxo.out0.toHex()].slice(0, 8).toHex(), "00ca9a3b00000000");
+        assert.equal(topic.utxo.set.stats().dirty, 0);
+      }
+    }
+  },
+  'A UTXO set across a reorg': {
+    topic: function () {
+      var tx = Util.decodeHex("0100000001c997a5e56e104102fa209c6a852dd90660a20b2d9c352423edce25857fcd3704000000004847304402204e45e16932b8af514961a1d3a1a25fdf3f4f7732e9d624c6c61548ab5fb8cd410220181522ec8eca07de4860a4acdd12909d831cc56cbbac4622082221a8768d1d0901ffffffff0200ca9a3b00000000434104ae1a62fe09c5f51b13905f07f06b99a2f7159b2225f374cd378d71302fa28414e7aab37397f554a7df5f142c21c1b7303b8a0626f1baded5c72a704f7e6cd84cac00286bee0000000043410411db93e1dcdb8a016b49840f8c53bc1eb68a382e97b1482ecad7b148a6909a5cb2e0eaddfb84ccf9744464f82e160bfa9b8b64f9d4c03f999b8643f656b412a3ac00000000");
+      var hash = Util.twoSha256(tx);
+      var prevOut = Util.decodeHex("c997a5e56e104102fa209c6a852dd90660a20b2d9c352423edce25857fcd370400000000");
+      var prevData = Util.decodeHex("00f2052a01000000");
+
+      // Spends the first output of tx
+      var spend = Util.decodeHex("0100000001").concat(
+        hash, Util.decodeHex("0000000000ffffffff0100ca9a3b00000000015100000000"));
+      var spendHash = Util.twoSha256(spend);
+
+      var out0 = hash.concat(Util.decodeHex("00000000"));
+      var out0Data = new Util.UtxoSet();
+      out0Data.connect(hash, tx);
+      out0Data = out0Data.get(out0);
+
+      var set = new Util.UtxoSet();
+      set.load(prevOut, prevData);
+      set.connect(hash, tx);
+      set.flush();
+
+      // Disconnect and reconnect before the next flush, then spend
+      set.disconnect(hash, tx, [prevData]);
+      set.connect(hash, tx);
+      set.connect(spendHash, spend);
+      var reconnected = set.flush();
+
+      // Disconnect both again
+      set.disconnect(spendHash, spend, [out0Data]);
+      set.disconnect(hash, tx, [prevData]);
+      var disconnected = set.flush();
+
+      var byKey = function (changes) {
+        var result = {};
+        changes.forEach(function (change) {
+          result[change.key.toHex()] = change.value;
+        });
+        return result;
+      };
+
+      return {
+        reconnected: byKey(reconnected),
+        disconnected: byKey(disconnected),
+        prevOut: prevOut,
+        prevData: prevData,
+        out0: out0,
+        out1: hash.concat(Util.decodeHex("01000000")),
+        spendOut: spendHash.concat(Util.decodeHex("00000000"))
+      };
+    },
+    'deletes an output that was reconnected and spent': function (topic) {
+      assert.isNull(topic.reconnected[topic.out0.toHex()]);
+      assert.isNull(topic.reconnected[topic.prevOut.toHex()]);
+      assert.equal(topic.reconnected[topic.out1.toHex()].slice(0, 8).toHex(),
+                   "00286bee00000000");
+      assert.ok(topic.reconnected[topic.spendOut.toHex()]);
+      assert.equal(Object.keys(topic.reconnected).length, 4);
+    },
+    'restores the outputs a disconnected transaction spent': function (topic) {
+      assert.equal(topic.disconnected[topic.prevOut.toHex()].toHex(),
+                   topic.prevData.toHex());
+      assert.isNull(topic.disconnected[topic.out0.toHex()]);
+      assert.isNull(topic.disconnected[topic.out1.toHex()]);
+      assert.isNull(topic.disconnected[topic.spendOut.toHex()]);
+      assert.equal(Object.keys(topic.disconnected).length, 4);
+    }
+  },
+  'A block record': {
+    topic: function () {
+      var block = new Block({
+        prev_hash: Util.twoSha256(new Buffer('prev')),
+        merkle_root: Util.twoSha256(new Buffer('merkle')),
+        timestamp: 1231006505,
+        bits: 0x1d00ffff,
+        nonce: 2083236893,
+        version: 1,
+        height: 1234,
+        size: 285,
+        active: true,
+        chainWork: Util.decodeHex("0100010001"),
+        txs: [Util.twoSha256(new Buffer('a')), Util.twoSha256(new Buffer('b'))]
+      });
+      var record = Util.encodeBlockRecord(block);
+      return {
+        block: block,
+        record: record,
+        decoded: new Block(Util.decodeBlockRecord(record))
+      };
+    },
+    'has a fixed size header part': function (topic) {
+      assert.equal(topic.record.length, 125 + 2 * 32);
+    },
+    'keeps the block hash': function (topic) {
+      assert.equal(topic.decoded.hash.toHex(), topic.block.getHash().toHex());
+    },
+    'keeps the index fields': function (topic) {
+      assert.equal(topic.decoded.height, 1234);
+      assert.equal(topic.decoded.size, 285);
+      assert.isTrue(topic.decoded.active);
+      assert.equal(topic.decoded.chainWork.toHex(),
+                   "00000000000000000000000000000000" +
+                   "00000000000000000000000100010001");
+    },
+    'keeps the transaction hashes': function (topic) {
+      assert.equal(topic.decoded.txs.length, 2);
+      assert.equal(topic.decoded.txs[1].toHex(), topic.block.txs[1].toHex());
+    }
+  },
+  'A block tree': {
+    topic: function () {
+      var tree = new Util.BlockTree();
+      var work = Util.decodeHex("01");
+      var hash = function (branch, height) {
+        return Util.twoSha256(new Buffer(branch+height));
+      };
+
+      // Main chain up to 100, side branch from 60 up to 70
+      var prev = Util.NULL_HASH;
+      for (var i = 0; i <= 100; i++) {
+        tree.add(hash('main', i), prev, i, work);
+        prev = hash('main', i);
+      }
+      prev = hash('main', 60);
+      for (i = 61; i <= 70; i++) {
+        tree.add(hash('side', i), prev, i, work);
+        prev = hash('side', i);
+      }
+      tree.setTip(hash('main', 100));
+
+      return {tree: tree, hash: hash};
+    },
+    'finds ancestors on side branches': function (topic) {
+      var ancestor = topic.tree.ancestor(topic.hash('side', 70), 13);
+      assert.equal(ancestor.toHex(), topic.hash('main', 13).toHex());
+      assert.isFalse(topic.tree.get(topic.hash('side', 65)).active);
+    },
+    'builds locators': function (topic) {
+      var locator = topic.tree.locator();
+      assert.equal(locator[0].toHex(), topic.hash('main', 100).toHex());
+      assert.equal(locator[10].toHex(), topic.hash('main', 90).toHex());
+      assert.equal(locator[11].toHex(), topic.hash('main', 88).toHex());
+      assert.equal(locator[locator.length-1].toHex(), topic.hash('main', 0).toHex());
+    },
+    'finds forks': function (topic) {
+      var fork = topic.tree.findFork(topic.hash('main', 100),
+                                     topic.hash('side', 70));
+      assert.equal(fork.fork.toHex(), topic.hash('main', 60).toHex());
+      assert.equal(fork.disconnect.length, 40);
+      assert.equal(fork.disconnect[0].toHex(), topic.hash('main', 100).toHex());
+      assert.equal(fork.connect.length, 10);
+      assert.equal(fork.connect[0].toHex(), topic.hash('side', 61).toHex());
+    },
+    'answers getblocks from a side branch locator': function (topic) {
+      var locator = topic.tree.locator(topic.hash('side', 70));
+      var hashes = topic.tree.getBlocks(locator, topic.hash('main', 64), 500);
+      assert.equal(hashes.length, 4);
+      assert.equal(hashes[0].toHex(), topic.hash('main', 61).toHex());
+    }
+  },
+  'A hash table': {
+    topic: function () {
+      var keys = [];
+      for (var i = 0; i < 5; i++) {
+        keys.push(Util.sha256(new Buffer('key'+i)));
+      }
+      return keys;
+    },
+    'stores values by hash': function (keys) {
+      var table = new Util.HashTable();
+      assert.isTrue(table.set(keys[0], 'a'));
+      assert.isFalse(table.set(keys[0], 'b'));
+      assert.equal(table.get(keys[0]), 'b');
+      assert.isUndefined(table.get(keys[1]));
+      assert.isTrue(table.remove(keys[0]));
+      assert.equal(table.count(), 0);
+    },
+    'drops the oldest entries when full': function (keys) {
+      var table = new Util.HashTable(3);
+      keys.forEach(function (key, i) {
+        table.set(key, i);
+      });
+      assert.deepEqual(table.values(), [2, 3, 4]);
+      assert.equal(table.keys()[0].toHex(), keys[2].toHex());
+    },
+    'tells its oldest key': function (keys) {
+      var table = new Util.HashTable();
+      assert.isUndefined(table.oldest());
+      table.set(keys[0], 0);
+      table.set(keys[1], 1);
+      assert.equal(table.oldest().toHex(), keys[0].toHex());
+      table.remove(keys[0]);
+      assert.equal(table.oldest().toHex(), keys[1].toHex());
+    },
+    'keeps recently read entries in LRU mode': function (keys) {
+      var table = new Util.HashTable(3, true);
+      table.set(keys[0], 0);
+      table.set(keys[1], 1);
+      table.set(keys[2], 2);
+      table.get(keys[0]);
+      table.set(keys[3], 3);
+      assert.isFalse(table.has(keys[1]));
+      assert.deepEqual(table.values(), [2, 0, 3]);
+    }
+  },
+  'A rolling bloom filter': {
+    topic: function () {
+      var filter = new Util.RollingBloomFilter(100, 0.001);
+      for (var i = 0; i < 1000; i++) {
+        filter.insert(Util.sha256(new Buffer('inv'+i)));
+      }
+      return filter;
+    },
+    'contains the latest entries': function (filter) {
+      for (var i = 900; i < 1000; i++) {
+        assert.isTrue(filter.contains(Util.sha256(new Buffer('inv'+i))));
+      }
+    },
+    'forgets old entries': function (filter) {
+      var found = 0;
+      for (var i = 0; i < 100; i++) {
+        if (filter.contains(Util.sha256(new Buffer('inv'+i)))) {
+          found++;
+        }
+      }
+      assert.ok(found < 5);
+    },
+    'is sized for its false positive rate': function (filter) {
+      var stats = filter.stats();
+      assert.equal(stats.hashFuncs, 10);
+      assert.ok(stats.fpRate <= 0.001);
+    }
+  },
+  'A block file': {
+    topic: function () {
+      var genesis = new Buffer(
+    "0100000000000000000000000000000000000000000000000000000000000000" +
+    "000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa" +
+    "4b1e5e4a29ab5f49ffff001d1dac2b7c01010000000100000000000000000000" +
+    "00000000000000000000000000000000000000000000ffffffff4d04ffff001d" +
+    "0104455468652054696d65732030332f4a616e2f32303039204368616e63656c" +
+    "6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f75742066" +
+    "6f722062616e6b73ffffffff0100f2052a01000000434104678afdb0fe554827" +
+    "1967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4" +
+    "f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000", 'hex');
+      var magic = new Buffer('f9beb4d9', 'hex');
+      var frame = function (block) {
+        var size = new Buffer(4);
+        size[0] = block.length & 0xff;
+        size[1] = block.length >> 8;
+        size[2] = size[3] = 0;
+        return [magic, size, block];
+      };
+      var bad = new Buffer(genesis.length);
+      genesis.copy(bad);
+      bad[bad.length - 1] ^= 1;
+
+      var padding = new Buffer([0, 0, 0, 0, 0, 0, 0]);
+      var parts = frame(genesis).concat([padding], frame(bad),
+                                        frame(genesis).slice(0, 2));
+      var chunk = new Buffer(parts.reduce(function (n, part) {
+        return n + part.length;
+      }, 0));
+      var pos = 0;
+      parts.forEach(function (part) {
+        part.copy(chunk, pos);
+        pos += part.length;
+      });
+
+      var callback = this.callback;
+      Util.parseBlockFile(chunk, magic, function (err, result) {
+        callback(err, {result: result, length: chunk.length});
+      });
+    },
+    'finds every complete block': function (topic) {
+      assert.equal(topic.result.blocks.length, 2);
+      assert.equal(topic.result.blocks[0].offset, 8);
+      assert.equal(topic.result.blocks[0].length, 285);
+    },
+    'hashes the blocks': function (topic) {
+      assert.equal(Util.formatHashFull(topic.result.blocks[0].hash),
+                   '000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f');
+    },
+    'parses the transactions': function (topic) {
+      assert.equal(topic.result.blocks[0].hashes.toString('hex'),
+                   '3ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a');
+    },
+    'rejects a wrong merkle root': function (topic) {
+      assert.equal(topic.result.blocks[1].error, 'Merkle root incorrect');
+    },
+    'stops at the incomplete frame': function (topic) {
+      assert.equal(topic.result.end, topic.length - 8);
+    }
+  },
+  'A built message': {
+    topic: function () {
+      var magic = new Buffer('f9beb4d9', 'hex');
+      var hash = Util.sha256(new Buffer('block'));
+      return {
+        magic: magic,
+        hash: hash,
+        plain: Util.buildMessage(magic, 'inv', [new Buffer('01', 'hex'),
+          new Buffer('02000000', 'hex'), hash], true),
+        inv: Util.buildInvMessage(magic, [{type: 2, hash: hash}], true)
+      };
+    },
+    'has a 24 byte header': function (topic) {
+      assert.equal(topic.inv.length, 24 + 37);
+      assert.equal(topic.inv.slice(0, 4).toString('hex'), 'f9beb4d9');
+      assert.equal(topic.inv.slice(4, 16).toString('ascii'),
+                   'inv\0\0\0\0\0\0\0\0\0');
+      assert.equal(topic.inv.slice(16, 20).toString('hex'), '25000000');
+    },
+    'is checksummed': function (topic) {
+      var payload = topic.inv.slice(24);
+      assert.equal(topic.inv.slice(20, 24).toString('hex'),
+                   Util.twoSha256(payload).slice(0, 4).toString('hex'));
+    },
+    'matches a hand-assembled inv': function (topic) {
+      assert.equal(topic.plain.toString('hex'), topic.inv.toString('hex'));
+    },
+    'leaves out the checksum for old peers': function (topic) {
+      var old = Util.buildMessage(topic.magic, 'verack', new Buffer(0), false);
+      assert.equal(old.length, 20);
+    }
   }
 }).export(module);